@@ -0,0 +1,754 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <unistd.h>
+
+#include <vtrenderlib.h>
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+// Frames drawn before measuring, to get buffers and the terminal state warmed up.
+#define VT_BENCH_WARMUP_FRAMES  16
+
+// Every benchmark starts from the same seed, so that runs draw exactly the same frames.
+#define VT_BENCH_SEED           0x2545F491u
+
+// Viewports of the dashboard bench, in a 2x2 grid.
+#define VT_BENCH_PANELS         4
+
+// Boid dimensions and speed, as in the boids demo.
+#define VT_BOID_WIDTH   7
+#define VT_BOID_LENGTH  9
+#define VT_BOID_SPEED   1.0f
+#define VT_BOID_SPRITE_ANGLES   64
+
+// Options.
+static uint16_t g_opt_rows = 50;
+static uint16_t g_opt_cols = 200;
+static int g_opt_frames = 256;
+static int g_opt_threads = 1;
+static bool g_opt_pipelined;
+static bool g_opt_grouping;
+static const char* g_opt_sink;
+static const char* g_opt_filter;
+static const char* g_opt_record_dir;
+
+static struct vtr_sprite* g_boid_sprite;
+
+struct bench_boid
+{
+    float x;
+    float y;
+    float h;
+    float w;
+    int turn_delay;
+    enum vtr_color color;
+};
+
+struct bench_state
+{
+    struct vtr_canvas* vt;
+    uint16_t xdots;
+    uint16_t ydots;
+    uint32_t seed;
+    struct bench_boid* boids;
+    size_t nboids;
+    struct vtr_canvas* panels[VT_BENCH_PANELS];
+};
+
+struct bench
+{
+    const char* name;
+    size_t nboids;
+    void (*frame)(struct bench_state* st, int frame);
+};
+
+static inline uint32_t rand_next(struct bench_state* st)
+{
+    // Numerical Recipes LCG, good enough to scatter primitives and the same on every platform.
+    st->seed = st->seed * 1664525u + 1013904223u;
+    return st->seed >> 8;
+}
+
+static inline int rand_range(struct bench_state* st, int n)
+{
+    return n > 0 ? (int)(rand_next(st) % (uint32_t)n) : 0;
+}
+
+static inline enum vtr_color rand_color(struct bench_state* st)
+{
+    return VTR_COLOR_RED + rand_range(st, VTR_COLOR_TOTAL - VTR_COLOR_RED);
+}
+
+static uint64_t clock_monotonic_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void dots_frame(struct bench_state* st, int percent)
+{
+    for (int y = 0; y < st->ydots; y++) {
+        for (int x = 0; x < st->xdots; x++) {
+            if (rand_range(st, 100) < percent) {
+                vtr_render_dot(st->vt, x, y);
+            }
+        }
+    }
+}
+
+static void dots_dense(struct bench_state* st, int frame)
+{
+    (void)frame;
+    dots_frame(st, 50);
+}
+
+static void dots_sparse(struct bench_state* st, int frame)
+{
+    (void)frame;
+    dots_frame(st, 1);
+}
+
+// Same frame as dots_dense through the unchecked path, deferred mode has to take the checked one
+static void dots_unchecked(struct bench_state* st, int frame)
+{
+    struct vtr_dot_target target;
+
+    (void)frame;
+    if (vtr_get_dot_target(st->vt, VTR_COLOR_DEFAULT, &target) != 0) {
+        dots_frame(st, 50);
+        return;
+    }
+
+    for (int y = 0; y < st->ydots; y++) {
+        for (int x = 0; x < st->xdots; x++) {
+            if (rand_range(st, 100) < 50) {
+                vtr_plot_unchecked(&target, x, y);
+            }
+        }
+    }
+}
+
+static void dots_batch(struct bench_state* st, int frame)
+{
+    static struct vtr_vertex dots[4096];
+
+    (void)frame;
+    for (size_t i = 0; i < sizeof(dots) / sizeof(*dots); i++) {
+        dots[i] = (struct vtr_vertex){rand_range(st, st->xdots), rand_range(st, st->ydots)};
+    }
+
+    vtr_render_dots(st->vt, sizeof(dots) / sizeof(*dots), dots, NULL, VTR_COLOR_GREEN);
+}
+
+// A cloud of samples clustered around the center, as in a dense scatter plot. Built once and moved around a circle
+// by every frame, so that every frame changes cells and encodes them. Moving it costs both scatter benches the same.
+#define VT_BENCH_CLOUD_SAMPLES  (1 << 20)
+
+static const struct vtr_vertex* scatter_cloud(struct bench_state* st, int frame)
+{
+    static struct vtr_vertex* cloud;
+    static int cloud_dx, cloud_dy;
+
+    if (!cloud) {
+        cloud = malloc(VT_BENCH_CLOUD_SAMPLES * sizeof(*cloud));
+        if (!cloud) {
+            return NULL;
+        }
+
+        // Sums of uniform numbers to get something bell shaped
+        for (size_t i = 0; i < VT_BENCH_CLOUD_SAMPLES; i++) {
+            int x = 0, y = 0;
+            for (int k = 0; k < 4; k++) {
+                x += rand_range(st, st->xdots);
+                y += rand_range(st, st->ydots);
+            }
+            cloud[i] = (struct vtr_vertex){x / 4, y / 4};
+        }
+    }
+
+    float radius = MIN(st->xdots, st->ydots) / 8.0f;
+    int dx = (int)lroundf(cosf(frame * 0.05f) * radius) - cloud_dx;
+    int dy = (int)lroundf(sinf(frame * 0.05f) * radius) - cloud_dy;
+    for (size_t i = 0; i < VT_BENCH_CLOUD_SAMPLES; i++) {
+        cloud[i].x += dx;
+        cloud[i].y += dy;
+    }
+
+    cloud_dx += dx;
+    cloud_dy += dy;
+
+    return cloud;
+}
+
+static void scatter_dots(struct bench_state* st, int frame)
+{
+    const struct vtr_vertex* cloud = scatter_cloud(st, frame);
+
+    if (cloud) {
+        vtr_render_dots(st->vt, VT_BENCH_CLOUD_SAMPLES, cloud, NULL, VTR_COLOR_GREEN);
+    }
+}
+
+// The same cloud accumulated in density mode, on a 256-color ramp
+static void scatter_density(struct bench_state* st, int frame)
+{
+    const struct vtr_vertex* cloud = scatter_cloud(st, frame);
+
+    if (frame == 0) {
+        static const uint32_t ramp[] = {
+            VTR_XCOLOR_INDEXED(22), VTR_XCOLOR_INDEXED(28), VTR_XCOLOR_INDEXED(34), VTR_XCOLOR_INDEXED(40), VTR_XCOLOR_INDEXED(46),
+            VTR_XCOLOR_INDEXED(82), VTR_XCOLOR_INDEXED(118), VTR_XCOLOR_INDEXED(154), VTR_XCOLOR_INDEXED(190), VTR_XCOLOR_INDEXED(226),
+        };
+        struct vtr_density density = {
+            .scale = VTR_DENSITY_LOG,
+            .ncolors = sizeof(ramp) / sizeof(*ramp),
+            .colors = ramp,
+        };
+
+        if (vtr_set_density(st->vt, &density) != 0) {
+            return;
+        }
+    }
+
+    if (cloud) {
+        vtr_accumulate_dots(st->vt, VT_BENCH_CLOUD_SAMPLES, cloud);
+    }
+}
+
+// Scatter lines of a slope class, given as the range of dx and dy per line.
+static void lines_frame(struct bench_state* st, int mindx, int maxdx, int mindy, int maxdy)
+{
+    for (int i = 0; i < 256; i++) {
+        int x0 = rand_range(st, st->xdots);
+        int y0 = rand_range(st, st->ydots);
+        int dx = mindx + rand_range(st, maxdx - mindx + 1);
+        int dy = mindy + rand_range(st, maxdy - mindy + 1);
+
+        if (rand_next(st) & 1) {
+            dx = -dx;
+        }
+
+        vtr_scan_linec(st->vt, x0, y0, x0 + dx, y0 + dy, rand_color(st));
+    }
+}
+
+static void lines_horizontal(struct bench_state* st, int frame)
+{
+    (void)frame;
+    lines_frame(st, 8, st->xdots / 2, 0, 0);
+}
+
+static void lines_vertical(struct bench_state* st, int frame)
+{
+    (void)frame;
+    lines_frame(st, 0, 0, 8, st->ydots / 2);
+}
+
+static void lines_diagonal(struct bench_state* st, int frame)
+{
+    int len = 8 + rand_range(st, st->ydots / 2);
+
+    (void)frame;
+    lines_frame(st, len, len, len, len);
+}
+
+static void lines_shallow(struct bench_state* st, int frame)
+{
+    (void)frame;
+    lines_frame(st, st->xdots / 4, st->xdots / 2, 1, st->ydots / 8);
+}
+
+static void lines_steep(struct bench_state* st, int frame)
+{
+    (void)frame;
+    lines_frame(st, 1, st->xdots / 8, st->ydots / 4, st->ydots / 2);
+}
+
+// Fill npolys random quads, each fitting in a size by size dots square.
+static void polys_frame(struct bench_state* st, int npolys, int size)
+{
+    for (int i = 0; i < npolys; i++) {
+        int x = rand_range(st, st->xdots - size / 2);
+        int y = rand_range(st, st->ydots - size / 2);
+        int h = size / 2;
+
+        struct vtr_vertex quad[] = {
+            {x + rand_range(st, h), y},
+            {x + size, y + rand_range(st, h)},
+            {x + size - rand_range(st, h), y + size},
+            {x, y + size - rand_range(st, h)},
+        };
+
+        vtr_trace_polyc(st->vt, sizeof(quad) / sizeof(*quad), quad, rand_color(st));
+    }
+}
+
+static void polys_small(struct bench_state* st, int frame)
+{
+    (void)frame;
+    polys_frame(st, 512, 6);
+}
+
+static void polys_medium(struct bench_state* st, int frame)
+{
+    (void)frame;
+    polys_frame(st, 64, 32);
+}
+
+static void polys_large(struct bench_state* st, int frame)
+{
+    (void)frame;
+    polys_frame(st, 4, MIN(st->xdots, st->ydots));
+}
+
+// A line of text on every other row, over a sparse dot background.
+static void text_overlay(struct bench_state* st, int frame)
+{
+    char buf[64];
+
+    dots_frame(st, 5);
+    for (uint16_t row = 0; row < g_opt_rows; row += 2) {
+        snprintf(buf, sizeof(buf), "row %u frame %d: %08x", row, frame, rand_next(st));
+        vtr_print_text(st->vt, row, (uint16_t)rand_range(st, g_opt_cols / 2), buf);
+    }
+}
+
+// Styled UTF-8 status bars on every row, rewritten in full every frame while only their counters change.
+static void status_bars(struct bench_state* st, int frame)
+{
+    static const struct vtr_text_style label = { VTR_COLOR_CYAN, 0, 1 };
+    static const struct vtr_text_style value = { VTR_XCOLOR_RGB(255, 200, 0), VTR_XCOLOR_INDEXED(236), 0 };
+    char buf[64];
+
+    dots_frame(st, 5);
+    for (uint16_t row = 0; row < g_opt_rows; row++) {
+        vtr_print_textx(st->vt, row, 0, "状態 ▶ sensor:", &label);
+        snprintf(buf, sizeof(buf), " %5d °C ", (row * 7 + frame / (row % 8 + 1)) % 1000);
+        vtr_print_textx(st->vt, row, 16, buf, &value);
+    }
+}
+
+// A dashboard of four viewports around a static frame: a plot redrawn on every frame, a gauge at 10 Hz and two
+// status panels at 1 Hz. Only the panels that are due cost anything.
+static void dashboard(struct bench_state* st, int frame)
+{
+    static const unsigned rates[VT_BENCH_PANELS] = { 0, 10, 1, 1 };
+    uint16_t prows = g_opt_rows / 2 - 1, pcols = g_opt_cols / 2 - 1;
+    char buf[64];
+
+    if (!st->panels[0]) {
+        for (int i = 0; i < VT_BENCH_PANELS; i++) {
+            st->panels[i] = vtr_viewport_create(st->vt, 1 + (i / 2) * (prows + 1), 1 + (i % 2) * (pcols + 1),
+                                                prows, pcols);
+            if (!st->panels[i] || vtr_viewport_set_rate(st->panels[i], rates[i]) != 0) {
+                return;
+            }
+        }
+    }
+
+    vtr_scan_line(st->vt, 0, 1, st->xdots - 1, 1);
+    vtr_scan_line(st->vt, 0, (prows + 1) * 4 + 1, st->xdots - 1, (prows + 1) * 4 + 1);
+    vtr_scan_line(st->vt, 0, 0, 0, st->ydots - 1);
+    vtr_scan_line(st->vt, (pcols + 1) * 2, 0, (pcols + 1) * 2, st->ydots - 1);
+
+    if (vtr_viewport_begin(st->panels[0]) == 1) {
+        int mid = prows * 2;
+        for (int x = 0; x < pcols * 2; x++) {
+            vtr_render_dot(st->panels[0], x, mid + (int)lroundf(sinf((x + frame) * 0.05f) * (mid - 1)));
+        }
+    }
+
+    if (vtr_viewport_begin(st->panels[1]) == 1) {
+        int len = (frame * 7) % (pcols * 2);
+        for (int y = prows * 2 - 4; y < prows * 2 + 4; y++) {
+            vtr_scan_line(st->panels[1], 0, y, len, y);
+        }
+    }
+
+    for (int i = 2; i < VT_BENCH_PANELS; i++) {
+        if (vtr_viewport_begin(st->panels[i]) != 1) {
+            continue;
+        }
+
+        for (uint16_t row = 0; row < prows; row++) {
+            snprintf(buf, sizeof(buf), "sensor %d.%u: %5d", i, row, (row * 7 + frame) % 1000);
+            vtr_print_text(st->panels[i], row, 0, buf);
+        }
+    }
+}
+
+// Every cell changes on every frame, the dot row lit in each cell moves down one dot per frame.
+static void swap_full(struct bench_state* st, int frame)
+{
+    for (int y = frame & 3; y < st->ydots; y += 4) {
+        vtr_scan_line(st->vt, 0, y, st->xdots - 1, y);
+    }
+}
+
+// The same static pattern on every frame, with 1% of the cells flipping.
+static void swap_1pct(struct bench_state* st, int frame)
+{
+    int ncells = g_opt_rows * g_opt_cols / 100;
+
+    (void)frame;
+    for (int y = 0; y < st->ydots; y += 4) {
+        vtr_scan_line(st->vt, 0, y, st->xdots - 1, y);
+    }
+
+    for (int i = 0; i < ncells; i++) {
+        vtr_render_dot(st->vt, rand_range(st, st->xdots), rand_range(st, st->ydots / 4) * 4 + 2);
+    }
+}
+
+static void init_boids(struct bench_state* st)
+{
+    for (size_t i = 0; i < st->nboids; i++) {
+        struct bench_boid* b = st->boids + i;
+
+        b->x = rand_range(st, st->xdots);
+        b->y = rand_range(st, st->ydots);
+        b->h = rand_range(st, 360) * (float)M_PI / 180;
+        b->w = 0;
+        b->turn_delay = rand_range(st, 120);
+        b->color = rand_color(st);
+    }
+}
+
+static void move_boid(struct bench_state* st, struct bench_boid* b)
+{
+    if (--b->turn_delay <= 0) {
+        b->w = (rand_range(st, 61) - 30) * (float)M_PI / 180 / 60;
+        b->turn_delay = 60 + rand_range(st, 120);
+    }
+
+    b->h += b->w;
+    b->x += cosf(b->h) * VT_BOID_SPEED;
+    b->y += sinf(b->h) * VT_BOID_SPEED;
+    b->x = b->x < 0 ? b->x + st->xdots : (b->x >= st->xdots ? b->x - st->xdots : b->x);
+    b->y = b->y < 0 ? b->y + st->ydots : (b->y >= st->ydots ? b->y - st->ydots : b->y);
+}
+
+// Replay the boids demo drawing workload: wandering triangles wrapping around the screen.
+// Flocking is left out so that the motion is cheap and the same everywhere.
+static void boids(struct bench_state* st, int frame)
+{
+    (void)frame;
+    for (size_t i = 0; i < st->nboids; i++) {
+        struct bench_boid* b = st->boids + i;
+        move_boid(st, b);
+
+        float dx = cosf(b->h), dy = sinf(b->h);
+        struct vtr_vertex buf[] = {
+            {lroundf(b->x + dy * VT_BOID_WIDTH / 2), lroundf(b->y - dx * VT_BOID_WIDTH / 2)},
+            {lroundf(b->x - dy * VT_BOID_WIDTH / 2), lroundf(b->y + dx * VT_BOID_WIDTH / 2)},
+            {lroundf(b->x + dx * VT_BOID_LENGTH), lroundf(b->y + dy * VT_BOID_LENGTH)},
+        };
+
+        vtr_trace_polyc(st->vt, sizeof(buf) / sizeof(*buf), buf, b->color);
+    }
+}
+
+// The same boids blitted as pre-rasterized sprites, the way the demo draws them.
+static void boid_sprites(struct bench_state* st, int frame)
+{
+    (void)frame;
+    for (size_t i = 0; i < st->nboids; i++) {
+        struct bench_boid* b = st->boids + i;
+        move_boid(st, b);
+
+        vtr_blit_sprite_rotated(st->vt, g_boid_sprite, lroundf(b->x), lroundf(b->y), b->h, b->color);
+    }
+}
+
+static const struct bench g_benches[] = {
+    {"dots_dense", 0, dots_dense},
+    {"dots_sparse", 0, dots_sparse},
+    {"dots_unchecked", 0, dots_unchecked},
+    {"dots_batch", 0, dots_batch},
+    {"scatter_dots", 0, scatter_dots},
+    {"scatter_density", 0, scatter_density},
+    {"lines_horizontal", 0, lines_horizontal},
+    {"lines_vertical", 0, lines_vertical},
+    {"lines_diagonal", 0, lines_diagonal},
+    {"lines_shallow", 0, lines_shallow},
+    {"lines_steep", 0, lines_steep},
+    {"polys_small", 0, polys_small},
+    {"polys_medium", 0, polys_medium},
+    {"polys_large", 0, polys_large},
+    {"text_overlay", 0, text_overlay},
+    {"status_bars", 0, status_bars},
+    {"dashboard", 0, dashboard},
+    {"swap_full", 0, swap_full},
+    {"swap_1pct", 0, swap_1pct},
+    {"boids_64", 64, boids},
+    {"boids_1k", 1000, boids},
+    {"boids_10k", 10000, boids},
+    {"sprites_1k", 1000, boid_sprites},
+    {"sprites_10k", 10000, boid_sprites},
+};
+
+static struct vtr_canvas* create_canvas(int sinkfd)
+{
+    struct vtr_canvas* vt = vtr_canvas_create_headless(g_opt_rows, g_opt_cols, sinkfd);
+    if (!vt) {
+        return NULL;
+    }
+
+    if (vtr_set_raster_threads(vt, g_opt_threads) != 0 ||
+        vtr_set_pipelined(vt, g_opt_pipelined) != 0 ||
+        vtr_set_color_grouping(vt, g_opt_grouping) != 0 ||
+        vtr_reset(vt) != 0) {
+        vtr_close(vt);
+        return NULL;
+    }
+
+    return vt;
+}
+
+static int run_bench(const struct bench* bench, int sinkfd, bool first)
+{
+    int error = 0;
+    struct bench_state st = {.seed = VT_BENCH_SEED, .nboids = bench->nboids};
+    struct vtr_stats before, after;
+    uint64_t min_ns = UINT64_MAX, total_ns = 0;
+    bool have_stats;
+    int recfd = -1;
+
+    st.vt = create_canvas(sinkfd);
+    if (!st.vt) {
+        return -ENOMEM;
+    }
+
+    if (g_opt_record_dir) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s.vtrrec", g_opt_record_dir, bench->name);
+        recfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (recfd < 0) {
+            error = -errno;
+            goto error_out;
+        }
+
+        error = vtr_record_start(st.vt, recfd);
+        if (error) {
+            goto error_out;
+        }
+    }
+
+    st.xdots = vtr_xdots(st.vt);
+    st.ydots = vtr_ydots(st.vt);
+
+    if (st.nboids) {
+        st.boids = calloc(st.nboids, sizeof(*st.boids));
+        if (!st.boids) {
+            error = -ENOMEM;
+            goto error_out;
+        }
+
+        init_boids(&st);
+    }
+
+    for (int i = 0; i < VT_BENCH_WARMUP_FRAMES; i++) {
+        bench->frame(&st, i);
+        error = vtr_swap_buffers(st.vt);
+        if (error) {
+            goto error_out;
+        }
+    }
+
+    have_stats = (vtr_get_stats(st.vt, &before) == 0);
+
+    for (int i = 0; i < g_opt_frames; i++) {
+        uint64_t start = clock_monotonic_ns();
+
+        bench->frame(&st, VT_BENCH_WARMUP_FRAMES + i);
+        error = vtr_swap_buffers(st.vt);
+        if (error) {
+            goto error_out;
+        }
+
+        uint64_t elapsed = clock_monotonic_ns() - start;
+        total_ns += elapsed;
+        min_ns = elapsed < min_ns ? elapsed : min_ns;
+    }
+
+    // Let a pipelined frame finish so that it is both timed and counted.
+    uint64_t start = clock_monotonic_ns();
+    error = vtr_flush_pending(st.vt);
+    total_ns += clock_monotonic_ns() - start;
+    if (error && error != -EAGAIN) {
+        goto error_out;
+    }
+    error = 0;
+
+    have_stats = have_stats && (vtr_get_stats(st.vt, &after) == 0);
+
+    printf("%s    {\"name\": \"%s\", \"ns_per_frame\": %llu, \"min_ns_per_frame\": %llu",
+           first ? "" : ",\n", bench->name,
+           (unsigned long long)(total_ns / g_opt_frames), (unsigned long long)min_ns);
+
+    if (have_stats) {
+        uint64_t frames = after.frames - before.frames;
+        frames = frames ? frames : 1;
+
+        printf(", \"bytes_per_frame\": %llu, \"cells_changed_per_frame\": %llu, \"writes_per_frame\": %llu",
+               (unsigned long long)((after.total.bytes - before.total.bytes) / frames),
+               (unsigned long long)((after.total.cells_changed - before.total.cells_changed) / frames),
+               (unsigned long long)((after.total.writes - before.total.writes) / frames));
+    }
+
+    printf("}");
+
+error_out:
+    free(st.boids);
+    for (int i = 0; i < VT_BENCH_PANELS; i++) {
+        if (st.panels[i]) {
+            vtr_context_destroy(st.panels[i]);
+        }
+    }
+    if (recfd >= 0) {
+        int recerror = vtr_record_stop(st.vt);
+        error = (error ? error : recerror);
+        close(recfd);
+    }
+    vtr_close(st.vt);
+    return error;
+}
+
+void print_help(const char *progname)
+{
+    printf("Usage: %s [options] [name filter]\n", progname);
+    printf("\t-r <number>: canvas rows (default %u)\n", g_opt_rows);
+    printf("\t-c <number>: canvas columns (default %u)\n", g_opt_cols);
+    printf("\t-n <number>: measured frames per benchmark (default %d)\n", g_opt_frames);
+    printf("\t-j <number>: rasterize with this many threads\n");
+    printf("\t-p:          encode and write out frames in the background\n");
+    printf("\t-g:          encode rows grouped by color when that is shorter\n");
+    printf("\t-o <path>:   write the output to this file, e.g. /dev/null, instead of discarding it\n");
+    printf("\t-R <dir>:    record the frames of every benchmark into <dir>/<name>.vtrrec for vtr-replay\n");
+    printf("\t-h:          display this help\n");
+    printf("Only benchmarks with the filter in their name are run. Results are printed as JSON.\n");
+}
+
+int main(int argc, char** argv)
+{
+    int error;
+    int opt;
+    int sinkfd = -1;
+    bool first = true;
+
+    while ((opt = getopt(argc, argv, "r:c:n:j:pgo:R:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            g_opt_rows = (uint16_t)atoi(optarg);
+            if (g_opt_rows == 0) {
+                goto bad_opts;
+            }
+            break;
+        case 'c':
+            g_opt_cols = (uint16_t)atoi(optarg);
+            if (g_opt_cols == 0) {
+                goto bad_opts;
+            }
+            break;
+        case 'n':
+            g_opt_frames = atoi(optarg);
+            if (g_opt_frames <= 0) {
+                goto bad_opts;
+            }
+            break;
+        case 'j':
+            g_opt_threads = atoi(optarg);
+            if (g_opt_threads <= 0) {
+                goto bad_opts;
+            }
+            break;
+        case 'p':
+            g_opt_pipelined = true;
+            break;
+        case 'g':
+            g_opt_grouping = true;
+            break;
+        case 'o':
+            g_opt_sink = optarg;
+            break;
+        case 'R':
+            g_opt_record_dir = optarg;
+            break;
+        case 'h':
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            goto bad_opts;
+        }
+    }
+
+    if (optind < argc) {
+        g_opt_filter = argv[optind];
+    }
+
+    if (g_opt_sink) {
+        sinkfd = open(g_opt_sink, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (sinkfd < 0) {
+            perror(g_opt_sink);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Boid triangle as in the boids demo, pointing along the x axis
+    static const struct vtr_vertex shape[] = {
+        {0, -VT_BOID_WIDTH / 2},
+        {0, VT_BOID_WIDTH / 2},
+        {VT_BOID_LENGTH, 0},
+    };
+
+    g_boid_sprite = vtr_sprite_create(sizeof(shape) / sizeof(*shape), shape, VT_BOID_SPRITE_ANGLES);
+    if (!g_boid_sprite) {
+        fprintf(stderr, "%s\n", strerror(ENOMEM));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("{\n  \"rows\": %u, \"cols\": %u, \"frames\": %d, \"threads\": %d, \"pipelined\": %s, \"grouping\": %s,\n",
+           g_opt_rows, g_opt_cols, g_opt_frames, g_opt_threads,
+           g_opt_pipelined ? "true" : "false", g_opt_grouping ? "true" : "false");
+    printf("  \"sink\": \"%s\",\n  \"results\": [\n", g_opt_sink ? g_opt_sink : "discard");
+
+    for (size_t i = 0; i < sizeof(g_benches) / sizeof(*g_benches); i++) {
+        if (g_opt_filter && !strstr(g_benches[i].name, g_opt_filter)) {
+            continue;
+        }
+
+        error = run_bench(&g_benches[i], sinkfd, first);
+        if (error) {
+            fprintf(stderr, "%s: %s\n", g_benches[i].name, strerror(-error));
+            exit(EXIT_FAILURE);
+        }
+
+        first = false;
+        fflush(stdout);
+    }
+
+    printf("\n  ]\n}\n");
+
+    vtr_sprite_destroy(g_boid_sprite);
+    if (sinkfd >= 0) {
+        close(sinkfd);
+    }
+
+    return 0;
+
+bad_opts:
+    print_help(argv[0]);
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <unistd.h>
+
+#include <vtrenderlib.h>
+
+// Options.
+static int g_opt_loops = 1;
+static int g_opt_threads = 1;
+static bool g_opt_pipelined;
+static bool g_opt_grouping;
+static bool g_opt_truecolor;
+static const char* g_opt_sink;
+
+static uint64_t clock_monotonic_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static struct vtr_canvas* create_canvas(uint16_t rows, uint16_t cols, int sinkfd)
+{
+    struct vtr_canvas* vt = vtr_canvas_create_headless(rows, cols, sinkfd);
+    if (!vt) {
+        return NULL;
+    }
+
+    if (vtr_set_raster_threads(vt, g_opt_threads) != 0 ||
+        vtr_set_pipelined(vt, g_opt_pipelined) != 0 ||
+        vtr_set_color_grouping(vt, g_opt_grouping) != 0 ||
+        vtr_set_color_mode(vt, g_opt_truecolor ? VTR_COLORS_TRUECOLOR : VTR_COLORS_256) != 0 ||
+        vtr_reset(vt) != 0) {
+        vtr_close(vt);
+        return NULL;
+    }
+
+    return vt;
+}
+
+// Stats of a canvas that is about to be closed, added to the totals of the run
+static void add_canvas_stats(struct vtr_canvas* vt, struct vtr_stats* sum)
+{
+    struct vtr_stats stats;
+    if (vtr_flush_pending(vt) == 0 && vtr_get_stats(vt, &stats) == 0) {
+        sum->frames += stats.frames;
+        sum->total.bytes += stats.total.bytes;
+        sum->total.cells_changed += stats.total.cells_changed;
+        sum->total.writes += stats.total.writes;
+        sum->total.diff_ns += stats.total.diff_ns;
+        sum->total.encode_ns += stats.total.encode_ns;
+        sum->total.write_ns += stats.total.write_ns;
+    }
+}
+
+// Feed every frame of the recording through a headless canvas, which is recreated whenever the dimensions change.
+// Only decoding is left out of the time taken.
+static int replay(struct vtr_replay* rp, int sinkfd, uint64_t* nframes, uint64_t* elapsed_ns, struct vtr_stats* sum)
+{
+    int error;
+    struct vtr_canvas* vt = NULL;
+    uint16_t rows, cols;
+
+    while ((error = vtr_replay_next(rp, &rows, &cols)) == 0) {
+        uint64_t start = clock_monotonic_ns();
+
+        if (vt && (vtr_xdots(vt) != cols * 2 || vtr_ydots(vt) != rows * 4)) {
+            add_canvas_stats(vt, sum);
+            vtr_close(vt);
+            vt = NULL;
+        }
+
+        if (!vt) {
+            vt = create_canvas(rows, cols, sinkfd);
+            if (!vt) {
+                return -ENOMEM;
+            }
+        }
+
+        error = vtr_replay_draw(rp, vt);
+        if (!error) {
+            error = vtr_swap_buffers(vt);
+        }
+
+        *elapsed_ns += clock_monotonic_ns() - start;
+        if (error) {
+            break;
+        }
+
+        (*nframes)++;
+    }
+
+    if (vt) {
+        uint64_t start = clock_monotonic_ns();
+        add_canvas_stats(vt, sum);
+        *elapsed_ns += clock_monotonic_ns() - start;
+        vtr_close(vt);
+    }
+
+    return (error == -ENODATA ? 0 : error);
+}
+
+void print_help(const char *progname)
+{
+    printf("Usage: %s [options] <recording>\n", progname);
+    printf("\t-n <number>: replay the recording this many times (default %d)\n", g_opt_loops);
+    printf("\t-j <number>: rasterize with this many threads\n");
+    printf("\t-p:          encode and write out frames in the background\n");
+    printf("\t-g:          encode rows grouped by color when that is shorter\n");
+    printf("\t-t:          send RGB colors as is instead of quantizing them\n");
+    printf("\t-o <path>:   write the output to this file, e.g. /dev/null, instead of discarding it\n");
+    printf("\t-h:          display this help\n");
+    printf("Results are printed as JSON.\n");
+}
+
+int main(int argc, char** argv)
+{
+    int error;
+    int opt;
+    int sinkfd = -1;
+
+    while ((opt = getopt(argc, argv, "n:j:pgto:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            g_opt_loops = atoi(optarg);
+            if (g_opt_loops <= 0) {
+                goto bad_opts;
+            }
+            break;
+        case 'j':
+            g_opt_threads = atoi(optarg);
+            if (g_opt_threads <= 0) {
+                goto bad_opts;
+            }
+            break;
+        case 'p':
+            g_opt_pipelined = true;
+            break;
+        case 'g':
+            g_opt_grouping = true;
+            break;
+        case 't':
+            g_opt_truecolor = true;
+            break;
+        case 'o':
+            g_opt_sink = optarg;
+            break;
+        case 'h':
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            goto bad_opts;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        goto bad_opts;
+    }
+
+    const char* path = argv[optind];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    struct vtr_replay* rp = vtr_replay_open(fd);
+    close(fd);
+    if (!rp) {
+        fprintf(stderr, "%s: not a recording\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (g_opt_sink) {
+        sinkfd = open(g_opt_sink, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (sinkfd < 0) {
+            perror(g_opt_sink);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t nframes = 0, elapsed_ns = 0;
+    struct vtr_stats sum;
+    memset(&sum, 0, sizeof(sum));
+
+    for (int i = 0; i < g_opt_loops; i++) {
+        vtr_replay_rewind(rp);
+        error = replay(rp, sinkfd, &nframes, &elapsed_ns, &sum);
+        if (error) {
+            fprintf(stderr, "%s: replay failed after %llu frames: %s\n", path, (unsigned long long)nframes,
+                    strerror(-error));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    vtr_replay_close(rp);
+    if (sinkfd >= 0) {
+        close(sinkfd);
+    }
+
+    uint64_t frames = nframes ? nframes : 1;
+    uint64_t encoded = sum.frames ? sum.frames : 1;
+
+    printf("{\n");
+    printf("  \"recording\": \"%s\", \"loops\": %d, \"threads\": %d, \"pipelined\": %s, \"grouping\": %s, "
+           "\"truecolor\": %s,\n", path, g_opt_loops, g_opt_threads, g_opt_pipelined ? "true" : "false",
+           g_opt_grouping ? "true" : "false", g_opt_truecolor ? "true" : "false");
+    printf("  \"sink\": \"%s\",\n", g_opt_sink ? g_opt_sink : "discard");
+    printf("  \"frames\": %llu, \"frames_per_sec\": %.1f, \"ns_per_frame\": %llu",
+           (unsigned long long)nframes, elapsed_ns ? nframes * 1e9 / elapsed_ns : 0.0,
+           (unsigned long long)(elapsed_ns / frames));
+
+    // Stats are compiled out of some builds
+    if (sum.frames) {
+        printf(",\n  \"bytes_per_frame\": %llu, \"cells_changed_per_frame\": %llu, \"writes_per_frame\": %llu,\n",
+               (unsigned long long)(sum.total.bytes / encoded),
+               (unsigned long long)(sum.total.cells_changed / encoded),
+               (unsigned long long)(sum.total.writes / encoded));
+        printf("  \"diff_ns_per_frame\": %llu, \"encode_ns_per_frame\": %llu, \"write_ns_per_frame\": %llu",
+               (unsigned long long)(sum.total.diff_ns / encoded),
+               (unsigned long long)(sum.total.encode_ns / encoded),
+               (unsigned long long)(sum.total.write_ns / encoded));
+    }
+
+    printf("\n}\n");
+
+    return 0;
+
+bad_opts:
+    fprintf(stderr, "Usage: %s [-n loops] [-j threads] [-p] [-g] [-t] [-o path] <recording>\n", argv[0]);
+    exit(EXIT_FAILURE);
+}
@@ -10,7 +10,9 @@
 #include <errno.h>
 
 #include <signal.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <vtrenderlib.h>
 
@@ -38,6 +40,9 @@
 #define VT_BOID_WIDTH   7
 #define VT_BOID_LENGTH  9
 
+// Boid shape is rasterized ahead of time at this many headings.
+#define VT_BOID_SPRITE_ANGLES   64
+
 // Boid linear speed in dots per second.
 #define VT_BOID_SPEED        60
 
@@ -67,11 +72,24 @@ _Static_assert(VT_BOID_REPULSION_RANGE < VT_BOID_VIEW_RANGE);
 // Trail history buffer size.
 #define VT_BOID_TRAIL_SIZE                  20
 
+// Number of boids a simulation thread picks up at a time.
+#define VT_SIM_CHUNK                        256
+
+// Lanes of the neighbor search kernel, sorted grid arrays are padded by that many entries.
+#define VT_SIMD_WIDTH                       4
+
 // Options.
 static bool g_opt_debug;
 static bool g_opt_colors;
 static bool g_opt_trails;
+static bool g_opt_sync;
 static int g_opt_nboids = 64;
+static int g_opt_threads = 1;
+static int g_opt_sim_threads = 1;
+static bool g_opt_pipelined;
+static bool g_opt_grouping;
+static bool g_opt_timings;
+static const char* g_opt_record;
 
 struct vec2f
 {
@@ -79,32 +97,86 @@ struct vec2f
     float y;
 };
 
-struct vt_boid
+// Boid state is kept as one array per field, so the simulation streams only the fields it reads.
+struct vt_flock
 {
-    struct vec2f p;
-    struct vec2f v;
+    // Position and heading vector
+    float* x;
+    float* y;
+    float* vx;
+    float* vy;
 
-    // heading angle, in radians
-    float h;
+    // Heading angle, in radians
+    float* h;
 
     // Current angular speed
-    float w;
+    float* w;
+
+    // Wandering state
+    float* wander_angle;
+    int* heading_change_delay;
+    int* cur_heading_time;
+    uint32_t* seed;
 
-    // wandering state
-    float wander_angle;
-    int heading_change_delay;
-    int cur_heading_time;
+    // Rendering data
+    enum vtr_color* color;
 
-    // rendering data
-    enum vtr_color color;
-    struct vec2f trail[VT_BOID_TRAIL_SIZE];
+    // Trail ring store of VT_BOID_TRAIL_SIZE positions per boid.
+    // Every boid records one position per tick, so they all share the ring position.
+    struct vec2f* trail;
     size_t trail_idx;
     size_t trail_len;
 };
 
+// Uniform grid over the canvas used for neighbor lookups.
+// Cells are at least VT_BOID_VIEW_RANGE wide, so all neighbors of a boid are found in the 3x3 block of cells around it.
+struct vt_grid
+{
+    size_t cols;
+    size_t rows;
+    float cell_width;
+    float cell_height;
+
+    // Boid indices sorted by cell, cells[c] is the start of cell c in that list.
+    // Positions and velocities are copied in the same order when the grid is built,
+    // so the neighbor search reads them sequentially and sees the state from the start of the tick.
+    // That also lets threads update boids in place without locks.
+    size_t* cells;
+    size_t* boids;
+    float* x;
+    float* y;
+    float* vx;
+    float* vy;
+    size_t ncells_max;
+
+    // Cell of every boid at the time of the last rebuild.
+    size_t* boid_cell;
+};
+
+// Simulation threads, run boids of the current tick in chunks along with the main thread.
+struct vt_sim_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    pthread_t* workers;
+    unsigned nworkers;
+
+    // Bumping the generation starts a tick
+    uint64_t generation;
+    unsigned nrunning;
+    uint32_t dtime;
+    float width;
+    float height;
+    size_t next_chunk;
+};
+
 static struct vtr_canvas* g_vt;
-static struct vt_boid* g_boids;
+static struct vt_flock g_flock;
 static size_t g_nboids;
+static struct vt_grid g_grid;
+static struct vt_sim_pool* g_pool;
+static struct vtr_sprite* g_boid_sprite;
 
 static inline float grad2rad(int grad)
 {
@@ -225,10 +297,31 @@ static inline int random_value_in_range(int min, int max)
     return min + rand() % (max - min);
 }
 
-static inline int random_value_spread(int base, int spread)
+// Per-boid xorshift generator, so that threads do not share rand() state.
+static inline uint32_t next_random(uint32_t* seed)
+{
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+static inline int random_value_spread(uint32_t* seed, int base, int spread)
 {
     assert(spread != 0);
-    return base + ((rand() % (spread * 2)) - spread);
+    return base + ((int)(next_random(seed) % (spread * 2)) - spread);
+}
+
+static void* calloc_or_die(size_t n, size_t size)
+{
+    void* p = calloc(n, size);
+    if (!p) {
+        exit(ENOMEM);
+    }
+
+    return p;
 }
 
 static void debug_print(uint16_t row, uint16_t col, const char* fmt, ...)
@@ -250,88 +343,293 @@ static void debug_vec(struct vec2f origin, struct vec2f vec, float scale, enum v
 }
 
 // Apply a steering force (acceleration) vector to a boid to update its speed, position and heading.
-static void steer(struct vt_boid* b, struct vec2f fsteer, uint32_t dtime)
+static void steer(size_t i, struct vec2f fsteer, uint32_t dtime)
 {
+    struct vt_flock* f = &g_flock;
+
     // Record current position for trails before we change it.
-    b->trail[b->trail_idx] = b->p;
-    b->trail_idx = (b->trail_idx + 1) % VT_BOID_TRAIL_SIZE;
-    b->trail_len = MIN(b->trail_len + 1, VT_BOID_TRAIL_SIZE);
+    if (f->trail) {
+        f->trail[i * VT_BOID_TRAIL_SIZE + f->trail_idx] = vec2f_make(f->x[i], f->y[i]);
+    }
 
     // Boid linear speed is fixed so we are only interested in the lateral component of the steering force.
     // Compute that as lateral acceleration, get the angular speed from it and blend it into an accumulator.
     // Then integrate blended angular speed into heading and position changes over dt.
     float dts = (float)dtime / 1000;
-    float alat = vec2f_dot(vec2f_clamp(fsteer, VT_BOID_STEERING_CAP), vec2f_make(-sinf(b->h), cos(b->h)));
-    b->w = (1 - VT_BOID_BLEND_FACTOR) * b->w + VT_BOID_BLEND_FACTOR * alat;
-    b->h = fmodf(b->h + b->w * dts, 2.0f * M_PI);
-    b->p.x += VT_BOID_SPEED * cosf(b->h) * dts;
-    b->p.y += VT_BOID_SPEED * sinf(b->h) * dts;
-    b->v = heading_vec(b->h);
+    float h = f->h[i];
+    float alat = vec2f_dot(vec2f_clamp(fsteer, VT_BOID_STEERING_CAP), vec2f_make(-sinf(h), cos(h)));
+    f->w[i] = (1 - VT_BOID_BLEND_FACTOR) * f->w[i] + VT_BOID_BLEND_FACTOR * alat;
+    h = fmodf(h + f->w[i] * dts, 2.0f * M_PI);
+    f->h[i] = h;
+    f->x[i] += VT_BOID_SPEED * cosf(h) * dts;
+    f->y[i] += VT_BOID_SPEED * sinf(h) * dts;
+
+    struct vec2f v = heading_vec(h);
+    f->vx[i] = v.x;
+    f->vy[i] = v.y;
 }
 
-// Update simulation, dtime is in millisecs.
-static void update(uint32_t dtime)
+static inline size_t grid_coord(float v, float cell_size, size_t ncells)
 {
-    if (g_opt_debug) {
-        static uint64_t total_time = 0;
-        total_time += dtime;
-        debug_print(0, 0, "t(s) = %.02f\n", (float)total_time / 1000);
+    size_t c = v > 0 ? (size_t)(v / cell_size) : 0;
+    return MIN(c, ncells - 1);
+}
+
+// Rebuild the neighbor grid for current boid positions with a counting sort over cells.
+static void build_grid(float width, float height)
+{
+    struct vt_grid* g = &g_grid;
+    const struct vt_flock* f = &g_flock;
+
+    g->cols = MAX(1, (size_t)(width / VT_BOID_VIEW_RANGE));
+    g->rows = MAX(1, (size_t)(height / VT_BOID_VIEW_RANGE));
+    g->cell_width = MAX(width / g->cols, 1.0f);
+    g->cell_height = MAX(height / g->rows, 1.0f);
+
+    size_t ncells = g->cols * g->rows;
+    if (ncells > g->ncells_max) {
+        size_t* cells = realloc(g->cells, sizeof(*cells) * (ncells + 1));
+        if (!cells) {
+            exit(ENOMEM);
+        }
+
+        g->cells = cells;
+        g->ncells_max = ncells;
     }
 
+    memset(g->cells, 0, sizeof(*g->cells) * (ncells + 1));
     for (size_t i = 0; i < g_nboids; i++) {
-        struct vt_boid* b = g_boids + i;
-
-        // The neighbors search below makes the entire update quadratic.
-        // It's not super terrible given the low number of boids i anticipate,
-        // but i could think about maybe using a proximity lookup via space partitioning.
-
-        size_t total_neighbors = 0;
-        struct vec2f alignment = {0, 0};
-        struct vec2f centroid = {0, 0};
-        struct vec2f separation = {0, 0};
-        for (size_t j = 0; j < g_nboids; j++) {
-            if (j == i) {
-                continue;
+        size_t c = grid_coord(f->y[i], g->cell_height, g->rows) * g->cols + grid_coord(f->x[i], g->cell_width, g->cols);
+        g->boid_cell[i] = c;
+        g->cells[c + 1]++;
+    }
+
+    for (size_t c = 0; c < ncells; c++) {
+        g->cells[c + 1] += g->cells[c];
+    }
+
+    // Place boids using cells[c] as the insertion point of the cell c.
+    // That leaves every entry pointing at the start of the next cell, so shift them back after.
+    for (size_t i = 0; i < g_nboids; i++) {
+        size_t k = g->cells[g->boid_cell[i]]++;
+        g->boids[k] = i;
+        g->x[k] = f->x[i];
+        g->y[k] = f->y[i];
+        g->vx[k] = f->vx[i];
+        g->vy[k] = f->vy[i];
+    }
+
+    memmove(g->cells + 1, g->cells, sizeof(*g->cells) * ncells);
+    g->cells[0] = 0;
+}
+
+// Collect distinct neighbor cells along one axis, wrapping over the edges.
+static inline size_t grid_neighbors(size_t c, size_t ncells, size_t out[3])
+{
+    if (ncells < 3) {
+        for (size_t i = 0; i < ncells; i++) {
+            out[i] = i;
+        }
+        return ncells;
+    }
+
+    out[0] = (c == 0 ? ncells - 1 : c - 1);
+    out[1] = c;
+    out[2] = (c + 1 == ncells ? 0 : c + 1);
+    return 3;
+}
+
+// Column spans [first, last) that cover the neighborhood of column c, wrapping over the edges.
+// Cells of a grid row are contiguous in the sorted boid list, so each span is a single run of boids.
+static inline size_t grid_spans(size_t c, size_t ncells, size_t spans[2][2])
+{
+    if (ncells < 3) {
+        spans[0][0] = 0;
+        spans[0][1] = ncells;
+        return 1;
+    }
+
+    if (c == 0 || c + 1 == ncells) {
+        spans[0][0] = 0;
+        spans[0][1] = (c == 0 ? 2 : 1);
+        spans[1][0] = (c == 0 ? ncells - 1 : ncells - 2);
+        spans[1][1] = ncells;
+        return 2;
+    }
+
+    spans[0][0] = c - 1;
+    spans[0][1] = c + 2;
+    return 1;
+}
+
+// Sums over the neighbors of a boid within view range.
+struct vt_neighbors
+{
+    float count;
+    struct vec2f alignment;
+    struct vec2f offset;
+    struct vec2f separation;
+};
+
+#if defined(__GNUC__)
+
+typedef float vec4f __attribute__((vector_size(16)));
+typedef int32_t vec4i __attribute__((vector_size(16)));
+_Static_assert(VT_SIMD_WIDTH == 4);
+
+static inline vec4f vec4f_load(const float* p)
+{
+    vec4f v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline vec4f vec4f_splat(float v)
+{
+    return (vec4f){v, v, v, v};
+}
+
+static inline vec4f vec4f_select(vec4i mask, vec4f v)
+{
+    return (vec4f)(mask & (vec4i)v);
+}
+
+static inline float vec4f_sum(vec4f v)
+{
+    return (v[0] + v[1]) + (v[2] + v[3]);
+}
+
+// Accumulate boids [begin, end) of the sorted grid relative to position (x, y) four at a time.
+// Lanes past the end read the padding or the next cell and are masked out.
+static void sum_neighbors(size_t begin, size_t end, float x, float y, float width, float height,
+                          struct vt_neighbors* ns)
+{
+    const struct vt_grid* g = &g_grid;
+    const vec4i lanes = {0, 1, 2, 3};
+    const vec4i vend = {end, end, end, end};
+    const vec4f vx = vec4f_splat(x);
+    const vec4f vy = vec4f_splat(y);
+    const vec4f vwidth = vec4f_splat(width);
+    const vec4f vheight = vec4f_splat(height);
+    const vec4f vone = vec4f_splat(1.0f);
+
+    vec4f count = {0}, ax = {0}, ay = {0}, ox = {0}, oy = {0}, sx = {0}, sy = {0};
+    for (size_t k = begin; k < end; k += VT_SIMD_WIDTH) {
+        vec4i live = (lanes + (int32_t)k) < vend;
+
+        vec4f dx = vec4f_load(g->x + k) - vx;
+        vec4f dy = vec4f_load(g->y + k) - vy;
+        dx = dx - vec4f_select(dx > vwidth * 0.5f, vwidth) + vec4f_select(dx < vwidth * -0.5f, vwidth);
+        dy = dy - vec4f_select(dy > vheight * 0.5f, vheight) + vec4f_select(dy < vheight * -0.5f, vheight);
+
+        vec4f dist_squared = dx * dx + dy * dy;
+        vec4i in_view = live & (dist_squared <= (float)VT_BOID_VIEW_RANGE_SQUARED);
+        vec4i in_repulsion = live & (dist_squared <= (float)VT_BOID_REPULSION_RANGE_SQUARED);
+
+        vec4f weight = vec4f_select(in_view, vone);
+        count += weight;
+        ax += weight * vec4f_load(g->vx + k);
+        ay += weight * vec4f_load(g->vy + k);
+        ox += weight * dx;
+        oy += weight * dy;
+
+        vec4f repulsion = vec4f_select(in_repulsion, -(float)VT_BOID_REPULSION_RANGE / (dist_squared + (float)FLT_EPSILON));
+        sx += repulsion * dx;
+        sy += repulsion * dy;
+    }
+
+    ns->count += vec4f_sum(count);
+    ns->alignment = vec2f_add(ns->alignment, vec2f_make(vec4f_sum(ax), vec4f_sum(ay)));
+    ns->offset = vec2f_add(ns->offset, vec2f_make(vec4f_sum(ox), vec4f_sum(oy)));
+    ns->separation = vec2f_add(ns->separation, vec2f_make(vec4f_sum(sx), vec4f_sum(sy)));
+}
+
+#else
+
+// Shortest offset between two coordinates on a wrapping axis.
+static inline float wrap_delta(float d, float size)
+{
+    if (d > size / 2) {
+        return d - size;
+    } else if (d < -size / 2) {
+        return d + size;
+    }
+
+    return d;
+}
+
+// Accumulate boids [begin, end) of the sorted grid relative to position (x, y).
+static void sum_neighbors(size_t begin, size_t end, float x, float y, float width, float height,
+                          struct vt_neighbors* ns)
+{
+    const struct vt_grid* g = &g_grid;
+
+    for (size_t k = begin; k < end; k++) {
+        struct vec2f offset = vec2f_make(wrap_delta(g->x[k] - x, width), wrap_delta(g->y[k] - y, height));
+        float dist_squared = vec2f_dot(offset, offset);
+        if (dist_squared <= VT_BOID_VIEW_RANGE_SQUARED) {
+            ns->count += 1;
+            ns->alignment = vec2f_add(ns->alignment, vec2f_make(g->vx[k], g->vy[k]));
+            ns->offset = vec2f_add(ns->offset, offset);
+
+            if (dist_squared <= VT_BOID_REPULSION_RANGE_SQUARED) {
+                ns->separation = vec2f_mul_add(ns->separation, offset,
+                                               -(float)VT_BOID_REPULSION_RANGE / (dist_squared + (float)FLT_EPSILON));
             }
+        }
+    }
+}
 
-            struct vt_boid* other = g_boids + j;
-            float dist_squared = vec2f_dist_squared(b->p, other->p);
-            if (dist_squared <= VT_BOID_VIEW_RANGE_SQUARED) {
-                total_neighbors += 1;
-                alignment = vec2f_add(alignment, other->v);
-                centroid = vec2f_add(centroid, other->p);
-
-                if (dist_squared <= VT_BOID_REPULSION_RANGE_SQUARED)
-                {
-                    // Compute a repulsion vector to be stronger the closer this neighbor is to us.
-                    // Add an epsilon value to avoid potential div by 0.
-                    struct vec2f repulsion = vec2f_mul(vec2f_sub(b->p, other->p),
-                                                       (float)VT_BOID_REPULSION_RANGE / (dist_squared + FLT_EPSILON));
-                    separation = vec2f_add(separation, repulsion);
-                }
+#endif
+
+// Update boids [first, last) on a canvas of given size in dots, dtime is in millisecs.
+// Neighbors are read from the grid so any range can be updated concurrently with the others.
+static void update_boids(size_t first, size_t last, uint32_t dtime, float width, float height)
+{
+    struct vt_flock* f = &g_flock;
+
+    for (size_t i = first; i < last; i++) {
+        struct vec2f p = vec2f_make(f->x[i], f->y[i]);
+
+        // Only the cells around the boid can hold neighbors within view range.
+        // Screen edges wrap, so neighbors are measured by the shortest offset across them.
+        size_t spans[2][2], rows[3];
+        size_t nspans = grid_spans(g_grid.boid_cell[i] % g_grid.cols, g_grid.cols, spans);
+        size_t nrows = grid_neighbors(g_grid.boid_cell[i] / g_grid.cols, g_grid.rows, rows);
+
+        struct vt_neighbors ns = {0};
+        for (size_t r = 0; r < nrows; r++) {
+            const size_t* row = g_grid.cells + rows[r] * g_grid.cols;
+            for (size_t s = 0; s < nspans; s++) {
+                sum_neighbors(row[spans[s][0]], row[spans[s][1]], p.x, p.y, width, height, &ns);
             }
         }
 
+        // The boid itself is in the grid too. Its offset and repulsion are zero, so only discount the rest.
+        size_t total_neighbors = (size_t)ns.count - 1;
+        struct vec2f alignment = vec2f_sub(ns.alignment, vec2f_make(f->vx[i], f->vy[i]));
+
         if (total_neighbors == 0) {
             // Small random changes to boid's heading after keeping the current heading for some time.
-            b->cur_heading_time += dtime;
-            if (b->cur_heading_time >= b->heading_change_delay) {
-                b->cur_heading_time = 0;
-                b->heading_change_delay = random_value_spread(VT_BOID_AVG_HEADING_DELAY_MS, VT_BOID_HEADING_DELAY_VARIATION_MS);
-                b->wander_angle = grad2rad(random_value_spread(b->h, VT_BOID_HEADING_CHANGE_LIMIT_DEG));
+            f->cur_heading_time[i] += dtime;
+            if (f->cur_heading_time[i] >= f->heading_change_delay[i]) {
+                f->cur_heading_time[i] = 0;
+                f->heading_change_delay[i] = random_value_spread(f->seed + i, VT_BOID_AVG_HEADING_DELAY_MS,
+                                                                 VT_BOID_HEADING_DELAY_VARIATION_MS);
+                f->wander_angle[i] = grad2rad(random_value_spread(f->seed + i, f->h[i], VT_BOID_HEADING_CHANGE_LIMIT_DEG));
             }
 
-            struct vec2f fwander = heading_vec(b->wander_angle);
-            steer(b, fwander, dtime);
+            struct vec2f fwander = heading_vec(f->wander_angle[i]);
+            steer(i, fwander, dtime);
 
             if (g_opt_debug) {
-                debug_print(i + 1, 0, "h = %+.02f, w = %+.02f, fwander = %.02f", b->h, b->w, vec2f_length(fwander));
+                debug_print(i + 1, 0, "h = %+.02f, w = %+.02f, fwander = %.02f", f->h[i], f->w[i], vec2f_length(fwander));
             }
         } else {
             // Reset wander state since we are in a flock now.
-            b->cur_heading_time = 0;
-            b->heading_change_delay = 0;
-            b->wander_angle = 0;
+            f->cur_heading_time[i] = 0;
+            f->heading_change_delay[i] = 0;
+            f->wander_angle[i] = 0;
 
             // Alignment vec points towards average direction of our neighbors while its magnitude
             // is proportional to how much consensus they have with that direction.
@@ -342,14 +640,14 @@ static void update(uint32_t dtime)
             // Cohesion vec points to the center-mass point of local flock.
             // Convert that to a pull towards that centroid which is proportional to distance to the centroid.
             // Maximum possible cohesion magnitude will approach the view distance, so we normalize by that.
-            centroid = vec2f_mul(vec2f_add(centroid, b->p), 1.0f / (total_neighbors + 1));
-            struct vec2f cohesion = vec2f_sub(centroid, b->p);
+            // Neighbors are summed as offsets from us, which puts the centroid at their mean offset.
+            struct vec2f cohesion = vec2f_mul(ns.offset, 1.0f / (total_neighbors + 1));
             cohesion = vec2f_mul(cohesion, VT_BOID_COHESION_WEIGHT / VT_BOID_VIEW_RANGE);
             cohesion = vec2f_clamp(cohesion, VT_BOID_STEERING_CAP);
 
             // Separation vec points away from neighbors in repulsion range.
             // The magnitude is iversely proportional to how close the neighbors are (e.g. how urgent it is).
-            separation = vec2f_mul(separation, VT_BOID_SEPARATION_WEIGHT);
+            struct vec2f separation = vec2f_mul(ns.separation, VT_BOID_SEPARATION_WEIGHT);
             separation = vec2f_clamp(separation, VT_BOID_STEERING_CAP);
 
             struct vec2f fsteer = {0, 0};
@@ -357,58 +655,199 @@ static void update(uint32_t dtime)
             fsteer = vec2f_add(fsteer, cohesion);
             fsteer = vec2f_add(fsteer, separation);
 
-            steer(b, fsteer, dtime);
+            steer(i, fsteer, dtime);
 
             if (g_opt_debug) {
                 debug_print(i + 1, 0, "h = %+.02f, w = %+.02f, falign = %.02f, fcoh = %.02f, fsep = %.02f",
-                            b->h, b->w, vec2f_length(alignment), vec2f_length(cohesion), vec2f_length(separation));
-                debug_vec(b->p, alignment, 10, VTR_COLOR_BLUE);
-                debug_vec(b->p, cohesion, 10, VTR_COLOR_GREEN);
-                debug_vec(b->p, separation, 10, VTR_COLOR_RED);
-                debug_vec(b->p, fsteer, 10, VTR_COLOR_DEFAULT);
+                            f->h[i], f->w[i], vec2f_length(alignment), vec2f_length(cohesion), vec2f_length(separation));
+                debug_vec(p, alignment, 10, VTR_COLOR_BLUE);
+                debug_vec(p, cohesion, 10, VTR_COLOR_GREEN);
+                debug_vec(p, separation, 10, VTR_COLOR_RED);
+                debug_vec(p, fsteer, 10, VTR_COLOR_DEFAULT);
             }
         }
 
-
         // Wrap over screen edges
-        if (b->p.x < 0) {
-            b->p.x = vtr_xdots(g_vt) + b->p.x;
-        } else if (b->p.x >= vtr_xdots(g_vt)) {
-            b->p.x = b->p.x - vtr_xdots(g_vt);
+        if (f->x[i] < 0) {
+            f->x[i] = width + f->x[i];
+        } else if (f->x[i] >= width) {
+            f->x[i] = f->x[i] - width;
+        }
+
+        if (f->y[i] < 0) {
+            f->y[i] = height + f->y[i];
+        } else if (f->y[i] >= height) {
+            f->y[i] = f->y[i] - height;
+        }
+    }
+}
+
+static void run_sim_chunks(struct vt_sim_pool* pool)
+{
+    while (true) {
+        size_t first = __atomic_fetch_add(&pool->next_chunk, 1, __ATOMIC_RELAXED) * VT_SIM_CHUNK;
+        if (first >= g_nboids) {
+            break;
         }
 
-        if (b->p.y < 0) {
-            b->p.y = vtr_ydots(g_vt) + b->p.y;
-        } else if (b->p.y >= vtr_ydots(g_vt)) {
-            b->p.y = b->p.y - vtr_ydots(g_vt);
+        update_boids(first, MIN(first + VT_SIM_CHUNK, g_nboids), pool->dtime, pool->width, pool->height);
+    }
+}
+
+static void* sim_worker(void* arg)
+{
+    struct vt_sim_pool* pool = arg;
+    uint64_t generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->generation == generation) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_sim_chunks(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->nrunning == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+
+    return NULL;
+}
+
+static int create_sim_pool(unsigned nthreads)
+{
+    assert(nthreads > 1);
+
+    struct vt_sim_pool* pool = calloc_or_die(1, sizeof(*pool));
+    pool->workers = calloc_or_die(nthreads - 1, sizeof(*pool->workers));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (; pool->nworkers < nthreads - 1; pool->nworkers++) {
+        int error = pthread_create(&pool->workers[pool->nworkers], NULL, sim_worker, pool);
+        if (error) {
+            return -error;
+        }
+    }
+
+    g_pool = pool;
+    return 0;
+}
+
+// Update simulation, dtime is in millisecs.
+static void update(uint32_t dtime)
+{
+    if (g_opt_debug) {
+        static uint64_t total_time = 0;
+        total_time += dtime;
+        debug_print(0, 0, "t(s) = %.02f\n", (float)total_time / 1000);
+    }
+
+    float width = vtr_xdots(g_vt);
+    float height = vtr_ydots(g_vt);
+    build_grid(width, height);
+
+    // Debug output draws from inside the update, so it stays on the main thread.
+    struct vt_sim_pool* pool = g_pool;
+    if (!pool || g_opt_debug) {
+        update_boids(0, g_nboids, dtime, width, height);
+    } else {
+        pthread_mutex_lock(&pool->lock);
+        pool->dtime = dtime;
+        pool->width = width;
+        pool->height = height;
+        pool->next_chunk = 0;
+        pool->nrunning = pool->nworkers;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+
+        run_sim_chunks(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->nrunning > 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
         }
+        pthread_mutex_unlock(&pool->lock);
     }
+
+    g_flock.trail_idx = (g_flock.trail_idx + 1) % VT_BOID_TRAIL_SIZE;
+    g_flock.trail_len = MIN(g_flock.trail_len + 1, VT_BOID_TRAIL_SIZE);
+}
+
+// Overlay the stats of the last frame at the bottom of the screen
+static void draw_stats(void)
+{
+    struct vtr_stats st;
+    if (0 != vtr_get_stats(g_vt, &st)) {
+        return;
+    }
+
+    uint16_t row = vtr_ydots(g_vt) / 4;
+    if (row < 5) {
+        return;
+    }
+
+    const struct vtr_frame_stats* f = &st.last;
+    debug_print(row - 4, 0, "frame %llu: %llu bytes (%llu in order), %llu cells changed of %llu scanned",
+                (unsigned long long)st.frames, (unsigned long long)f->bytes, (unsigned long long)f->inorder_bytes,
+                (unsigned long long)f->cells_changed, (unsigned long long)f->cells_scanned);
+    debug_print(row - 3, 0, "us: raster %llu, diff %llu, encode %llu, write %llu",
+                (unsigned long long)f->raster_ns / 1000, (unsigned long long)f->diff_ns / 1000,
+                (unsigned long long)f->encode_ns / 1000, (unsigned long long)f->write_ns / 1000);
+    debug_print(row - 2, 0, "writes %llu (%llu short), reallocs %llu, dots %llu, lines %llu, polys %llu, texts %llu",
+                (unsigned long long)f->writes, (unsigned long long)f->short_writes, (unsigned long long)f->seq_reallocs,
+                (unsigned long long)f->dots, (unsigned long long)f->lines, (unsigned long long)f->polys,
+                (unsigned long long)f->texts);
+    debug_print(row - 1, 0, "total: %llu KiB, %llu KiB in order, %.1f fps paced at %u Hz",
+                (unsigned long long)st.total.bytes / 1024, (unsigned long long)st.total.inorder_bytes / 1024,
+                st.fps, st.pace_hz);
 }
 
 static void draw(void)
 {
-    for (size_t i = 0; i < g_nboids; i++) {
-        struct vt_boid* b = g_boids + i;
-        struct vec2f d = vec2f_unit(b->v);
-        struct vec2f n = vec2f_normal(d);
+    if (g_opt_debug) {
+        draw_stats();
+    }
 
-        struct vtr_vertex buf[] = {
-            vec2f_project(vec2f_mul_add(b->p, n, -VT_BOID_WIDTH / 2)),
-            vec2f_project(vec2f_mul_add(b->p, n, VT_BOID_WIDTH / 2)),
-            vec2f_project(vec2f_mul_add(b->p, d, VT_BOID_LENGTH)),
-        };
+    // Trails are the bulk of all dots, those skip the draw calls unless the canvas is deferred
+    struct vtr_dot_target targets[VTR_COLOR_TOTAL];
+    bool unchecked = (g_flock.trail != NULL);
+    for (int c = 0; unchecked && c < VTR_COLOR_TOTAL; c++) {
+        unchecked = (vtr_get_dot_target(g_vt, c, &targets[c]) == 0);
+    }
+
+    const struct vt_flock* f = &g_flock;
+    for (size_t i = 0; i < g_nboids; i++) {
+        struct vtr_vertex p = vec2f_project(vec2f_make(f->x[i], f->y[i]));
+        vtr_blit_sprite_rotated(g_vt, g_boid_sprite, p.x, p.y, f->h[i], f->color[i]);
 
-        vtr_trace_polyc(g_vt, sizeof(buf) / sizeof(*buf), buf, b->color);
+        if (f->trail) {
+            const struct vec2f* trail = f->trail + i * VT_BOID_TRAIL_SIZE;
+            const struct vtr_dot_target* target = &targets[f->color[i]];
+            struct vtr_vertex trail_dots[VT_BOID_TRAIL_SIZE / 2];
+            size_t ndots = 0;
 
-        if (g_opt_trails) {
-            for (size_t idx = 0; idx < b->trail_len; idx++) {
+            for (size_t idx = 0; idx < f->trail_len; idx++) {
                 // Draw every other trail dot so that it makes a dashed curve
                 if (idx & 0x1) {
-                    struct vec2f trail_pos = b->trail[b->trail_idx > idx ? b->trail_idx - idx - 1 : b->trail_len + b->trail_idx - idx];
-                    struct vtr_vertex trail_dot = vec2f_project(trail_pos);
-                    vtr_render_dotc(g_vt, trail_dot.x, trail_dot.y, b->color);
+                    struct vec2f trail_pos = trail[(f->trail_idx + VT_BOID_TRAIL_SIZE - idx - 1) % VT_BOID_TRAIL_SIZE];
+                    struct vtr_vertex dot = vec2f_project(trail_pos);
+                    if (!unchecked) {
+                        trail_dots[ndots++] = dot;
+                    } else if ((unsigned)dot.x < target->xdots && (unsigned)dot.y < target->ydots) {
+                        vtr_plot_unchecked(target, dot.x, dot.y);
+                    }
                 }
             }
+
+            vtr_render_dots(g_vt, ndots, trail_dots, NULL, f->color[i]);
         }
     }
 }
@@ -425,21 +864,47 @@ static void handle_signal(int signo)
     raise(signo);
 }
 
-static uint64_t clock_monotonic_ms(void)
+static uint64_t clock_monotonic_ns(void)
 {
     struct timespec t;
     clock_gettime(CLOCK_MONOTONIC_RAW, &t);
 
-    return ((uint64_t)t.tv_sec * 1000000000 + t.tv_nsec) / 1000000;
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static uint64_t clock_monotonic_ms(void)
+{
+    return clock_monotonic_ns() / 1000000;
+}
+
+// Overlay how long the last frame spent in simulation and in rendering at the top right of the screen
+static void draw_timings(uint64_t sim_ns, uint64_t render_ns)
+{
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "sim %6llu us, render %6llu us",
+                       (unsigned long long)sim_ns / 1000, (unsigned long long)render_ns / 1000);
+    uint16_t cols = vtr_xdots(g_vt) / 2;
+    if (len <= 0 || len > cols) {
+        return;
+    }
+
+    vtr_print_text(g_vt, 0, cols - len, buf);
 }
 
 void print_help(const char *progname)
 {
     printf("Usage: %s [options]\n", progname);
     printf("\t-n <number>: set a specific number of boids\n");
-    printf("\t-d:          draw debug vectors\n");
+    printf("\t-d:          draw debug vectors and frame stats\n");
     printf("\t-c:          use random colors for boids\n");
     printf("\t-t:          draw trails\n");
+    printf("\t-s:          use synchronized updates if the terminal supports them\n");
+    printf("\t-j <number>: rasterize with this many threads\n");
+    printf("\t-u <number>: update the simulation with this many threads\n");
+    printf("\t-p:          encode and write out frames in the background\n");
+    printf("\t-g:          encode rows grouped by color when that is shorter\n");
+    printf("\t-m:          show simulation and render time of every frame\n");
+    printf("\t-r <path>:   record the frames into this file for vtr-replay\n");
     printf("\t-h:          display this help\n");
 }
 
@@ -448,7 +913,7 @@ int main(int argc, char** argv)
     int error;
     int opt;
 
-    while ((opt = getopt(argc, argv, "dn:ch")) != -1) {
+    while ((opt = getopt(argc, argv, "dn:chtsj:u:pgmr:")) != -1) {
         switch (opt) {
         case 'd':
             g_opt_debug = true;
@@ -465,6 +930,33 @@ int main(int argc, char** argv)
         case 't':
             g_opt_trails = true;
             break;
+        case 's':
+            g_opt_sync = true;
+            break;
+        case 'j':
+            g_opt_threads = atoi(optarg);
+            if (g_opt_threads <= 0) {
+                goto bad_opts;
+            }
+            break;
+        case 'u':
+            g_opt_sim_threads = atoi(optarg);
+            if (g_opt_sim_threads <= 0) {
+                goto bad_opts;
+            }
+            break;
+        case 'p':
+            g_opt_pipelined = true;
+            break;
+        case 'g':
+            g_opt_grouping = true;
+            break;
+        case 'm':
+            g_opt_timings = true;
+            break;
+        case 'r':
+            g_opt_record = optarg;
+            break;
         case 'h':
             print_help(argv[0]);
             exit(EXIT_SUCCESS);
@@ -481,19 +973,66 @@ int main(int argc, char** argv)
     atexit(restore_tty_attrs);
     signal(SIGINT, handle_signal);
 
+    if (g_opt_sync) {
+        vtr_set_sync_updates(g_vt, VTR_SYNC_AUTO);
+    }
+
+    error = vtr_set_raster_threads(g_vt, g_opt_threads);
+    if (error) {
+        exit(-error);
+    }
+
+    if (g_opt_grouping) {
+        vtr_set_color_grouping(g_vt, 1);
+    }
+
+    if (g_opt_pipelined) {
+        error = vtr_set_pipelined(g_vt, 1);
+        if (error) {
+            exit(-error);
+        }
+    }
+
     error = vtr_reset(g_vt);
     if (error) {
         exit(error);
     }
 
+    // Recording is closed by vtr_close, the file itself when we exit
+    if (g_opt_record) {
+        int fd = open(g_opt_record, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || vtr_record_start(g_vt, fd) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
     srand((unsigned int)time(NULL));
 
     g_nboids = g_opt_nboids;
-    g_boids = calloc(sizeof(*g_boids), g_nboids);
-    if (!g_boids) {
-        exit(ENOMEM);
+
+    struct vt_flock* f = &g_flock;
+    f->x = calloc_or_die(g_nboids, sizeof(*f->x));
+    f->y = calloc_or_die(g_nboids, sizeof(*f->y));
+    f->vx = calloc_or_die(g_nboids, sizeof(*f->vx));
+    f->vy = calloc_or_die(g_nboids, sizeof(*f->vy));
+    f->h = calloc_or_die(g_nboids, sizeof(*f->h));
+    f->w = calloc_or_die(g_nboids, sizeof(*f->w));
+    f->wander_angle = calloc_or_die(g_nboids, sizeof(*f->wander_angle));
+    f->heading_change_delay = calloc_or_die(g_nboids, sizeof(*f->heading_change_delay));
+    f->cur_heading_time = calloc_or_die(g_nboids, sizeof(*f->cur_heading_time));
+    f->seed = calloc_or_die(g_nboids, sizeof(*f->seed));
+    f->color = calloc_or_die(g_nboids, sizeof(*f->color));
+    if (g_opt_trails) {
+        f->trail = calloc_or_die(g_nboids * VT_BOID_TRAIL_SIZE, sizeof(*f->trail));
     }
 
+    g_grid.boids = calloc_or_die(g_nboids, sizeof(*g_grid.boids));
+    g_grid.boid_cell = calloc_or_die(g_nboids, sizeof(*g_grid.boid_cell));
+    g_grid.x = calloc_or_die(g_nboids + VT_SIMD_WIDTH, sizeof(*g_grid.x));
+    g_grid.y = calloc_or_die(g_nboids + VT_SIMD_WIDTH, sizeof(*g_grid.y));
+    g_grid.vx = calloc_or_die(g_nboids + VT_SIMD_WIDTH, sizeof(*g_grid.vx));
+    g_grid.vy = calloc_or_die(g_nboids + VT_SIMD_WIDTH, sizeof(*g_grid.vy));
+
     static const int colors[] = {
         VTR_COLOR_YELLOW,
         VTR_COLOR_BLUE,
@@ -501,17 +1040,48 @@ int main(int argc, char** argv)
         VTR_COLOR_RED
     };
 
+    // Boid triangle pointing along the x axis, with its base centered on the boid position
+    static const struct vtr_vertex shape[] = {
+        {0, -VT_BOID_WIDTH / 2},
+        {0, VT_BOID_WIDTH / 2},
+        {VT_BOID_LENGTH, 0},
+    };
+
+    g_boid_sprite = vtr_sprite_create(sizeof(shape) / sizeof(*shape), shape, VT_BOID_SPRITE_ANGLES);
+    if (!g_boid_sprite) {
+        exit(ENOMEM);
+    }
+
     for (size_t i = 0; i < g_nboids; i++) {
-        struct vt_boid* b = g_boids + i;
-        b->p = vec2f_make(random_value_in_range(0, vtr_xdots(g_vt) - 1), random_value_in_range(0, vtr_ydots(g_vt) - 1));
-        b->h = grad2rad(random_value_in_range(0, 360));
-        b->v = heading_vec(b->h);
-        b->color = (g_opt_colors ? colors[i % (sizeof(colors) / sizeof(*colors))] : VTR_COLOR_DEFAULT);
+        f->x[i] = random_value_in_range(0, vtr_xdots(g_vt) - 1);
+        f->y[i] = random_value_in_range(0, vtr_ydots(g_vt) - 1);
+        f->h[i] = grad2rad(random_value_in_range(0, 360));
+
+        struct vec2f v = heading_vec(f->h[i]);
+        f->vx[i] = v.x;
+        f->vy[i] = v.y;
+        f->seed[i] = (uint32_t)rand() | 1;
+        f->color[i] = (g_opt_colors ? colors[i % (sizeof(colors) / sizeof(*colors))] : VTR_COLOR_DEFAULT);
+    }
+
+    if (g_opt_sim_threads > 1) {
+        error = create_sim_pool(g_opt_sim_threads);
+        if (error) {
+            exit(-error);
+        }
+    }
+
+    // Simulation steps by the time that actually passed, so it keeps up when the pacer lowers the rate
+    error = vtr_set_pacing(g_vt, &(struct vtr_pacing){ .hz = VT_HZ, .min_hz = VT_HZ / 4 });
+    if (error) {
+        exit(-error);
     }
 
     uint64_t tcur, tprev = clock_monotonic_ms();
     uint32_t tdiff;
+    uint64_t render_ns = 0;
     while (true) {
+        vtr_frame_begin(g_vt);
         vtr_resize(g_vt);
 
         tcur = clock_monotonic_ms();
@@ -519,17 +1089,23 @@ int main(int argc, char** argv)
         tdiff = tcur - tprev;
         tprev = tcur;
 
+        // Render time covers drawing and the buffer swap, so it is shown one frame late.
+        uint64_t tstart = clock_monotonic_ns();
         update(tdiff);
-        draw();
+        uint64_t tsim = clock_monotonic_ns();
 
-        vtr_swap_buffers(g_vt);
+        if (g_opt_timings) {
+            draw_timings(tsim - tstart, render_ns);
+        }
 
-        usleep(1000000 / VT_HZ);
+        draw();
+        vtr_frame_end(g_vt);
+        render_ns = clock_monotonic_ns() - tsim;
     }
 
     return 0;
 
 bad_opts:
-    fprintf(stderr, "Usage: %s [-d] [-c] [-t] [-n boids-count]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-d] [-c] [-t] [-s] [-j threads] [-u threads] [-p] [-g] [-m] [-r path] [-n boids-count]\n", argv[0]);
     exit(EXIT_FAILURE);
 }
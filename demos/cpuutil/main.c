@@ -23,11 +23,14 @@ struct cpu_times
 
 static struct cpu_times g_tlast;
 static double* g_util_history;
+static struct vtr_line* g_columns;
 static size_t g_history_depth;
 static size_t g_history_pos;
+static uint64_t g_nsamples;
 static double g_utilavg;
 static double g_decay_factor;
 static struct vtr_canvas* g_vt;
+static struct vtr_canvas* g_grid;
 
 static int read_cpu_times(struct cpu_times *t)
 {
@@ -67,22 +70,42 @@ static void update(uint32_t dtimems)
 
     g_util_history[g_history_pos] = uavg;
     g_history_pos = (g_history_pos + 1) % g_history_depth;
+    g_nsamples++;
     g_tlast = t;
     g_utilavg = uavg;
 }
 
+// Plot moves right by a whole char cell every other sample, so that the terminal can scroll it
 static void draw(void)
 {
     for (size_t i = 0; i < g_history_depth; i++) {
         double u = g_util_history[(g_history_pos + i) % g_history_depth];
-        uint16_t x = (uint16_t) (vtr_xdots(g_vt) - i - 1);
+        uint16_t x = (uint16_t) (g_history_depth - i - 1 + (g_nsamples & 1));
         uint16_t h = (uint16_t) ((double)vtr_ydots(g_vt) * u);
 
-        if (h > 0) {
-            vtr_scan_line(g_vt, x, vtr_ydots(g_vt) - h - 1, x, vtr_ydots(g_vt) - 1);
-        } else {
-            vtr_render_dot(g_vt, x, vtr_ydots(g_vt) - 1);
+        // A zero height column is a single dot
+        g_columns[i] = (struct vtr_line){ {x, vtr_ydots(g_vt) - h - 1}, {x, vtr_ydots(g_vt) - 1} };
+    }
+
+    vtr_scan_lines(g_vt, g_history_depth, g_columns, NULL, VTR_COLOR_DEFAULT);
+}
+
+// Utilization scale, it only changes with the canvas size so it lives in a retained layer
+static void draw_grid(void)
+{
+    uint16_t xdots = vtr_xdots(g_grid);
+    uint16_t ydots = vtr_ydots(g_grid);
+
+    for (int pct = 25; pct < 100; pct += 25) {
+        int y = ydots - 1 - ydots * pct / 100;
+        for (int x = 0; x < xdots; x += 2) {
+            vtr_render_dotc(g_grid, x, y, VTR_COLOR_DEFAULT);
         }
+
+        // Braille cells are 4 dots high
+        char label[8];
+        snprintf(label, sizeof(label), "%d%%", pct);
+        vtr_print_text(g_grid, (uint16_t)(y / 4), 0, label);
     }
 }
 
@@ -115,9 +138,15 @@ int main(void)
         exit(error);
     }
 
+    g_grid = vtr_layer_create(g_vt, 0);
+    if (!g_grid) {
+        exit(ENOMEM);
+    }
+
     g_history_depth = vtr_xdots(g_vt);
     g_util_history = calloc(sizeof(double), g_history_depth);
-    if (!g_util_history) {
+    g_columns = calloc(sizeof(*g_columns), g_history_depth);
+    if (!g_util_history || !g_columns) {
         exit(ENOMEM);
     }
 
@@ -125,7 +154,17 @@ int main(void)
 
     while (true) {
         vtr_resize(g_vt);
+        uint64_t nsamples = g_nsamples;
         update(1000 / TICK_HZ);
+        if (g_nsamples != nsamples && (g_nsamples & 1)) {
+            // Terminals without left and right margins just get the whole plot redrawn
+            struct vtr_rect plot = { 0, 0, vtr_ydots(g_vt) / 4, vtr_xdots(g_vt) / 2 };
+            (void) vtr_scroll(g_vt, &plot, 1, 0);
+        }
+
+        if (vtr_layer_needs_redraw(g_grid)) {
+            draw_grid();
+        }
         draw();
         vtr_swap_buffers(g_vt);
         usleep(1000000 / TICK_HZ);
@@ -37,11 +37,14 @@ int main(void)
         exit(error);
     }
 
+    vtr_set_pacing(g_vt, &(struct vtr_pacing){ .hz = 60 });
+
     uint32_t wbox = 150, hbox = 80, margin = 4, charw = wbox / 3;
     int x = 0, y = 0;
     int xdir = 1, ydir = 1;
 
     while(true) {
+        vtr_frame_begin(g_vt);
         vtr_resize(g_vt);
 
         vtr_scan_linec(g_vt, x + margin, y + hbox - margin, x + charw / 2, y + margin, VTR_COLOR_RED);
@@ -55,8 +58,7 @@ int main(void)
         vtr_scan_linec(g_vt, x + charw * 2 + margin, y + margin, x + charw * 3 - margin, y + hbox - margin, VTR_COLOR_WHITE);
         vtr_scan_linec(g_vt, x + charw * 3 - margin, y + margin, x + charw * 2 + margin, y + hbox - margin, VTR_COLOR_DEFAULT);
 
-        vtr_swap_buffers(g_vt);
-        usleep(1000000 / 60);
+        vtr_frame_end(g_vt);
 
         x += xdir * 1; y += ydir * 1;
 
@@ -0,0 +1,106 @@
+// Checks every compiled frame diff kernel against diff_cells_scalar, mask word for mask word.
+// The kernels are internal to the library, so this builds the library source into the test itself.
+
+#include "vtrenderlib.c"
+
+// Longest run checked, a few AVX2 iterations plus every tail length
+#define VT_TEST_MAX_CELLS   (4 * 32 + 31)
+#define VT_TEST_MAX_OFFSET  7
+#define VT_TEST_ROUNDS      64
+
+typedef void (*diff_kernel_fn)(const uint32_t*, const uint32_t*, size_t, uint64_t*);
+
+struct diff_kernel
+{
+    const char* name;
+    diff_kernel_fn fn;
+    bool supported;
+};
+
+static uint32_t g_seed = 0x2545F491u;
+
+static uint32_t rand_next(void)
+{
+    g_seed ^= g_seed << 13;
+    g_seed ^= g_seed >> 17;
+    g_seed ^= g_seed << 5;
+    return g_seed;
+}
+
+// Fill prev with random cells and cur with a copy that differs in roughly one cell out of every `every`,
+// 0 meaning no differences (reported as 1 in 0) and 1 meaning all cells
+static void fill_cells(uint32_t* cur, uint32_t* prev, size_t ncells, uint32_t every)
+{
+    for (size_t i = 0; i < ncells; i++) {
+        prev[i] = rand_next();
+        cur[i] = prev[i];
+        if (every && rand_next() % every == 0) {
+            cur[i] ^= 1u << (rand_next() % 32);
+        }
+    }
+}
+
+static bool check_kernel(const struct diff_kernel* k)
+{
+    static const uint32_t densities[] = { 0, 1, 2, 7, 64 };
+    uint32_t cur[VT_TEST_MAX_CELLS + VT_TEST_MAX_OFFSET], prev[VT_TEST_MAX_CELLS + VT_TEST_MAX_OFFSET];
+    uint64_t expected[VT_DIFFMASK_WORDS(VT_TEST_MAX_CELLS)], actual[VT_DIFFMASK_WORDS(VT_TEST_MAX_CELLS)];
+
+    for (int round = 0; round < VT_TEST_ROUNDS; round++) {
+        uint32_t every = densities[round % (sizeof(densities) / sizeof(*densities))];
+        fill_cells(cur, prev, (sizeof(cur) / sizeof(*cur)), every);
+
+        for (size_t curoff = 0; curoff <= VT_TEST_MAX_OFFSET; curoff++) {
+            // prev at its own offset too, the two buffers are never aligned alike in the library either
+            size_t prevoff = (curoff * 3 + round) % (VT_TEST_MAX_OFFSET + 1);
+
+            for (size_t ncells = 0; ncells <= VT_TEST_MAX_CELLS; ncells++) {
+                // Kernels own the whole mask, stale bits must not survive
+                memset(expected, 0xA5, sizeof(expected));
+                memset(actual, 0x5A, sizeof(actual));
+
+                diff_cells_scalar(cur + curoff, prev + prevoff, ncells, expected);
+                k->fn(cur + curoff, prev + prevoff, ncells, actual);
+
+                if (0 != memcmp(expected, actual, VT_DIFFMASK_WORDS(ncells) * sizeof(*expected))) {
+                    fprintf(stderr, "%s: mismatch at ncells %zu, offsets %zu/%zu, changes 1 in %u\n",
+                            k->name, ncells, curoff, prevoff, every);
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+int main(void)
+{
+#if defined(VT_HAVE_X86_SIMD)
+    __builtin_cpu_init();
+#endif
+
+    struct diff_kernel kernels[] = {
+        {"scalar", diff_cells_scalar, true},
+#if defined(VT_HAVE_X86_SIMD)
+        {"sse2", diff_cells_sse2, __builtin_cpu_supports("sse2")},
+        {"avx2", diff_cells_avx2, __builtin_cpu_supports("avx2")},
+#elif defined(VT_HAVE_NEON)
+        {"neon", diff_cells_neon, true},
+#endif
+    };
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+        if (!kernels[i].supported) {
+            printf("%s: skipped, not supported by this CPU\n", kernels[i].name);
+            continue;
+        }
+
+        bool ok = check_kernel(&kernels[i]);
+        printf("%s: %s\n", kernels[i].name, ok ? "ok" : "FAILED");
+        failed += !ok;
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,313 @@
+// Records a few frames of dots, RGB colors, styled and wide text and a resize, replays them into two canvases
+// in turn and checks that every replayed frame resolves to the recorded one, cell for cell and glyph for glyph.
+// Color and style ids differ from canvas to canvas, so cells are compared by the colors and styles they stand for.
+// That takes the buffers of the canvases, so this builds the library source into the test itself.
+
+#include "vtrenderlib.c"
+
+#define VT_TEST_ROWS    12
+#define VT_TEST_COLS    40
+#define VT_TEST_FRAMES  8
+
+// Frame resized to before drawing it
+#define VT_TEST_RESIZE_FRAME    5
+#define VT_TEST_RESIZE_ROWS     9
+#define VT_TEST_RESIZE_COLS     30
+
+// Frame drawn into the canvas of the previous one, closed and created again in between,
+// and the canvases created at most to get one at the address of the closed one
+#define VT_TEST_REOPEN_FRAME    3
+#define VT_TEST_REOPEN_TRIES    16
+
+// Text style with its colors resolved
+struct style
+{
+    uint32_t fg;
+    uint32_t bg;
+    bool bold;
+};
+
+// Frame as drawn, by row. Cells and glyphs are kept without their color and style ids, which are resolved.
+struct frame
+{
+    uint16_t nrows;
+    uint16_t ncols;
+    uint32_t cells[VT_TEST_ROWS * VT_TEST_COLS];
+    uint32_t colors[VT_TEST_ROWS * VT_TEST_COLS];
+    uint32_t glyphs[VT_TEST_ROWS * VT_TEST_COLS];
+    struct style styles[VT_TEST_ROWS * VT_TEST_COLS];
+};
+
+// RGB colors resolved to their value above the 16 bit ids, the others stay as they are
+static uint32_t resolve_color(const struct vtr_canvas* vt, uint16_t id)
+{
+    if (id >= VT_COLOR_RGB_BASE && id != VT_FGCOLOR_UNKNOWN) {
+        return 0x1000000u | palette_rgb(vt, id);
+    }
+
+    return id;
+}
+
+static void snapshot(const struct vtr_canvas* vt, struct frame* f)
+{
+    const struct vtr_stencil_buf* sb = vt->cur_sb;
+
+    f->nrows = vt->nrows;
+    f->ncols = vt->ncols;
+    for (uint16_t row = 0; row < vt->nrows; row++) {
+        for (uint16_t col = 0; col < vt->ncols; col++) {
+            uint32_t cell = sb->cells[(size_t)row * sb->stride + col];
+            uint32_t glyph = sb->glyphs[(size_t)row * sb->stride + col];
+            size_t i = (size_t)row * vt->ncols + col;
+
+            f->cells[i] = cell & ~VT_CELL_FGCOLOR_BITS;
+            f->colors[i] = resolve_color(vt, cell_fgcolor(cell));
+            f->glyphs[i] = glyph & ~((uint32_t)0xFF << VT_GLYPH_STYLE_SHIFT);
+            f->styles[i] = (struct style){0};
+            if (glyph_style(glyph)) {
+                struct vt_text_style style = text_style(vt, glyph_style(glyph));
+                f->styles[i].fg = resolve_color(vt, style.fgc);
+                f->styles[i].bg = resolve_color(vt, style.bgc);
+                f->styles[i].bold = style.bold;
+            }
+        }
+    }
+}
+
+static bool compare_frames(int frame, const struct frame* want, const struct frame* got)
+{
+    if (want->nrows != got->nrows || want->ncols != got->ncols) {
+        fprintf(stderr, "frame %d: replayed as %ux%u instead of %ux%u\n", frame, got->nrows, got->ncols, want->nrows,
+                want->ncols);
+        return false;
+    }
+
+    for (size_t i = 0; i < (size_t)want->nrows * want->ncols; i++) {
+        if (want->cells[i] != got->cells[i] || want->colors[i] != got->colors[i] || want->glyphs[i] != got->glyphs[i] ||
+            want->styles[i].fg != got->styles[i].fg || want->styles[i].bg != got->styles[i].bg ||
+            want->styles[i].bold != got->styles[i].bold) {
+            fprintf(stderr, "frame %d: cell %zu/%zu replayed as %08x/%08x/%08x/%08x/%08x "
+                    "instead of %08x/%08x/%08x/%08x/%08x\n", frame, i / want->ncols, i % want->ncols,
+                    got->cells[i], got->colors[i], got->glyphs[i], got->styles[i].fg, got->styles[i].bg,
+                    want->cells[i], want->colors[i], want->glyphs[i], want->styles[i].fg, want->styles[i].bg);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void draw_frame(struct vtr_canvas* vt, int frame)
+{
+    int xdots = vtr_xdots(vt);
+    int ydots = vtr_ydots(vt);
+
+    // New RGB colors in every frame, with recurring ones and indexed and enum ones among them.
+    // Recurring colors and styles are drawn with the ids the replay keeps for them, which have to be the right ones.
+    for (int i = 0; i < 64; i++) {
+        int x = (i * 7 + frame * 3) % xdots;
+        int y = (i * 5 + frame) % ydots;
+        uint32_t color = VTR_XCOLOR_RGB(i * 4, frame * 30, 255 - i * 2);
+        if (i % 8 == 0) {
+            color = VTR_XCOLOR_RGB(i, 90, 180);
+        } else if (i % 8 == 1) {
+            color = VTR_XCOLOR_INDEXED(i + frame);
+        } else if (i % 8 == 2) {
+            color = VTR_COLOR_RED + (i / 8) % 7;
+        }
+
+        vtr_render_dotx(vt, x, y, color);
+    }
+
+    vtr_scan_linex(vt, 0, ydots - 1, xdots - 1, 0, VTR_XCOLOR_RGB(200, 100, frame));
+
+    struct vtr_text_style styles[] = {
+        { VTR_XCOLOR_RGB(255, 128, frame), 0, 0 },
+        { 0, VTR_XCOLOR_RGB(10, 20, 30 + frame), 1 },
+        { VTR_XCOLOR_INDEXED(200), VTR_XCOLOR_RGB(frame, frame, frame), frame % 2 },
+    };
+    struct vtr_text_style recurring = { VTR_XCOLOR_RGB(0, 90, 180), VTR_COLOR_BLUE, 1 };
+
+    vtr_print_text(vt, 0, 0, "plain");
+    vtr_print_textx(vt, 0, 8, "same", &recurring);
+    vtr_print_textx(vt, 1, frame % 4, "wide \xE6\xBC\xA2\xE5\xAD\x97 and \xF0\x9F\x98\x80", &styles[frame % 3]);
+    vtr_print_textx(vt, 2, 3, "bold", &styles[1]);
+
+    // Wide glyph cut by the end of the row, and one half of another printed over
+    vtr_print_textx(vt, 3, vt->ncols - 1, "\xE6\xBC\xA2", &styles[2]);
+    vtr_print_text(vt, 4, 0, "\xE6\xBC\xA2\xE5\xAD\x97");
+    vtr_print_textx(vt, 4, 1, "x", &styles[0]);
+}
+
+// Colors and styles interned before the replay, so that the canvas gives the recorded ones other ids.
+// How many depends on the seed, so that canvases polluted with different seeds don't agree on ids either.
+static void pollute_palette(struct vtr_canvas* vt, uint8_t seed)
+{
+    struct vtr_text_style style = { VTR_XCOLOR_RGB(seed, 1, 2), VTR_XCOLOR_RGB(3, seed, 4), 1 };
+    for (int i = 0; i < seed % 8; i++) {
+        vtr_render_dotx(vt, i, 0, VTR_XCOLOR_RGB(seed, i, 77));
+        style.fg += 1;
+        vtr_print_textx(vt, 0, i, "s", &style);
+    }
+    vtr_swap_buffers(vt);
+}
+
+// Close a canvas and create one of the given dimensions in its place, at the same address if the allocator
+// gives it back within a few canvases. Returns NULL on error.
+static struct vtr_canvas* reopen_canvas(struct vtr_canvas* vt, uint16_t rows, uint16_t cols)
+{
+    uintptr_t addr = (uintptr_t)vt;
+    vtr_close(vt);
+
+    struct vtr_canvas* spare[VT_TEST_REOPEN_TRIES];
+    size_t nspare = 0;
+
+    vt = vtr_canvas_create_headless(rows, cols, -1);
+    while (vt && (uintptr_t)vt != addr && nspare < VT_TEST_REOPEN_TRIES) {
+        spare[nspare++] = vt;
+        vt = vtr_canvas_create_headless(rows, cols, -1);
+    }
+
+    if (vt && (uintptr_t)vt != addr) {
+        printf("replay: no canvas at the address of the closed one\n");
+    }
+
+    while (nspare > 0) {
+        vtr_close(spare[--nspare]);
+    }
+
+    return vt;
+}
+
+static bool record_frames(int fd, struct frame* frames)
+{
+    struct vtr_canvas* vt = vtr_canvas_create_headless(VT_TEST_ROWS, VT_TEST_COLS, -1);
+    if (!vt) {
+        fprintf(stderr, "failed to create the recording canvas\n");
+        return false;
+    }
+
+    int error = vtr_record_start(vt, fd);
+    for (int i = 0; !error && i < VT_TEST_FRAMES; i++) {
+        if (i == VT_TEST_RESIZE_FRAME) {
+            error = reconfigure_canvas(vt, VT_TEST_RESIZE_ROWS, VT_TEST_RESIZE_COLS);
+            if (error) {
+                break;
+            }
+        }
+
+        draw_frame(vt, i);
+        snapshot(vt, &frames[i]);
+        error = vtr_swap_buffers(vt);
+    }
+
+    int stop_error = vtr_record_stop(vt);
+    vtr_close(vt);
+    if (error || stop_error) {
+        fprintf(stderr, "recording failed: %d/%d\n", error, stop_error);
+        return false;
+    }
+
+    return true;
+}
+
+static bool replay_frames(int fd, const struct frame* frames)
+{
+    struct vtr_replay* rp = vtr_replay_open(fd);
+    struct frame* got = malloc(sizeof(*got));
+    struct vtr_canvas* canvases[2] = {
+        vtr_canvas_create_headless(VT_TEST_ROWS, VT_TEST_COLS, -1),
+        vtr_canvas_create_headless(VT_TEST_ROWS, VT_TEST_COLS, -1),
+    };
+
+    bool ok = (rp && got && canvases[0] && canvases[1]);
+    if (!ok) {
+        fprintf(stderr, "failed to open the replay\n");
+    } else {
+        pollute_palette(canvases[1], 11);
+    }
+
+    int frame = 0;
+    uint16_t rows, cols;
+    int error = 0;
+    while (ok && 0 == (error = vtr_replay_next(rp, &rows, &cols))) {
+        // Fresh canvas with ids of its own, which mustn't be taken for the closed one
+        struct vtr_canvas** vt = &canvases[(frame + (frame >= VT_TEST_REOPEN_FRAME)) % 2];
+        if (frame == VT_TEST_REOPEN_FRAME) {
+            *vt = reopen_canvas(*vt, rows, cols);
+            if (!*vt) {
+                fprintf(stderr, "failed to create the canvas again\n");
+                ok = false;
+                break;
+            }
+            pollute_palette(*vt, 42);
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if ((canvases[i]->nrows != rows || canvases[i]->ncols != cols) &&
+                0 != reconfigure_canvas(canvases[i], rows, cols)) {
+                fprintf(stderr, "failed to resize a replay canvas\n");
+                ok = false;
+            }
+        }
+
+        if (ok && frame >= VT_TEST_FRAMES) {
+            fprintf(stderr, "replay has more frames than recorded\n");
+            ok = false;
+        }
+
+        if (ok) {
+            error = vtr_replay_draw(rp, *vt);
+            if (error) {
+                fprintf(stderr, "frame %d: replay draw failed: %d\n", frame, error);
+                ok = false;
+            }
+        }
+
+        if (ok) {
+            snapshot(*vt, got);
+            ok = compare_frames(frame, &frames[frame], got);
+            vtr_swap_buffers(*vt);
+        }
+
+        frame++;
+    }
+
+    if (ok && (error != -ENODATA || frame != VT_TEST_FRAMES)) {
+        fprintf(stderr, "replay ended after %d frames with %d\n", frame, error);
+        ok = false;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (canvases[i]) {
+            vtr_close(canvases[i]);
+        }
+    }
+    if (rp) {
+        vtr_replay_close(rp);
+    }
+    free(got);
+
+    return ok;
+}
+
+int main(void)
+{
+    FILE* file = tmpfile();
+    if (!file) {
+        perror("tmpfile");
+        return EXIT_FAILURE;
+    }
+
+    struct frame* frames = malloc(VT_TEST_FRAMES * sizeof(*frames));
+    bool ok = (frames && record_frames(fileno(file), frames));
+
+    // Replay maps what was written through the same file
+    ok = ok && replay_frames(fileno(file), frames);
+    printf("replay: %s\n", ok ? "ok" : "FAILED");
+
+    free(frames);
+    fclose(file);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -89,9 +89,23 @@
 #include <math.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <termios.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VT_HAVE_X86_SIMD
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VT_HAVE_NEON
+#endif
 
 #include "vtrenderlib.h"
 
@@ -105,6 +119,13 @@
 #define DBG_LOG(fmt, ...)
 #endif
 
+// Frame statistics are collected unless built with VTR_NO_STATS, which leaves the counted expressions unevaluated
+#ifndef VTR_NO_STATS
+#define STAT_ADD(stats, field, n) ((stats)->field += (n))
+#else
+#define STAT_ADD(stats, field, n) ((void)sizeof(n))
+#endif
+
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
@@ -120,19 +141,326 @@
 // Character cell dims in dots
 #define VT_CELL_YDOTS ((uint16_t)4)
 #define VT_CELL_XDOTS ((uint16_t)2)
+#define VT_CELL_YDOTS_SHIFT 2
+#define VT_CELL_XDOTS_SHIFT 1
 
-// We preallocate enough space to hold the biggest number of draw calls (3 + 6 colored bytes per escape seq)
-// plus some slack to hold a cursor reset commands.
+// Sequence lists are preallocated for the worst case frame, see seq_frame_bound,
+// plus some slack to hold control sequences sent in between frames.
 #define VT_MIN_SEQLIST_SLACK                ((size_t)64)
-#define VT_SEQLIST_BUFFER_SIZE(rows, cols)  MAX((size_t)((rows + 1) * cols + 1) * 9, VT_MIN_SEQLIST_SLACK)
+
+// Stencil cells are packed into a single 32-bit word so that a cell diff is a single compare:
+//
+// +---------------+--------------+----------+
+// |     31-16     |     15-8     |   7-0    |
+// +---------------+--------------+----------+
+// | fgcolor id    | text overlay | dot mask |
+// +---------------+--------------+----------+
+//
+// Text overlay is only a flag, the glyph a text cell shows is kept in the glyph plane of the stencil.
+//
+#define VT_CELL_MASK_SHIFT      0
+#define VT_CELL_TEXT_SHIFT      8
+#define VT_CELL_FGCOLOR_SHIFT   16
+
+#define VT_CELL_MASK_BITS       ((uint32_t)0xFF << VT_CELL_MASK_SHIFT)
+#define VT_CELL_TEXT_BITS       ((uint32_t)0xFF << VT_CELL_TEXT_SHIFT)
+#define VT_CELL_FGCOLOR_BITS    ((uint32_t)0xFFFF << VT_CELL_FGCOLOR_SHIFT)
+#define VT_CELL_TEXT            ((uint32_t)1 << VT_CELL_TEXT_SHIFT)
+
+// Mask and color, e.g. everything a text overlay hides
+#define VT_CELL_RASTER_BITS     (VT_CELL_MASK_BITS | VT_CELL_FGCOLOR_BITS)
+
+// Foreground color ids: basic colors keep their enum values, followed by the 256 indexed colors
+// and then by RGB colors interned into the canvas palette
+#define VT_COLOR_INDEXED_BASE   ((uint16_t)VTR_COLOR_TOTAL)
+#define VT_COLOR_RGB_BASE       ((uint16_t)(VT_COLOR_INDEXED_BASE + 256))
+
+// Id 0xFFFF is never stored, encoders use it for an unknown terminal color
+#define VT_PALETTE_MAX_COLORS   ((size_t)0xFFFF - VT_COLOR_RGB_BASE)
+
+// Mask bit of every dot within a cell, by dot row and column
+static const uint8_t g_dot_bits[VT_CELL_YDOTS][VT_CELL_XDOTS] = {
+    { 0x01, 0x10 }, { 0x02, 0x20 }, { 0x04, 0x40 }, { 0x08, 0x80 }
+};
+
+static inline uint8_t dot_bit(unsigned x, unsigned y)
+{
+    return g_dot_bits[y & (VT_CELL_YDOTS - 1)][x & (VT_CELL_XDOTS - 1)];
+}
+
+static inline uint8_t cell_mask(uint32_t cell)
+{
+    return (cell & VT_CELL_MASK_BITS) >> VT_CELL_MASK_SHIFT;
+}
+
+static inline uint16_t cell_fgcolor(uint32_t cell)
+{
+    return (cell & VT_CELL_FGCOLOR_BITS) >> VT_CELL_FGCOLOR_SHIFT;
+}
+
+// Glyphs of text cells take a word of the glyph plane each, a wide glyph takes two cells:
+//
+// +------------+-------+------+------+------------+
+// |   31-24    | 23    |  22  |  21  |    20-0    |
+// +------------+-------+------+------+------------+
+// | text style | spare | tail | wide | code point |
+// +------------+-------+------+------+------------+
+//
+// Second cell of a wide glyph repeats it with the tail bit instead of the wide one, so that it differs whenever
+// the glyph does. Every text cell has a non-zero glyph and every other one a zero glyph.
+#define VT_GLYPH_CODE_BITS      ((uint32_t)0x1FFFFF)
+#define VT_GLYPH_WIDE           ((uint32_t)1 << 21)
+#define VT_GLYPH_TAIL           ((uint32_t)1 << 22)
+#define VT_GLYPH_STYLE_SHIFT    24
+
+// Text style 0 is the default colors without bold, up to 255 more are interned per canvas
+#define VT_MAX_TEXT_STYLES      ((size_t)255)
+
+static inline uint32_t glyph_code(uint32_t glyph)
+{
+    return glyph & VT_GLYPH_CODE_BITS;
+}
+
+static inline uint8_t glyph_style(uint32_t glyph)
+{
+    return glyph >> VT_GLYPH_STYLE_SHIFT;
+}
+
+// Actual braille cell has a different mask layout than our stencil, bit numbers displayed below.
+//
+// +---+---+
+// | 1 | 4 |
+// +---+---+
+// | 2 | 5 |
+// +---+---+
+// | 3 | 6 |
+// +---+---+
+// | 7 | 8 |
+// +---+---+
+//
+// The conversion is done through a lookup table generated at compile time.
+#define VT_BRAILLE_REMAP(s) ((uint8_t)(((s) & 0x7) | ((s) & 0x8) << 3 | ((s) & 0x70) >> 1 | ((s) & 0x80)))
+#define VT_BRAILLE_REMAP4(s) VT_BRAILLE_REMAP(s), VT_BRAILLE_REMAP(s + 1), VT_BRAILLE_REMAP(s + 2), VT_BRAILLE_REMAP(s + 3)
+#define VT_BRAILLE_REMAP16(s) VT_BRAILLE_REMAP4(s), VT_BRAILLE_REMAP4(s + 4), VT_BRAILLE_REMAP4(s + 8), VT_BRAILLE_REMAP4(s + 12)
+#define VT_BRAILLE_REMAP64(s) VT_BRAILLE_REMAP16(s), VT_BRAILLE_REMAP16(s + 16), VT_BRAILLE_REMAP16(s + 32), VT_BRAILLE_REMAP16(s + 48)
+
+static const uint8_t g_braille_lut[256] = {
+    VT_BRAILLE_REMAP64(0), VT_BRAILLE_REMAP64(64), VT_BRAILLE_REMAP64(128), VT_BRAILLE_REMAP64(192)
+};
+
+// Synchronized update (DEC private mode 2026) sequences wrapped around each frame
+#define VT_SYNC_BEGIN       "\x1B[?2026h"
+#define VT_SYNC_END         "\x1B[?2026l"
+#define VT_SYNC_SEQ_LEN     ((size_t)8)
+#define VT_SYNC_MODE        2026
+
+// Left and right margin mode (DECLRMM) and the longest sequence a single scroll is encoded into
+#define VT_MARGINS_MODE     69
+#define VT_SCROLL_SEQ_MAX   ((size_t)96)
+
+// How long we wait for the terminal to answer a query
+#define VT_QUERY_TIMEOUT_MS 200
+
+// Max number of 64-bit words in a changed cell bitmask for a single row
+#define VT_DIFFMASK_WORDS(ncells)   (((size_t)(ncells) + 63) / 64)
 
 struct vtr_stencil_buf
 {
     uint16_t ydots;
     uint16_t xdots;
-    uint8_t* buffer;
-    uint8_t* fgcolors;
-    uint8_t* textoverlay;
+
+    // Cells are stored stride cells per row, for up to rowcap rows, so that the buffer can be resized in place.
+    // Cells outside of the current dimensions are always clear.
+    uint32_t* cells;
+    uint16_t stride;
+    uint16_t rowcap;
+
+    // Per-row dirty spans, updated by every cell write.
+    // Cells outside of these spans are guaranteed to be clear.
+    struct vtr_span* dirty;
+
+    // Glyphs of text cells, laid out like the cells, and per-row spans of the cells text was printed into.
+    // Glyphs outside of those spans are clear, and text spans are always within the dirty ones.
+    uint32_t* glyphs;
+    struct vtr_span* text;
+
+    // Dot rows [clip_y0, clip_y1) rasterizers are allowed to touch.
+    // That is the whole buffer except for the tile views used by deferred rasterization.
+    uint16_t clip_y0;
+    uint16_t clip_y1;
+};
+
+// Draw command recorded in deferred rasterization mode
+enum vt_cmd_type
+{
+    VT_CMD_DOT,
+    VT_CMD_LINE,
+    VT_CMD_POLY,
+    VT_CMD_TEXT,
+    VT_CMD_SPRITE,
+
+    VT_CMD_TYPES // always last
+};
+
+struct vtr_sprite_frame;
+
+struct vtr_cmd
+{
+    uint8_t type;
+    uint8_t rule;
+    uint16_t fgc;
+
+    // Dot rows the primitive can touch, clamped to the canvas
+    uint16_t ymin;
+    uint16_t ymax;
+
+    union {
+        struct { int x; int y; } dot;
+        struct { int x0; int y0; int x1; int y1; } line;
+        struct { size_t first; size_t count; } poly;
+        struct { uint16_t row; uint16_t col; uint16_t len; size_t first; } text;
+        struct { const struct vtr_sprite_frame* frame; int row; int col; } sprite;
+    };
+};
+
+// Cell rectangle of the terminal contents shifted by dx columns or dy rows, the other one is 0
+struct vtr_scroll_op
+{
+    uint16_t row;
+    uint16_t col;
+    uint16_t nrows;
+    uint16_t ncols;
+    int dx;
+    int dy;
+
+    // Narrower than the screen, needs left and right margins
+    bool margins;
+};
+
+// Per-frame command list.
+// Polygon vertices and text are kept in pools that commands index into.
+struct vtr_cmdlist
+{
+    struct vtr_cmd* cmds;
+    size_t ncmds;
+    size_t cmdcap;
+
+    struct vtr_vertex* vertices;
+    size_t nvertices;
+    size_t vertexcap;
+
+    char* text;
+    size_t ntext;
+    size_t textcap;
+
+    // Vertices in the largest recorded polygon, sizes the edge tables
+    size_t maxpoly;
+
+    // Hardware scrolls the frame starts with, these outlive the raster commands until the frame is encoded
+    struct vtr_scroll_op* scrolls;
+    size_t nscrolls;
+    size_t scrollcap;
+
+    // Primitives drawn into the frame by type, in both modes, and samples accumulated in density mode
+    uint64_t nprims[VT_CMD_TYPES];
+    uint64_t nsamples;
+};
+
+struct vtr_pool;
+struct vtr_tile;
+struct vtr_pipeline;
+struct vtr_palette;
+struct vtr_density_plane;
+struct vtr_recorder;
+struct vtr_viewport;
+struct vtr_canvas;
+
+// Draw context state.
+// A context is a canvas handle of its own whose back buffer (sb[0]) is a layer only its thread draws into.
+// Submitting swaps it with the published layer (sb[1]), which the parent canvas merges at every swap.
+struct vtr_layer_ctx
+{
+    struct vtr_canvas* parent;
+    struct vtr_canvas* next;
+    int priority;
+
+    // Guards the published layer, whether it holds anything, and the canvas dimensions set by vtr_resize
+    pthread_mutex_t lock;
+    bool published;
+    uint16_t want_rows;
+    uint16_t want_cols;
+
+    // Retained layers belong to the thread that swaps the canvas, which publishes them
+    // once they are redrawn after being invalidated
+    bool retained;
+    bool invalid;
+
+    // Viewport state of viewport handles, which are linked into the viewports of their canvas instead
+    struct vtr_viewport* viewport;
+};
+
+// Viewport state.
+// A viewport draws into a back plane of its own, which swaps present by diffing it against its front plane.
+// Both planes are laid out like the canvas, the handle's back buffer is a view of the viewport rectangle in the back
+// plane, with dirty and text spans of its own in view columns. Those are only copied to the back plane to present it.
+struct vtr_viewport
+{
+    // Requested rectangle, and the part of it within the canvas
+    struct vtr_rect want;
+    uint16_t row;
+    uint16_t col;
+    uint16_t nrows;
+    uint16_t ncols;
+
+    struct vtr_stencil_buf planes[2];
+    struct vtr_span* dirty;
+    struct vtr_span* text;
+
+    // Redraw period, 0 for every frame, and the monotonic time the next redraw is due
+    uint64_t period_ns;
+    uint64_t due;
+
+    // Redrawn since the last swap, and handed to the frame presented by that swap
+    bool drawn;
+    bool presenting;
+
+    // Terminal doesn't show the front plane since the viewport was created, resized or scrolled over,
+    // which makes a redraw due right away
+    bool stale;
+};
+
+// Colors and attributes of a text style
+struct vt_text_style
+{
+    uint16_t fgc;
+    uint16_t bgc;
+    bool bold;
+};
+
+// Frame pacer state, see vtr_frame_begin
+struct vtr_pacer
+{
+    // Rate frames are paced at now and its range, all 0 while pacing is off
+    unsigned hz;
+    unsigned min_hz;
+    unsigned max_hz;
+    uint64_t byte_budget;
+
+    // Monotonic time the next frame is due, 0 until the first one begins
+    uint64_t deadline;
+
+    // Output totals of the canvas at the last frame end, moving averages of what a frame adds to them,
+    // and for how many frames in a row there has been room to raise the rate
+    uint64_t last_bytes;
+    uint64_t last_ns;
+    uint64_t avg_bytes;
+    uint64_t avg_ns;
+    unsigned quiet_frames;
+
+    // Swaps since the measuring window started, and the rate they made in the last full window
+    uint64_t window_start;
+    uint64_t window_frames;
+    double fps;
 };
 
 struct vtr_canvas
@@ -140,6 +468,10 @@ struct vtr_canvas
     int fd;
     struct termios origattrs;
 
+    // Headless canvases have fixed dimensions and no terminal to set up or talk to.
+    // Their output goes to fd as is, or nowhere if it is negative.
+    bool headless;
+
     // Canvas dimentions in char cells
     uint16_t nrows;
     uint16_t ncols;
@@ -148,73 +480,589 @@ struct vtr_canvas
     uint16_t ydots;
     uint16_t xdots;
 
-    // Double-buffered stencil
-    struct vtr_stencil_buf sb[2];
+    // Terminal size the last vtr_resize saw and since when, while it differs from the canvas dimensions
+    uint16_t resize_rows;
+    uint16_t resize_cols;
+    uint64_t resize_since;
+
+    // Row the cursor is left on once everything queued is written out, UINT16_MAX if unknown
+    uint16_t cursor_row;
+
+    // Double-buffered stencil, the third buffer is only there in pipelined mode.
+    // Front buffer holds the state the terminal is in once everything queued is written out.
+    struct vtr_stencil_buf sb[3];
     struct vtr_stencil_buf* cur_sb;
+    struct vtr_stencil_buf* front_sb;
 
-    // Escape sequence list buffer
+    // Escape sequence list buffer.
+    // Bytes in [seqhead, seqlen) are queued and not yet accepted by the TTY.
     char* seqlist;
     size_t seqcap;
+    size_t seqhead;
+    size_t seqlen;
+
+    // Output mode and the fd flags to restore on close
+    enum vtr_output_mode outmode;
+    int origflags;
+
+    // Requested synchronized update mode, whether frames are actually wrapped,
+    // and whether the terminal was reset, so we can talk to it
+    enum vtr_sync_mode syncmode;
+    bool sync;
+    bool is_reset;
+
+    // Whether the terminal supports left and right margins (DECLRMM), once we asked
+    bool margins_known;
+    bool margins;
+
+    // Seqlist offset where the last queued frame starts, SIZE_MAX if it is not the last thing queued.
+    // Frame-relative offsets right after its preamble (0) and each row (1 to nrows) let us cut it at a row boundary.
+    size_t frame_start;
+    size_t* rowends;
+    size_t rowendcap;
+
+    // State the terminal is known to be in before the queued frame, valid only while that frame is pending.
+    // Otherwise the terminal is in the front buffer state.
+    enum vtr_frame_policy policy;
+    struct vtr_stencil_buf shadow;
+    bool shadow_valid;
+    uint64_t dropped_frames;
+    uint64_t merged_frames;
+
+    // Frame diff kernel picked for the current CPU
+    void (*diff_cells)(const uint32_t* cur, const uint32_t* prev, size_t ncells, uint64_t* mask);
+
+    // Deferred rasterization: draw calls are recorded into a command list which a worker pool
+    // rasterizes and encodes in tiles of cell rows at swap. No pool means immediate mode.
+    struct vtr_cmdlist cmds;
+    struct vtr_pool* pool;
+    struct vtr_tile* tiles;
+    size_t ntiles;
+    size_t tilecap;
+
+    // Draw contexts sorted by priority, the list is guarded by ctxlock.
+    // Context handles themselves have a layer state and no contexts of their own.
+    pthread_mutex_t ctxlock;
+    struct vtr_canvas* contexts;
+    struct vtr_layer_ctx* layer;
+
+    // Viewports in creation order. They belong to the thread that swaps the canvas, which only changes the list
+    // while no frame is in flight.
+    struct vtr_canvas* viewports;
+
+    // Encoder thread which presents swapped frames in pipelined mode, NULL otherwise
+    struct vtr_pipeline* pipeline;
+
+    // RGB colors interned into color ids, allocated on first use. Contexts draw with the palette of their canvas.
+    // Whether RGB colors go out as is or quantized to the 256 color palette.
+    pthread_mutex_t colorlock;
+    struct vtr_palette* palette;
+    bool truecolor;
+
+    // Text styles interned into style ids 1 and up under colorlock, allocated on first use.
+    // Contexts print with the styles of their canvas.
+    struct vt_text_style* styles;
+    size_t nstyles;
+
+    // Sample counts of density mode, NULL while it is off. Contexts don't have one.
+    struct vtr_density_plane* density;
+
+    // Frame recorder, NULL while not recording. Presenting a frame records it, so in pipelined mode
+    // it belongs to the encoder thread until the frame in flight is out.
+    struct vtr_recorder* recorder;
+
+    // Serial number of the canvas, unique for the process unlike its address, 0 for draw contexts and viewports
+    uint64_t serial;
+
+    // Frame pacing. Bytes queued and time spent presenting frames are added up by whichever thread
+    // presents them, so those are updated atomically.
+    struct vtr_pacer pacer;
+    uint64_t out_bytes;
+    uint64_t present_ns;
+
+    // Whether rows may be encoded grouped by color.
+    // Stats of the last frame, which also gets everything written out after its swap, are added to the totals
+    // once the next frame is presented.
+    bool group_colors;
+    struct vtr_stats stats;
 };
 
+// Deferred rasterization calls, defined at the end with the rest of the command list code
+static void record_dot(struct vtr_canvas* vt, int x, int y, uint16_t fgc);
+static void record_line(struct vtr_canvas* vt, int x0, int y0, int x1, int y1, uint16_t fgc);
+static void record_poly(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vlist,
+                        uint16_t fgc, enum vtr_fill_rule rule);
+static void record_text(struct vtr_canvas* vt, uint16_t row, uint16_t col, const char* str, size_t len, uint8_t style);
+static void record_sprite(struct vtr_canvas* vt, const struct vtr_sprite_frame* frame, int64_t row, int64_t col, uint16_t fgc);
+
+// Density mode, defined with the sprites
+static void resolve_density(struct vtr_canvas* vt);
+static void destroy_density(struct vtr_canvas* vt);
+
+// Frame pacing, defined with the pipelined mode
+static void count_frame_rate(struct vtr_canvas* vt);
+
+// Frame recording, defined after the extended colors
+static void record_frame(struct vtr_canvas* vt, const struct vtr_stencil_buf* sb);
+static void clear_cmds(struct vtr_cmdlist* list);
+static int bin_cmds(struct vtr_canvas* vt);
+static void encode_frame_tiles(struct vtr_canvas* vt, struct vtr_stencil_buf* cur_sb, const struct vtr_stencil_buf* base_sb,
+                               struct vtr_cmdlist* cmds);
+static void destroy_deferred(struct vtr_canvas* vt);
+static void lock_layers(struct vtr_canvas* vt);
+static void unlock_layers(struct vtr_canvas* vt);
+static void merge_layers(struct vtr_canvas* vt, struct vtr_stencil_buf* sb, uint16_t first, uint16_t last);
+static void detach_contexts(struct vtr_canvas* vt);
+static void publish_retained(struct vtr_canvas* vt);
+static int create_layers(struct vtr_canvas* ctx, uint16_t rows, uint16_t cols);
+
+// Viewports, defined after the draw contexts
+static int reserve_viewports(struct vtr_canvas* vt, uint16_t rows, uint16_t cols);
+static void resize_viewports(struct vtr_canvas* vt);
+static void schedule_viewports(struct vtr_canvas* vt);
+static void detach_viewports(struct vtr_canvas* vt);
+static void destroy_viewport(struct vtr_canvas* h);
+
+// Hardware scrolling, also defined at the end
+static size_t encode_scrolls(char* seq, const struct vtr_cmdlist* cmds);
+static void shift_scrolled(struct vtr_stencil_buf* sb, const struct vtr_cmdlist* cmds);
+
+// Pipelined mode, defined at the end as well
+static int swap_pipelined(struct vtr_canvas* vt);
+static void pipeline_idle(struct vtr_canvas* vt);
+static int stop_pipeline(struct vtr_canvas* vt);
+
+// Extended colors, at the end too
+static uint16_t color_id(struct vtr_canvas* vt, uint32_t color);
+static uint32_t palette_rgb(const struct vtr_canvas* vt, uint16_t id);
+static uint8_t text_style_id(struct vtr_canvas* vt, uint16_t fgc, uint16_t bgc, bool bold);
+static struct vt_text_style text_style(const struct vtr_canvas* vt, uint8_t id);
+static uint8_t quantize_rgb(uint32_t rgb);
+static bool colorterm_truecolor(void);
+
+// Worst case encoded sizes, defined with the encoder
+static size_t seq_rows_bound(uint16_t canvas_rows, uint16_t canvas_cols, uint16_t ncols, uint16_t nrows, bool truecolor,
+                             bool grouped);
+static size_t seq_frame_bound(uint16_t nrows, uint16_t ncols, bool truecolor, bool grouped, size_t nscrolls);
+static size_t viewports_bound(const struct vtr_canvas* vt, uint16_t rows, uint16_t cols);
+
+//
+// Frame diff kernels.
+//
+// Each kernel compares ncells packed stencil cells and sets bit (i % 64) of mask[i / 64] for every cell i that differs.
+// The mask must have room for VT_DIFFMASK_WORDS(ncells) words.
+//
+
+static void diff_cells_scalar(const uint32_t* cur, const uint32_t* prev, size_t ncells, uint64_t* mask)
+{
+    memset(mask, 0, VT_DIFFMASK_WORDS(ncells) * sizeof(*mask));
+
+    for (size_t i = 0; i < ncells; i++) {
+        if (cur[i] != prev[i]) {
+            mask[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+    }
+}
+
+#if defined(VT_HAVE_X86_SIMD)
+
+__attribute__((target("sse2")))
+static void diff_cells_sse2(const uint32_t* cur, const uint32_t* prev, size_t ncells, uint64_t* mask)
+{
+    memset(mask, 0, VT_DIFFMASK_WORDS(ncells) * sizeof(*mask));
+
+    // 16 cells per iteration, chunks never straddle mask words
+    size_t i = 0;
+    for (; i + 16 <= ncells; i += 16) {
+        uint32_t eqbits = 0;
+        for (size_t k = 0; k < 4; k++) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(cur + i + k * 4));
+            __m128i b = _mm_loadu_si128((const __m128i*)(prev + i + k * 4));
+            eqbits |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b))) << (k * 4);
+        }
+
+        mask[i / 64] |= (uint64_t)(~eqbits & 0xFFFF) << (i % 64);
+    }
+
+    for (; i < ncells; i++) {
+        if (cur[i] != prev[i]) {
+            mask[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void diff_cells_avx2(const uint32_t* cur, const uint32_t* prev, size_t ncells, uint64_t* mask)
+{
+    memset(mask, 0, VT_DIFFMASK_WORDS(ncells) * sizeof(*mask));
+
+    // 32 cells per iteration, chunks never straddle mask words
+    size_t i = 0;
+    for (; i + 32 <= ncells; i += 32) {
+        uint32_t eqbits = 0;
+        for (size_t k = 0; k < 4; k++) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(cur + i + k * 8));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(prev + i + k * 8));
+            eqbits |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b))) << (k * 8);
+        }
+
+        mask[i / 64] |= (uint64_t)(~eqbits) << (i % 64);
+    }
+
+    for (; i < ncells; i++) {
+        if (cur[i] != prev[i]) {
+            mask[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+    }
+}
+
+#elif defined(VT_HAVE_NEON)
+
+static void diff_cells_neon(const uint32_t* cur, const uint32_t* prev, size_t ncells, uint64_t* mask)
+{
+    static const uint32_t lanebits[4] = { 1, 2, 4, 8 };
+    uint32x4_t weights = vld1q_u32(lanebits);
+
+    memset(mask, 0, VT_DIFFMASK_WORDS(ncells) * sizeof(*mask));
+
+    // 16 cells per iteration, chunks never straddle mask words
+    size_t i = 0;
+    for (; i + 16 <= ncells; i += 16) {
+        uint32_t eqbits = 0;
+        for (size_t k = 0; k < 4; k++) {
+            uint32x4_t eq = vceqq_u32(vld1q_u32(cur + i + k * 4), vld1q_u32(prev + i + k * 4));
+            eqbits |= vaddvq_u32(vandq_u32(eq, weights)) << (k * 4);
+        }
+
+        mask[i / 64] |= (uint64_t)(~eqbits & 0xFFFF) << (i % 64);
+    }
+
+    for (; i < ncells; i++) {
+        if (cur[i] != prev[i]) {
+            mask[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+    }
+}
+
+#endif
+
+// Cross-check a diff kernel against the scalar reference on a synthetic frame
+// with a mix of sparse and dense changes at every possible tail length.
+// The exhaustive check of every kernel is tests/diff_kernels.c, this one guards the kernel picked at runtime.
+static bool diff_kernel_selftest(void (*diff_cells)(const uint32_t*, const uint32_t*, size_t, uint64_t*))
+{
+    enum { NCELLS = 200 };
+    uint32_t cur[NCELLS], prev[NCELLS];
+    uint64_t expected[VT_DIFFMASK_WORDS(NCELLS)], actual[VT_DIFFMASK_WORDS(NCELLS)];
+
+    uint32_t seed = 0x9E3779B9u;
+    for (size_t i = 0; i < NCELLS; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        prev[i] = seed;
+        cur[i] = ((seed >> 24) % (i < NCELLS / 2 ? 7 : 2) == 0 ? seed ^ (1u << (seed % 32)) : seed);
+    }
+
+    for (size_t offset = 0; offset < 4; offset++) {
+        for (size_t ncells = 0; ncells <= NCELLS - offset; ncells++) {
+            diff_cells_scalar(cur + offset, prev + offset, ncells, expected);
+            diff_cells(cur + offset, prev + offset, ncells, actual);
+            if (0 != memcmp(expected, actual, VT_DIFFMASK_WORDS(ncells) * sizeof(*expected))) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void (*select_diff_kernel(void))(const uint32_t*, const uint32_t*, size_t, uint64_t*)
+{
+    void (*diff_cells)(const uint32_t*, const uint32_t*, size_t, uint64_t*) = diff_cells_scalar;
+
+#if defined(VT_HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        diff_cells = diff_cells_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        diff_cells = diff_cells_sse2;
+    }
+#elif defined(VT_HAVE_NEON)
+    diff_cells = diff_cells_neon;
+#endif
+
+    // A kernel that disagrees is a bug: fail debug builds, and don't let release builds draw garbage with it
+    if (diff_cells != diff_cells_scalar && !diff_kernel_selftest(diff_cells)) {
+        fprintf(stderr, "vtrenderlib: diff kernel output does not match the scalar reference, using the scalar kernel\n");
+        assert(!"diff kernel self-test failed");
+        diff_cells = diff_cells_scalar;
+    }
+
+    return diff_cells;
+}
+
 static int create_stencil_buf(struct vtr_stencil_buf* sb, uint16_t rows, uint16_t cols)
 {
     memset(sb, 0, sizeof(*sb));
 
-    sb->buffer = calloc(rows, cols);
-    if (!sb->buffer) {
+    sb->cells = calloc((size_t)rows * cols, sizeof(*sb->cells));
+    sb->glyphs = calloc((size_t)rows * cols, sizeof(*sb->glyphs));
+    if (!sb->cells || !sb->glyphs) {
         goto error_out;
     }
 
-    sb->fgcolors = calloc(rows, cols);
-    if (!sb->fgcolors) {
+    sb->dirty = malloc(MAX(rows, 1) * sizeof(*sb->dirty));
+    sb->text = malloc(MAX(rows, 1) * sizeof(*sb->text));
+    if (!sb->dirty || !sb->text) {
         goto error_out;
     }
 
-    sb->textoverlay = calloc(rows, cols);
-    if (!sb->textoverlay) {
-        goto error_out;
+    for (uint16_t row = 0; row < rows; row++) {
+        sb->dirty[row] = (struct vtr_span){ .lo = cols, .hi = 0 };
+        sb->text[row] = sb->dirty[row];
     }
 
     sb->xdots = cols * VT_CELL_XDOTS;
     sb->ydots = rows * VT_CELL_YDOTS;
+    sb->stride = cols;
+    sb->rowcap = rows;
+    sb->clip_y0 = 0;
+    sb->clip_y1 = sb->ydots;
 
     return 0;
 
 error_out:
-    free(sb->fgcolors);
-    free(sb->buffer);
+    free(sb->cells);
+    free(sb->glyphs);
+    free(sb->dirty);
+    free(sb->text);
 
     return -ENOMEM;
 }
 
+// Grow stencil buffer capacity so that it can be resized to given dimensions in place, keeping its contents.
+// Capacity grows with some headroom and never shrinks.
+static int reserve_stencil_buf(struct vtr_stencil_buf* sb, uint16_t rows, uint16_t cols)
+{
+    if (rows <= sb->rowcap && cols <= sb->stride) {
+        return 0;
+    }
+
+    uint16_t rowcap = (rows > sb->rowcap ? MAX(rows, MIN(UINT16_MAX, sb->rowcap + sb->rowcap / 4)) : sb->rowcap);
+    uint16_t stride = (cols > sb->stride ? MAX(cols, MIN(UINT16_MAX, sb->stride + sb->stride / 4)) : sb->stride);
+
+    uint32_t* cells = calloc((size_t)rowcap * stride, sizeof(*cells));
+    uint32_t* glyphs = calloc((size_t)rowcap * stride, sizeof(*glyphs));
+    struct vtr_span* dirty = malloc(MAX(rowcap, 1) * sizeof(*dirty));
+    struct vtr_span* text = malloc(MAX(rowcap, 1) * sizeof(*text));
+    if (!cells || !glyphs || !dirty || !text) {
+        free(cells);
+        free(glyphs);
+        free(dirty);
+        free(text);
+        return -ENOMEM;
+    }
+
+    uint16_t nrows = sb->ydots / VT_CELL_YDOTS;
+    for (uint16_t row = 0; row < nrows; row++) {
+        struct vtr_span span = sb->dirty[row];
+        if (span.lo < span.hi) {
+            memcpy(cells + (size_t)row * stride + span.lo, sb->cells + (size_t)row * sb->stride + span.lo,
+                   (span.hi - span.lo) * sizeof(*cells));
+        }
+
+        struct vtr_span tspan = sb->text[row];
+        if (tspan.lo < tspan.hi) {
+            memcpy(glyphs + (size_t)row * stride + tspan.lo, sb->glyphs + (size_t)row * sb->stride + tspan.lo,
+                   (tspan.hi - tspan.lo) * sizeof(*glyphs));
+        }
+
+        dirty[row] = span;
+        text[row] = tspan;
+    }
+
+    free(sb->cells);
+    free(sb->glyphs);
+    free(sb->dirty);
+    free(sb->text);
+    sb->cells = cells;
+    sb->glyphs = glyphs;
+    sb->dirty = dirty;
+    sb->text = text;
+    sb->stride = stride;
+    sb->rowcap = rowcap;
+
+    return 0;
+}
+
+// Change stencil buffer dimensions within its capacity.
+// Contents of the overlapping area are kept, the rest is cleared.
+static void resize_stencil_buf(struct vtr_stencil_buf* sb, uint16_t rows, uint16_t cols)
+{
+    assert(rows <= sb->rowcap && cols <= sb->stride);
+
+    uint16_t nrows = sb->ydots / VT_CELL_YDOTS;
+
+    for (uint16_t row = 0; row < MAX(nrows, rows); row++) {
+        struct vtr_span* span = &sb->dirty[row];
+        struct vtr_span* tspan = &sb->text[row];
+        uint32_t* cells = sb->cells + (size_t)row * sb->stride;
+        uint32_t* glyphs = sb->glyphs + (size_t)row * sb->stride;
+
+        if (row >= nrows) {
+            *span = (struct vtr_span){ .lo = cols, .hi = 0 };
+            *tspan = *span;
+            continue;
+        }
+
+        // Cells left outside are cleared, so that they are clear once the buffer grows back.
+        // A wide glyph cut in half leaves a space behind.
+        uint16_t keep = (row < rows ? cols : 0);
+        if (keep > 0 && keep < tspan->hi && (glyphs[keep - 1] & VT_GLYPH_WIDE)) {
+            glyphs[keep - 1] = (glyphs[keep - 1] & ~(VT_GLYPH_CODE_BITS | VT_GLYPH_WIDE)) | ' ';
+        }
+
+        if (span->hi > keep) {
+            uint16_t lo = MAX(span->lo, keep);
+            memset(cells + lo, 0, (span->hi - lo) * sizeof(*cells));
+            span->hi = keep;
+        }
+
+        if (tspan->hi > keep) {
+            uint16_t lo = MAX(tspan->lo, keep);
+            memset(glyphs + lo, 0, (tspan->hi - lo) * sizeof(*glyphs));
+            tspan->hi = keep;
+        }
+
+        if (span->lo >= span->hi) {
+            *span = (struct vtr_span){ .lo = cols, .hi = 0 };
+        }
+
+        if (tspan->lo >= tspan->hi) {
+            *tspan = (struct vtr_span){ .lo = cols, .hi = 0 };
+        }
+    }
+
+    sb->xdots = cols * VT_CELL_XDOTS;
+    sb->ydots = rows * VT_CELL_YDOTS;
+    sb->clip_y0 = 0;
+    sb->clip_y1 = sb->ydots;
+}
+
 static void free_stencil_buf(struct vtr_stencil_buf* sb)
 {
     if (sb) {
-        free(sb->buffer);
-        free(sb->fgcolors);
-        free(sb->textoverlay);
+        free(sb->cells);
+        free(sb->glyphs);
+        free(sb->dirty);
+        free(sb->text);
         sb->ydots = sb->xdots = 0;
-        sb->buffer = sb->fgcolors = NULL;
+        sb->stride = sb->rowcap = 0;
+        sb->clip_y0 = sb->clip_y1 = 0;
+        sb->cells = NULL;
+        sb->glyphs = NULL;
+        sb->dirty = NULL;
+        sb->text = NULL;
     }
 }
 
-struct vtr_canvas* vtr_canvas_create(int ttyfd)
+static inline void mark_dirty(struct vtr_stencil_buf* sb, uint16_t row, uint16_t col)
 {
-    int error = 0;
+    struct vtr_span* span = &sb->dirty[row];
+    span->lo = MIN(span->lo, col);
+    span->hi = MAX(span->hi, col + 1);
+}
 
-    struct termios attrs;
-    error = tcgetattr(ttyfd, &attrs);
-    if (error) {
-        return NULL;
+static inline void mark_text(struct vtr_stencil_buf* sb, uint16_t row, uint16_t col)
+{
+    struct vtr_span* span = &sb->text[row];
+    span->lo = MIN(span->lo, col);
+    span->hi = MAX(span->hi, col + 1);
+    mark_dirty(sb, row, col);
+}
+
+// Clear everything that was drawn into the stencil and reset its dirty spans.
+static void clear_stencil_buf(struct vtr_stencil_buf* sb)
+{
+    uint16_t nrows = sb->ydots / VT_CELL_YDOTS;
+    uint16_t ncols = sb->xdots / VT_CELL_XDOTS;
+
+    for (uint16_t row = 0; row < nrows; row++) {
+        struct vtr_span* span = &sb->dirty[row];
+        if (span->lo < span->hi) {
+            size_t offset = (size_t)row * sb->stride + span->lo;
+            size_t len = span->hi - span->lo;
+
+            memset(sb->cells + offset, 0, len * sizeof(*sb->cells));
+        }
+
+        struct vtr_span* tspan = &sb->text[row];
+        if (tspan->lo < tspan->hi) {
+            memset(sb->glyphs + (size_t)row * sb->stride + tspan->lo, 0, (tspan->hi - tspan->lo) * sizeof(*sb->glyphs));
+        }
+
+        *span = (struct vtr_span){ .lo = ncols, .hi = 0 };
+        *tspan = *span;
     }
+}
 
-    struct winsize ws;
-    error = ioctl(ttyfd, TIOCGWINSZ, &ws);
-    if (error) {
-        return NULL;
+// Copy rows [first, last) of one stencil buffer into another of the same dimensions, strides may differ.
+static void copy_stencil_rows(struct vtr_stencil_buf* dst, const struct vtr_stencil_buf* src, uint16_t first, uint16_t last)
+{
+    assert(dst->xdots == src->xdots && dst->ydots == src->ydots);
+
+    for (uint16_t row = first; row < last; row++) {
+        // Anything outside of both spans is clear already
+        uint16_t lo = MIN(dst->dirty[row].lo, src->dirty[row].lo);
+        uint16_t hi = MAX(dst->dirty[row].hi, src->dirty[row].hi);
+        if (lo < hi) {
+            memcpy(dst->cells + (size_t)row * dst->stride + lo, src->cells + (size_t)row * src->stride + lo,
+                   (hi - lo) * sizeof(*dst->cells));
+        }
+
+        lo = MIN(dst->text[row].lo, src->text[row].lo);
+        hi = MAX(dst->text[row].hi, src->text[row].hi);
+        if (lo < hi) {
+            memcpy(dst->glyphs + (size_t)row * dst->stride + lo, src->glyphs + (size_t)row * src->stride + lo,
+                   (hi - lo) * sizeof(*dst->glyphs));
+        }
+
+        dst->dirty[row] = src->dirty[row];
+        dst->text[row] = src->text[row];
+    }
+}
+
+// Cell nothing is ever drawn as, color id 0xFFFF is never stored
+#define VT_CELL_UNKNOWN ((uint32_t)0xFFFF << VT_CELL_FGCOLOR_SHIFT)
+
+// Fill a rectangle of a buffer holding terminal contents with cells that differ from anything drawn,
+// so that a frame diffed against it redraws the rectangle in full
+static void invalidate_cells(struct vtr_stencil_buf* sb, uint16_t row, uint16_t col, uint16_t nrows, uint16_t ncols)
+{
+    if (nrows == 0 || ncols == 0) {
+        return;
     }
 
+    for (uint16_t r = row; r < row + nrows; r++) {
+        uint32_t* cells = sb->cells + (size_t)r * sb->stride;
+        uint32_t* glyphs = sb->glyphs + (size_t)r * sb->stride;
+        for (uint16_t c = col; c < col + ncols; c++) {
+            cells[c] = VT_CELL_UNKNOWN;
+            glyphs[c] = 0;
+        }
+
+        mark_dirty(sb, r, col);
+        mark_dirty(sb, r, col + ncols - 1);
+    }
+}
+
+// Allocate a canvas writing to fd with given dimensions, the terminal attributes are left for the caller to fill in
+// Last serial number given to a canvas
+static uint64_t canvas_serials = 0;
+
+static struct vtr_canvas* create_canvas(int fd, uint16_t nrows, uint16_t ncols)
+{
+    size_t* rowends = NULL;
+
     struct vtr_canvas* vt = malloc(sizeof(*vt));
     if (!vt) {
         return NULL;
@@ -224,27 +1072,81 @@ struct vtr_canvas* vtr_canvas_create(int ttyfd)
     struct vtr_stencil_buf sb2 = {0};
     char* seqlist = NULL;
 
-    if (0 != create_stencil_buf(&sb1, ws.ws_row, ws.ws_col) || 0 != create_stencil_buf(&sb2, ws.ws_row, ws.ws_col)) {
+    if (0 != create_stencil_buf(&sb1, nrows, ncols) || 0 != create_stencil_buf(&sb2, nrows, ncols)) {
         goto error_out;
     }
 
-    size_t seqcap = VT_SEQLIST_BUFFER_SIZE(ws.ws_row, ws.ws_col);
+    bool truecolor = colorterm_truecolor();
+    size_t seqcap = seq_frame_bound(nrows, ncols, truecolor, false, 0) + VT_MIN_SEQLIST_SLACK;
     seqlist = malloc(seqcap);
     if (!seqlist) {
         goto error_out;
     }
 
-    vt->fd = ttyfd;
-    vt->nrows = ws.ws_row;
-    vt->ncols = ws.ws_col;
-    vt->ydots = ws.ws_row * VT_CELL_YDOTS;
-    vt->xdots = ws.ws_col * VT_CELL_XDOTS;
+    rowends = malloc((nrows + 1) * sizeof(*rowends));
+    if (!rowends) {
+        goto error_out;
+    }
+
+    vt->fd = fd;
+    vt->headless = false;
+    vt->nrows = nrows;
+    vt->ncols = ncols;
+    vt->ydots = nrows * VT_CELL_YDOTS;
+    vt->xdots = ncols * VT_CELL_XDOTS;
     vt->sb[0] = sb1;
     vt->sb[1] = sb2;
+    memset(&vt->sb[2], 0, sizeof(vt->sb[2]));
     vt->cur_sb = &vt->sb[0];
+    vt->front_sb = &vt->sb[1];
     vt->seqlist = seqlist;
     vt->seqcap = seqcap;
-    memcpy(&vt->origattrs, &attrs, sizeof(attrs));
+    vt->seqhead = 0;
+    vt->seqlen = 0;
+    vt->outmode = VTR_OUTPUT_BLOCKING;
+    vt->origflags = fcntl(fd, F_GETFL);
+    vt->syncmode = VTR_SYNC_OFF;
+    vt->sync = false;
+    vt->is_reset = false;
+    vt->margins_known = false;
+    vt->margins = false;
+    vt->resize_rows = nrows;
+    vt->resize_cols = ncols;
+    vt->resize_since = 0;
+    vt->cursor_row = UINT16_MAX;
+    vt->frame_start = SIZE_MAX;
+    vt->rowends = rowends;
+    vt->rowendcap = nrows + 1;
+    vt->policy = VTR_FRAME_QUEUE;
+    memset(&vt->shadow, 0, sizeof(vt->shadow));
+    vt->shadow_valid = false;
+    vt->dropped_frames = 0;
+    vt->merged_frames = 0;
+    vt->diff_cells = select_diff_kernel();
+    memset(&vt->cmds, 0, sizeof(vt->cmds));
+    vt->pool = NULL;
+    vt->tiles = NULL;
+    vt->ntiles = 0;
+    vt->tilecap = 0;
+    pthread_mutex_init(&vt->ctxlock, NULL);
+    vt->contexts = NULL;
+    vt->layer = NULL;
+    vt->viewports = NULL;
+    vt->pipeline = NULL;
+    pthread_mutex_init(&vt->colorlock, NULL);
+    vt->palette = NULL;
+    vt->truecolor = truecolor;
+    vt->styles = NULL;
+    vt->nstyles = 0;
+    vt->density = NULL;
+    vt->recorder = NULL;
+    vt->serial = __atomic_add_fetch(&canvas_serials, 1, __ATOMIC_RELAXED);
+    memset(&vt->pacer, 0, sizeof(vt->pacer));
+    vt->out_bytes = 0;
+    vt->present_ns = 0;
+    vt->group_colors = false;
+    memset(&vt->stats, 0, sizeof(vt->stats));
+    memset(&vt->origattrs, 0, sizeof(vt->origattrs));
 
     return vt;
 
@@ -253,546 +1155,5915 @@ error_out:
     free_stencil_buf(&sb1);
     free_stencil_buf(&sb2);
     free(seqlist);
+    free(rowends);
     free(vt);
 
     return NULL;
 }
 
-static int sendseq(int ttyfd, const char* seq, size_t nbytes)
-{
-    ssize_t res = write(ttyfd, seq, nbytes);
-    if (res == -1 || res != nbytes) {
-        return -1;
-    }
-
-    return 0;
-}
-
-int vtr_reset(struct vtr_canvas* vt)
+struct vtr_canvas* vtr_canvas_create(int ttyfd)
 {
-    int error;
+    int error = 0;
 
     struct termios attrs;
-    error = tcgetattr(vt->fd, &attrs);
+    error = tcgetattr(ttyfd, &attrs);
     if (error) {
-        return error;
+        return NULL;
     }
-    
-    attrs.c_oflag &= ~OPOST;
-    attrs.c_cflag &= ~CREAD;
-    attrs.c_lflag &= ~(ICANON | ECHO | IEXTEN);
 
-    error = tcsetattr(vt->fd, TCSANOW, &attrs);
+    struct winsize ws;
+    error = ioctl(ttyfd, TIOCGWINSZ, &ws);
     if (error) {
-        return error;
+        return NULL;
     }
 
-    // switch to alternate buffer, hide cursor and reset attributes
-    error |= sendseq(vt->fd, "\x1B[?1049h", 8);
-    error |= sendseq(vt->fd, "\x1B[?25l", 6);
-    error |= sendseq(vt->fd, "\x1B[2J", 4);
-    error |= sendseq(vt->fd, "\x1B[0m", 4);
+    struct vtr_canvas* vt = create_canvas(ttyfd, ws.ws_row, ws.ws_col);
+    if (vt) {
+        memcpy(&vt->origattrs, &attrs, sizeof(attrs));
+    }
 
-    return error;
+    return vt;
 }
 
-int vtr_resize(struct vtr_canvas* vt)
+struct vtr_canvas* vtr_canvas_create_headless(uint16_t rows, uint16_t cols, int sinkfd)
 {
-    int error;
-    struct winsize ws;
-    error = ioctl(vt->fd, TIOCGWINSZ, &ws);
-    if (error) {
-        return error;
+    if (rows == 0 || cols == 0) {
+        return NULL;
+    }
+
+    struct vtr_canvas* vt = create_canvas(sinkfd, rows, cols);
+    if (vt) {
+        vt->headless = true;
+    }
+
+    return vt;
+}
+
+static inline uint64_t clock_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Monotonic clock for the frame stats, always 0 if those are compiled out
+static inline uint64_t stat_clock_ns(void)
+{
+#ifndef VTR_NO_STATS
+    return clock_ns();
+#else
+    return 0;
+#endif
+}
+
+// Double the capacity of a sequence list buffer.
+static char* extend_seq_buf(char** seqlist, size_t* seqcap)
+{
+    DBG_LOG("Ran out of sequence list capacity %zu\n", *seqcap);
+
+    assert(*seqcap > 0);
+
+    char* newlist = realloc(*seqlist, *seqcap << 1);
+    if (!newlist) {
+        return NULL;
+    }
+
+    *seqlist = newlist;
+    *seqcap <<= 1;
+    return newlist;
+}
+
+// Write out as much of the queued output as the TTY accepts.
+// Returns 0 if the queue was drained, -EAGAIN if a non-blocking TTY is full, or -errno on errors.
+static int flush_seq(struct vtr_canvas* vt)
+{
+    int error = 0;
+    uint64_t start = stat_clock_ns();
+
+    // Headless canvas without a sink takes everything right away
+    if (vt->fd < 0 && vt->headless) {
+        vt->seqhead = vt->seqlen;
+    }
+
+    while (vt->seqhead < vt->seqlen) {
+        size_t len = vt->seqlen - vt->seqhead;
+        ssize_t res = write(vt->fd, vt->seqlist + vt->seqhead, len);
+        STAT_ADD(&vt->stats.last, writes, 1);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            error = (errno == EAGAIN || errno == EWOULDBLOCK ? -EAGAIN : -errno);
+            STAT_ADD(&vt->stats.last, short_writes, error == -EAGAIN);
+            break;
+        }
+
+        STAT_ADD(&vt->stats.last, short_writes, (size_t)res < len);
+        vt->seqhead += res;
+    }
+
+    STAT_ADD(&vt->stats.last, write_ns, stat_clock_ns() - start);
+    if (error) {
+        return error;
+    }
+
+    // The queued frame, if any, is on screen now
+    vt->seqhead = vt->seqlen = 0;
+    vt->frame_start = SIZE_MAX;
+    vt->shadow_valid = false;
+    return 0;
+}
+
+// Move the queued tail to the start of the sequence list so that a new frame can be appended to it.
+static void compact_seq_buf(struct vtr_canvas* vt)
+{
+    if (vt->seqhead > 0) {
+        memmove(vt->seqlist, vt->seqlist + vt->seqhead, vt->seqlen - vt->seqhead);
+        vt->seqlen -= vt->seqhead;
+        if (vt->frame_start != SIZE_MAX) {
+            vt->frame_start = (vt->frame_start > vt->seqhead ? vt->frame_start - vt->seqhead : 0);
+        }
+        vt->seqhead = 0;
+    }
+}
+
+// Send a control sequence after anything that is already queued.
+static int sendseq(struct vtr_canvas* vt, const char* seq, size_t nbytes)
+{
+    pipeline_idle(vt);
+    compact_seq_buf(vt);
+
+    // Queued frame can't be cut anymore, so the terminal will end up in the front buffer state after all
+    vt->frame_start = SIZE_MAX;
+    vt->shadow_valid = false;
+
+    while (vt->seqcap - vt->seqlen < nbytes) {
+        if (!extend_seq_buf(&vt->seqlist, &vt->seqcap)) {
+            return -ENOMEM;
+        }
+        STAT_ADD(&vt->stats.last, seq_reallocs, 1);
+    }
+
+    memcpy(vt->seqlist + vt->seqlen, seq, nbytes);
+    vt->seqlen += nbytes;
+
+    int error = flush_seq(vt);
+    return (error == -EAGAIN ? 0 : error);
+}
+
+// Ask the terminal whether it knows about a private mode with a DECRQM, like 2026 for synchronized updates.
+// Not every terminal answers DECRQM, so we follow it with a primary DA query which everyone answers
+// and stop waiting once that comes back.
+static bool query_dec_mode(struct vtr_canvas* vt, unsigned mode)
+{
+    char query[32];
+    char prefix[16];
+    int querylen = snprintf(query, sizeof(query), "\x1B[?%u$p\x1B[c", mode);
+    int prefixlen = snprintf(prefix, sizeof(prefix), "%u;", mode);
+
+    // Nobody to answer
+    if (vt->headless) {
+        return false;
+    }
+
+    // Make sure the query doesn't sit behind anything in a non-blocking queue
+    if (0 != sendseq(vt, query, querylen)) {
+        return false;
+    }
+
+    while (vt->seqhead < vt->seqlen) {
+        struct pollfd pfd = { .fd = vt->fd, .events = POLLOUT };
+        int error = (poll(&pfd, 1, -1) < 0 && errno != EINTR ? -errno : flush_seq(vt));
+        if (error && error != -EAGAIN) {
+            return false;
+        }
+    }
+
+    char reply[256];
+    size_t len = 0;
+    int mode_state = 0;
+    bool da_seen = false;
+
+    while (!da_seen && len < sizeof(reply)) {
+        struct pollfd pfd = { .fd = vt->fd, .events = POLLIN };
+        if (poll(&pfd, 1, VT_QUERY_TIMEOUT_MS) <= 0) {
+            break;
+        }
+
+        ssize_t res = read(vt->fd, reply + len, sizeof(reply) - len);
+        if (res <= 0) {
+            if (res < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            break;
+        }
+
+        len += res;
+
+        // Scan complete CSI replies: DECRPM is "CSI ? mode ; Ps $ y", primary DA is "CSI ? ... c"
+        for (size_t i = 0; i + 2 < len; i++) {
+            if (reply[i] != 0x1b || reply[i + 1] != '[' || reply[i + 2] != '?') {
+                continue;
+            }
+
+            size_t end = i + 3;
+            while (end < len && (reply[end] < 0x40 || reply[end] > 0x7e)) {
+                end++;
+            }
+
+            if (end == len) {
+                break;
+            }
+
+            if (reply[end] == 'y' && end - i > 4 + (size_t)prefixlen && 0 == memcmp(reply + i + 3, prefix, prefixlen)) {
+                mode_state = reply[i + 3 + prefixlen] - '0';
+            } else if (reply[end] == 'c') {
+                da_seen = true;
+            }
+        }
+    }
+
+    // 1 and 2 are set and reset, 3 is permanently set. 0 is unknown mode and 4 is permanently reset.
+    return (mode_state >= 1 && mode_state <= 3);
+}
+
+int vtr_reset(struct vtr_canvas* vt)
+{
+    int error = 0;
+
+    if (!vt->headless) {
+        struct termios attrs;
+        error = tcgetattr(vt->fd, &attrs);
+        if (error) {
+            return error;
+        }
+
+        attrs.c_oflag &= ~OPOST;
+        attrs.c_cflag &= ~CREAD;
+        attrs.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+
+        error = tcsetattr(vt->fd, TCSANOW, &attrs);
+        if (error) {
+            return error;
+        }
+    }
+
+    // switch to alternate buffer, hide cursor and reset attributes
+    error |= sendseq(vt, "\x1B[?1049h", 8);
+    error |= sendseq(vt, "\x1B[?25l", 6);
+    error |= sendseq(vt, "\x1B[2J", 4);
+    error |= sendseq(vt, "\x1B[0m", 4);
+    if (error) {
+        return error;
+    }
+
+    vt->is_reset = true;
+    vt->cursor_row = UINT16_MAX;
+    if (vt->syncmode == VTR_SYNC_AUTO) {
+        vt->sync = query_dec_mode(vt, VT_SYNC_MODE);
+    }
+
+    return 0;
+}
+
+// Longest sequence erasing the rest of a row, or of the screen, from a given cell
+#define VT_ERASE_SEQ_MAX    ((size_t)20)
+
+// Time a grown terminal size has to hold before a canvas that still fits follows it
+#define VT_RESIZE_SETTLE_NS ((uint64_t)50 * 1000000)
+
+// Erase what the terminal shows outside of the old dimensions, that the canvas doesn't know about.
+// Room for it is expected to be in the output queue.
+static int erase_exposed(struct vtr_canvas* vt, uint16_t nrows, uint16_t ncols)
+{
+    compact_seq_buf(vt);
+    vt->frame_start = SIZE_MAX;
+    vt->shadow_valid = false;
+    vt->cursor_row = UINT16_MAX;
+
+    char* seq = vt->seqlist + vt->seqlen;
+    size_t len = 0;
+
+    if (vt->ncols > ncols) {
+        for (uint16_t row = 0; row < MIN(nrows, vt->nrows); row++) {
+            len += snprintf(seq + len, VT_ERASE_SEQ_MAX, "\x1B[%u;%uH\x1B[K", row + 1, ncols + 1);
+        }
+    }
+
+    if (vt->nrows > nrows) {
+        len += snprintf(seq + len, VT_ERASE_SEQ_MAX, "\x1B[%uH\x1B[J", nrows + 1);
+    }
+
+    assert(vt->seqcap - vt->seqlen >= len);
+    vt->seqlen += len;
+
+    int error = flush_seq(vt);
+    return (error == -EAGAIN ? 0 : error);
+}
+
+// Switch the canvas to new dimensions.
+// Buffers are resized in place as long as they have the capacity, and the front buffer keeps the overlap
+// with the previous dimensions, so the next frame is diffed against what the terminal still shows.
+static int reconfigure_canvas(struct vtr_canvas* vt, uint16_t rows, uint16_t cols)
+{
+    // Frame in flight is still encoded for the old dimensions
+    pipeline_idle(vt);
+
+    uint16_t nrows = vt->nrows;
+    uint16_t ncols = vt->ncols;
+    size_t npending = vt->seqlen - vt->seqhead;
+
+    // Terminals keep the overlap as it was, except that they scroll it up if the cursor ends up below the last row.
+    // Whatever is still queued for the old dimensions has to go out first, and is not going to land as expected.
+    bool keep = (npending == 0 && (rows >= nrows || vt->cursor_row < rows));
+
+    // Everything that can fail comes first, buffers only grow and keep their contents and dimensions
+    for (size_t i = 0; i < 3; i++) {
+        if (vt->sb[i].cells && 0 != reserve_stencil_buf(&vt->sb[i], rows, cols)) {
+            return -ENOMEM;
+        }
+    }
+
+    if (vt->shadow.cells && 0 != reserve_stencil_buf(&vt->shadow, rows, cols)) {
+        return -ENOMEM;
+    }
+
+    if (0 != reserve_viewports(vt, rows, cols)) {
+        return -ENOMEM;
+    }
+
+    if ((size_t)rows + 1 > vt->rowendcap) {
+        size_t* rowends = realloc(vt->rowends, ((size_t)rows + 1) * sizeof(*rowends));
+        if (!rowends) {
+            return -ENOMEM;
+        }
+
+        vt->rowends = rowends;
+        vt->rowendcap = (size_t)rows + 1;
+    }
+
+    size_t bound = seq_frame_bound(rows, cols, vt->truecolor, vt->group_colors, 0) + VT_MIN_SEQLIST_SLACK +
+                   ((size_t)MIN(rows, nrows) + 1) * VT_ERASE_SEQ_MAX + viewports_bound(vt, rows, cols);
+    while (vt->seqcap - npending < bound) {
+        if (!extend_seq_buf(&vt->seqlist, &vt->seqcap)) {
+            return -ENOMEM;
+        }
+        STAT_ADD(&vt->stats.last, seq_reallocs, 1);
+    }
+
+    // Back buffers start over for the new dimensions, recorded draw calls and scrolls go away with them
+    for (size_t i = 0; i < 3; i++) {
+        struct vtr_stencil_buf* sb = &vt->sb[i];
+        if (sb->cells) {
+            if (sb != vt->front_sb || !keep) {
+                clear_stencil_buf(sb);
+            }
+            resize_stencil_buf(sb, rows, cols);
+        }
+    }
+
+    if (vt->shadow.cells) {
+        clear_stencil_buf(&vt->shadow);
+        resize_stencil_buf(&vt->shadow, rows, cols);
+    }
+
+    clear_cmds(&vt->cmds);
+    vt->cmds.nscrolls = 0;
+
+    // Draw contexts pick up new dimensions on their next submit
+    pthread_mutex_lock(&vt->ctxlock);
+    vt->nrows = rows;
+    vt->ncols = cols;
+    vt->ydots = rows * VT_CELL_YDOTS;
+    vt->xdots = cols * VT_CELL_XDOTS;
+    for (struct vtr_canvas* ctx = vt->contexts; ctx; ctx = ctx->layer->next) {
+        pthread_mutex_lock(&ctx->layer->lock);
+        ctx->layer->want_rows = vt->nrows;
+        ctx->layer->want_cols = vt->ncols;
+        if (ctx->layer->retained) {
+            // Retained content is gone, but the layer can be redrawn for the new dimensions right away.
+            // If that runs out of memory the next publish tries again.
+            (void) create_layers(ctx, vt->nrows, vt->ncols);
+            ctx->layer->published = false;
+            ctx->layer->invalid = true;
+        }
+        pthread_mutex_unlock(&ctx->layer->lock);
+    }
+    pthread_mutex_unlock(&vt->ctxlock);
+
+    resize_viewports(vt);
+
+    if (keep) {
+        return erase_exposed(vt, nrows, ncols);
+    }
+
+    // Clearing the screen also makes any queued frame uncuttable
+    vtr_clear_screen(vt);
+
+    return 0;
+}
+
+int vtr_resize(struct vtr_canvas* vt)
+{
+    if (vt->layer) {
+        return -EINVAL;
+    }
+
+    if (vt->headless) {
+        return 0;
+    }
+
+    int error;
+    struct winsize ws;
+    error = ioctl(vt->fd, TIOCGWINSZ, &ws);
+    if (error) {
+        return error;
     }
 
     if (ws.ws_row == vt->nrows && ws.ws_col == vt->ncols) {
+        vt->resize_rows = ws.ws_row;
+        vt->resize_cols = ws.ws_col;
         return 0;
     }
 
-    struct vtr_stencil_buf sb1 = {0};
-    struct vtr_stencil_buf sb2 = {0};
-    char* seqlist = NULL;
+    // Dragging a window resizes the terminal over and over. A canvas that still fits waits for the size to settle
+    // and follows it once, one that doesn't has to follow right away so that nothing is drawn off the screen.
+    uint64_t now = clock_ns();
+    if (ws.ws_row != vt->resize_rows || ws.ws_col != vt->resize_cols) {
+        vt->resize_rows = ws.ws_row;
+        vt->resize_cols = ws.ws_col;
+        vt->resize_since = now;
+    }
 
-    if (0 != create_stencil_buf(&sb1, ws.ws_row, ws.ws_col) || 0 != create_stencil_buf(&sb2, ws.ws_row, ws.ws_col)) {
-        goto error_out;
+    bool fits = (ws.ws_row >= vt->nrows && ws.ws_col >= vt->ncols);
+    if (fits && now - vt->resize_since < VT_RESIZE_SETTLE_NS) {
+        return 0;
     }
 
-    size_t seqcap = VT_SEQLIST_BUFFER_SIZE(ws.ws_row, ws.ws_col);
-    seqlist = malloc(seqcap);
-    if (!seqlist) {
-        goto error_out;
+    return reconfigure_canvas(vt, ws.ws_row, ws.ws_col);
+}
+
+uint16_t vtr_xdots(struct vtr_canvas* vt)
+{
+    return vt->xdots;
+}
+
+uint16_t vtr_ydots(struct vtr_canvas* vt)
+{
+    return vt->ydots;
+}
+    
+void vtr_close(struct vtr_canvas* vt)
+{
+    if (vt->layer) {
+        vtr_context_destroy(vt);
+        return;
+    }
+
+    (void) stop_pipeline(vt);
+    (void) vtr_record_stop(vt);
+    if (!vt->headless) {
+        tcsetattr(vt->fd, TCSANOW, &vt->origattrs);
     }
 
-    // No use keeping the previous buffer contents since those
-    // are invalid in the new dimentions anyway.
+    // Drain the queue in blocking mode so we don't leave the terminal in the middle of a frame,
+    // then switch back to main buffer and restore cursor
+    (void) vtr_set_output_mode(vt, VTR_OUTPUT_BLOCKING);
+    (void) sendseq(vt, "\x1B[?1049l", 8);
+    (void) sendseq(vt, "\x1B[?25h", 6);
+    (void) fcntl(vt->fd, F_SETFL, vt->origflags);
+
+    destroy_deferred(vt);
+    destroy_density(vt);
+    detach_contexts(vt);
+    detach_viewports(vt);
     free_stencil_buf(&vt->sb[0]);
     free_stencil_buf(&vt->sb[1]);
+    free_stencil_buf(&vt->sb[2]);
+    free_stencil_buf(&vt->shadow);
     free(vt->seqlist);
+    free(vt->rowends);
+    pthread_mutex_destroy(&vt->colorlock);
+    free(vt->palette);
+    free(vt->styles);
+    free(vt);
+}
 
-    vt->nrows = ws.ws_row;
-    vt->ncols = ws.ws_col;
-    vt->ydots = ws.ws_row * VT_CELL_YDOTS;
-    vt->xdots = ws.ws_col * VT_CELL_XDOTS;
-    vt->sb[0] = sb1;
-    vt->sb[1] = sb2;
-    vt->cur_sb = &vt->sb[0];
-    vt->seqlist = seqlist;
-    vt->seqcap = seqcap;
+int vtr_clear_screen(struct vtr_canvas* vt)
+{
+    return sendseq(vt, "\x1B[2J", 4);
+}
+
+int vtr_set_output_mode(struct vtr_canvas* vt, enum vtr_output_mode mode)
+{
+    assert(vt);
+
+    // Encoder thread can only write frames out in full
+    if (vt->pipeline && mode == VTR_OUTPUT_NONBLOCKING) {
+        return -EINVAL;
+    }
+
+    int flags = fcntl(vt->fd, F_GETFL);
+    if (flags == -1) {
+        return -errno;
+    }
+
+    flags = (mode == VTR_OUTPUT_NONBLOCKING ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+    if (-1 == fcntl(vt->fd, F_SETFL, flags)) {
+        return -errno;
+    }
+
+    vt->outmode = mode;
+
+    // Blocking mode never leaves anything queued
+    return (mode == VTR_OUTPUT_BLOCKING ? flush_seq(vt) : 0);
+}
+
+int vtr_flush_pending(struct vtr_canvas* vt)
+{
+    assert(vt);
+    pipeline_idle(vt);
+    return flush_seq(vt);
+}
+
+size_t vtr_pending_bytes(struct vtr_canvas* vt)
+{
+    assert(vt);
+    pipeline_idle(vt);
+    return vt->seqlen - vt->seqhead;
+}
+
+int vtr_output_fd(struct vtr_canvas* vt)
+{
+    assert(vt);
+    return vt->fd;
+}
+
+int vtr_set_frame_policy(struct vtr_canvas* vt, enum vtr_frame_policy policy)
+{
+    assert(vt);
+
+    if (policy == vt->policy) {
+        return 0;
+    }
+
+    pipeline_idle(vt);
+
+    if (policy == VTR_FRAME_DROP) {
+        int error = create_stencil_buf(&vt->shadow, vt->nrows, vt->ncols);
+        if (error) {
+            return error;
+        }
+    } else {
+        free_stencil_buf(&vt->shadow);
+    }
+
+    // Whatever is queued now will go out as is
+    vt->frame_start = SIZE_MAX;
+    vt->shadow_valid = false;
+    vt->policy = policy;
+
+    return 0;
+}
+
+int vtr_set_sync_updates(struct vtr_canvas* vt, enum vtr_sync_mode mode)
+{
+    assert(vt);
+    pipeline_idle(vt);
+
+    vt->syncmode = mode;
+    if (mode == VTR_SYNC_AUTO) {
+        // Otherwise we'll ask once the terminal is in raw mode
+        vt->sync = (vt->is_reset ? query_dec_mode(vt, VT_SYNC_MODE) : false);
+    } else {
+        vt->sync = (mode == VTR_SYNC_ON);
+    }
+
+    return 0;
+}
+
+int vtr_sync_updates_active(struct vtr_canvas* vt)
+{
+    assert(vt);
+    return vt->sync;
+}
+
+uint64_t vtr_dropped_frames(struct vtr_canvas* vt)
+{
+    assert(vt);
+    return vt->dropped_frames;
+}
+
+uint64_t vtr_merged_frames(struct vtr_canvas* vt)
+{
+    assert(vt);
+    return vt->merged_frames;
+}
+
+int vtr_set_color_grouping(struct vtr_canvas* vt, int enable)
+{
+    assert(vt);
+
+    if (vt->layer) {
+        return -EINVAL;
+    }
+
+    pipeline_idle(vt);
+    vt->group_colors = enable;
+
+    return 0;
+}
+
+static inline size_t count_digits(uint16_t v)
+{
+    return (v >= 10000 ? 5 : v >= 1000 ? 4 : v >= 100 ? 3 : v >= 10 ? 2 : 1);
+}
+
+// Write a decimal representation of v, two digits at a time.
+static size_t put_uint_s(char* seq, size_t seqcap, uint16_t v)
+{
+    static const char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+    size_t ndigits = count_digits(v);
+    assert(seqcap >= ndigits);
+
+    char* end = seq + ndigits;
+    while (v >= 100) {
+        end -= 2;
+        memcpy(end, digit_pairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+
+    if (v >= 10) {
+        memcpy(seq, digit_pairs + v * 2, 2);
+    } else {
+        seq[0] = '0' + v;
+    }
+
+    return ndigits;
+}
+
+// Byte length of a CSI sequence with a single numeric parameter that defaults to 1
+static inline size_t csi_n_len(uint16_t n)
+{
+    return (n == 1 ? 3 : 3 + count_digits(n));
+}
+
+static size_t csi_n_s(char* seq, size_t seqcap, uint16_t n, char cmd)
+{
+    assert(seqcap >= csi_n_len(n));
+
+    size_t nwritten = 0;
+    seq[nwritten++] = 0x1b;
+    seq[nwritten++] = '[';
+    if (n != 1) {
+        nwritten += put_uint_s(seq + nwritten, seqcap - nwritten, n);
+    }
+    seq[nwritten++] = cmd;
+
+    return nwritten;
+}
+
+// Byte length of an absolute CUP to 1-based row and col, omitting default parameters
+static inline size_t set_pos_len(uint16_t row, uint16_t col)
+{
+    return 3 + (row != 1 ? count_digits(row) : 0) + (col != 1 ? 1 + count_digits(col) : 0);
+}
+
+static size_t set_pos_s(char* seq, size_t seqcap, uint16_t row, uint16_t col)
+{
+    assert(seqcap >= set_pos_len(row, col));
+
+    size_t nwritten = 0;
+    seq[nwritten++] = 0x1b;
+    seq[nwritten++] = '[';
+    if (row != 1) {
+        nwritten += put_uint_s(seq + nwritten, seqcap - nwritten, row);
+    }
+    if (col != 1) {
+        seq[nwritten++] = ';';
+        nwritten += put_uint_s(seq + nwritten, seqcap - nwritten, col);
+    }
+    seq[nwritten++] = 'H';
+
+    return nwritten;
+}
+
+static size_t draw_cell_s(char* seq, size_t seqcap, uint8_t mask)
+{
+    assert(seqcap >= 3);
+
+    seq[0] = 0xE2;
+    seq[1] = 0xA0 | (mask >> 6);
+    seq[2] = 0x80 | (mask & 0x3f);
+
+    return 3;
+}
+
+// Most colors in a row we try grouping cells by
+#define VT_MAX_COLOR_GROUPS 8
+
+// Longest SGR we emit, for an RGB color, and for a palette one
+#define VT_MAX_SGR_LEN          19
+#define VT_MAX_INDEXED_SGR_LEN  11
+
+// Longest SGR switching text styles, with both colors and bold in one, for each of the above
+#define VT_MAX_STYLE_SGR_LEN(sgrlen)    (2 * (sgrlen) + 1)
+
+// SGR resetting every attribute, which ends each row that switched text styles
+#define VT_SGR_RESET            "\x1B[0m"
+#define VT_SGR_RESET_LEN        ((size_t)4)
+
+// Append the SGR parameters selecting color id as the foreground or the background color:
+// 3X or 4X for basic colors and the first 8 indexed ones, 9X or 10X for the bright ones, 38;5;N or 48;5;N
+// for the rest of the palette and 38;2;R;G;B or 48;2;R;G;B for RGB colors, unless those are quantized to the palette
+// because the terminal lacks truecolor.
+static size_t put_color_params_s(char* seq, size_t seqcap, const struct vtr_canvas* vt, uint16_t id, bool background)
+{
+    assert(id < VT_COLOR_RGB_BASE + VT_PALETTE_MAX_COLORS);
+    assert(seqcap >= VT_MAX_SGR_LEN - 3);
+
+    size_t nwritten = 0;
+    if (id < VT_COLOR_INDEXED_BASE) {
+        seq[nwritten++] = (background ? '4' : '3');
+        seq[nwritten++] = (id == VTR_COLOR_DEFAULT ? '9' : '0' + id - 1);
+        return nwritten;
+    }
+
+    uint32_t rgb = 0;
+    unsigned index = 256;
+    if (id < VT_COLOR_RGB_BASE) {
+        index = id - VT_COLOR_INDEXED_BASE;
+    } else {
+        rgb = palette_rgb(vt, id);
+        if (!vt->truecolor) {
+            index = quantize_rgb(rgb);
+        }
+    }
+
+    if (index < 8) {
+        seq[nwritten++] = (background ? '4' : '3');
+        seq[nwritten++] = '0' + index;
+    } else if (index < 16) {
+        if (background) {
+            seq[nwritten++] = '1';
+            seq[nwritten++] = '0';
+        } else {
+            seq[nwritten++] = '9';
+        }
+        seq[nwritten++] = '0' + index % 8;
+    } else if (index < 256) {
+        memcpy(seq + nwritten, (background ? "48;5;" : "38;5;"), 5);
+        nwritten += 5;
+        nwritten += put_uint_s(seq + nwritten, seqcap - nwritten, index);
+    } else {
+        memcpy(seq + nwritten, (background ? "48;2;" : "38;2;"), 5);
+        nwritten += 5;
+        nwritten += put_uint_s(seq + nwritten, seqcap - nwritten, (rgb >> 16) & 0xFF);
+        seq[nwritten++] = ';';
+        nwritten += put_uint_s(seq + nwritten, seqcap - nwritten, (rgb >> 8) & 0xFF);
+        seq[nwritten++] = ';';
+        nwritten += put_uint_s(seq + nwritten, seqcap - nwritten, rgb & 0xFF);
+    }
+
+    return nwritten;
+}
+
+// Set foreground color id fgc with the shortest SGR for it, see put_color_params_s
+static size_t set_foreground_color_s(char* seq, size_t seqcap, const struct vtr_canvas* vt, uint16_t fgc)
+{
+    assert(seqcap >= VT_MAX_SGR_LEN);
+
+    size_t nwritten = 0;
+    seq[nwritten++] = 0x1b;
+    seq[nwritten++] = '[';
+    nwritten += put_color_params_s(seq + nwritten, seqcap - nwritten, vt, fgc, false);
+    seq[nwritten++] = 'm';
+
+    return nwritten;
+}
+
+static size_t put_char_s(char* seq, size_t seqcap, char chr)
+{
+    assert(seqcap >= 1);
+    seq[0] = chr;
+    return 1;
+}
+
+static inline size_t utf8_len(uint32_t code)
+{
+    return (code < 0x80 ? 1 : code < 0x800 ? 2 : code < 0x10000 ? 3 : 4);
+}
+
+static size_t put_utf8_s(char* seq, size_t seqcap, uint32_t code)
+{
+    size_t len = utf8_len(code);
+    assert(seqcap >= len);
+
+    switch (len) {
+    case 1:
+        seq[0] = code;
+        break;
+    case 2:
+        seq[0] = 0xC0 | (code >> 6);
+        seq[1] = 0x80 | (code & 0x3F);
+        break;
+    case 3:
+        seq[0] = 0xE0 | (code >> 12);
+        seq[1] = 0x80 | ((code >> 6) & 0x3F);
+        seq[2] = 0x80 | (code & 0x3F);
+        break;
+    default:
+        seq[0] = 0xF0 | (code >> 18);
+        seq[1] = 0x80 | ((code >> 12) & 0x3F);
+        seq[2] = 0x80 | ((code >> 6) & 0x3F);
+        seq[3] = 0x80 | (code & 0x3F);
+        break;
+    }
+
+    return len;
+}
+
+// Escape sequence encoder output and the state the terminal is left in after it.
+// Index of the cell right after the last one drawn is where the cursor is expected to be, SIZE_MAX if unknown.
+// Cell indices are in the stencil buffer layout, the cell after the last one of a row is the first one of the next.
+// Background color and bold are only set by text styles, which every row resets before it ends.
+// Encoders of a viewport only draw within its rectangle, those of the canvas around all viewports.
+// Stats of the encoded rows are collected per encoder, along with the bytes saved by grouping them by color.
+// Encoders never grow their buffer, it has to be reserved for the worst case beforehand.
+struct vt_encoder
+{
+    char* seq;
+    size_t cap;
+    size_t len;
+    size_t next_idx;
+    uint16_t fgc;
+    uint16_t bgc;
+    bool bold;
+    const struct vtr_viewport* vp;
+    size_t saved;
+    struct vtr_frame_stats stats;
+};
+
+// Switch the terminal to given colors and bold in a single SGR with whatever differs from the encoder state
+static size_t set_style_s(char* seq, size_t seqcap, const struct vtr_canvas* vt, struct vt_encoder* enc,
+                          uint16_t fgc, uint16_t bgc, bool bold)
+{
+    assert(seqcap >= VT_MAX_STYLE_SGR_LEN(VT_MAX_SGR_LEN));
+
+    if (fgc == enc->fgc && bgc == enc->bgc && bold == enc->bold) {
+        return 0;
+    }
+
+    size_t nwritten = 0;
+    seq[nwritten++] = 0x1b;
+    seq[nwritten++] = '[';
+
+    if (bold != enc->bold) {
+        if (bold) {
+            seq[nwritten++] = '1';
+        } else {
+            seq[nwritten++] = '2';
+            seq[nwritten++] = '2';
+        }
+        seq[nwritten++] = ';';
+    }
+
+    if (bgc != enc->bgc) {
+        nwritten += put_color_params_s(seq + nwritten, seqcap - nwritten, vt, bgc, true);
+        seq[nwritten++] = ';';
+    }
+
+    if (fgc != enc->fgc) {
+        nwritten += put_color_params_s(seq + nwritten, seqcap - nwritten, vt, fgc, false);
+        seq[nwritten++] = ';';
+    }
+
+    seq[nwritten - 1] = 'm';
+
+    enc->fgc = fgc;
+    enc->bgc = bgc;
+    enc->bold = bold;
+
+    return nwritten;
+}
+
+// Byte cost of re-emitting unchanged cell idx exactly as it is on screen with the current encoder state,
+// first tells if it is the first cell re-emitted. Returns SIZE_MAX if the cell needs a different style.
+static size_t bridge_cell_len(const struct vtr_canvas* vt, const struct vtr_stencil_buf* sb, const struct vt_encoder* enc,
+                              size_t idx, bool first)
+{
+    uint32_t cell = sb->cells[idx];
+
+    if (cell & VT_CELL_TEXT_BITS) {
+        uint32_t glyph = sb->glyphs[idx];
+
+        // Tail of a wide glyph comes with its head, and can't be drawn on its own
+        if (glyph & VT_GLYPH_TAIL) {
+            return (first ? SIZE_MAX : 0);
+        }
+
+        struct vt_text_style style = text_style(vt, glyph_style(glyph));
+        if (style.fgc != enc->fgc || style.bgc != enc->bgc || style.bold != enc->bold) {
+            return SIZE_MAX;
+        }
+
+        return utf8_len(glyph_code(glyph));
+    } else if (enc->bgc != VTR_COLOR_DEFAULT || enc->bold) {
+        return SIZE_MAX;
+    } else if (cell_mask(cell) != 0) {
+        return (cell_fgcolor(cell) == enc->fgc ? 3 : SIZE_MAX);
+    } else {
+        // Blank cell looks the same as a space in any foreground color
+        return 1;
+    }
+}
+
+static size_t bridge_cell_s(char* seq, size_t seqcap, const struct vtr_stencil_buf* sb, size_t idx)
+{
+    uint32_t cell = sb->cells[idx];
+
+    if (cell & VT_CELL_TEXT_BITS) {
+        uint32_t glyph = sb->glyphs[idx];
+        return (glyph & VT_GLYPH_TAIL ? 0 : put_utf8_s(seq, seqcap, glyph_code(glyph)));
+    } else if (cell_mask(cell) != 0) {
+        return draw_cell_s(seq, seqcap, g_braille_lut[cell_mask(cell)]);
+    } else {
+        return put_char_s(seq, seqcap, ' ');
+    }
+}
+
+// Columns [lo, hi) of a row whose unchanged cells an encoder may re-emit.
+// A viewport owns its rectangle, the canvas owns whatever is left of the first viewport on the row.
+static void bridge_window(const struct vtr_canvas* vt, const struct vt_encoder* enc, uint16_t row,
+                          uint16_t* lo, uint16_t* hi)
+{
+    const struct vtr_viewport* vp = enc->vp;
+    if (vp) {
+        *lo = vp->col;
+        *hi = (row >= vp->row && row - vp->row < vp->nrows ? vp->col + vp->ncols : vp->col);
+        return;
+    }
+
+    *lo = 0;
+    *hi = vt->ncols;
+    for (const struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        vp = h->layer->viewport;
+        if (row >= vp->row && row - vp->row < vp->nrows && vp->ncols > 0) {
+            *hi = MIN(*hi, vp->col);
+        }
+    }
+}
+
+enum vt_cursor_motion
+{
+    VT_MOTION_ABSOLUTE,     // CUP to the target cell
+    VT_MOTION_BRIDGE,       // re-emit unchanged cells up to the target cell
+    VT_MOTION_FORWARD,      // CUF on the same row
+    VT_MOTION_BACKWARD,     // CUB on the same row
+    VT_MOTION_NEWLINE,      // CR, LFs and an optional CUF
+    VT_MOTION_LINEFEED,     // LFs keeping the column and an optional CUF
+};
+
+// Move the cursor to cell to_idx using the shortest sequence available.
+// Cells before the cursor can only be reached on its own row or with an absolute move.
+// The cursor is expected to be where the next drawn char will land at from_idx, SIZE_MAX if unknown.
+// Cells of the current frame in sb are used to bridge short gaps with the current encoder state.
+static size_t move_cursor_s(char* seq, size_t seqcap, const struct vtr_canvas* vt, const struct vtr_stencil_buf* sb,
+                            const struct vt_encoder* enc, size_t from_idx, size_t to_idx)
+{
+    uint16_t ncols = vt->ncols;
+    uint16_t stride = sb->stride;
+    uint16_t trow = to_idx / stride;
+    uint16_t tcol = to_idx % stride;
+
+    enum vt_cursor_motion motion = VT_MOTION_ABSOLUTE;
+    size_t best = set_pos_len(trow + 1, tcol + 1);
+
+    if (from_idx != SIZE_MAX) {
+        assert(from_idx != to_idx);
+
+        // Having just drawn the last column the cursor still sits there with a pending autowrap.
+        // Drawing a char wraps it to the next row first, CR and LF work as usual but CUF and CUB do nothing.
+        bool pending_wrap = (from_idx % stride == 0);
+        uint16_t crow = from_idx / stride - (pending_wrap ? 1 : 0);
+        uint16_t ccol = (pending_wrap ? ncols - 1 : (uint16_t)(from_idx % stride));
+
+        if (trow == crow && !pending_wrap) {
+            if (tcol > ccol && csi_n_len(tcol - ccol) < best) {
+                motion = VT_MOTION_FORWARD;
+                best = csi_n_len(tcol - ccol);
+            } else if (tcol < ccol && csi_n_len(ccol - tcol) < best) {
+                motion = VT_MOTION_BACKWARD;
+                best = csi_n_len(ccol - tcol);
+            }
+        }
+
+        if (trow > crow || (trow == crow && tcol < ccol)) {
+            size_t nlines = trow - crow;
+            size_t cost = 1 + nlines + (tcol > 0 ? csi_n_len(tcol) : 0);
+            if (cost < best) {
+                motion = VT_MOTION_NEWLINE;
+                best = cost;
+            }
+
+            cost = nlines + (tcol > ccol ? csi_n_len(tcol - ccol) : 0);
+            if (nlines > 0 && !pending_wrap && tcol >= ccol && cost < best) {
+                motion = VT_MOTION_LINEFEED;
+                best = cost;
+            }
+        }
+
+        // Unchanged cells are worth re-emitting as long as that beats every cursor motion.
+        // Stencil rows are padded up to the stride, which the terminal wraps over.
+        // Cells some other viewport, or the canvas, draws into are not ours to re-emit.
+        if (to_idx > from_idx) {
+            size_t cost = 0;
+            uint16_t row = from_idx / stride;
+            uint16_t col = from_idx % stride;
+            uint16_t lo, hi;
+            bridge_window(vt, enc, row, &lo, &hi);
+            for (size_t idx = from_idx; idx < to_idx && cost < best; idx++) {
+                size_t len = (col >= lo && col < hi ? bridge_cell_len(vt, sb, enc, idx, idx == from_idx) : SIZE_MAX);
+                cost = (len == SIZE_MAX ? SIZE_MAX : cost + len);
+                if (++col == ncols) {
+                    idx += stride - ncols;
+                    col = 0;
+                    bridge_window(vt, enc, ++row, &lo, &hi);
+                }
+            }
+
+            if (cost < best) {
+                motion = VT_MOTION_BRIDGE;
+                best = cost;
+            }
+        }
+    }
+
+    assert(seqcap >= best);
+
+    size_t nwritten = 0;
+    switch (motion) {
+    case VT_MOTION_ABSOLUTE:
+        nwritten = set_pos_s(seq, seqcap, trow + 1, tcol + 1);
+        break;
+    case VT_MOTION_BRIDGE: {
+        uint16_t col = from_idx % stride;
+        for (size_t idx = from_idx; idx < to_idx; idx++) {
+            nwritten += bridge_cell_s(seq + nwritten, seqcap - nwritten, sb, idx);
+            if (++col == ncols) {
+                idx += stride - ncols;
+                col = 0;
+            }
+        }
+        break;
+    }
+    case VT_MOTION_FORWARD:
+        nwritten = csi_n_s(seq, seqcap, tcol - (from_idx % stride), 'C');
+        break;
+    case VT_MOTION_BACKWARD:
+        nwritten = csi_n_s(seq, seqcap, (from_idx % stride) - tcol, 'D');
+        break;
+    case VT_MOTION_NEWLINE:
+    case VT_MOTION_LINEFEED: {
+        bool pending_wrap = (from_idx % stride == 0);
+        uint16_t crow = from_idx / stride - (pending_wrap ? 1 : 0);
+        uint16_t ccol = (motion == VT_MOTION_NEWLINE ? 0 : from_idx % stride);
+
+        if (motion == VT_MOTION_NEWLINE) {
+            seq[nwritten++] = '\r';
+        }
+        for (uint16_t row = crow; row < trow; row++) {
+            seq[nwritten++] = '\n';
+        }
+        if (tcol > ccol) {
+            nwritten += csi_n_s(seq + nwritten, seqcap - nwritten, tcol - ccol, 'C');
+        }
+        break;
+    }
+    }
+
+    assert(nwritten == best);
+    return nwritten;
+}
+
+// Most bytes encoding nrows rows of ncols cells of a canvas with canvas_rows by canvas_cols cells can take.
+// A changed cell takes a style switch and a 4 byte char at most, and a cursor motion before it, which is never
+// longer than an absolute CUP. The cursor only moves before a cell that doesn't follow a drawn one though,
+// so in order that is every other cell of a row at worst. A row that switched styles ends with a reset.
+// Grouped by color, the cursor can move before every cell, but the color switches once per group only.
+// Rows with text are never grouped, so the grouped cells are 3 byte chars.
+// The grouped encoding of a row sits next to the in-order one until the shorter is picked, so one row has both.
+// Style setters want room for the longest SGR whatever they write, hence the extra one at the end.
+static size_t seq_rows_bound(uint16_t canvas_rows, uint16_t canvas_cols, uint16_t ncols, uint16_t nrows, bool truecolor,
+                             bool grouped)
+{
+    size_t movelen = set_pos_len(MAX(canvas_rows, 1), MAX(canvas_cols, 1));
+    size_t sgrlen = (truecolor ? VT_MAX_SGR_LEN : VT_MAX_INDEXED_SGR_LEN);
+    size_t inorder = (size_t)ncols * (VT_MAX_STYLE_SGR_LEN(sgrlen) + 4) + (size_t)(ncols + 1) / 2 * movelen +
+                     VT_SGR_RESET_LEN;
+    size_t bygroup = (size_t)ncols * (movelen + 3) + VT_MAX_COLOR_GROUPS * sgrlen;
+
+    return (size_t)nrows * inorder + (grouped ? bygroup : 0) + VT_MAX_STYLE_SGR_LEN(VT_MAX_SGR_LEN);
+}
+
+// Most bytes a whole frame can take, with its synchronized update markers, scrolls and initial color reset
+static size_t seq_frame_bound(uint16_t nrows, uint16_t ncols, bool truecolor, bool grouped, size_t nscrolls)
+{
+    return seq_rows_bound(nrows, ncols, ncols, nrows, truecolor, grouped) +
+           2 * VT_SYNC_SEQ_LEN + nscrolls * VT_SCROLL_SEQ_MAX + VT_MAX_SGR_LEN;
+}
+
+// Clip the requested rectangle of a viewport to canvas dimensions
+static void clip_viewport_rect(struct vtr_viewport* vp, uint16_t rows, uint16_t cols)
+{
+    const struct vtr_rect* want = &vp->want;
+
+    if (want->row >= rows || want->col >= cols || want->nrows == 0 || want->ncols == 0) {
+        vp->row = vp->col = vp->nrows = vp->ncols = 0;
+    } else {
+        vp->row = want->row;
+        vp->col = want->col;
+        vp->nrows = MIN(want->nrows, rows - want->row);
+        vp->ncols = MIN(want->ncols, cols - want->col);
+    }
+}
+
+// Most bytes viewports can add to a frame of a canvas with rows by cols cells, 0 if there are none.
+// The frame bound has every cell of the screen already, whoever draws it. Each viewport row splits a canvas row
+// into more segments though, each of which can take a cursor motion more and ends with a reset of its own.
+// Cells of overlapping viewports are drawn more than once, which the sum of their pairwise overlaps is enough for.
+static size_t viewports_bound(const struct vtr_canvas* vt, uint16_t rows, uint16_t cols)
+{
+    size_t movelen = set_pos_len(MAX(rows, 1), MAX(cols, 1));
+    size_t sgrlen = (vt->truecolor ? VT_MAX_SGR_LEN : VT_MAX_INDEXED_SGR_LEN);
+    size_t celllen = VT_MAX_STYLE_SGR_LEN(sgrlen) + 4 + movelen;
+    size_t bound = 0;
+
+    for (const struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        struct vtr_viewport vp = *h->layer->viewport;
+        clip_viewport_rect(&vp, rows, cols);
+        bound += (size_t)vp.nrows * (2 * movelen + VT_SGR_RESET_LEN);
+
+        for (const struct vtr_canvas* o = h->layer->next; o; o = o->layer->next) {
+            struct vtr_viewport other = *o->layer->viewport;
+            clip_viewport_rect(&other, rows, cols);
+
+            int nrows = MIN(vp.row + vp.nrows, other.row + other.nrows) - MAX(vp.row, other.row);
+            int ncols = MIN(vp.col + vp.ncols, other.col + other.ncols) - MAX(vp.col, other.col);
+            if (nrows > 0 && ncols > 0) {
+                bound += (size_t)nrows * ncols * celllen;
+            }
+        }
+    }
+
+    return bound;
+}
+
+// Tell if any viewport is redrawn in the frame being presented
+static bool presenting_viewports(const struct vtr_canvas* vt)
+{
+    for (const struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        if (h->layer->viewport->presenting) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void add_frame_stats(struct vtr_frame_stats* dst, const struct vtr_frame_stats* src)
+{
+#ifndef VTR_NO_STATS
+    dst->cells_scanned += src->cells_scanned;
+    dst->cells_changed += src->cells_changed;
+    dst->bytes += src->bytes;
+    dst->inorder_bytes += src->inorder_bytes;
+    dst->writes += src->writes;
+    dst->short_writes += src->short_writes;
+    dst->seq_reallocs += src->seq_reallocs;
+    dst->raster_ns += src->raster_ns;
+    dst->diff_ns += src->diff_ns;
+    dst->encode_ns += src->encode_ns;
+    dst->write_ns += src->write_ns;
+    dst->dots += src->dots;
+    dst->lines += src->lines;
+    dst->polys += src->polys;
+    dst->texts += src->texts;
+    dst->sprites += src->sprites;
+    dst->samples += src->samples;
+#else
+    (void) dst;
+    (void) src;
+#endif
+}
+
+// Add the stats of the last frame to the totals and start a new one with the primitives drawn into it
+static void start_frame_stats(struct vtr_canvas* vt, struct vtr_cmdlist* cmds)
+{
+#ifndef VTR_NO_STATS
+    add_frame_stats(&vt->stats.total, &vt->stats.last);
+    memset(&vt->stats.last, 0, sizeof(vt->stats.last));
+
+    vt->stats.last.dots = cmds->nprims[VT_CMD_DOT];
+    vt->stats.last.lines = cmds->nprims[VT_CMD_LINE];
+    vt->stats.last.polys = cmds->nprims[VT_CMD_POLY];
+    vt->stats.last.texts = cmds->nprims[VT_CMD_TEXT];
+    vt->stats.last.sprites = cmds->nprims[VT_CMD_SPRITE];
+    vt->stats.last.samples = cmds->nsamples;
+    memset(cmds->nprims, 0, sizeof(cmds->nprims));
+    cmds->nsamples = 0;
+#else
+    (void) vt;
+    (void) cmds;
+#endif
+}
+
+int vtr_get_stats(struct vtr_canvas* vt, struct vtr_stats* stats)
+{
+    assert(vt);
+    assert(stats);
+
+#ifndef VTR_NO_STATS
+    if (vt->layer) {
+        return -EINVAL;
+    }
+
+    pipeline_idle(vt);
+    *stats = vt->stats;
+    add_frame_stats(&stats->total, &vt->stats.last);
+    stats->fps = vt->pacer.fps;
+    stats->pace_hz = vt->pacer.hz;
+
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+// Foreground color the terminal might have, forces the first drawn cell to set one
+#define VT_FGCOLOR_UNKNOWN ((uint16_t)0xFFFF)
+
+// Draw a changed cell of the current frame on the row starting at row_idx, moving the cursor to it first
+static void encode_cell(const struct vtr_canvas* vt, struct vt_encoder* enc, const struct vtr_stencil_buf* cur_sb,
+                        size_t row_idx, size_t cell_idx)
+{
+    uint32_t cur_cell = cur_sb->cells[cell_idx];
+    uint32_t glyph = cur_sb->glyphs[cell_idx];
+    size_t width = (glyph & VT_GLYPH_WIDE ? 2 : 1);
+    size_t next_idx = (cell_idx + width == row_idx + vt->ncols ? row_idx + cur_sb->stride : cell_idx + width);
+
+    // Tail of a wide glyph is drawn along with its head, which comes first unless it is unchanged
+    if (glyph & VT_GLYPH_TAIL) {
+        if (enc->next_idx != next_idx) {
+            encode_cell(vt, enc, cur_sb, row_idx, cell_idx - 1);
+        }
+        return;
+    }
+
+    // Any cell skipped since the last one we've drawn means we have to move the cursor
+    if (cell_idx != enc->next_idx) {
+        enc->len += move_cursor_s(enc->seq + enc->len, enc->cap - enc->len, vt, cur_sb, enc, enc->next_idx, cell_idx);
+    }
+
+    enc->next_idx = next_idx;
+
+    // Underlying buffer cell might just got un-overlaid so we need to draw it uncoditionally
+    if (!(cur_cell & VT_CELL_TEXT_BITS)) {
+        uint8_t bcell = g_braille_lut[cell_mask(cur_cell)];
+        uint16_t fgc = cell_fgcolor(cur_cell);
+
+        // Blank cell looks the same in any foreground color, so it keeps the current one
+        if ((fgc != enc->fgc && bcell != 0) || enc->bgc != VTR_COLOR_DEFAULT || enc->bold) {
+            enc->len += set_style_s(enc->seq + enc->len, enc->cap - enc->len, vt, enc, (bcell != 0 ? fgc : enc->fgc),
+                                    VTR_COLOR_DEFAULT, false);
+        }
+
+        enc->len += draw_cell_s(enc->seq + enc->len, enc->cap - enc->len, bcell);
+    } else {
+        struct vt_text_style style = text_style(vt, glyph_style(glyph));
+        enc->len += set_style_s(enc->seq + enc->len, enc->cap - enc->len, vt, enc, style.fgc, style.bgc, style.bold);
+        enc->len += put_utf8_s(enc->seq + enc->len, enc->cap - enc->len, glyph_code(glyph));
+    }
+}
+
+// Color a changed cell is drawn with, blank cells take any
+static inline bool cell_draw_color(uint32_t cell, uint16_t* fgc)
+{
+    if (cell & VT_CELL_TEXT_BITS) {
+        *fgc = VTR_COLOR_DEFAULT;
+    } else if (cell_mask(cell) != 0) {
+        *fgc = cell_fgcolor(cell);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Draw the cells of a row segment starting at column lo of the row at row_idx which are set in diffmask, in order.
+// With group set only cells of color fgc are drawn, and blank ones too if blanks is set.
+static void encode_cells(const struct vtr_canvas* vt, struct vt_encoder* enc, const struct vtr_stencil_buf* cur_sb,
+                         const uint64_t* diffmask, size_t nwords, size_t row_idx, uint16_t lo,
+                         bool group, uint16_t fgc, bool blanks)
+{
+    for (size_t word = 0; word < nwords; word++) {
+        for (uint64_t bits = diffmask[word]; bits != 0; bits &= bits - 1) {
+            size_t cell_idx = row_idx + lo + word * 64 + __builtin_ctzll(bits);
+
+            uint16_t cell_fgc;
+            if (group && (cell_draw_color(cur_sb->cells[cell_idx], &cell_fgc) ? cell_fgc != fgc : !blanks)) {
+                continue;
+            }
+
+            encode_cell(vt, enc, cur_sb, row_idx, cell_idx);
+        }
+    }
+}
+
+// Encode a row segment grouped by color as well, starting with the current one, and keep whichever is shorter.
+// Only pays off when the in-order encoding switches colors more often than there are colors to group by.
+static void encode_cells_grouped(const struct vtr_canvas* vt, struct vt_encoder* enc, const struct vtr_stencil_buf* cur_sb,
+                                 const uint64_t* diffmask, size_t nwords, size_t row_idx, uint16_t lo)
+{
+    uint16_t colors[VT_MAX_COLOR_GROUPS];
+    size_t ncolors = 0;
+    size_t nswitches = 0;
+    uint16_t last_fgc = enc->fgc;
+
+    for (size_t word = 0; word < nwords; word++) {
+        for (uint64_t bits = diffmask[word]; bits != 0; bits &= bits - 1) {
+            uint16_t fgc;
+            if (!cell_draw_color(cur_sb->cells[row_idx + lo + word * 64 + __builtin_ctzll(bits)], &fgc)) {
+                continue;
+            }
+
+            if (fgc != last_fgc) {
+                nswitches++;
+                last_fgc = fgc;
+            }
+
+            size_t i = 0;
+            while (i < ncolors && colors[i] != fgc) {
+                i++;
+            }
+
+            if (i == ncolors) {
+                if (ncolors == VT_MAX_COLOR_GROUPS) {
+                    encode_cells(vt, enc, cur_sb, diffmask, nwords, row_idx, lo, false, 0, false);
+                    return;
+                }
+                colors[ncolors++] = fgc;
+            }
+        }
+    }
+
+    // Grouping can't do with fewer switches than the number of colors other than the current one
+    bool has_cur = false;
+    for (size_t i = 0; i < ncolors; i++) {
+        if (colors[i] == enc->fgc) {
+            colors[i] = colors[0];
+            colors[0] = enc->fgc;
+            has_cur = true;
+        }
+    }
+
+    if (nswitches <= ncolors - (has_cur ? 1 : 0)) {
+        encode_cells(vt, enc, cur_sb, diffmask, nwords, row_idx, lo, false, 0, false);
+        return;
+    }
+
+    size_t start = enc->len;
+    size_t start_idx = enc->next_idx;
+    uint16_t start_fgc = enc->fgc;
+
+    encode_cells(vt, enc, cur_sb, diffmask, nwords, row_idx, lo, false, 0, false);
+
+    struct vt_encoder inorder = *enc;
+
+    enc->next_idx = start_idx;
+    enc->fgc = start_fgc;
+    for (size_t i = 0; i < ncolors; i++) {
+        encode_cells(vt, enc, cur_sb, diffmask, nwords, row_idx, lo, true, colors[i], i == 0);
+    }
+
+    // Both encodings are in the buffer one after another
+    size_t inorder_len = inorder.len - start;
+    size_t grouped_len = enc->len - inorder.len;
+    if (grouped_len < inorder_len) {
+        memmove(enc->seq + start, enc->seq + inorder.len, grouped_len);
+        enc->len = start + grouped_len;
+        enc->saved += inorder_len - grouped_len;
+    } else {
+        enc->len = inorder.len;
+        enc->next_idx = inorder.next_idx;
+        enc->fgc = inorder.fgc;
+    }
+}
+
+// Cut the wide glyphs of rows [first, last) of a canvas frame that straddle a viewport edge, leaving a space
+// in the half outside. The canvas then draws and erases every cell outside of viewports on its own.
+static void clip_viewport_glyphs(const struct vtr_canvas* vt, struct vtr_stencil_buf* sb, uint16_t first, uint16_t last)
+{
+    for (const struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        const struct vtr_viewport* vp = h->layer->viewport;
+        uint16_t end = vp->col + vp->ncols;
+
+        for (uint16_t row = MAX(first, vp->row); row < MIN(last, vp->row + vp->nrows) && vp->ncols > 0; row++) {
+            uint32_t* glyphs = sb->glyphs + (size_t)row * sb->stride;
+            const struct vtr_span* tspan = &sb->text[row];
+
+            if (vp->col > tspan->lo && vp->col < tspan->hi && (glyphs[vp->col - 1] & VT_GLYPH_WIDE)) {
+                glyphs[vp->col - 1] = (glyphs[vp->col - 1] & ~(VT_GLYPH_CODE_BITS | VT_GLYPH_WIDE)) | ' ';
+            }
+            if (end > tspan->lo && end < tspan->hi && (glyphs[end] & VT_GLYPH_TAIL)) {
+                glyphs[end] = (glyphs[end] & ~(VT_GLYPH_CODE_BITS | VT_GLYPH_TAIL)) | ' ';
+            }
+        }
+    }
+}
+
+// Leave the cells of viewports on a row segment starting at column lo out of its diffmask
+static void mask_viewports(const struct vtr_canvas* vt, uint64_t* diffmask, uint16_t row, uint16_t lo, uint16_t hi)
+{
+    for (const struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        const struct vtr_viewport* vp = h->layer->viewport;
+        if (row < vp->row || row - vp->row >= vp->nrows) {
+            continue;
+        }
+
+        for (uint16_t col = MAX(vp->col, lo); col < MIN(vp->col + vp->ncols, hi); col++) {
+            diffmask[(col - lo) / 64] &= ~((uint64_t)1 << ((col - lo) % 64));
+        }
+    }
+}
+
+// Diff rows [first, last) of a frame against a base state and append the escape sequences to the encoder.
+// Encoder offset after each row minus base is stored into rowends[row + 1].
+static void encode_rows(const struct vtr_canvas* vt, struct vt_encoder* enc,
+                        const struct vtr_stencil_buf* cur_sb, const struct vtr_stencil_buf* base_sb,
+                        uint16_t first, uint16_t last, size_t base)
+{
+    uint64_t diffmask[VT_DIFFMASK_WORDS(UINT16_MAX)];
+
+    for (uint16_t row = first; row < last; row++) {
+        // Only cells touched in either frame can differ, everything else is clear in both.
+        struct vtr_span* cur_span = &cur_sb->dirty[row];
+        struct vtr_span* base_span = &base_sb->dirty[row];
+        uint16_t lo = MIN(cur_span->lo, base_span->lo);
+        uint16_t hi = MAX(cur_span->hi, base_span->hi);
+        if (lo >= hi) {
+            vt->rowends[row + 1] = enc->len - base;
+            continue;
+        }
+
+        uint64_t diff_start = stat_clock_ns();
+        size_t row_idx = (size_t)row * cur_sb->stride;
+        const uint32_t* cur_row = cur_sb->cells + row_idx;
+        const uint32_t* base_row = base_sb->cells + (size_t)row * base_sb->stride;
+        size_t nwords = VT_DIFFMASK_WORDS(hi - lo);
+        size_t nchanged = 0;
+        vt->diff_cells(cur_row + lo, base_row + lo, hi - lo, diffmask);
+
+        // Text only changes in the glyph plane, which is compared where text was printed into either frame
+        const uint32_t* cur_glyphs = cur_sb->glyphs + row_idx;
+        const uint32_t* base_glyphs = base_sb->glyphs + (size_t)row * base_sb->stride;
+        uint16_t tlo = MIN(cur_sb->text[row].lo, base_sb->text[row].lo);
+        uint16_t thi = MAX(cur_sb->text[row].hi, base_sb->text[row].hi);
+        for (uint16_t col = tlo; col < thi; col++) {
+            if (cur_glyphs[col] != base_glyphs[col]) {
+                diffmask[(col - lo) / 64] |= (uint64_t)1 << ((col - lo) % 64);
+            }
+        }
+
+        if (!enc->vp && vt->viewports) {
+            mask_viewports(vt, diffmask, row, lo, hi);
+        }
+
+        // Raster changes under an unchanged text overlay are invisible
+        for (size_t word = 0; word < nwords; word++) {
+            for (uint64_t bits = diffmask[word]; bits != 0; bits &= bits - 1) {
+                size_t col = lo + word * 64 + __builtin_ctzll(bits);
+
+                if ((cur_row[col] & VT_CELL_TEXT_BITS) && cur_glyphs[col] == base_glyphs[col]) {
+                    diffmask[word] &= ~(bits & -bits);
+                } else {
+                    nchanged++;
+                }
+            }
+        }
+
+        uint64_t encode_start = stat_clock_ns();
+        STAT_ADD(&enc->stats, cells_scanned, hi - lo);
+        STAT_ADD(&enc->stats, cells_changed, nchanged);
+        STAT_ADD(&enc->stats, diff_ns, encode_start - diff_start);
+
+        // Drawing over half of a wide glyph erases all of it, so rows with text are drawn in order
+        if (vt->group_colors && tlo >= thi) {
+            encode_cells_grouped(vt, enc, cur_sb, diffmask, nwords, row_idx, lo);
+        } else {
+            encode_cells(vt, enc, cur_sb, diffmask, nwords, row_idx, lo, false, 0, false);
+        }
+
+        // Rows start with no background or bold, so that any of them can be encoded on its own
+        if (enc->bgc != VTR_COLOR_DEFAULT || enc->bold) {
+            memcpy(enc->seq + enc->len, VT_SGR_RESET, VT_SGR_RESET_LEN);
+            enc->len += VT_SGR_RESET_LEN;
+            enc->fgc = VTR_COLOR_DEFAULT;
+            enc->bgc = VTR_COLOR_DEFAULT;
+            enc->bold = false;
+        }
+
+        STAT_ADD(&enc->stats, encode_ns, stat_clock_ns() - encode_start);
+
+        vt->rowends[row + 1] = enc->len - base;
+    }
+}
+
+// Copy the spans of a viewport's back buffer to its back plane, in canvas columns
+static void publish_viewport_spans(struct vtr_viewport* vp, uint16_t ncols)
+{
+    struct vtr_stencil_buf* back = &vp->planes[0];
+
+    for (uint16_t row = 0; row < vp->nrows; row++) {
+        struct vtr_span span = vp->dirty[row];
+        struct vtr_span tspan = vp->text[row];
+        back->dirty[vp->row + row] = (span.lo < span.hi ?
+            (struct vtr_span){ span.lo + vp->col, span.hi + vp->col } : (struct vtr_span){ ncols, 0 });
+        back->text[vp->row + row] = (tspan.lo < tspan.hi ?
+            (struct vtr_span){ tspan.lo + vp->col, tspan.hi + vp->col } : (struct vtr_span){ ncols, 0 });
+    }
+}
+
+static bool scroll_overlaps(const struct vtr_scroll_op* op, const struct vtr_viewport* vp)
+{
+    return (op->row < vp->row + vp->nrows && vp->row < op->row + op->nrows &&
+            op->col < vp->col + vp->ncols && vp->col < op->col + op->ncols);
+}
+
+// Point the back buffer of a viewport handle at the viewport rectangle in its back plane
+static void bind_viewport(struct vtr_canvas* h)
+{
+    struct vtr_viewport* vp = h->layer->viewport;
+    struct vtr_stencil_buf* plane = &vp->planes[0];
+    size_t offset = (size_t)vp->row * plane->stride + vp->col;
+
+    h->nrows = vp->nrows;
+    h->ncols = vp->ncols;
+    h->ydots = vp->nrows * VT_CELL_YDOTS;
+    h->xdots = vp->ncols * VT_CELL_XDOTS;
+    h->sb[0] = (struct vtr_stencil_buf){
+        .ydots = h->ydots,
+        .xdots = h->xdots,
+        .cells = plane->cells + offset,
+        .stride = plane->stride,
+        .rowcap = vp->nrows,
+        .dirty = vp->dirty,
+        .glyphs = plane->glyphs + offset,
+        .text = vp->text,
+        .clip_y0 = 0,
+        .clip_y1 = h->ydots,
+    };
+    h->cur_sb = &h->sb[0];
+}
+
+// Append the viewports handed to a frame, each diffed against its own front plane, and make their back planes
+// the front ones. Viewports the frame scrolls over get their front planes invalidated first.
+// Stride is the one the encoder's cursor index is in, before and after. Row ends of frames with viewports are
+// left as they come out, those frames are never cut.
+static void encode_viewports(struct vtr_canvas* vt, struct vt_encoder* enc, const struct vtr_cmdlist* cmds,
+                             uint16_t stride)
+{
+    for (struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        struct vtr_viewport* vp = h->layer->viewport;
+        struct vtr_stencil_buf* back = &vp->planes[0];
+        struct vtr_stencil_buf* front = &vp->planes[1];
+
+        // Scrolling marked the viewport stale already, unless it is redrawn for this very frame
+        for (size_t i = 0; i < cmds->nscrolls; i++) {
+            if (scroll_overlaps(&cmds->scrolls[i], vp)) {
+                invalidate_cells(front, vp->row, vp->col, vp->nrows, vp->ncols);
+                break;
+            }
+        }
+
+        if (!vp->presenting) {
+            continue;
+        }
+
+        publish_viewport_spans(vp, vt->ncols);
+
+        if (enc->next_idx != SIZE_MAX) {
+            enc->next_idx = enc->next_idx / stride * back->stride + enc->next_idx % stride;
+        }
+
+        enc->vp = vp;
+        encode_rows(vt, enc, back, front, vp->row, vp->row + vp->nrows, vt->seqlen);
+        enc->vp = NULL;
+
+        if (enc->next_idx != SIZE_MAX) {
+            enc->next_idx = enc->next_idx / back->stride * stride + enc->next_idx % back->stride;
+        }
+
+        struct vtr_stencil_buf shown = *front;
+        *front = *back;
+        *back = shown;
+        clear_stencil_buf(back);
+        for (uint16_t row = 0; row < vp->nrows; row++) {
+            vp->dirty[row] = (struct vtr_span){ .lo = vp->ncols, .hi = 0 };
+            vp->text[row] = vp->dirty[row];
+        }
+        bind_viewport(h);
+    }
+}
+
+// Start a frame in the output queue with the scrolls from its command list, returns an encoder appending to it.
+// Output queue is expected to have room for the worst case frame.
+static void begin_frame(struct vtr_canvas* vt, struct vt_encoder* enc, const struct vtr_cmdlist* cmds)
+{
+    *enc = (struct vt_encoder){ vt->seqlist, vt->seqcap, vt->seqlen, SIZE_MAX, VTR_COLOR_DEFAULT, VTR_COLOR_DEFAULT, false,
+                                NULL, 0, {0} };
+    assert(enc->cap - enc->len >= seq_frame_bound(vt->nrows, vt->ncols, vt->truecolor, vt->group_colors, cmds->nscrolls));
+
+    if (vt->sync) {
+        memcpy(enc->seq + enc->len, VT_SYNC_BEGIN, VT_SYNC_SEQ_LEN);
+        enc->len += VT_SYNC_SEQ_LEN;
+    }
+
+    // Cursor position is unknown after scrolling, which is what a new encoder assumes anyway
+    enc->len += encode_scrolls(enc->seq + enc->len, cmds);
+
+    enc->len += set_foreground_color_s(enc->seq + enc->len, enc->cap - enc->len, vt, VTR_COLOR_DEFAULT);
+    vt->rowends[0] = enc->len - vt->seqlen;
+}
+
+// Finish the frame started by begin_frame and queue it, drawn tells if anything at all was encoded.
+// Stride is the one of the stencil buffer the frame was encoded from.
+static void end_frame(struct vtr_canvas* vt, struct vt_encoder* enc, uint16_t stride, bool drawn)
+{
+    if (!drawn) {
+        // Nothing changed, no need to send anything
+        for (uint16_t row = 0; row <= vt->nrows; row++) {
+            vt->rowends[row] = 0;
+        }
+
+        enc->len = vt->seqlen;
+    } else {
+        if (vt->sync) {
+            memcpy(enc->seq + enc->len, VT_SYNC_END, VT_SYNC_SEQ_LEN);
+            enc->len += VT_SYNC_SEQ_LEN;
+        }
+
+        // Cursor stays on the row of the last drawn cell, it is anywhere after scrolls alone
+        if (enc->next_idx != SIZE_MAX) {
+            vt->cursor_row = enc->next_idx / stride - (enc->next_idx % stride == 0 ? 1 : 0);
+        } else {
+            vt->cursor_row = UINT16_MAX;
+        }
+    }
+
+    size_t nbytes = enc->len - vt->seqlen;
+    __atomic_fetch_add(&vt->out_bytes, nbytes, __ATOMIC_RELAXED);
+    STAT_ADD(&enc->stats, bytes, nbytes);
+    STAT_ADD(&enc->stats, inorder_bytes, (drawn ? nbytes + enc->saved : 0));
+    STAT_ADD(&vt->stats, frames, 1);
+    add_frame_stats(&vt->stats.last, &enc->stats);
+
+    vt->frame_start = vt->seqlen;
+    vt->seqlen = enc->len;
+}
+
+// Diff a frame against a base state and append the resulting escape sequence list to the output queue.
+static void encode_frame(struct vtr_canvas* vt, const struct vtr_stencil_buf* cur_sb, const struct vtr_stencil_buf* base_sb,
+                         const struct vtr_cmdlist* cmds)
+{
+    struct vt_encoder enc;
+    begin_frame(vt, &enc, cmds);
+    encode_rows(vt, &enc, cur_sb, base_sb, 0, vt->nrows, vt->seqlen);
+    encode_viewports(vt, &enc, cmds, cur_sb->stride);
+    end_frame(vt, &enc, cur_sb->stride, enc.next_idx != SIZE_MAX || cmds->nscrolls > 0);
+}
+
+// Throw away the part of the queued frame the TTY hasn't seen yet, keeping only what's needed
+// to finish the row that is being written now.  Shadow buffer is updated to the resulting terminal state.
+static void cut_queued_frame(struct vtr_canvas* vt, const struct vtr_stencil_buf* front_sb)
+{
+    assert(vt->shadow_valid && vt->frame_start != SIZE_MAX);
+
+    size_t nwritten = (vt->seqhead > vt->frame_start ? vt->seqhead - vt->frame_start : 0);
+    size_t framelen = vt->seqlen - vt->frame_start;
+    size_t tail = (vt->sync && framelen > 0 ? VT_SYNC_SEQ_LEN : 0);
+
+    // Rows that the terminal will have in full once we let the row in progress finish
+    uint16_t nrows = 0;
+    if (nwritten > 0) {
+        while (nrows < vt->nrows && vt->rowends[nrows] < nwritten) {
+            nrows++;
+        }
+    }
+
+    if (framelen > 0 && nwritten == 0) {
+        vt->seqlen = vt->frame_start;
+        vt->dropped_frames++;
+    } else if (framelen == 0 || nrows == vt->nrows || vt->rowends[nrows] + tail == framelen) {
+        // It was in the last row with anything to draw already so there is nothing to cut
+        nrows = vt->nrows;
+    } else {
+        vt->seqlen = vt->frame_start + vt->rowends[nrows];
+        vt->merged_frames++;
+
+        // Synchronized update that was already started has to be finished.
+        // Cut is made before the frame's own sync end so there is enough space left for it.
+        if (tail) {
+            memcpy(vt->seqlist + vt->seqlen, VT_SYNC_END, VT_SYNC_SEQ_LEN);
+            vt->seqlen += VT_SYNC_SEQ_LEN;
+        }
+    }
+
+    copy_stencil_rows(&vt->shadow, front_sb, 0, nrows);
+    vt->frame_start = SIZE_MAX;
+    vt->cursor_row = UINT16_MAX;
+}
+
+// Merge context layers into a finished back buffer, diff it against the front buffer and write it out.
+// Deferred mode rasterizes the binned command list first.
+// Once the frame is queued the back buffer becomes the front buffer and the previous front buffer is cleared,
+// otherwise both are left as they were.
+static int present_frame(struct vtr_canvas* vt, struct vtr_stencil_buf* cur_sb, struct vtr_cmdlist* cmds)
+{
+    uint64_t present_start = clock_ns();
+    start_frame_stats(vt, cmds);
+
+    // Room for the worst case frame is made before anything is touched, so running out of memory leaves
+    // the frame as it was, and the encoder never has to check for space. Only the rest of a previous frame
+    // still queued for a non-blocking TTY, or a change of color settings, can take more than was allocated upfront.
+    size_t bound = seq_frame_bound(vt->nrows, vt->ncols, vt->truecolor, vt->group_colors, cmds->nscrolls) +
+                   viewports_bound(vt, vt->nrows, vt->ncols);
+    while (vt->seqcap - (vt->seqlen - vt->seqhead) < bound) {
+        if (!extend_seq_buf(&vt->seqlist, &vt->seqcap)) {
+            return -ENOMEM;
+        }
+        STAT_ADD(&vt->stats.last, seq_reallocs, 1);
+    }
+
+    int error;
+    struct vtr_stencil_buf* prev_sb = vt->front_sb;
+    struct vtr_stencil_buf* base_sb = prev_sb;
+    bool scrolled = (cmds->nscrolls > 0);
+
+    // Scrolls move whatever the terminal shows once the queue is written, so nothing queued can be cut
+    if (scrolled) {
+        vt->frame_start = SIZE_MAX;
+        vt->shadow_valid = false;
+    }
+
+    // If the previous frame is still in flight we can replace the rest of it with this one.
+    // We then have to diff against what the terminal will actually show instead of the front buffer.
+    if (vt->policy == VTR_FRAME_DROP && vt->shadow_valid) {
+        cut_queued_frame(vt, prev_sb);
+        base_sb = &vt->shadow;
+    }
+
+    // New frame is appended to whatever the TTY didn't accept yet
+    compact_seq_buf(vt);
+
+    // Front buffer is shifted to match the terminal after scrolling, and diffed against as such.
+    // Whatever viewports showed moves along, so it is redrawn wherever it ends up outside of them.
+    if (scrolled) {
+        for (struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+            const struct vtr_viewport* vp = h->layer->viewport;
+            invalidate_cells(prev_sb, vp->row, vp->col, vp->nrows, vp->ncols);
+        }
+        shift_scrolled(prev_sb, cmds);
+    }
+
+    // Published context layers stay locked until they are merged, which deferred mode does in its tiles
+    lock_layers(vt);
+    if (vt->pool) {
+        encode_frame_tiles(vt, cur_sb, base_sb, cmds);
+        unlock_layers(vt);
+    } else {
+        uint64_t merge_start = stat_clock_ns();
+        merge_layers(vt, cur_sb, 0, vt->nrows);
+        unlock_layers(vt);
+        clip_viewport_glyphs(vt, cur_sb, 0, vt->nrows);
+        STAT_ADD(&vt->stats.last, raster_ns, stat_clock_ns() - merge_start);
+        encode_frame(vt, cur_sb, base_sb, cmds);
+    }
+
+    record_frame(vt, cur_sb);
+
+    if (scrolled) {
+        // Terminal state before the frame is not what it was diffed against, so it can't be cut either
+        vt->frame_start = SIZE_MAX;
+        cmds->nscrolls = 0;
+    }
+
+    // Nor can a frame with viewports, which were diffed against their own front planes
+    if (presenting_viewports(vt)) {
+        vt->frame_start = SIZE_MAX;
+    }
+
+    error = flush_seq(vt);
+    if (error == -EAGAIN && vt->policy == VTR_FRAME_DROP && vt->frame_start != SIZE_MAX) {
+        // Frame is in flight, keep the state it was diffed against in case we have to cut it later
+        if (base_sb != &vt->shadow) {
+            copy_stencil_rows(&vt->shadow, base_sb, 0, vt->nrows);
+        }
+
+        vt->shadow_valid = true;
+    }
+
+    clear_stencil_buf(prev_sb);
+    vt->front_sb = cur_sb;
+    __atomic_fetch_add(&vt->present_ns, clock_ns() - present_start, __ATOMIC_RELAXED);
+
+    return (error == -EAGAIN ? 0 : error);
+}
+
+int vtr_swap_buffers(struct vtr_canvas* vt)
+{
+    if (vt->layer) {
+        return -EINVAL;
+    }
+
+    count_frame_rate(vt);
+
+    // Density samples go under everything drawn into the frame, recorded commands are rasterized over them
+    resolve_density(vt);
+
+    if (vt->pipeline) {
+        return swap_pipelined(vt);
+    }
+
+    publish_retained(vt);
+
+    // Recorded draw calls are binned into tiles first, so running out of memory there leaves everything as it was
+    if (vt->pool) {
+        int error = bin_cmds(vt);
+        if (error) {
+            return error;
+        }
+    }
+
+    schedule_viewports(vt);
+
+    struct vtr_stencil_buf* prev_sb = vt->front_sb;
+    int error = present_frame(vt, vt->cur_sb, &vt->cmds);
+    if (vt->front_sb != prev_sb) {
+        vt->cur_sb = prev_sb;
+    }
+
+    return error;
+}
+
+static void render_dot(struct vtr_stencil_buf* sb, uint16_t x, uint16_t y, uint16_t fgc)
+{
+    assert(x < sb->xdots && y < sb->ydots);
+
+    uint16_t row = y >> VT_CELL_YDOTS_SHIFT;
+    uint16_t col = x >> VT_CELL_XDOTS_SHIFT;
+
+    uint32_t* cell = &sb->cells[(size_t)row * sb->stride + col];
+    *cell = (*cell & ~VT_CELL_FGCOLOR_BITS) | ((uint32_t)dot_bit(x, y) << VT_CELL_MASK_SHIFT) | ((uint32_t)fgc << VT_CELL_FGCOLOR_SHIFT);
+    mark_dirty(sb, row, col);
+}
+
+// Print a glyph into a cell, whichever half of a wide glyph it replaces leaves the other half a space
+static void print_glyph(struct vtr_stencil_buf* sb, uint16_t row, uint16_t col, uint32_t glyph)
+{
+    size_t idx = (size_t)row * sb->stride + col;
+    uint32_t prev = sb->glyphs[idx];
+
+    if ((prev & VT_GLYPH_TAIL) && !(glyph & VT_GLYPH_TAIL)) {
+        sb->glyphs[idx - 1] = (prev & ~(VT_GLYPH_CODE_BITS | VT_GLYPH_TAIL)) | ' ';
+    }
+
+    if ((prev & VT_GLYPH_WIDE) && !(glyph & VT_GLYPH_WIDE)) {
+        sb->glyphs[idx + 1] = (prev & ~(VT_GLYPH_CODE_BITS | VT_GLYPH_WIDE)) | ' ';
+    }
+
+    sb->cells[idx] |= VT_CELL_TEXT;
+    sb->glyphs[idx] = glyph;
+    mark_text(sb, row, col);
+}
+
+// Render a dot if it is inside the stencil clip rows
+static inline void draw_dot(struct vtr_stencil_buf* sb, int x, int y, uint16_t fgc)
+{
+    if ((x >= 0 && x < sb->xdots) && (y >= sb->clip_y0 && y < sb->clip_y1)) {
+        render_dot(sb, x, y, fgc);
+    }
+}
+
+void vtr_render_dot(struct vtr_canvas* vt, int x, int y)
+{
+    vtr_render_dotc(vt, x, y, VTR_COLOR_DEFAULT);
+}
+
+void vtr_render_dotc(struct vtr_canvas* vt, int x, int y, enum vtr_color fgc)
+{
+    vtr_render_dotx(vt, x, y, fgc);
+}
+
+void vtr_render_dotx(struct vtr_canvas* vt, int x, int y, uint32_t color)
+{
+    STAT_ADD(&vt->cmds, nprims[VT_CMD_DOT], 1);
+
+    uint16_t fgc = color_id(vt, color);
+    if (vt->pool) {
+        record_dot(vt, x, y, fgc);
+    } else {
+        draw_dot(vt->cur_sb, x, y, fgc);
+    }
+}
+
+#define VT_BATCH_CHUNK  1024
+
+// Color ids of a batch, whose colors come from either array or are all the same one.
+// Neighbouring elements tend to share a color, so an id is only looked up when the color changes.
+struct vt_batch_colors
+{
+    const enum vtr_color* colors;
+    const uint32_t* xcolors;
+    uint32_t color;
+    uint16_t id;
+};
+
+static inline void init_batch_colors(struct vtr_canvas* vt, struct vt_batch_colors* bc, const enum vtr_color* colors,
+                                     const uint32_t* xcolors, uint32_t color)
+{
+    assert(vt);
+    *bc = (struct vt_batch_colors){ colors, xcolors, color, color_id(vt, color) };
+}
+
+static inline uint16_t batch_color_id(struct vtr_canvas* vt, struct vt_batch_colors* bc, size_t i)
+{
+    uint32_t color = (bc->colors ? (uint32_t)bc->colors[i] : bc->xcolors ? bc->xcolors[i] : bc->color);
+    if (color != bc->color) {
+        bc->color = color;
+        bc->id = color_id(vt, color);
+    }
+
+    return bc->id;
+}
+
+// Render a run of dots in color ids from ids, or all of them in fgc if it is NULL
+static void plot_dots(struct vtr_stencil_buf* sb, size_t ndots, const struct vtr_vertex* dots, const uint16_t* ids,
+                      uint16_t fgc)
+{
+    uint32_t* cells = sb->cells;
+    unsigned xdots = sb->xdots;
+    unsigned ydots = sb->ydots;
+    size_t stride = sb->stride;
+
+    for (size_t i = 0; i < ndots; i++) {
+        // Negative coordinates wrap around to huge unsigned values so this is the full point test
+        unsigned x = (unsigned)dots[i].x;
+        unsigned y = (unsigned)dots[i].y;
+        if (x >= xdots || y >= ydots) {
+            continue;
+        }
+
+        uint32_t color = (ids ? ids[i] : fgc);
+        uint16_t row = y >> VT_CELL_YDOTS_SHIFT;
+        uint16_t col = x >> VT_CELL_XDOTS_SHIFT;
+        uint32_t* cell = &cells[row * stride + col];
+        *cell = (*cell & ~VT_CELL_FGCOLOR_BITS) | ((uint32_t)dot_bit(x, y) << VT_CELL_MASK_SHIFT) | (color << VT_CELL_FGCOLOR_SHIFT);
+        mark_dirty(sb, row, col);
+    }
+}
+
+static void render_dots(struct vtr_canvas* vt, size_t ndots, const struct vtr_vertex* dots, struct vt_batch_colors* bc)
+{
+    assert(dots || ndots == 0);
+
+    STAT_ADD(&vt->cmds, nprims[VT_CMD_DOT], ndots);
+
+    if (vt->pool) {
+        for (size_t i = 0; i < ndots; i++) {
+            record_dot(vt, dots[i].x, dots[i].y, batch_color_id(vt, bc, i));
+        }
+        return;
+    }
+
+    if (!bc->colors && !bc->xcolors) {
+        plot_dots(vt->cur_sb, ndots, dots, NULL, bc->id);
+        return;
+    }
+
+    // Colors are mapped a chunk at a time, so that the dots themselves are plotted in a tight loop
+    uint16_t ids[VT_BATCH_CHUNK];
+    for (size_t base = 0; base < ndots; base += VT_BATCH_CHUNK) {
+        size_t n = MIN(ndots - base, (size_t)VT_BATCH_CHUNK);
+        for (size_t i = 0; i < n; i++) {
+            ids[i] = batch_color_id(vt, bc, base + i);
+        }
+
+        plot_dots(vt->cur_sb, n, dots + base, ids, 0);
+    }
+}
+
+void vtr_render_dots(struct vtr_canvas* vt, size_t ndots, const struct vtr_vertex* dots,
+                     const enum vtr_color* colors, enum vtr_color fgc)
+{
+    struct vt_batch_colors bc;
+    init_batch_colors(vt, &bc, colors, NULL, fgc);
+    render_dots(vt, ndots, dots, &bc);
+}
+
+void vtr_render_dotsx(struct vtr_canvas* vt, size_t ndots, const struct vtr_vertex* dots,
+                      const uint32_t* colors, uint32_t color)
+{
+    struct vt_batch_colors bc;
+    init_batch_colors(vt, &bc, NULL, colors, color);
+    render_dots(vt, ndots, dots, &bc);
+}
+
+// vtr_plot_unchecked writes cells on its own, with the layout hardcoded
+_Static_assert(VT_CELL_FGCOLOR_SHIFT == 16 && VT_CELL_MASK_SHIFT == 0, "cell layout of vtr_plot_unchecked");
+_Static_assert(VT_CELL_YDOTS_SHIFT == 2 && VT_CELL_XDOTS_SHIFT == 1, "cell dims of vtr_plot_unchecked");
+
+int vtr_get_dot_target(struct vtr_canvas* vt, uint32_t color, struct vtr_dot_target* target)
+{
+    assert(vt);
+    assert(target);
+
+    // Recorded commands are rasterized later, dots written right away would end up under them
+    if (vt->pool) {
+        return -ENOTSUP;
+    }
+
+    struct vtr_stencil_buf* sb = vt->cur_sb;
+    *target = (struct vtr_dot_target){
+        .cells = sb->cells,
+        .dirty = sb->dirty,
+        .color = (uint32_t)color_id(vt, color) << VT_CELL_FGCOLOR_SHIFT,
+        .stride = sb->stride,
+        .xdots = sb->xdots,
+        .ydots = sb->ydots,
+    };
+
+    return 0;
+}
+
+// Set dots [x0, x1] on dot row y with whole cell masks.
+static void fill_hspan(struct vtr_stencil_buf* sb, uint16_t y, uint16_t x0, uint16_t x1, uint16_t fgc)
+{
+    assert(x0 <= x1 && x1 < sb->xdots && y < sb->ydots);
+
+    uint16_t row = y / VT_CELL_YDOTS;
+    uint16_t col0 = x0 / VT_CELL_XDOTS;
+    uint16_t col1 = x1 / VT_CELL_XDOTS;
+
+    // Both dot columns of a cell, except possibly for the first and last ones
+    uint32_t dotbit = 1u << (y & (VT_CELL_YDOTS - 1));
+    uint32_t first = ((x0 & 1) ? dotbit << 4 : dotbit | dotbit << 4);
+    uint32_t last = ((x1 & 1) ? dotbit | dotbit << 4 : dotbit);
+
+    uint32_t* cells = &sb->cells[(size_t)row * sb->stride];
+    for (uint16_t col = col0; col <= col1; col++) {
+        uint32_t stencil = (col == col0 ? first : 0xFF) & (col == col1 ? last : 0xFF) & (dotbit | dotbit << 4);
+        cells[col] = (cells[col] & ~VT_CELL_FGCOLOR_BITS) | (stencil << VT_CELL_MASK_SHIFT) | ((uint32_t)fgc << VT_CELL_FGCOLOR_SHIFT);
+    }
+
+    mark_dirty(sb, row, col0);
+    mark_dirty(sb, row, col1);
+}
+
+// Set dots [y0, y1] on dot column x with whole cell masks.
+static void fill_vspan(struct vtr_stencil_buf* sb, uint16_t x, uint16_t y0, uint16_t y1, uint16_t fgc)
+{
+    assert(y0 <= y1 && y1 < sb->ydots && x < sb->xdots);
+
+    uint16_t col = x / VT_CELL_XDOTS;
+    uint16_t row0 = y0 / VT_CELL_YDOTS;
+    uint16_t row1 = y1 / VT_CELL_YDOTS;
+    unsigned shift = (x & (VT_CELL_XDOTS - 1)) * 4;
+
+    for (uint16_t row = row0; row <= row1; row++) {
+        uint32_t nibble = 0xF;
+        if (row == row0) {
+            nibble &= 0xF << (y0 & (VT_CELL_YDOTS - 1));
+        }
+        if (row == row1) {
+            nibble &= 0xF >> (VT_CELL_YDOTS - 1 - (y1 & (VT_CELL_YDOTS - 1)));
+        }
+
+        uint32_t* cell = &sb->cells[(size_t)row * sb->stride + col];
+        *cell = (*cell & ~VT_CELL_FGCOLOR_BITS) | ((nibble << shift) << VT_CELL_MASK_SHIFT) | ((uint32_t)fgc << VT_CELL_FGCOLOR_SHIFT);
+        mark_dirty(sb, row, col);
+    }
+}
+
+// Floor division for a positive divisor
+static inline int64_t floor_div(int64_t n, int64_t d)
+{
+    assert(d > 0);
+    return (n >= 0 ? n / d : -((-n + d - 1) / d));
+}
+
+// Coordinates beyond this are clipped to the guard band first, so that the exact integer math below can't overflow.
+#define VT_GUARD_BAND (1 << 24)
+
+// Clip a line to the guard band box in floating point.
+// Only lines with far away endpoints ever get here so the precision loss is way below a dot.
+static bool clip_guard_band(int* x0, int* y0, int* x1, int* y1)
+{
+    double dx = (double)*x1 - *x0, dy = (double)*y1 - *y0;
+    double p[4] = { -dx, dx, -dy, dy };
+    double q[4] = { (double)*x0 + VT_GUARD_BAND, VT_GUARD_BAND - (double)*x0,
+                    (double)*y0 + VT_GUARD_BAND, VT_GUARD_BAND - (double)*y0 };
+
+    double tentry = 0, texit = 1;
+    for (int i = 0; i < 4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0) {
+                return false;
+            }
+        } else {
+            double t = q[i] / p[i];
+            if (p[i] < 0) {
+                tentry = MAX(tentry, t);
+            } else {
+                texit = MIN(texit, t);
+            }
+        }
+    }
+
+    if (tentry > texit) {
+        return false;
+    }
+
+    double ox = *x0, oy = *y0;
+    *x0 = (int)round(ox + tentry * dx);
+    *y0 = (int)round(oy + tentry * dy);
+    *x1 = (int)round(ox + texit * dx);
+    *y1 = (int)round(oy + texit * dy);
+
+    return true;
+}
+
+// Generic slope case.
+// A line is y - y1 = m(x - x1) in screen dot space, where m = dy / dx.
+//
+// We scan the major axis coordinate (the one that increases faster) and find the minor one from the line equation.
+// If the resulting value has a fractional part it means the line fragment sits in 2 adjacent dot boxes.
+// We render the dot that has the largest fragment, e.g. round the minor coordinate.
+// If the fraction is exactly 0.5 then both boxes have equal fragment sizes, in which case we opt to render both.
+//
+// All of that is done in exact integer math: with D = 2 * dx and N(x) = 2 * (x - x1) * dy + dx
+// the rounded minor coordinate is y1 + floor(N / D) and the tie case is N mod D == 0.
+// Stepping the major coordinate by 1 adds 2 * dy to N, which is less than D, so keeping the quotient
+// and the remainder around makes it a plain DDA.
+//
+// Major coordinate range is clipped to where the minor coordinate can produce visible dots,
+// so clipped lines cover exactly the same dots as they would without clipping.
+// Visible range is [umin, umax] x [vmin, vmax], the 'steep' flag means y is the major axis
+// and coordinates are swapped on output.
+static void scan_line_generic(struct vtr_stencil_buf* sb, int64_t u0, int64_t v0, int64_t u1, int64_t v1,
+                              int64_t umin, int64_t umax, int64_t vmin, int64_t vmax, bool steep, uint16_t fgc)
+{
+    // Always scan in increasing major coordinate direction, the covered dots are the same
+    if (u0 > u1) {
+        int64_t t;
+        t = u0; u0 = u1; u1 = t;
+        t = v0; v0 = v1; v1 = t;
+    }
+
+    int64_t du = u1 - u0, dv = v1 - v0;
+    int64_t d = 2 * du;
+    assert(du > 0 && (dv < 0 ? -dv : dv) < du);
+
+    // Rounded minor coordinate at major coordinate u. Tie dots are at minor - 1 so minor == vmax + 1 is still visible.
+    #define VT_LINE_MINOR(u) (v1 + floor_div(2 * ((u) - u1) * dv + du, d))
+
+    int64_t ufirst = MAX(u0, umin);
+    int64_t ulast = MIN(u1, umax);
+    if (ufirst > ulast) {
+        return;
+    }
+
+    // Minor coordinate is monotonic so binary search for the first and last major coordinates
+    // where it is in [vmin, vmax + 1].
+    int64_t lo = ufirst, hi = ulast + 1;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        int64_t v = VT_LINE_MINOR(mid);
+        if (dv >= 0 ? v >= vmin : v <= vmax + 1) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    ufirst = lo;
+
+    lo = ufirst - 1;
+    hi = ulast;
+    while (lo < hi) {
+        int64_t mid = hi - (hi - lo) / 2;
+        int64_t v = VT_LINE_MINOR(mid);
+        if (dv >= 0 ? v <= vmax + 1 : v >= vmin) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    ulast = lo;
+
+    if (ufirst > ulast) {
+        return;
+    }
+
+    int64_t n = 2 * (ufirst - u1) * dv + du;
+    int64_t q = floor_div(n, d);
+    int64_t r = n - q * d;
+
+    #undef VT_LINE_MINOR
+
+    for (int64_t u = ufirst; u <= ulast; u++) {
+        int64_t v = v1 + q;
+        if (v >= vmin && v <= vmax) {
+            if (steep) {
+                render_dot(sb, v, u, fgc);
+            } else {
+                render_dot(sb, u, v, fgc);
+            }
+        }
+
+        if (r == 0 && v - 1 >= vmin && v - 1 <= vmax) {
+            if (steep) {
+                render_dot(sb, v - 1, u, fgc);
+            } else {
+                render_dot(sb, u, v - 1, fgc);
+            }
+        }
+
+        r += 2 * dv;
+        if (r >= d) {
+            r -= d;
+            q++;
+        } else if (r < 0) {
+            r += d;
+            q--;
+        }
+    }
+}
+
+// Scan a line clipping it to the stencil dimensions and clip rows.
+static void scan_line(struct vtr_stencil_buf* sb, int64_t x0, int64_t y0, int64_t x1, int64_t y1, uint16_t fgc)
+{
+    int64_t xmax = sb->xdots - 1;
+    int64_t ymin = sb->clip_y0;
+    int64_t ymax = sb->clip_y1 - 1;
+    int64_t dx = x1 - x0, dy = y1 - y0;
+
+    // Trivially reject lines that are entirely on one side of the canvas
+    if (ymin > ymax || (x0 < 0 && x1 < 0) || (x0 > xmax && x1 > xmax) || (y0 < ymin && y1 < ymin) || (y0 > ymax && y1 > ymax)) {
+        return;
+    }
+
+    if (dy == 0) {
+        fill_hspan(sb, y0, MAX(MIN(x0, x1), 0), MIN(MAX(x0, x1), xmax), fgc);
+    } else if (dx == 0) {
+        fill_vspan(sb, x0, MAX(MIN(y0, y1), ymin), MIN(MAX(y0, y1), ymax), fgc);
+    } else if (dx == dy || dx == -dy) {
+        // Diagonal, find the range of steps from (x0, y0) that is inside the canvas on both axes
+        int64_t hdir = (dx > 0 ? 1 : -1);
+        int64_t vdir = (dy > 0 ? 1 : -1);
+        int64_t nsteps = (dx > 0 ? dx : -dx);
+        int64_t first = 0, last = nsteps;
+
+        first = MAX(first, (hdir > 0 ? -x0 : x0 - xmax));
+        last = MIN(last, (hdir > 0 ? xmax - x0 : x0));
+        first = MAX(first, (vdir > 0 ? ymin - y0 : y0 - ymax));
+        last = MIN(last, (vdir > 0 ? ymax - y0 : y0 - ymin));
+
+        for (int64_t t = first; t <= last; t++) {
+            render_dot(sb, x0 + t * hdir, y0 + t * vdir, fgc);
+        }
+    } else if ((dy < 0 ? -dy : dy) < (dx < 0 ? -dx : dx)) {
+        scan_line_generic(sb, x0, y0, x1, y1, 0, xmax, ymin, ymax, false, fgc);
+    } else {
+        scan_line_generic(sb, y0, x0, y1, x1, ymin, ymax, 0, xmax, true, fgc);
+    }
+}
+
+// Pull far away endpoints into the guard band and scan the line
+static void draw_line(struct vtr_stencil_buf* sb, int x0, int y0, int x1, int y1, uint16_t fgc)
+{
+    if (x0 < -VT_GUARD_BAND || x0 > VT_GUARD_BAND || y0 < -VT_GUARD_BAND || y0 > VT_GUARD_BAND ||
+        x1 < -VT_GUARD_BAND || x1 > VT_GUARD_BAND || y1 < -VT_GUARD_BAND || y1 > VT_GUARD_BAND) {
+        if (!clip_guard_band(&x0, &y0, &x1, &y1)) {
+            return;
+        }
+    }
+
+    scan_line(sb, x0, y0, x1, y1, fgc);
+}
+
+void vtr_scan_line(struct vtr_canvas* vt, int x0, int y0, int x1, int y1)
+{
+    vtr_scan_linec(vt, x0, y0, x1, y1, VTR_COLOR_DEFAULT);
+}
+
+void vtr_scan_linec(struct vtr_canvas* vt, int x0, int y0, int x1, int y1, enum vtr_color fgc)
+{
+    vtr_scan_linex(vt, x0, y0, x1, y1, fgc);
+}
+
+void vtr_scan_linex(struct vtr_canvas* vt, int x0, int y0, int x1, int y1, uint32_t color)
+{
+    STAT_ADD(&vt->cmds, nprims[VT_CMD_LINE], 1);
+
+    uint16_t fgc = color_id(vt, color);
+    if (vt->pool) {
+        record_line(vt, x0, y0, x1, y1, fgc);
+    } else {
+        draw_line(vt->cur_sb, x0, y0, x1, y1, fgc);
+    }
+}
+
+static void scan_lines(struct vtr_canvas* vt, size_t nlines, const struct vtr_line* lines, struct vt_batch_colors* bc)
+{
+    assert(vt);
+    assert(lines || nlines == 0);
+
+    STAT_ADD(&vt->cmds, nprims[VT_CMD_LINE], nlines);
+
+    struct vtr_stencil_buf* sb = vt->cur_sb;
+    for (size_t i = 0; i < nlines; i++) {
+        const struct vtr_line* l = &lines[i];
+        uint16_t fgc = batch_color_id(vt, bc, i);
+
+        if (vt->pool) {
+            record_line(vt, l->p0.x, l->p0.y, l->p1.x, l->p1.y, fgc);
+        } else {
+            draw_line(sb, l->p0.x, l->p0.y, l->p1.x, l->p1.y, fgc);
+        }
+    }
+}
+
+void vtr_scan_lines(struct vtr_canvas* vt, size_t nlines, const struct vtr_line* lines,
+                    const enum vtr_color* colors, enum vtr_color fgc)
+{
+    struct vt_batch_colors bc;
+    init_batch_colors(vt, &bc, colors, NULL, fgc);
+    scan_lines(vt, nlines, lines, &bc);
+}
+
+void vtr_scan_linesx(struct vtr_canvas* vt, size_t nlines, const struct vtr_line* lines,
+                     const uint32_t* colors, uint32_t color)
+{
+    struct vt_batch_colors bc;
+    init_batch_colors(vt, &bc, NULL, colors, color);
+    scan_lines(vt, nlines, lines, &bc);
+}
+
+// Polygon edge in the edge table.
+// Covers scanlines [ytop, ybot) and its x intercept at the current scanline is xq + xr / dy, 0 <= xr < dy.
+struct vtr_edge
+{
+    int64_t ytop;
+    int64_t ybot;
+    int64_t xq;
+    int64_t xr;
+    int64_t dy;
+    int64_t stepq;
+    int64_t stepr;
+    int winding;
+};
+
+// Edge tables of small polygons live on stack
+#define VT_POLY_STACK_EDGES 32
+
+static int compare_edge_ytop(const void* a, const void* b)
+{
+    const struct vtr_edge* ea = a;
+    const struct vtr_edge* eb = b;
+    return (ea->ytop > eb->ytop) - (ea->ytop < eb->ytop);
+}
+
+static inline bool edge_x_less(const struct vtr_edge* a, const struct vtr_edge* b)
+{
+    if (a->xq != b->xq) {
+        return a->xq < b->xq;
+    }
+
+    // Fractions are only compared to order intercepts within the same dot, that doesn't need to be exact
+    return (double)a->xr * b->dy < (double)b->xr * a->dy;
+}
+
+// Set up an edge intercept at scanline y, which is in [ytop, ybot)
+static void edge_start(struct vtr_edge* e, int64_t x, int64_t dx, int64_t y)
+{
+    int64_t n;
+    if (__builtin_mul_overflow(y - e->ytop, dx, &n)) {
+        // Only possible with extremely long edges, the intercept fraction doesn't matter much there
+        double xf = x + (double)(y - e->ytop) * dx / e->dy;
+        e->xq = (int64_t)floor(xf);
+        e->xr = (int64_t)((xf - e->xq) * e->dy);
+        e->xr = CLAMP(e->xr, 0, e->dy - 1);
+    } else {
+        e->xq = x + floor_div(n, e->dy);
+        e->xr = n - floor_div(n, e->dy) * e->dy;
+    }
+}
+
+int vtr_trace_poly(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vlist)
+{
+    return vtr_trace_polyc(vt, nvertices, vlist, VTR_COLOR_DEFAULT);
+}
+
+int vtr_trace_polyc(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vlist, enum vtr_color fgc)
+{
+    return vtr_trace_poly_rule(vt, nvertices, vlist, fgc, VTR_FILL_NONZERO);
+}
+
+// Edge table storage, small polygons use stack buffers provided by the caller
+struct vtr_edge_storage
+{
+    struct vtr_edge* edges;
+    struct vtr_edge** active;
+    size_t cap;
+    bool on_heap;
+};
+
+static void free_edge_storage(struct vtr_edge_storage* st)
+{
+    if (st->on_heap) {
+        free(st->edges);
+        free(st->active);
+    }
+}
+
+// Make sure the storage fits polygons of up to nvertices
+static int reserve_edge_storage(struct vtr_edge_storage* st, size_t nvertices)
+{
+    if (nvertices <= st->cap) {
+        return 0;
+    }
+
+    struct vtr_edge* edges = malloc(nvertices * sizeof(*edges));
+    struct vtr_edge** active = malloc(nvertices * sizeof(*active));
+    if (!edges || !active) {
+        free(edges);
+        free(active);
+        return -ENOMEM;
+    }
+
+    free_edge_storage(st);
+    st->edges = edges;
+    st->active = active;
+    st->cap = nvertices;
+    st->on_heap = true;
+
+    return 0;
+}
+
+// Fill a polygon within the stencil clip rows, edge table storage has to fit nvertices already.
+static void trace_poly(struct vtr_stencil_buf* sb, size_t nvertices, const struct vtr_vertex* vlist,
+                       uint16_t fgc, enum vtr_fill_rule rule, struct vtr_edge_storage* st)
+{
+    if (nvertices == 0) {
+        return;
+    }
+
+    if (nvertices == 1) {
+        draw_dot(sb, vlist[0].x, vlist[0].y, fgc);
+        return;
+    }
+
+    if (nvertices == 2) {
+        draw_line(sb, vlist[0].x, vlist[0].y, vlist[1].x, vlist[1].y, fgc);
+        return;
+    }
+
+    assert(nvertices >= 3);
+
+    assert(st->cap >= nvertices);
+
+    struct vtr_edge* edges = st->edges;
+    struct vtr_edge** active = st->active;
+    int64_t xmax = sb->xdots - 1;
+    int64_t ymin = sb->clip_y0;
+    int64_t ymax = sb->clip_y1 - 1;
+
+    // Polygon interior is sampled at dot centers, so its outline has to be traced separately
+    // for the polygon to include it the same way lines do.
+    int64_t pymin = INT64_MAX, pymax = INT64_MIN;
+    for (size_t i = 0; i < nvertices; i++) {
+        struct vtr_vertex a = vlist[i];
+        struct vtr_vertex b = (i + 1 == nvertices ? vlist[0] : vlist[i + 1]);
+        draw_line(sb, a.x, a.y, b.x, b.y, fgc);
+
+        pymin = MIN(pymin, a.y);
+        pymax = MAX(pymax, a.y);
+    }
+
+    // Clip bounding box
+    if (pymax < ymin || pymin > ymax) {
+        return;
+    }
+
+    int64_t yfirst = MAX(pymin, ymin);
+    int64_t ylast = MIN(pymax, ymax);
+
+    // Build the edge table out of non-horizontal edges that cross visible scanlines
+    size_t nedges = 0;
+    for (size_t i = 0; i < nvertices; i++) {
+        struct vtr_vertex a = vlist[i];
+        struct vtr_vertex b = (i + 1 == nvertices ? vlist[0] : vlist[i + 1]);
+        if (a.y == b.y) {
+            continue;
+        }
+
+        int winding = 1;
+        if (a.y > b.y) {
+            struct vtr_vertex t = a;
+            a = b;
+            b = t;
+            winding = -1;
+        }
+
+        if (b.y <= yfirst || a.y > ylast) {
+            continue;
+        }
+
+        struct vtr_edge* e = &edges[nedges++];
+        int64_t dx = (int64_t)b.x - a.x;
+        e->ytop = a.y;
+        e->ybot = b.y;
+        e->dy = (int64_t)b.y - a.y;
+        e->stepq = floor_div(dx, e->dy);
+        e->stepr = dx - e->stepq * e->dy;
+        e->winding = winding;
+
+        // Edges that start above the canvas are advanced to the first visible scanline right away
+        if (e->ytop < yfirst) {
+            edge_start(e, a.x, dx, yfirst);
+            e->ytop = yfirst;
+        } else {
+            e->xq = a.x;
+            e->xr = 0;
+        }
+    }
+
+    qsort(edges, nedges, sizeof(*edges), compare_edge_ytop);
+
+    size_t nactive = 0;
+    size_t nextedge = 0;
+    for (int64_t y = yfirst; y <= ylast; y++) {
+
+        // Retire finished edges and bring in new ones
+        size_t n = 0;
+        for (size_t i = 0; i < nactive; i++) {
+            if (active[i]->ybot > y) {
+                active[n++] = active[i];
+            }
+        }
+        nactive = n;
+
+        while (nextedge < nedges && edges[nextedge].ytop <= y) {
+            active[nactive++] = &edges[nextedge++];
+        }
+
+        if (nactive == 0) {
+            if (nextedge == nedges) {
+                break;
+            }
+            continue;
+        }
+
+        // Active list stays mostly sorted between scanlines, only crossing edges swap places
+        for (size_t i = 1; i < nactive; i++) {
+            struct vtr_edge* e = active[i];
+            size_t j = i;
+            for (; j > 0 && edge_x_less(e, active[j - 1]); j--) {
+                active[j] = active[j - 1];
+            }
+            active[j] = e;
+        }
+
+        // Fill dots whose centers are inside the polygon between consecutive intercepts
+        int winding = 0;
+        for (size_t i = 0; i + 1 < nactive; i++) {
+            winding += active[i]->winding;
+
+            bool inside = (rule == VTR_FILL_NONZERO ? winding != 0 : (winding & 1) != 0);
+            if (!inside) {
+                continue;
+            }
+
+            int64_t xl = active[i]->xq + (active[i]->xr != 0);
+            int64_t xr = active[i + 1]->xq;
+            xl = MAX(xl, 0);
+            xr = MIN(xr, xmax);
+            if (xl <= xr) {
+                fill_hspan(sb, y, xl, xr, fgc);
+            }
+        }
+
+        // Step intercepts to the next scanline
+        for (size_t i = 0; i < nactive; i++) {
+            struct vtr_edge* e = active[i];
+            e->xq += e->stepq;
+            e->xr += e->stepr;
+            if (e->xr >= e->dy) {
+                e->xr -= e->dy;
+                e->xq++;
+            }
+        }
+    }
+}
+
+// Fill a polygon with its own edge table storage
+static int draw_poly(struct vtr_stencil_buf* sb, size_t nvertices, const struct vtr_vertex* vlist,
+                     uint16_t fgc, enum vtr_fill_rule rule)
+{
+    struct vtr_edge edgebuf[VT_POLY_STACK_EDGES];
+    struct vtr_edge* activebuf[VT_POLY_STACK_EDGES];
+    struct vtr_edge_storage st = { edgebuf, activebuf, VT_POLY_STACK_EDGES, false };
+
+    int error = reserve_edge_storage(&st, nvertices);
+    if (error) {
+        return error;
+    }
+
+    trace_poly(sb, nvertices, vlist, fgc, rule, &st);
+    free_edge_storage(&st);
+
+    return 0;
+}
+
+int vtr_trace_poly_rule(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vlist,
+                        enum vtr_color fgc, enum vtr_fill_rule rule)
+{
+    return vtr_trace_polyx(vt, nvertices, vlist, fgc, rule);
+}
+
+int vtr_trace_polyx(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vlist,
+                    uint32_t color, enum vtr_fill_rule rule)
+{
+    assert(vt);
+    assert(vlist);
+
+    if (rule != VTR_FILL_EVENODD && rule != VTR_FILL_NONZERO) {
+        return -EINVAL;
+    }
+
+    STAT_ADD(&vt->cmds, nprims[VT_CMD_POLY], 1);
+
+    uint16_t fgc = color_id(vt, color);
+    if (vt->pool) {
+        record_poly(vt, nvertices, vlist, fgc, rule);
+        return 0;
+    }
+
+    return draw_poly(vt->cur_sb, nvertices, vlist, fgc, rule);
+}
+
+static int trace_polys(struct vtr_canvas* vt, size_t npolys, const size_t* nvertices, const struct vtr_vertex* vlist,
+                       struct vt_batch_colors* bc, enum vtr_fill_rule rule)
+{
+    assert(vt);
+    assert((nvertices && vlist) || npolys == 0);
+
+    if (rule != VTR_FILL_EVENODD && rule != VTR_FILL_NONZERO) {
+        return -EINVAL;
+    }
+
+    STAT_ADD(&vt->cmds, nprims[VT_CMD_POLY], npolys);
+
+    if (vt->pool) {
+        for (size_t i = 0; i < npolys; i++) {
+            record_poly(vt, nvertices[i], vlist, batch_color_id(vt, bc, i), rule);
+            vlist += nvertices[i];
+        }
+        return 0;
+    }
+
+    size_t maxvertices = 0;
+    for (size_t i = 0; i < npolys; i++) {
+        maxvertices = MAX(maxvertices, nvertices[i]);
+    }
+
+    // Edge table storage is shared by the whole batch
+    struct vtr_edge edgebuf[VT_POLY_STACK_EDGES];
+    struct vtr_edge* activebuf[VT_POLY_STACK_EDGES];
+    struct vtr_edge_storage st = { edgebuf, activebuf, VT_POLY_STACK_EDGES, false };
+
+    int error = reserve_edge_storage(&st, maxvertices);
+    if (error) {
+        return error;
+    }
+
+    for (size_t i = 0; i < npolys; i++) {
+        trace_poly(vt->cur_sb, nvertices[i], vlist, batch_color_id(vt, bc, i), rule, &st);
+        vlist += nvertices[i];
+    }
+
+    free_edge_storage(&st);
+
+    return 0;
+}
+
+int vtr_trace_polys(struct vtr_canvas* vt, size_t npolys, const size_t* nvertices, const struct vtr_vertex* vlist,
+                    const enum vtr_color* colors, enum vtr_color fgc, enum vtr_fill_rule rule)
+{
+    struct vt_batch_colors bc;
+    init_batch_colors(vt, &bc, colors, NULL, fgc);
+    return trace_polys(vt, npolys, nvertices, vlist, &bc, rule);
+}
+
+int vtr_trace_polysx(struct vtr_canvas* vt, size_t npolys, const size_t* nvertices, const struct vtr_vertex* vlist,
+                     const uint32_t* colors, uint32_t color, enum vtr_fill_rule rule)
+{
+    struct vt_batch_colors bc;
+    init_batch_colors(vt, &bc, NULL, colors, color);
+    return trace_polys(vt, npolys, nvertices, vlist, &bc, rule);
+}
+
+//
+// Text overlay.
+//
+// Text is decoded from UTF-8 as it is printed, into a glyph per cell, or two for a wide one. Printing a string
+// that is already there leaves the glyphs as they were, so the diff finds nothing to send, and a changed string
+// is a run of changed cells the encoder writes out with one style switch and no cursor motion in between.
+//
+
+struct vt_code_range
+{
+    uint32_t first;
+    uint32_t last;
+};
+
+// Code points that take no cell and two cells, sorted
+static const struct vt_code_range g_zero_width[] = {
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x0610, 0x061A }, { 0x064B, 0x065F },
+    { 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x2028, 0x202E }, { 0x2060, 0x206F },
+    { 0x20D0, 0x20FF }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF }, { 0xE0000, 0xE0FFF },
+};
+
+static const struct vt_code_range g_wide[] = {
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC }, { 0x23F0, 0x23F0 },
+    { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 }, { 0x267F, 0x267F },
+    { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 }, { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 },
+    { 0x26CE, 0x26CE }, { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+    { 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B }, { 0x2728, 0x2728 },
+    { 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+    { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF }, { 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 },
+    { 0x2E80, 0x303E }, { 0x3041, 0x4DBF }, { 0x4E00, 0xA4CF }, { 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 },
+    { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6F }, { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 },
+    { 0x16FE0, 0x16FE4 }, { 0x17000, 0x18CFF }, { 0x1B000, 0x1B2FF }, { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF },
+    { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F251 }, { 0x1F300, 0x1F64F }, { 0x1F680, 0x1F6FF },
+    { 0x1F7E0, 0x1F7EB }, { 0x1F900, 0x1F9FF }, { 0x1FA70, 0x1FAFF }, { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },
+};
+
+#define VT_IN_RANGES(code, ranges) in_ranges((code), (ranges), sizeof(ranges) / sizeof((ranges)[0]))
+
+static bool in_ranges(uint32_t code, const struct vt_code_range* r, size_t nranges)
+{
+    size_t lo = 0, hi = nranges;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (code < r[mid].first) {
+            hi = mid;
+        } else if (code > r[mid].last) {
+            lo = mid + 1;
+        } else {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Cells a code point takes. Control chars, combining marks and other zero width code points take none
+// and are dropped, as terminals don't agree on where they go. East Asian wide ones and emoji take two.
+static unsigned glyph_width(uint32_t code)
+{
+    if (code < 0x300) {
+        return (code < 0x20 || (code >= 0x7F && code < 0xA0) ? 0 : 1);
+    }
+
+    if (VT_IN_RANGES(code, g_zero_width)) {
+        return 0;
+    }
+
+    return (VT_IN_RANGES(code, g_wide) ? 2 : 1);
+}
+
+// Decode the UTF-8 sequence at the start of str, which is at most len bytes long, and return its length.
+// Malformed sequences decode into U+FFFD a byte at a time.
+static size_t decode_utf8(const char* str, size_t len, uint32_t* code)
+{
+    const uint8_t* s = (const uint8_t*)str;
+    size_t n = 0;
+    uint32_t c = 0;
+    uint32_t min = 0;
+
+    if (s[0] < 0x80) {
+        *code = s[0];
+        return 1;
+    } else if ((s[0] & 0xE0) == 0xC0) {
+        n = 2, c = s[0] & 0x1F, min = 0x80;
+    } else if ((s[0] & 0xF0) == 0xE0) {
+        n = 3, c = s[0] & 0x0F, min = 0x800;
+    } else if ((s[0] & 0xF8) == 0xF0) {
+        n = 4, c = s[0] & 0x07, min = 0x10000;
+    }
+
+    if (n == 0 || n > len) {
+        goto bad_seq;
+    }
+
+    for (size_t i = 1; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            goto bad_seq;
+        }
+        c = (c << 6) | (s[i] & 0x3F);
+    }
+
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)) {
+        goto bad_seq;
+    }
+
+    *code = c;
+    return n;
+
+bad_seq:
+    *code = 0xFFFD;
+    return 1;
+}
+
+// Bytes of a string that fit into ncols cells, up to what a text command holds
+static size_t text_extent(const char* str, uint16_t ncols)
+{
+    size_t pos = 0;
+    unsigned width = 0;
+
+    while (str[pos] != '\0') {
+        uint32_t code;
+        size_t len = decode_utf8(str + pos, strnlen(str + pos, 4), &code);
+        unsigned w = glyph_width(code);
+        if (width + w > ncols || pos + len > UINT16_MAX) {
+            break;
+        }
+
+        width += w;
+        pos += len;
+    }
+
+    return pos;
+}
+
+// Print len bytes of UTF-8 text in a text style within the stencil clip rows.
+// A wide glyph that doesn't fit into the row ends the text.
+static void draw_text(struct vtr_stencil_buf* sb, uint16_t row, uint16_t col, const char* str, size_t len, uint8_t style)
+{
+    uint16_t ncols = sb->xdots / VT_CELL_XDOTS;
+
+    if (row < sb->clip_y0 / VT_CELL_YDOTS || row >= sb->clip_y1 / VT_CELL_YDOTS) {
+        return;
+    }
+
+    uint32_t style_bits = (uint32_t)style << VT_GLYPH_STYLE_SHIFT;
+    for (size_t pos = 0; pos < len && col < ncols;) {
+        uint32_t code;
+        pos += decode_utf8(str + pos, len - pos, &code);
+
+        unsigned width = glyph_width(code);
+        if (width == 0) {
+            continue;
+        } else if (col + width > ncols) {
+            break;
+        }
+
+        if (width == 2) {
+            print_glyph(sb, row, col, code | VT_GLYPH_WIDE | style_bits);
+            print_glyph(sb, row, col + 1, code | VT_GLYPH_TAIL | style_bits);
+        } else {
+            print_glyph(sb, row, col, code | style_bits);
+        }
+
+        col += width;
+    }
+}
+
+int vtr_print_textx(struct vtr_canvas* vt, uint16_t row, uint16_t col, const char* str, const struct vtr_text_style* style)
+{
+    assert(vt);
+    assert(str);
+
+    if (row >= vt->nrows || col >= vt->ncols) {
+        return -EINVAL;
+    }
+
+    uint8_t id = 0;
+    if (style) {
+        id = text_style_id(vt, color_id(vt, style->fg), color_id(vt, style->bg), style->bold != 0);
+    }
+
+    STAT_ADD(&vt->cmds, nprims[VT_CMD_TEXT], 1);
+
+    size_t len = text_extent(str, vt->ncols - col);
+    if (vt->pool) {
+        record_text(vt, row, col, str, len, id);
+    } else {
+        draw_text(vt->cur_sb, row, col, str, len, id);
+    }
+
+    return 0;
+}
+
+int vtr_print_text(struct vtr_canvas* vt, uint16_t row, uint16_t col, const char* str)
+{
+    return vtr_print_textx(vt, row, col, str, NULL);
+}
+
+//
+// Sprites.
+//
+// A sprite keeps the cell masks of a polygon rasterized at every rotation and dot offset within a cell,
+// so a blit only has to OR the masks of one of them into the stencil. The rasterizer only works with
+// integer coordinates, which makes a frame drawn at an offset identical to tracing the rotated polygon there.
+//
+
+#define VT_SPRITE_OFFSETS       (VT_CELL_XDOTS * VT_CELL_YDOTS)
+#define VT_SPRITE_MAX_EXTENT    1024
+#define VT_SPRITE_MAX_ANGLES    4096
+
+// Polygon rasterized at one rotation and one offset of the origin within its cell.
+// Cell masks are nrows by ncols, starting row and col cells away from the cell of the origin.
+struct vtr_sprite_frame
+{
+    int16_t row;
+    int16_t col;
+    uint16_t nrows;
+    uint16_t ncols;
+    const uint8_t* masks;
+};
+
+struct vtr_sprite
+{
+    unsigned nangles;
+
+    // VT_SPRITE_OFFSETS frames for each rotation, indexed by the dot row and column of the origin within its cell
+    struct vtr_sprite_frame* frames;
+    uint8_t* masks;
+};
+
+static void rotate_vertices(const struct vtr_vertex* vlist, size_t nvertices, double angle, struct vtr_vertex* out)
+{
+    double cs = cos(angle);
+    double sn = sin(angle);
+
+    for (size_t i = 0; i < nvertices; i++) {
+        out[i].x = (int)lround(vlist[i].x * cs - vlist[i].y * sn);
+        out[i].y = (int)lround(vlist[i].x * sn + vlist[i].y * cs);
+    }
+}
+
+struct vtr_sprite* vtr_sprite_create(size_t nvertices, const struct vtr_vertex* vlist, unsigned nangles)
+{
+    assert(vlist || nvertices == 0);
+
+    if (nvertices == 0 || nangles == 0 || nangles > VT_SPRITE_MAX_ANGLES) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < nvertices; i++) {
+        if (vlist[i].x < -VT_SPRITE_MAX_EXTENT || vlist[i].x > VT_SPRITE_MAX_EXTENT ||
+            vlist[i].y < -VT_SPRITE_MAX_EXTENT || vlist[i].y > VT_SPRITE_MAX_EXTENT) {
+            return NULL;
+        }
+    }
+
+    struct vtr_edge edgebuf[VT_POLY_STACK_EDGES];
+    struct vtr_edge* activebuf[VT_POLY_STACK_EDGES];
+    struct vtr_edge_storage st = { edgebuf, activebuf, VT_POLY_STACK_EDGES, false };
+    struct vtr_stencil_buf sb = {0};
+    struct vtr_vertex* rotated = NULL;
+    struct vtr_vertex* shifted = NULL;
+
+    struct vtr_sprite* sprite = calloc(1, sizeof(*sprite));
+    if (!sprite) {
+        return NULL;
+    }
+
+    sprite->nangles = nangles;
+    sprite->frames = calloc((size_t)nangles * VT_SPRITE_OFFSETS, sizeof(*sprite->frames));
+    rotated = malloc((size_t)nangles * nvertices * sizeof(*rotated));
+    shifted = malloc(nvertices * sizeof(*shifted));
+    if (!sprite->frames || !rotated || !shifted || 0 != reserve_edge_storage(&st, nvertices)) {
+        goto error_out;
+    }
+
+    // Lay out the cell masks of every frame from the bounding boxes first
+    size_t nmasks = 0;
+    uint16_t maxrows = 0, maxcols = 0;
+    for (unsigned a = 0; a < nangles; a++) {
+        struct vtr_vertex* rv = rotated + (size_t)a * nvertices;
+        rotate_vertices(vlist, nvertices, 2 * M_PI * a / nangles, rv);
+
+        int xmin = INT_MAX, xmax = INT_MIN, ymin = INT_MAX, ymax = INT_MIN;
+        for (size_t i = 0; i < nvertices; i++) {
+            xmin = MIN(xmin, rv[i].x);
+            xmax = MAX(xmax, rv[i].x);
+            ymin = MIN(ymin, rv[i].y);
+            ymax = MAX(ymax, rv[i].y);
+        }
+
+        for (unsigned k = 0; k < VT_SPRITE_OFFSETS; k++) {
+            struct vtr_sprite_frame* frame = &sprite->frames[a * VT_SPRITE_OFFSETS + k];
+            int ox = k % VT_CELL_XDOTS;
+            int oy = k / VT_CELL_XDOTS;
+
+            frame->row = floor_div(ymin + oy, VT_CELL_YDOTS);
+            frame->col = floor_div(xmin + ox, VT_CELL_XDOTS);
+            frame->nrows = floor_div(ymax + oy, VT_CELL_YDOTS) - frame->row + 1;
+            frame->ncols = floor_div(xmax + ox, VT_CELL_XDOTS) - frame->col + 1;
+            maxrows = MAX(maxrows, frame->nrows);
+            maxcols = MAX(maxcols, frame->ncols);
+            nmasks += (size_t)frame->nrows * frame->ncols;
+        }
+    }
+
+    sprite->masks = malloc(nmasks);
+    if (!sprite->masks || 0 != create_stencil_buf(&sb, maxrows, maxcols)) {
+        goto error_out;
+    }
+
+    // Trace every frame with its top left cell at the stencil origin
+    uint8_t* masks = sprite->masks;
+    for (unsigned a = 0; a < nangles; a++) {
+        const struct vtr_vertex* rv = rotated + (size_t)a * nvertices;
+
+        for (unsigned k = 0; k < VT_SPRITE_OFFSETS; k++) {
+            struct vtr_sprite_frame* frame = &sprite->frames[a * VT_SPRITE_OFFSETS + k];
+            int dx = k % VT_CELL_XDOTS - frame->col * VT_CELL_XDOTS;
+            int dy = k / VT_CELL_XDOTS - frame->row * VT_CELL_YDOTS;
+
+            for (size_t i = 0; i < nvertices; i++) {
+                shifted[i].x = rv[i].x + dx;
+                shifted[i].y = rv[i].y + dy;
+            }
+
+            clear_stencil_buf(&sb);
+            trace_poly(&sb, nvertices, shifted, VTR_COLOR_DEFAULT, VTR_FILL_NONZERO, &st);
+
+            frame->masks = masks;
+            for (uint16_t row = 0; row < frame->nrows; row++) {
+                for (uint16_t col = 0; col < frame->ncols; col++) {
+                    *masks++ = cell_mask(sb.cells[(size_t)row * sb.stride + col]);
+                }
+            }
+        }
+    }
+
+    free_stencil_buf(&sb);
+    free_edge_storage(&st);
+    free(shifted);
+    free(rotated);
+
+    return sprite;
+
+error_out:
+
+    free_stencil_buf(&sb);
+    free_edge_storage(&st);
+    free(shifted);
+    free(rotated);
+    vtr_sprite_destroy(sprite);
+
+    return NULL;
+}
+
+void vtr_sprite_destroy(struct vtr_sprite* sprite)
+{
+    if (!sprite) {
+        return;
+    }
+
+    free(sprite->masks);
+    free(sprite->frames);
+    free(sprite);
+}
+
+// OR the masks of a frame into the stencil with its top left cell at (row, col), within the stencil clip rows
+static void blit_frame(struct vtr_stencil_buf* sb, const struct vtr_sprite_frame* frame, int64_t row, int64_t col, uint16_t fgc)
+{
+    int64_t first = MAX(row, sb->clip_y0 / VT_CELL_YDOTS);
+    int64_t last = MIN(row + frame->nrows, sb->clip_y1 / VT_CELL_YDOTS);
+    int64_t left = MAX(col, 0);
+    int64_t right = MIN(col + frame->ncols, sb->xdots / VT_CELL_XDOTS);
+
+    for (int64_t r = first; r < last; r++) {
+        const uint8_t* masks = frame->masks + (r - row) * frame->ncols;
+        uint32_t* cells = sb->cells + (size_t)r * sb->stride;
+
+        for (int64_t c = left; c < right; c++) {
+            uint8_t mask = masks[c - col];
+            if (mask) {
+                cells[c] = (cells[c] & ~VT_CELL_FGCOLOR_BITS) | ((uint32_t)mask << VT_CELL_MASK_SHIFT) |
+                           ((uint32_t)fgc << VT_CELL_FGCOLOR_SHIFT);
+                mark_dirty(sb, r, c);
+            }
+        }
+    }
+}
+
+void vtr_blit_sprite(struct vtr_canvas* vt, const struct vtr_sprite* sprite, int x, int y, uint32_t color)
+{
+    vtr_blit_sprite_rotated(vt, sprite, x, y, 0, color);
+}
+
+void vtr_blit_sprite_rotated(struct vtr_canvas* vt, const struct vtr_sprite* sprite, int x, int y, float angle,
+                             uint32_t color)
+{
+    assert(vt);
+    assert(sprite);
+
+    STAT_ADD(&vt->cmds, nprims[VT_CMD_SPRITE], 1);
+
+    // Nearest rotation, anything that isn't a finite angle is just drawn unrotated
+    double turns = angle / (2 * M_PI);
+    turns -= floor(turns);
+    unsigned rotation = (turns >= 0 && turns < 1 ? (unsigned)(turns * sprite->nangles + 0.5) % sprite->nangles : 0);
+
+    unsigned offset = ((unsigned)y % VT_CELL_YDOTS) * VT_CELL_XDOTS + (unsigned)x % VT_CELL_XDOTS;
+    const struct vtr_sprite_frame* frame = &sprite->frames[rotation * VT_SPRITE_OFFSETS + offset];
+    int64_t row = floor_div(y, VT_CELL_YDOTS) + frame->row;
+    int64_t col = floor_div(x, VT_CELL_XDOTS) + frame->col;
+
+    uint16_t fgc = color_id(vt, color);
+    if (vt->pool) {
+        record_sprite(vt, frame, row, col, fgc);
+    } else {
+        blit_frame(vt->cur_sb, frame, row, col, fgc);
+    }
+}
+
+//
+// Density mode.
+//
+// Samples are counted per dot into a plane of saturating 16-bit counters laid out cell by cell, so the 8 counters
+// of a cell share 16 bytes: neighbouring samples hit the same cache lines and resolving a cell reads one block.
+// Each chunk of samples is first turned into counter offsets in a branchless pass the compiler can vectorize,
+// clipped samples going to a spare counter past the plane, and only then are the counters incremented.
+// Samples are not sorted into tiles first: the plane of a terminal sized canvas fits in L2, and binning a batch
+// by row band before counting it took 3-4 times as long as counting it in place.
+// At swap the counts are mapped to dots through a 2x4 ordered dither matrix and to cell colors through
+// the ramp, both compared against count thresholds worked out once per frame.
+//
+
+#define VT_DENSITY_CELL_DOTS    (VT_CELL_XDOTS * VT_CELL_YDOTS)
+#define VT_DENSITY_CHUNK        1024
+#define VT_DENSITY_MAX_COLORS   256
+
+// Dither rank of each dot within a cell, by dot row and column. A dot of rank r is lit above r/8 coverage.
+static const uint8_t g_density_ranks[VT_CELL_YDOTS][VT_CELL_XDOTS] = {
+    { 0, 2 }, { 4, 6 }, { 3, 1 }, { 7, 5 }
+};
+
+struct vtr_density_plane
+{
+    // VT_DENSITY_CELL_DOTS counters per cell in row-major dot order, ncols cells per row,
+    // followed by the spare one clipped samples are counted into
+    uint16_t* counts;
+    uint16_t nrows;
+    uint16_t ncols;
+
+    // Cell rows [first, last) that may hold samples
+    uint16_t first;
+    uint16_t last;
+
+    enum vtr_density_scale scale;
+    uint32_t full;
+
+    // Color ids of the ramp, from the sparsest cells to the densest ones
+    uint16_t* ramp;
+    size_t ncolors;
+};
+
+// (Re)allocate cleared counters for a canvas of rows by cols cells, dropping any samples
+static bool alloc_density_counts(struct vtr_density_plane* d, uint16_t rows, uint16_t cols)
+{
+    size_t ncounts = (size_t)rows * cols * VT_DENSITY_CELL_DOTS;
+    uint16_t* counts = calloc(ncounts + 1, sizeof(*counts));
+    if (!counts) {
+        return false;
+    }
+
+    free(d->counts);
+    d->counts = counts;
+    d->nrows = rows;
+    d->ncols = cols;
+    d->first = rows;
+    d->last = 0;
+
+    return true;
+}
+
+static void destroy_density(struct vtr_canvas* vt)
+{
+    struct vtr_density_plane* d = vt->density;
+    if (d) {
+        free(d->counts);
+        free(d->ramp);
+        free(d);
+        vt->density = NULL;
+    }
+}
+
+int vtr_set_density(struct vtr_canvas* vt, const struct vtr_density* density)
+{
+    assert(vt);
+
+    if (vt->layer) {
+        return -EINVAL;
+    }
+
+    if (!density) {
+        destroy_density(vt);
+        return 0;
+    }
+
+    if ((density->scale != VTR_DENSITY_LINEAR && density->scale != VTR_DENSITY_LOG) ||
+        density->ncolors > VT_DENSITY_MAX_COLORS || (density->ncolors > 0 && !density->colors)) {
+        return -EINVAL;
+    }
+
+    struct vtr_density_plane* d = vt->density;
+    uint16_t* ramp = malloc(MAX(density->ncolors, 1) * sizeof(*ramp));
+    if (!ramp) {
+        goto error_out;
+    }
+
+    // Samples accumulated so far are kept when only the mapping changes
+    if (!d) {
+        d = calloc(1, sizeof(*d));
+        if (!d || !alloc_density_counts(d, vt->nrows, vt->ncols)) {
+            goto error_out;
+        }
+    }
+
+    for (size_t i = 0; i < density->ncolors; i++) {
+        ramp[i] = color_id(vt, density->colors[i]);
+    }
+
+    free(d->ramp);
+    d->ramp = ramp;
+    d->ncolors = density->ncolors;
+    d->scale = density->scale;
+    d->full = MIN(density->full, UINT16_MAX);
+    vt->density = d;
+
+    return 0;
+
+error_out:
+
+    if (d != vt->density) {
+        free(d);
+    }
+    free(ramp);
+
+    return -ENOMEM;
+}
+
+int vtr_accumulate_dots(struct vtr_canvas* vt, size_t ndots, const struct vtr_vertex* dots)
+{
+    assert(vt);
+    assert(dots || ndots == 0);
+
+    struct vtr_density_plane* d = vt->density;
+    if (!d) {
+        return -EINVAL;
+    }
+
+    // Samples taken before a resize are dropped, they wouldn't match the cells anymore
+    if ((d->nrows != vt->nrows || d->ncols != vt->ncols) && !alloc_density_counts(d, vt->nrows, vt->ncols)) {
+        return -ENOMEM;
+    }
+
+    STAT_ADD(&vt->cmds, nsamples, ndots);
+
+    uint32_t offsets[VT_DENSITY_CHUNK];
+    unsigned xdots = vt->xdots;
+    unsigned ydots = vt->ydots;
+    uint32_t rowlen = (uint32_t)d->ncols * VT_DENSITY_CELL_DOTS;
+    uint32_t spare = rowlen * d->nrows;
+    uint32_t lo = spare;
+    uint32_t hi = 0;
+
+    for (size_t base = 0; base < ndots; base += VT_DENSITY_CHUNK) {
+        const struct vtr_vertex* chunk = dots + base;
+        size_t n = MIN(ndots - base, (size_t)VT_DENSITY_CHUNK);
+
+        // Negative coordinates wrap around to huge unsigned values so this is the full point test
+        for (size_t i = 0; i < n; i++) {
+            unsigned x = (unsigned)chunk[i].x;
+            unsigned y = (unsigned)chunk[i].y;
+            uint32_t offset = (y >> VT_CELL_YDOTS_SHIFT) * rowlen + (x >> VT_CELL_XDOTS_SHIFT) * VT_DENSITY_CELL_DOTS +
+                              (y & (VT_CELL_YDOTS - 1)) * VT_CELL_XDOTS + (x & (VT_CELL_XDOTS - 1));
+            bool inside = (x < xdots && y < ydots);
+            offsets[i] = (inside ? offset : spare);
+            lo = MIN(lo, offsets[i]);
+            hi = MAX(hi, (inside ? offset : 0));
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            uint16_t* count = &d->counts[offsets[i]];
+            *count += (*count != UINT16_MAX);
+        }
+    }
+
+    if (lo < spare) {
+        d->first = MIN(d->first, lo / rowlen);
+        d->last = MAX(d->last, hi / rowlen + 1);
+    }
+
+    return 0;
+}
+
+// Smallest count that maps to a coverage of more than num / den, times weight and rounded down,
+// so a count, or a sum of weight counts, is above that coverage if it exceeds the result.
+static uint32_t density_threshold(enum vtr_density_scale scale, uint32_t full, size_t num, size_t den, uint32_t weight)
+{
+    if (scale == VTR_DENSITY_LOG) {
+        return (uint32_t)floor(weight * expm1(log1p(full) * num / den));
+    }
+
+    return (uint32_t)((uint64_t)weight * full * num / den);
+}
+
+// Map the counts of rows [first, last) of the density plane to the dots and colors of a stencil with matching dimensions.
+// Cells that are drawn into already keep their color.
+static void map_density(const struct vtr_density_plane* d, struct vtr_stencil_buf* sb)
+{
+    size_t rowlen = (size_t)d->ncols * VT_DENSITY_CELL_DOTS;
+    const uint16_t* counts = d->counts + d->first * rowlen;
+    size_t ncounts = (d->last - d->first) * rowlen;
+
+    // Densest dot of the frame is the full coverage unless it was given
+    uint32_t full = d->full;
+    if (!full) {
+        uint16_t maxcount = 0;
+        for (size_t i = 0; i < ncounts; i++) {
+            maxcount = MAX(maxcount, counts[i]);
+        }
+        full = maxcount;
+    }
+
+    if (!full) {
+        return;
+    }
+
+    // Thresholds and mask bits by dot, in counter order
+    uint32_t dot_thresholds[VT_DENSITY_CELL_DOTS];
+    uint8_t dot_bits[VT_DENSITY_CELL_DOTS];
+    for (size_t k = 0; k < VT_DENSITY_CELL_DOTS; k++) {
+        unsigned x = k % VT_CELL_XDOTS;
+        unsigned y = k / VT_CELL_XDOTS;
+        dot_thresholds[k] = density_threshold(d->scale, full, g_density_ranks[y][x], VT_DENSITY_CELL_DOTS, 1);
+        dot_bits[k] = g_dot_bits[y][x];
+    }
+
+    // Cells take ramp color i above the coverage of i / ncolors by their mean count, compared as sums
+    uint32_t color_thresholds[VT_DENSITY_MAX_COLORS];
+    for (size_t i = 0; i < d->ncolors; i++) {
+        color_thresholds[i] = density_threshold(d->scale, full, i, d->ncolors, VT_DENSITY_CELL_DOTS);
+    }
+
+    for (uint16_t row = d->first; row < d->last; row++) {
+        const uint16_t* rowcounts = d->counts + row * rowlen;
+        uint32_t* cells = sb->cells + (size_t)row * sb->stride;
+
+        for (uint16_t col = 0; col < d->ncols; col++) {
+            const uint16_t* cellcounts = rowcounts + (size_t)col * VT_DENSITY_CELL_DOTS;
+            uint64_t block[2];
+            memcpy(block, cellcounts, sizeof(block));
+            if (!(block[0] | block[1])) {
+                continue;
+            }
+
+            uint32_t sum = 0;
+            uint8_t mask = 0;
+            for (size_t k = 0; k < VT_DENSITY_CELL_DOTS; k++) {
+                sum += cellcounts[k];
+                mask |= (cellcounts[k] > dot_thresholds[k] ? dot_bits[k] : 0);
+            }
+
+            if (!mask) {
+                continue;
+            }
+
+            // Last ramp color the sum is above, the thresholds never decrease
+            size_t lo = 0;
+            size_t hi = d->ncolors;
+            while (hi - lo > 1) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (sum > color_thresholds[mid]) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+
+            uint32_t fgc = (d->ncolors ? d->ramp[lo] : VTR_COLOR_DEFAULT);
+            uint32_t cell = cells[col];
+            if (!cell_mask(cell)) {
+                cell = (cell & ~VT_CELL_FGCOLOR_BITS) | (fgc << VT_CELL_FGCOLOR_SHIFT);
+            }
+
+            cells[col] = cell | ((uint32_t)mask << VT_CELL_MASK_SHIFT);
+            mark_dirty(sb, row, col);
+        }
+    }
+}
+
+// Draw the samples accumulated for the frame into the back buffer and clear them for the next one
+static void resolve_density(struct vtr_canvas* vt)
+{
+    struct vtr_density_plane* d = vt->density;
+    if (!d || d->first >= d->last) {
+        return;
+    }
+
+    // Canvas could have been resized since the last samples were taken
+    if (d->nrows == vt->nrows && d->ncols == vt->ncols) {
+        map_density(d, vt->cur_sb);
+    }
+
+    size_t rowlen = (size_t)d->ncols * VT_DENSITY_CELL_DOTS;
+    memset(d->counts + d->first * rowlen, 0, (d->last - d->first) * rowlen * sizeof(*d->counts));
+    d->first = d->nrows;
+    d->last = 0;
+}
+
+//
+// Deferred rasterization.
+//
+// Draw calls are recorded into a per-frame command list. At swap every command is binned into the tiles
+// of cell rows its bounding box touches, and a worker pool rasterizes each tile through a stencil view
+// clipped to its rows, then encodes those rows into its own sequence buffer right away.
+// Tile outputs are concatenated in order, each tile starts with an absolute cursor move and color.
+//
+
+#define VT_MAX_RASTER_THREADS   256
+#define VT_TILES_PER_THREAD     4
+#define VT_MIN_CMDLIST_SIZE     ((size_t)256)
+
+struct vtr_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+
+    // Total number of threads, including the one that runs the batch
+    unsigned nthreads;
+    pthread_t* workers;
+
+    // Current batch of tasks, bumping the generation starts it
+    uint64_t generation;
+    unsigned nrunning;
+    bool quit;
+    void (*task)(struct vtr_canvas* vt, size_t idx, void* arg);
+    struct vtr_canvas* vt;
+    void* arg;
+    size_t ntasks;
+    size_t next_task;
+};
+
+struct vtr_tile
+{
+    // Cell rows [first, last)
+    uint16_t first;
+    uint16_t last;
+
+    // Indices of the commands touching the tile in recording order
+    size_t* bin;
+    size_t nbin;
+    size_t bincap;
+
+    struct vtr_edge_storage edges;
+    struct vt_encoder enc;
+};
+
+// Stencils a frame is rasterized into and diffed against, and its binned commands
+struct vtr_frame_job
+{
+    struct vtr_stencil_buf* cur_sb;
+    const struct vtr_stencil_buf* base_sb;
+    struct vtr_cmdlist* cmds;
+};
+
+static void run_pool_tasks(struct vtr_pool* pool)
+{
+    while (true) {
+        size_t idx = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED);
+        if (idx >= pool->ntasks) {
+            break;
+        }
+
+        pool->task(pool->vt, idx, pool->arg);
+    }
+}
+
+static void* pool_worker(void* arg)
+{
+    struct vtr_pool* pool = arg;
+    uint64_t generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->quit && pool->generation == generation) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+
+        if (pool->quit) {
+            break;
+        }
+
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_pool_tasks(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->nrunning == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+// Run tasks [0, ntasks) on the pool and the calling thread, returns once all of them are done.
+static void run_pool(struct vtr_pool* pool, void (*task)(struct vtr_canvas*, size_t, void*),
+                     struct vtr_canvas* vt, void* arg, size_t ntasks)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->vt = vt;
+    pool->arg = arg;
+    pool->ntasks = ntasks;
+    pool->next_task = 0;
+    pool->nrunning = pool->nthreads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_pool_tasks(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->nrunning > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void destroy_pool(struct vtr_pool* pool, unsigned nworkers)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < nworkers; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+static int create_pool(struct vtr_pool** ppool, unsigned nthreads)
+{
+    assert(nthreads > 1);
+
+    struct vtr_pool* pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return -ENOMEM;
+    }
+
+    pool->workers = calloc(nthreads - 1, sizeof(*pool->workers));
+    if (!pool->workers) {
+        free(pool);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->nthreads = nthreads;
+
+    for (unsigned i = 0; i < nthreads - 1; i++) {
+        int error = pthread_create(&pool->workers[i], NULL, pool_worker, pool);
+        if (error) {
+            destroy_pool(pool, i);
+            return -error;
+        }
+    }
+
+    *ppool = pool;
+    return 0;
+}
+
+static void clear_cmds(struct vtr_cmdlist* list)
+{
+    list->ncmds = 0;
+    list->nvertices = 0;
+    list->ntext = 0;
+    list->maxpoly = 0;
+}
+
+static void free_cmds(struct vtr_cmdlist* list)
+{
+    free(list->cmds);
+    free(list->vertices);
+    free(list->text);
+    free(list->scrolls);
+    memset(list, 0, sizeof(*list));
+}
+
+static void raster_cmd(struct vtr_stencil_buf* sb, const struct vtr_cmdlist* list, const struct vtr_cmd* cmd,
+                       struct vtr_edge_storage* st)
+{
+    switch (cmd->type) {
+    case VT_CMD_DOT:
+        draw_dot(sb, cmd->dot.x, cmd->dot.y, cmd->fgc);
+        break;
+    case VT_CMD_LINE:
+        scan_line(sb, cmd->line.x0, cmd->line.y0, cmd->line.x1, cmd->line.y1, cmd->fgc);
+        break;
+    case VT_CMD_POLY:
+        trace_poly(sb, cmd->poly.count, list->vertices + cmd->poly.first, cmd->fgc, cmd->rule, st);
+        break;
+    case VT_CMD_TEXT:
+        draw_text(sb, cmd->text.row, cmd->text.col, list->text + cmd->text.first, cmd->text.len, cmd->fgc);
+        break;
+    case VT_CMD_SPRITE:
+        blit_frame(sb, cmd->sprite.frame, cmd->sprite.row, cmd->sprite.col, cmd->fgc);
+        break;
+    }
+}
+
+// Rasterize everything recorded so far on the calling thread
+static void flush_cmds(struct vtr_canvas* vt)
+{
+    struct vtr_cmdlist* list = &vt->cmds;
+
+    struct vtr_edge edgebuf[VT_POLY_STACK_EDGES];
+    struct vtr_edge* activebuf[VT_POLY_STACK_EDGES];
+    struct vtr_edge_storage st = { edgebuf, activebuf, VT_POLY_STACK_EDGES, false };
+    bool have_edges = (0 == reserve_edge_storage(&st, list->maxpoly));
+
+    for (size_t i = 0; i < list->ncmds; i++) {
+        const struct vtr_cmd* cmd = &list->cmds[i];
+        if (cmd->type == VT_CMD_POLY && !have_edges) {
+            (void) draw_poly(vt->cur_sb, cmd->poly.count, list->vertices + cmd->poly.first, cmd->fgc, cmd->rule);
+        } else {
+            raster_cmd(vt->cur_sb, list, cmd, &st);
+        }
+    }
+
+    free_edge_storage(&st);
+    clear_cmds(list);
+}
+
+// Grow an array to fit n more elements, doubling its capacity
+static bool reserve_array(void** array, size_t* cap, size_t len, size_t n, size_t elemsize)
+{
+    if (*cap - len >= n) {
+        return true;
+    }
+
+    size_t newcap = MAX(*cap, VT_MIN_CMDLIST_SIZE);
+    while (newcap - len < n) {
+        newcap <<= 1;
+    }
+
+    void* newarray = realloc(*array, newcap * elemsize);
+    if (!newarray) {
+        return false;
+    }
+
+    *array = newarray;
+    *cap = newcap;
+    return true;
+}
+
+// Append a command covering dot rows [ymin, ymax], NULL if we're out of memory.
+// In that case everything recorded so far is rasterized right away and the caller should draw immediately too.
+static struct vtr_cmd* push_cmd(struct vtr_canvas* vt, enum vt_cmd_type type, uint16_t fgc, int64_t ymin, int64_t ymax)
+{
+    struct vtr_cmdlist* list = &vt->cmds;
+    if (!reserve_array((void**)&list->cmds, &list->cmdcap, list->ncmds, 1, sizeof(*list->cmds))) {
+        flush_cmds(vt);
+        return NULL;
+    }
+
+    struct vtr_cmd* cmd = &list->cmds[list->ncmds++];
+    cmd->type = type;
+    cmd->fgc = fgc;
+    cmd->ymin = CLAMP(ymin, 0, vt->ydots - 1);
+    cmd->ymax = CLAMP(ymax, 0, vt->ydots - 1);
+
+    return cmd;
+}
+
+static void record_dot(struct vtr_canvas* vt, int x, int y, uint16_t fgc)
+{
+    if (x < 0 || x >= vt->xdots || y < 0 || y >= vt->ydots) {
+        return;
+    }
+
+    struct vtr_cmd* cmd = push_cmd(vt, VT_CMD_DOT, fgc, y, y);
+    if (!cmd) {
+        draw_dot(vt->cur_sb, x, y, fgc);
+        return;
+    }
+
+    cmd->dot.x = x;
+    cmd->dot.y = y;
+}
+
+static void record_line(struct vtr_canvas* vt, int x0, int y0, int x1, int y1, uint16_t fgc)
+{
+    if (x0 < -VT_GUARD_BAND || x0 > VT_GUARD_BAND || y0 < -VT_GUARD_BAND || y0 > VT_GUARD_BAND ||
+        x1 < -VT_GUARD_BAND || x1 > VT_GUARD_BAND || y1 < -VT_GUARD_BAND || y1 > VT_GUARD_BAND) {
+        if (!clip_guard_band(&x0, &y0, &x1, &y1)) {
+            return;
+        }
+    }
+
+    if ((x0 < 0 && x1 < 0) || (x0 >= vt->xdots && x1 >= vt->xdots) || (y0 < 0 && y1 < 0) || (y0 >= vt->ydots && y1 >= vt->ydots)) {
+        return;
+    }
+
+    struct vtr_cmd* cmd = push_cmd(vt, VT_CMD_LINE, fgc, MIN(y0, y1), MAX(y0, y1));
+    if (!cmd) {
+        scan_line(vt->cur_sb, x0, y0, x1, y1, fgc);
+        return;
+    }
+
+    cmd->line.x0 = x0;
+    cmd->line.y0 = y0;
+    cmd->line.x1 = x1;
+    cmd->line.y1 = y1;
+}
+
+static void record_poly(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vlist,
+                        uint16_t fgc, enum vtr_fill_rule rule)
+{
+    if (nvertices == 0) {
+        return;
+    }
+
+    int64_t xmin = INT64_MAX, xmax = INT64_MIN, ymin = INT64_MAX, ymax = INT64_MIN;
+    for (size_t i = 0; i < nvertices; i++) {
+        xmin = MIN(xmin, vlist[i].x);
+        xmax = MAX(xmax, vlist[i].x);
+        ymin = MIN(ymin, vlist[i].y);
+        ymax = MAX(ymax, vlist[i].y);
+    }
+
+    if (xmax < 0 || xmin >= vt->xdots || ymax < 0 || ymin >= vt->ydots) {
+        return;
+    }
+
+    struct vtr_cmdlist* list = &vt->cmds;
+    if (!reserve_array((void**)&list->vertices, &list->vertexcap, list->nvertices, nvertices, sizeof(*list->vertices))) {
+        flush_cmds(vt);
+        (void) draw_poly(vt->cur_sb, nvertices, vlist, fgc, rule);
+        return;
+    }
+
+    struct vtr_cmd* cmd = push_cmd(vt, VT_CMD_POLY, fgc, ymin, ymax);
+    if (!cmd) {
+        (void) draw_poly(vt->cur_sb, nvertices, vlist, fgc, rule);
+        return;
+    }
+
+    cmd->rule = rule;
+    cmd->poly.first = list->nvertices;
+    cmd->poly.count = nvertices;
+
+    memcpy(list->vertices + list->nvertices, vlist, nvertices * sizeof(*vlist));
+    list->nvertices += nvertices;
+    list->maxpoly = MAX(list->maxpoly, nvertices);
+}
+
+// Text commands keep their style id in place of a color
+static void record_text(struct vtr_canvas* vt, uint16_t row, uint16_t col, const char* str, size_t len, uint8_t style)
+{
+    if (len == 0) {
+        return;
+    }
+
+    struct vtr_cmdlist* list = &vt->cmds;
+    if (!reserve_array((void**)&list->text, &list->textcap, list->ntext, len, sizeof(*list->text))) {
+        flush_cmds(vt);
+        draw_text(vt->cur_sb, row, col, str, len, style);
+        return;
+    }
+
+    struct vtr_cmd* cmd = push_cmd(vt, VT_CMD_TEXT, style, row * VT_CELL_YDOTS, row * VT_CELL_YDOTS + VT_CELL_YDOTS - 1);
+    if (!cmd) {
+        draw_text(vt->cur_sb, row, col, str, len, style);
+        return;
+    }
+
+    cmd->text.row = row;
+    cmd->text.col = col;
+    cmd->text.len = len;
+    cmd->text.first = list->ntext;
+
+    memcpy(list->text + list->ntext, str, len);
+    list->ntext += len;
+}
+
+static void record_sprite(struct vtr_canvas* vt, const struct vtr_sprite_frame* frame, int64_t row, int64_t col, uint16_t fgc)
+{
+    if (row + frame->nrows <= 0 || row >= vt->nrows || col + frame->ncols <= 0 || col >= vt->ncols) {
+        return;
+    }
+
+    struct vtr_cmd* cmd = push_cmd(vt, VT_CMD_SPRITE, fgc, row * VT_CELL_YDOTS, (row + frame->nrows) * VT_CELL_YDOTS - 1);
+    if (!cmd) {
+        blit_frame(vt->cur_sb, frame, row, col, fgc);
+        return;
+    }
+
+    cmd->sprite.frame = frame;
+    cmd->sprite.row = row;
+    cmd->sprite.col = col;
+}
+
+// Split the canvas into tiles and bin recorded commands into them by their bounding rows.
+static int bin_cmds(struct vtr_canvas* vt)
+{
+    // A few tiles per thread so that unevenly loaded tiles balance out
+    size_t ntiles = MIN((size_t)vt->nrows, (size_t)vt->pool->nthreads * VT_TILES_PER_THREAD);
+    uint16_t tile_rows = (ntiles > 0 ? (vt->nrows + ntiles - 1) / ntiles : 1);
+    ntiles = (vt->nrows + tile_rows - 1) / tile_rows;
+
+    if (ntiles > vt->tilecap) {
+        struct vtr_tile* tiles = realloc(vt->tiles, ntiles * sizeof(*tiles));
+        if (!tiles) {
+            return -ENOMEM;
+        }
+
+        for (size_t i = vt->tilecap; i < ntiles; i++) {
+            memset(&tiles[i], 0, sizeof(tiles[i]));
+            tiles[i].edges.on_heap = true;
+        }
+
+        vt->tiles = tiles;
+        vt->tilecap = ntiles;
+    }
+
+    vt->ntiles = ntiles;
+
+    for (size_t i = 0; i < ntiles; i++) {
+        struct vtr_tile* tile = &vt->tiles[i];
+        tile->first = i * tile_rows;
+        tile->last = MIN(tile->first + tile_rows, vt->nrows);
+        tile->nbin = 0;
+
+        if (0 != reserve_edge_storage(&tile->edges, vt->cmds.maxpoly)) {
+            return -ENOMEM;
+        }
+
+        // Tile encoders are sized for their worst case too, which only changes with the canvas and color settings
+        size_t seqcap = seq_rows_bound(vt->nrows, vt->ncols, vt->ncols, tile_rows, vt->truecolor, vt->group_colors);
+        if (tile->enc.cap < seqcap) {
+            char* seq = malloc(seqcap);
+            if (!seq) {
+                return -ENOMEM;
+            }
+
+            free(tile->enc.seq);
+            tile->enc.seq = seq;
+            tile->enc.cap = seqcap;
+        }
+    }
+
+    for (size_t i = 0; i < vt->cmds.ncmds; i++) {
+        const struct vtr_cmd* cmd = &vt->cmds.cmds[i];
+        size_t first = cmd->ymin / VT_CELL_YDOTS / tile_rows;
+        size_t last = cmd->ymax / VT_CELL_YDOTS / tile_rows;
+
+        for (size_t t = first; t <= last && t < ntiles; t++) {
+            struct vtr_tile* tile = &vt->tiles[t];
+            if (!reserve_array((void**)&tile->bin, &tile->bincap, tile->nbin, 1, sizeof(*tile->bin))) {
+                return -ENOMEM;
+            }
+
+            tile->bin[tile->nbin++] = i;
+        }
+    }
+
+    return 0;
+}
+
+// Pool task: rasterize the commands binned into a tile and encode its rows
+static void render_tile(struct vtr_canvas* vt, size_t idx, void* arg)
+{
+    const struct vtr_frame_job* job = arg;
+    struct vtr_tile* tile = &vt->tiles[idx];
+
+    // Back buffer view that lets rasterizers only touch the tile rows
+    struct vtr_stencil_buf view = *job->cur_sb;
+    view.clip_y0 = tile->first * VT_CELL_YDOTS;
+    view.clip_y1 = tile->last * VT_CELL_YDOTS;
+
+    uint64_t raster_start = stat_clock_ns();
+    for (size_t i = 0; i < tile->nbin; i++) {
+        raster_cmd(&view, job->cmds, &job->cmds->cmds[tile->bin[i]], &tile->edges);
+    }
+
+    merge_layers(vt, job->cur_sb, tile->first, tile->last);
+    clip_viewport_glyphs(vt, job->cur_sb, tile->first, tile->last);
+
+    memset(&tile->enc.stats, 0, sizeof(tile->enc.stats));
+    STAT_ADD(&tile->enc.stats, raster_ns, stat_clock_ns() - raster_start);
+
+    // First tile follows the frame preamble, other ones don't know where the previous tile has left the terminal
+    tile->enc.len = 0;
+    tile->enc.next_idx = SIZE_MAX;
+    tile->enc.fgc = (idx == 0 ? VTR_COLOR_DEFAULT : VT_FGCOLOR_UNKNOWN);
+    tile->enc.bgc = VTR_COLOR_DEFAULT;
+    tile->enc.bold = false;
+    tile->enc.vp = NULL;
+    tile->enc.saved = 0;
+    encode_rows(vt, &tile->enc, job->cur_sb, job->base_sb, tile->first, tile->last, 0);
+}
+
+// Rasterize a binned command list into cur_sb, diff it against base_sb and queue the result, all in parallel tiles.
+static void encode_frame_tiles(struct vtr_canvas* vt, struct vtr_stencil_buf* cur_sb, const struct vtr_stencil_buf* base_sb,
+                               struct vtr_cmdlist* cmds)
+{
+    struct vtr_frame_job job = { cur_sb, base_sb, cmds };
+    run_pool(vt->pool, render_tile, vt, &job, vt->ntiles);
+    clear_cmds(cmds);
+
+    struct vt_encoder enc;
+    begin_frame(vt, &enc, cmds);
+    bool drawn = cmds->nscrolls > 0;
+
+    // Concatenated tiles can't take more than the whole frame, which the output queue has room for
+    for (size_t i = 0; i < vt->ntiles; i++) {
+        struct vtr_tile* tile = &vt->tiles[i];
+        size_t offset = enc.len - vt->seqlen;
+
+        memcpy(enc.seq + enc.len, tile->enc.seq, tile->enc.len);
+        enc.len += tile->enc.len;
+        enc.saved += tile->enc.saved;
+        add_frame_stats(&enc.stats, &tile->enc.stats);
+
+        if (tile->enc.next_idx != SIZE_MAX) {
+            enc.next_idx = tile->enc.next_idx;
+            enc.fgc = tile->enc.fgc;
+            drawn = true;
+        }
+
+        for (uint16_t row = tile->first; row < tile->last; row++) {
+            vt->rowends[row + 1] += offset;
+        }
+    }
+
+    encode_viewports(vt, &enc, cmds, cur_sb->stride);
+    end_frame(vt, &enc, cur_sb->stride, drawn || enc.next_idx != SIZE_MAX);
+}
+
+static void free_tiles(struct vtr_canvas* vt)
+{
+    for (size_t i = 0; i < vt->tilecap; i++) {
+        free(vt->tiles[i].bin);
+        free(vt->tiles[i].enc.seq);
+        free_edge_storage(&vt->tiles[i].edges);
+    }
+
+    free(vt->tiles);
+    vt->tiles = NULL;
+    vt->ntiles = 0;
+    vt->tilecap = 0;
+}
+
+static void destroy_deferred(struct vtr_canvas* vt)
+{
+    if (vt->pool) {
+        destroy_pool(vt->pool, vt->pool->nthreads - 1);
+        vt->pool = NULL;
+    }
+
+    free_tiles(vt);
+    free_cmds(&vt->cmds);
+}
+
+int vtr_set_raster_threads(struct vtr_canvas* vt, unsigned nthreads)
+{
+    assert(vt);
+
+    if (nthreads > VT_MAX_RASTER_THREADS || vt->layer) {
+        return -EINVAL;
+    }
+
+    nthreads = MAX(nthreads, 1);
+    if (nthreads == (vt->pool ? vt->pool->nthreads : 1)) {
+        return 0;
+    }
+
+    // Frame in flight may still be using the pool and its tiles
+    pipeline_idle(vt);
+
+    struct vtr_pool* pool = NULL;
+    if (nthreads > 1) {
+        int error = create_pool(&pool, nthreads);
+        if (error) {
+            return error;
+        }
+    }
+
+    // Whatever was recorded for the current frame is drawn before switching
+    if (vt->pool) {
+        flush_cmds(vt);
+        destroy_pool(vt->pool, vt->pool->nthreads - 1);
+        vt->pool = NULL;
+    }
+
+    if (!pool) {
+        destroy_deferred(vt);
+    }
+
+    vt->pool = pool;
+    return 0;
+}
+
+//
+// Draw contexts.
+//
+
+static void lock_layers(struct vtr_canvas* vt)
+{
+    pthread_mutex_lock(&vt->ctxlock);
+    for (struct vtr_canvas* ctx = vt->contexts; ctx; ctx = ctx->layer->next) {
+        pthread_mutex_lock(&ctx->layer->lock);
+    }
+}
+
+static void unlock_layers(struct vtr_canvas* vt)
+{
+    for (struct vtr_canvas* ctx = vt->contexts; ctx; ctx = ctx->layer->next) {
+        pthread_mutex_unlock(&ctx->layer->lock);
+    }
+    pthread_mutex_unlock(&vt->ctxlock);
+}
+
+// Merge rows [first, last) of the published context layers into a stencil, lowest priority first.
+// Dot masks are ORed, colors and text of a layer replace whatever is under them.
+// Layers have to be locked and the ones left over from before a resize are skipped.
+static void merge_layers(struct vtr_canvas* vt, struct vtr_stencil_buf* sb, uint16_t first, uint16_t last)
+{
+    for (struct vtr_canvas* ctx = vt->contexts; ctx; ctx = ctx->layer->next) {
+        const struct vtr_stencil_buf* layer = &ctx->sb[1];
+        if (!ctx->layer->published || layer->xdots != sb->xdots || layer->ydots != sb->ydots) {
+            continue;
+        }
+
+        for (uint16_t row = first; row < last; row++) {
+            struct vtr_span span = layer->dirty[row];
+            if (span.lo >= span.hi) {
+                continue;
+            }
+
+            const uint32_t* src = layer->cells + (size_t)row * layer->stride;
+            const uint32_t* glyphs = layer->glyphs + (size_t)row * layer->stride;
+            uint32_t* dst = sb->cells + (size_t)row * sb->stride;
+            for (uint16_t col = span.lo; col < span.hi; col++) {
+                uint32_t cell = src[col];
+                if (cell & VT_CELL_MASK_BITS) {
+                    dst[col] = (dst[col] & ~VT_CELL_FGCOLOR_BITS) | (cell & VT_CELL_RASTER_BITS);
+                }
+                if (cell & VT_CELL_TEXT_BITS) {
+                    print_glyph(sb, row, col, glyphs[col]);
+                }
+            }
+
+            mark_dirty(sb, row, span.lo);
+            mark_dirty(sb, row, span.hi - 1);
+        }
+    }
+}
+
+// Let contexts that outlive their canvas be destroyed safely
+static void detach_contexts(struct vtr_canvas* vt)
+{
+    pthread_mutex_lock(&vt->ctxlock);
+    for (struct vtr_canvas* ctx = vt->contexts; ctx; ctx = ctx->layer->next) {
+        ctx->layer->parent = NULL;
+    }
+    vt->contexts = NULL;
+    pthread_mutex_unlock(&vt->ctxlock);
+
+    pthread_mutex_destroy(&vt->ctxlock);
+}
+
+// (Re)allocate both context layers for given dimensions
+static int create_layers(struct vtr_canvas* ctx, uint16_t rows, uint16_t cols)
+{
+    struct vtr_stencil_buf sb1 = {0};
+    struct vtr_stencil_buf sb2 = {0};
+
+    if (0 != create_stencil_buf(&sb1, rows, cols) || 0 != create_stencil_buf(&sb2, rows, cols)) {
+        free_stencil_buf(&sb1);
+        free_stencil_buf(&sb2);
+        return -ENOMEM;
+    }
+
+    free_stencil_buf(&ctx->sb[0]);
+    free_stencil_buf(&ctx->sb[1]);
+
+    ctx->nrows = rows;
+    ctx->ncols = cols;
+    ctx->ydots = rows * VT_CELL_YDOTS;
+    ctx->xdots = cols * VT_CELL_XDOTS;
+    ctx->sb[0] = sb1;
+    ctx->sb[1] = sb2;
+    ctx->cur_sb = &ctx->sb[0];
+
+    return 0;
+}
+
+static struct vtr_canvas* create_context(struct vtr_canvas* vt, int priority, bool retained)
+{
+    assert(vt);
+
+    if (vt->layer) {
+        return NULL;
+    }
+
+    struct vtr_canvas* ctx = calloc(1, sizeof(*ctx));
+    struct vtr_layer_ctx* layer = calloc(1, sizeof(*layer));
+    if (!ctx || !layer) {
+        goto error_out;
+    }
+
+    ctx->fd = -1;
+    ctx->frame_start = SIZE_MAX;
+    ctx->layer = layer;
+    layer->parent = vt;
+    layer->priority = priority;
+    layer->retained = retained;
+    layer->invalid = retained;
+    pthread_mutex_init(&layer->lock, NULL);
+
+    pthread_mutex_lock(&vt->ctxlock);
+
+    layer->want_rows = vt->nrows;
+    layer->want_cols = vt->ncols;
+    if (0 != create_layers(ctx, vt->nrows, vt->ncols)) {
+        pthread_mutex_unlock(&vt->ctxlock);
+        pthread_mutex_destroy(&layer->lock);
+        goto error_out;
+    }
+
+    // Keep the list sorted, contexts of the same priority merge in creation order
+    struct vtr_canvas** link = &vt->contexts;
+    while (*link && (*link)->layer->priority <= priority) {
+        link = &(*link)->layer->next;
+    }
+    layer->next = *link;
+    *link = ctx;
+
+    pthread_mutex_unlock(&vt->ctxlock);
+
+    return ctx;
+
+error_out:
+
+    free(layer);
+    free(ctx);
+
+    return NULL;
+}
+
+// Swap the back layer of a context with its published one and start a blank back layer
+static int publish_layer(struct vtr_canvas* ctx)
+{
+    struct vtr_layer_ctx* layer = ctx->layer;
+
+    pthread_mutex_lock(&layer->lock);
+
+    struct vtr_stencil_buf published = ctx->sb[1];
+    ctx->sb[1] = ctx->sb[0];
+    ctx->sb[0] = published;
+    layer->published = true;
+
+    uint16_t rows = layer->want_rows;
+    uint16_t cols = layer->want_cols;
+
+    pthread_mutex_unlock(&layer->lock);
+
+    // Previously published layer is ours to draw into now
+    if (rows != ctx->nrows || cols != ctx->ncols) {
+        struct vtr_stencil_buf* back = &ctx->sb[0];
+        struct vtr_stencil_buf sb = {0};
+        if (0 != create_stencil_buf(&sb, rows, cols)) {
+            clear_stencil_buf(back);
+            return -ENOMEM;
+        }
+
+        free_stencil_buf(back);
+        *back = sb;
+        ctx->nrows = rows;
+        ctx->ncols = cols;
+        ctx->ydots = rows * VT_CELL_YDOTS;
+        ctx->xdots = cols * VT_CELL_XDOTS;
+    } else {
+        clear_stencil_buf(&ctx->sb[0]);
+    }
+
+    return 0;
+}
+
+// Publish the retained layers that were invalidated, and presumably redrawn, since the last swap.
+// Called by swaps, so the pipelined encoder thread is idle.
+static void publish_retained(struct vtr_canvas* vt)
+{
+    pthread_mutex_lock(&vt->ctxlock);
+    for (struct vtr_canvas* ctx = vt->contexts; ctx; ctx = ctx->layer->next) {
+        struct vtr_layer_ctx* layer = ctx->layer;
+        if (!layer->retained || !layer->invalid) {
+            continue;
+        }
+
+        // A layer drawn for other dimensions still needs a redraw
+        if (0 == publish_layer(ctx) && ctx->sb[1].xdots == vt->xdots && ctx->sb[1].ydots == vt->ydots) {
+            layer->invalid = false;
+        }
+    }
+    pthread_mutex_unlock(&vt->ctxlock);
+}
+
+struct vtr_canvas* vtr_context_create(struct vtr_canvas* vt, int priority)
+{
+    return create_context(vt, priority, false);
+}
+
+int vtr_context_submit(struct vtr_canvas* ctx)
+{
+    assert(ctx);
+
+    if (!ctx->layer || ctx->layer->retained || ctx->layer->viewport) {
+        return -EINVAL;
+    }
+
+    return publish_layer(ctx);
+}
+
+struct vtr_canvas* vtr_layer_create(struct vtr_canvas* vt, int priority)
+{
+    return create_context(vt, priority, true);
+}
+
+int vtr_layer_invalidate(struct vtr_canvas* layer)
+{
+    assert(layer);
+
+    if (!layer->layer || !layer->layer->retained) {
+        return -EINVAL;
+    }
+
+    // Redraw starts from a blank layer, the retained one stays on screen until the redraw is published
+    clear_stencil_buf(&layer->sb[0]);
+    layer->layer->invalid = true;
+
+    return 0;
+}
+
+int vtr_layer_needs_redraw(struct vtr_canvas* layer)
+{
+    assert(layer);
+    return (layer->layer && layer->layer->invalid);
+}
+
+void vtr_context_destroy(struct vtr_canvas* ctx)
+{
+    if (!ctx || !ctx->layer) {
+        return;
+    }
+
+    struct vtr_layer_ctx* layer = ctx->layer;
+    struct vtr_canvas* vt = layer->parent;
+
+    if (layer->viewport) {
+        destroy_viewport(ctx);
+        return;
+    }
+
+    if (vt) {
+        pthread_mutex_lock(&vt->ctxlock);
+        struct vtr_canvas** link = &vt->contexts;
+        while (*link != ctx) {
+            link = &(*link)->layer->next;
+        }
+        *link = layer->next;
+        pthread_mutex_unlock(&vt->ctxlock);
+    }
+
+    pthread_mutex_destroy(&layer->lock);
+    free_stencil_buf(&ctx->sb[0]);
+    free_stencil_buf(&ctx->sb[1]);
+    free(layer);
+    free(ctx);
+}
+
+//
+// Viewports.
+//
+
+// Clip the requested rectangle of a viewport to the canvas dimensions and reset its spans
+static void clip_viewport(struct vtr_viewport* vp, uint16_t rows, uint16_t cols)
+{
+    clip_viewport_rect(vp, rows, cols);
+
+    for (uint16_t row = 0; row < vp->nrows; row++) {
+        vp->dirty[row] = (struct vtr_span){ .lo = vp->ncols, .hi = 0 };
+        vp->text[row] = vp->dirty[row];
+    }
+}
+
+// Front plane of a viewport no longer matches the terminal, its next redraw is due right away and draws all of it
+static void invalidate_viewport(struct vtr_viewport* vp)
+{
+    invalidate_cells(&vp->planes[1], vp->row, vp->col, vp->nrows, vp->ncols);
+    vp->stale = true;
+}
+
+// Make room in the viewport planes for new canvas dimensions, keeping what is drawn into them.
+// Called with no frame in flight.
+static int reserve_viewports(struct vtr_canvas* vt, uint16_t rows, uint16_t cols)
+{
+    for (struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        struct vtr_viewport* vp = h->layer->viewport;
+
+        // Back plane only knows what is drawn into it once its spans are published
+        publish_viewport_spans(vp, vt->ncols);
+
+        int error = reserve_stencil_buf(&vp->planes[0], rows, cols);
+        if (!error) {
+            error = reserve_stencil_buf(&vp->planes[1], rows, cols);
+        }
+
+        bind_viewport(h);
+        if (error) {
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+// Follow a resize of the canvas the planes are reserved for. Viewports start over clipped to the new dimensions,
+// like the back buffers of the canvas, and are redrawn in full.
+static void resize_viewports(struct vtr_canvas* vt)
+{
+    for (struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        struct vtr_viewport* vp = h->layer->viewport;
+
+        for (size_t i = 0; i < 2; i++) {
+            clear_stencil_buf(&vp->planes[i]);
+            resize_stencil_buf(&vp->planes[i], vt->nrows, vt->ncols);
+        }
+
+        clip_viewport(vp, vt->nrows, vt->ncols);
+        bind_viewport(h);
+        invalidate_viewport(vp);
+        vp->drawn = false;
+    }
+}
+
+// Hand the viewports redrawn since the last swap to the frame it presents.
+// Called by swaps once the pipelined encoder thread is idle.
+static void schedule_viewports(struct vtr_canvas* vt)
+{
+    for (struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        struct vtr_viewport* vp = h->layer->viewport;
+        vp->presenting = vp->drawn;
+        vp->drawn = false;
+    }
+}
+
+// Let viewports that outlive their canvas be destroyed safely
+static void detach_viewports(struct vtr_canvas* vt)
+{
+    for (struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        h->layer->parent = NULL;
+    }
+    vt->viewports = NULL;
+}
+
+static void free_viewport(struct vtr_viewport* vp)
+{
+    free_stencil_buf(&vp->planes[0]);
+    free_stencil_buf(&vp->planes[1]);
+    free(vp->dirty);
+    free(vp->text);
+    free(vp);
+}
+
+struct vtr_canvas* vtr_viewport_create(struct vtr_canvas* vt, uint16_t row, uint16_t col, uint16_t rows, uint16_t cols)
+{
+    assert(vt);
+
+    if (vt->layer) {
+        return NULL;
+    }
+
+    struct vtr_canvas* h = calloc(1, sizeof(*h));
+    struct vtr_layer_ctx* layer = calloc(1, sizeof(*layer));
+    struct vtr_viewport* vp = calloc(1, sizeof(*vp));
+    if (!h || !layer || !vp) {
+        goto error_out;
+    }
+
+    vp->dirty = malloc(MAX(rows, 1) * sizeof(*vp->dirty));
+    vp->text = malloc(MAX(rows, 1) * sizeof(*vp->text));
+    if (!vp->dirty || !vp->text ||
+        0 != create_stencil_buf(&vp->planes[0], vt->nrows, vt->ncols) ||
+        0 != create_stencil_buf(&vp->planes[1], vt->nrows, vt->ncols)) {
+        goto error_out;
+    }
+
+    h->fd = -1;
+    h->frame_start = SIZE_MAX;
+    h->layer = layer;
+    layer->parent = vt;
+    layer->viewport = vp;
+    pthread_mutex_init(&layer->lock, NULL);
+
+    vp->want = (struct vtr_rect){ .row = row, .col = col, .nrows = rows, .ncols = cols };
+    clip_viewport(vp, vt->nrows, vt->ncols);
+    bind_viewport(h);
+
+    // Terminal shows the canvas there so far
+    invalidate_viewport(vp);
+
+    // Encoders of the frame in flight go through the list
+    pipeline_idle(vt);
+    struct vtr_canvas** link = &vt->viewports;
+    while (*link) {
+        link = &(*link)->layer->next;
+    }
+    *link = h;
+
+    // Output queue makes room for what the viewport can add to a frame now, rather than when presenting one
+    size_t bound = seq_frame_bound(vt->nrows, vt->ncols, vt->truecolor, vt->group_colors, 0) + VT_MIN_SEQLIST_SLACK +
+                   viewports_bound(vt, vt->nrows, vt->ncols);
+    while (vt->seqcap - (vt->seqlen - vt->seqhead) < bound) {
+        if (!extend_seq_buf(&vt->seqlist, &vt->seqcap)) {
+            *link = NULL;
+            goto error_out;
+        }
+        STAT_ADD(&vt->stats.last, seq_reallocs, 1);
+    }
+
+    return h;
+
+error_out:
+
+    if (vp) {
+        free_viewport(vp);
+    }
+    free(layer);
+    free(h);
+
+    return NULL;
+}
+
+int vtr_viewport_set_rate(struct vtr_canvas* h, unsigned hz)
+{
+    assert(h);
+
+    if (!h->layer || !h->layer->viewport) {
+        return -EINVAL;
+    }
+
+    h->layer->viewport->period_ns = (hz > 0 ? 1000000000 / hz : 0);
+
+    return 0;
+}
+
+int vtr_viewport_begin(struct vtr_canvas* h)
+{
+    assert(h);
+
+    if (!h->layer || !h->layer->viewport) {
+        return -EINVAL;
+    }
+
+    struct vtr_viewport* vp = h->layer->viewport;
+    struct vtr_canvas* vt = h->layer->parent;
+
+    // Viewport outlived its canvas
+    if (!vt) {
+        return 0;
+    }
+
+    if (vp->drawn) {
+        return 1;
+    }
+
+    uint64_t now = clock_ns();
+    if (!vp->stale && now < vp->due) {
+        return 0;
+    }
+
+    // Redraws keep to the rate without drifting, unless they fell behind by a whole period
+    vp->due = (now >= vp->due && now - vp->due < vp->period_ns ? vp->due + vp->period_ns : now + vp->period_ns);
+    vp->stale = false;
+
+    // Planes are the encoder's until the frame that presented the last redraw is out
+    if (vp->presenting) {
+        pipeline_idle(vt);
+    }
+
+    vp->drawn = true;
+
+    return 1;
+}
+
+// Unlink a viewport handle from its canvas, which draws what was under the viewport again, and free it
+static void destroy_viewport(struct vtr_canvas* h)
+{
+    struct vtr_layer_ctx* layer = h->layer;
+    struct vtr_viewport* vp = layer->viewport;
+    struct vtr_canvas* vt = layer->parent;
+
+    if (vt) {
+        pipeline_idle(vt);
+
+        struct vtr_canvas** link = &vt->viewports;
+        while (*link != h) {
+            link = &(*link)->layer->next;
+        }
+        *link = layer->next;
+
+        // Shadow of a queued frame doesn't know the canvas has to redraw there, so that frame can't be cut anymore
+        invalidate_cells(vt->front_sb, vp->row, vp->col, vp->nrows, vp->ncols);
+        vt->shadow_valid = false;
+    }
+
+    pthread_mutex_destroy(&layer->lock);
+    free_viewport(vp);
+    free(layer);
+    free(h);
+}
+
+//
+// Pipelined swaps.
+//
+
+struct vtr_pipeline
+{
+    struct vtr_canvas* vt;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+
+    // Frame handed off by the last swap and its binned draw commands, busy until the frame is written out.
+    // The encoder thread owns the output queue and the front buffer while busy.
+    struct vtr_stencil_buf* frame;
+    struct vtr_cmdlist cmds;
+    bool busy;
+    bool quit;
+
+    // Result of presenting the last frame, reported by the next swap
+    int error;
+};
+
+static void* pipeline_worker(void* arg)
+{
+    struct vtr_pipeline* pl = arg;
+    struct vtr_canvas* vt = pl->vt;
+
+    pthread_mutex_lock(&pl->lock);
+    while (true) {
+        while (!pl->quit && !pl->busy) {
+            pthread_cond_wait(&pl->wake, &pl->lock);
+        }
+
+        if (pl->quit) {
+            break;
+        }
+
+        struct vtr_stencil_buf* frame = pl->frame;
+        pthread_mutex_unlock(&pl->lock);
+
+        int error = present_frame(vt, frame, &pl->cmds);
+        if (vt->front_sb != frame) {
+            // Frame never got queued, it is the spare buffer now
+            clear_stencil_buf(frame);
+        }
+
+        pthread_mutex_lock(&pl->lock);
+        pl->error = error;
+        pl->busy = false;
+        pthread_cond_signal(&pl->done);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+// Wait until the frame in flight is written out, if there is one.
+static void pipeline_idle(struct vtr_canvas* vt)
+{
+    struct vtr_pipeline* pl = vt->pipeline;
+    if (!pl) {
+        return;
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    while (pl->busy) {
+        pthread_cond_wait(&pl->done, &pl->lock);
+    }
+    pthread_mutex_unlock(&pl->lock);
+}
+
+// Hand the back buffer off to the encoder thread and continue with the spare one.
+// Returns whatever presenting the previous frame came up with.
+static int swap_pipelined(struct vtr_canvas* vt)
+{
+    struct vtr_pipeline* pl = vt->pipeline;
+    pipeline_idle(vt);
+    publish_retained(vt);
+
+    // Tiles are free to rebin once the previous frame is out
+    if (vt->pool) {
+        int error = bin_cmds(vt);
+        if (error) {
+            return error;
+        }
+    }
+
+    schedule_viewports(vt);
+
+    struct vtr_stencil_buf* spare = &vt->sb[0];
+    while (spare == vt->cur_sb || spare == vt->front_sb) {
+        spare++;
+    }
+
+    // Encoder thread cleared its command list with the previous frame, so we record into that one next
+    struct vtr_cmdlist cmds = pl->cmds;
+    pl->cmds = vt->cmds;
+    vt->cmds = cmds;
+
+    pthread_mutex_lock(&pl->lock);
+    int error = pl->error;
+    pl->error = 0;
+    pl->frame = vt->cur_sb;
+    pl->busy = true;
+    pthread_cond_signal(&pl->wake);
+    pthread_mutex_unlock(&pl->lock);
+
+    vt->cur_sb = spare;
+
+    return error;
+}
+
+// Write out the frame in flight, stop the encoder thread and drop the third buffer.
+// Returns the result of presenting the last frame.
+static int stop_pipeline(struct vtr_canvas* vt)
+{
+    struct vtr_pipeline* pl = vt->pipeline;
+    if (!pl) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    while (pl->busy) {
+        pthread_cond_wait(&pl->done, &pl->lock);
+    }
+    pl->quit = true;
+    pthread_cond_signal(&pl->wake);
+    pthread_mutex_unlock(&pl->lock);
+
+    pthread_join(pl->thread, NULL);
+
+    int error = pl->error;
+    pthread_cond_destroy(&pl->done);
+    pthread_cond_destroy(&pl->wake);
+    pthread_mutex_destroy(&pl->lock);
+    free_cmds(&pl->cmds);
+    free(pl);
+    vt->pipeline = NULL;
+
+    // Back and front buffers have to end up in the first two slots
+    struct vtr_stencil_buf* spare = &vt->sb[0];
+    while (spare == vt->cur_sb || spare == vt->front_sb) {
+        spare++;
+    }
+
+    if (spare != &vt->sb[2]) {
+        struct vtr_stencil_buf sb = *spare;
+        *spare = vt->sb[2];
+        vt->sb[2] = sb;
+
+        if (vt->cur_sb == &vt->sb[2]) {
+            vt->cur_sb = spare;
+        } else {
+            vt->front_sb = spare;
+        }
+    }
+
+    free_stencil_buf(&vt->sb[2]);
+
+    return error;
+}
+
+int vtr_set_pipelined(struct vtr_canvas* vt, int enable)
+{
+    assert(vt);
+
+    if (vt->layer || (enable && vt->outmode == VTR_OUTPUT_NONBLOCKING)) {
+        return -EINVAL;
+    }
+
+    if (!enable) {
+        return stop_pipeline(vt);
+    }
+
+    if (vt->pipeline) {
+        return 0;
+    }
+
+    struct vtr_pipeline* pl = calloc(1, sizeof(*pl));
+    if (!pl) {
+        return -ENOMEM;
+    }
+
+    int error = create_stencil_buf(&vt->sb[2], vt->nrows, vt->ncols);
+    if (error) {
+        free(pl);
+        return error;
+    }
+
+    pl->vt = vt;
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->wake, NULL);
+    pthread_cond_init(&pl->done, NULL);
+
+    error = pthread_create(&pl->thread, NULL, pipeline_worker, pl);
+    if (error) {
+        pthread_cond_destroy(&pl->done);
+        pthread_cond_destroy(&pl->wake);
+        pthread_mutex_destroy(&pl->lock);
+        free_stencil_buf(&vt->sb[2]);
+        free(pl);
+        return -error;
+    }
+
+    vt->pipeline = pl;
+    return 0;
+}
+
+//
+// Frame pacing.
+//
+// Frames are due at absolute deadlines one period apart, so the time spent drawing and presenting a frame
+// doesn't add up to drift. The rate goes down by a quarter whenever the averaged output of a frame
+// goes over the byte budget at the current rate, or presenting it takes more than half of the period,
+// and back up by an eighth once there was room for that for about a second.
+//
+
+#define VT_NS_PER_SEC   ((uint64_t)1000000000)
+
+int vtr_set_pacing(struct vtr_canvas* vt, const struct vtr_pacing* pacing)
+{
+    assert(vt);
+
+    if (vt->layer) {
+        return -EINVAL;
+    }
+
+    struct vtr_pacer* p = &vt->pacer;
+    double fps = p->fps;
+    uint64_t window_start = p->window_start;
+    uint64_t window_frames = p->window_frames;
+
+    memset(p, 0, sizeof(*p));
+    p->fps = fps;
+    p->window_start = window_start;
+    p->window_frames = window_frames;
+
+    if (pacing && pacing->hz) {
+        p->max_hz = pacing->hz;
+        p->min_hz = (pacing->min_hz && pacing->min_hz < pacing->hz ? pacing->min_hz : pacing->hz);
+        p->hz = p->max_hz;
+        p->byte_budget = pacing->byte_budget;
+        p->last_bytes = __atomic_load_n(&vt->out_bytes, __ATOMIC_RELAXED);
+        p->last_ns = __atomic_load_n(&vt->present_ns, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+int vtr_frame_begin(struct vtr_canvas* vt)
+{
+    assert(vt);
+
+    if (vt->layer) {
+        return -EINVAL;
+    }
+
+    struct vtr_pacer* p = &vt->pacer;
+    if (!p->hz) {
+        return 0;
+    }
+
+    if (!p->deadline) {
+        p->deadline = clock_ns();
+        return 0;
+    }
+
+    struct timespec ts = {
+        .tv_sec = p->deadline / VT_NS_PER_SEC,
+        .tv_nsec = p->deadline % VT_NS_PER_SEC,
+    };
+
+    int error;
+    do {
+        error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    } while (error == EINTR);
+
+    return -error;
+}
+
+// Adjust the rate to what the frames presented since the last call took, then schedule the next frame
+static void pace_frame(struct vtr_canvas* vt)
+{
+    struct vtr_pacer* p = &vt->pacer;
+
+    uint64_t out_bytes = __atomic_load_n(&vt->out_bytes, __ATOMIC_RELAXED);
+    uint64_t present_ns = __atomic_load_n(&vt->present_ns, __ATOMIC_RELAXED);
+    p->avg_bytes = (p->avg_bytes * 3 + (out_bytes - p->last_bytes)) / 4;
+    p->avg_ns = (p->avg_ns * 3 + (present_ns - p->last_ns)) / 4;
+    p->last_bytes = out_bytes;
+    p->last_ns = present_ns;
+
+    uint64_t period = VT_NS_PER_SEC / p->hz;
+    uint64_t rate = p->avg_bytes * p->hz;
+    bool over = (p->byte_budget && rate > p->byte_budget) || p->avg_ns * 2 > period;
+    bool quiet = (!p->byte_budget || rate * 2 <= p->byte_budget) && p->avg_ns * 4 <= period;
+
+    if (over && p->hz > p->min_hz) {
+        p->hz = MAX(p->min_hz, p->hz - MAX(p->hz / 4, 1u));
+        p->quiet_frames = 0;
+    } else if (quiet && p->hz < p->max_hz) {
+        if (++p->quiet_frames >= p->hz) {
+            p->hz = MIN(p->max_hz, p->hz + MAX(p->hz / 8, 1u));
+            p->quiet_frames = 0;
+        }
+    } else {
+        p->quiet_frames = 0;
+    }
+
+    // A frame that ran late by more than a period starts a new schedule, instead of the next ones catching up
+    uint64_t now = clock_ns();
+    period = VT_NS_PER_SEC / p->hz;
+    p->deadline = (p->deadline && p->deadline + 2 * period > now ? p->deadline + period : now);
+}
+
+int vtr_frame_end(struct vtr_canvas* vt)
+{
+    assert(vt);
+
+    int error = vtr_swap_buffers(vt);
+    if (vt->pacer.hz) {
+        pace_frame(vt);
+    }
+
+    return error;
+}
+
+// Count a swap into the measured frame rate
+static void count_frame_rate(struct vtr_canvas* vt)
+{
+    struct vtr_pacer* p = &vt->pacer;
+    uint64_t now = clock_ns();
+
+    if (!p->window_start) {
+        p->window_start = now;
+    }
+
+    p->window_frames++;
+    if (now - p->window_start >= VT_NS_PER_SEC) {
+        p->fps = (double)p->window_frames * VT_NS_PER_SEC / (now - p->window_start);
+        p->window_start = now;
+        p->window_frames = 0;
+    }
+}
+
+//
+// Hardware scrolling.
+//
+
+// Encode the scrolls of a command list, seq must have room for VT_SCROLL_SEQ_MAX bytes per scroll.
+// Rectangles narrower than the screen need left and right margins, which are only set for the scroll.
+static size_t encode_scrolls(char* seq, const struct vtr_cmdlist* cmds)
+{
+    size_t len = 0;
+
+    for (size_t i = 0; i < cmds->nscrolls; i++) {
+        const struct vtr_scroll_op* op = &cmds->scrolls[i];
+        unsigned top = op->row + 1;
+        unsigned bottom = op->row + op->nrows;
+        unsigned left = op->col + 1;
+        unsigned right = op->col + op->ncols;
+        char* p = seq + len;
+        int n;
+
+        if (op->margins) {
+            n = snprintf(p, VT_SCROLL_SEQ_MAX, "\x1B[?69h\x1B[%u;%ur\x1B[%u;%us", top, bottom, left, right);
+        } else {
+            n = snprintf(p, VT_SCROLL_SEQ_MAX, "\x1B[%u;%ur", top, bottom);
+        }
+
+        // DECDC and DECIC work on the cursor column, SU and SD on the whole scroll region
+        if (op->dx < 0) {
+            n += snprintf(p + n, VT_SCROLL_SEQ_MAX - n, "\x1B[%u;%uH\x1B[%u'~", top, left, (unsigned)-op->dx);
+        } else if (op->dx > 0) {
+            n += snprintf(p + n, VT_SCROLL_SEQ_MAX - n, "\x1B[%u;%uH\x1B[%u'}", top, left, (unsigned)op->dx);
+        } else if (op->dy < 0) {
+            n += snprintf(p + n, VT_SCROLL_SEQ_MAX - n, "\x1B[%uS", (unsigned)-op->dy);
+        } else {
+            n += snprintf(p + n, VT_SCROLL_SEQ_MAX - n, "\x1B[%uT", (unsigned)op->dy);
+        }
+
+        if (op->margins) {
+            n += snprintf(p + n, VT_SCROLL_SEQ_MAX - n, "\x1B[s\x1B[?69l\x1B[r");
+        } else {
+            n += snprintf(p + n, VT_SCROLL_SEQ_MAX - n, "\x1B[r");
+        }
+
+        assert(n > 0 && (size_t)n < VT_SCROLL_SEQ_MAX);
+        len += n;
+    }
+
+    return len;
+}
+
+// Shift a plane of stencil contents, cells or glyphs, the way the terminal does for a scroll
+static void shift_plane(uint32_t* plane, size_t stride, const struct vtr_scroll_op* op)
+{
+    uint32_t* rect = plane + (size_t)op->row * stride + op->col;
+    size_t rowsize = op->ncols * sizeof(*rect);
+
+    if (op->dx != 0) {
+        size_t n = abs(op->dx);
+        size_t keep = op->ncols - n;
+        for (uint16_t row = 0; row < op->nrows; row++) {
+            uint32_t* line = rect + (size_t)row * stride;
+            if (op->dx < 0) {
+                memmove(line, line + n, keep * sizeof(*line));
+                memset(line + keep, 0, n * sizeof(*line));
+            } else {
+                memmove(line + n, line, keep * sizeof(*line));
+                memset(line, 0, n * sizeof(*line));
+            }
+        }
+    } else if (op->dy < 0) {
+        uint16_t n = -op->dy;
+        for (uint16_t row = 0; row < op->nrows; row++) {
+            uint32_t* line = rect + (size_t)row * stride;
+            if (row + n < op->nrows) {
+                memcpy(line, line + (size_t)n * stride, rowsize);
+            } else {
+                memset(line, 0, rowsize);
+            }
+        }
+    } else {
+        uint16_t n = op->dy;
+        for (uint16_t row = op->nrows; row-- > 0;) {
+            uint32_t* line = rect + (size_t)row * stride;
+            if (row >= n) {
+                memcpy(line, line - (size_t)n * stride, rowsize);
+            } else {
+                memset(line, 0, rowsize);
+            }
+        }
+    }
+}
+
+// Shift stencil contents the way the terminal does for the scrolls of a command list.
+// Exposed cells are clear, just like the blanks the terminal fills in.
+static void shift_scrolled(struct vtr_stencil_buf* sb, const struct vtr_cmdlist* cmds)
+{
+    for (size_t i = 0; i < cmds->nscrolls; i++) {
+        const struct vtr_scroll_op* op = &cmds->scrolls[i];
+        shift_plane(sb->cells, sb->stride, op);
+        shift_plane(sb->glyphs, sb->stride, op);
+
+        for (uint16_t row = op->row; row < op->row + op->nrows; row++) {
+            mark_text(sb, row, op->col);
+            mark_text(sb, row, op->col + op->ncols - 1);
+        }
+    }
+}
+
+static bool margins_supported(struct vtr_canvas* vt)
+{
+    // Asking needs the terminal in raw mode
+    if (!vt->margins_known && vt->is_reset) {
+        vt->margins = query_dec_mode(vt, VT_MARGINS_MODE);
+        vt->margins_known = true;
+    }
+
+    return vt->margins;
+}
+
+int vtr_scroll(struct vtr_canvas* vt, const struct vtr_rect* rect, int dx, int dy)
+{
+    assert(vt);
+    assert(rect);
+
+    if (vt->layer || rect->row >= vt->nrows || rect->col >= vt->ncols) {
+        return -EINVAL;
+    }
+
+    struct vtr_scroll_op op = {
+        .row = rect->row,
+        .col = rect->col,
+        .nrows = MIN(rect->nrows, vt->nrows - rect->row),
+        .ncols = MIN(rect->ncols, vt->ncols - rect->col),
+        .margins = (rect->col > 0 || rect->ncols < vt->ncols),
+    };
+
+    // Shifting everything out of the rectangle is no better than redrawing it
+    bool hscroll = (dx != 0 && abs(dx) < op.ncols);
+    bool vscroll = (dy != 0 && abs(dy) < op.nrows);
+    if (!hscroll && !vscroll) {
+        return 0;
+    }
+
+    if ((hscroll || op.margins) && !margins_supported(vt)) {
+        return -ENOTSUP;
+    }
+
+    struct vtr_cmdlist* list = &vt->cmds;
+    if (!reserve_array((void**)&list->scrolls, &list->scrollcap, list->nscrolls, 2, sizeof(*list->scrolls))) {
+        return -ENOMEM;
+    }
+
+    if (hscroll) {
+        list->scrolls[list->nscrolls] = op;
+        list->scrolls[list->nscrolls++].dx = dx;
+    }
+
+    if (vscroll) {
+        list->scrolls[list->nscrolls] = op;
+        list->scrolls[list->nscrolls++].dy = dy;
+    }
+
+    // Viewports scrolled over are due for a redraw, which can still make it into this frame
+    for (struct vtr_canvas* h = vt->viewports; h; h = h->layer->next) {
+        struct vtr_viewport* vp = h->layer->viewport;
+        if (!vp->drawn && scroll_overlaps(&op, vp)) {
+            vp->stale = true;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Extended colors.
+//
+
+// RGB colors in use, interned into color ids from VT_COLOR_RGB_BASE on in the order they first appear.
+// The hash table is open addressed and never more than half full, keys have VT_PALETTE_USED set.
+// Entries of rgb never change once added, so encoders read the colors of the ids they get without locking.
+#define VT_PALETTE_SLOTS    ((size_t)1 << 17)
+#define VT_PALETTE_USED     ((uint32_t)1 << 31)
+
+struct vtr_palette
+{
+    uint32_t rgb[VT_PALETTE_MAX_COLORS];
+    uint32_t keys[VT_PALETTE_SLOTS];
+    uint16_t ids[VT_PALETTE_SLOTS];
+    size_t count;
+};
+
+static bool colorterm_truecolor(void)
+{
+    const char* colorterm = getenv("COLORTERM");
+    return colorterm && (0 == strcmp(colorterm, "truecolor") || 0 == strcmp(colorterm, "24bit"));
+}
+
+static inline unsigned cube_level(unsigned v)
+{
+    return (v < 48 ? 0 : (v < 115 ? 1 : (v - 35) / 40));
+}
+
+static inline unsigned rgb_distance(unsigned r, unsigned g, unsigned b, unsigned r2, unsigned g2, unsigned b2)
+{
+    return (r - r2) * (r - r2) + (g - g2) * (g - g2) + (b - b2) * (b - b2);
+}
+
+// Nearest xterm palette index, out of the 6x6x6 color cube and the gray ramp
+static uint8_t quantize_rgb(uint32_t rgb)
+{
+    static const uint8_t levels[6] = { 0, 95, 135, 175, 215, 255 };
+
+    unsigned r = (rgb >> 16) & 0xFF;
+    unsigned g = (rgb >> 8) & 0xFF;
+    unsigned b = rgb & 0xFF;
+
+    unsigned cr = cube_level(r);
+    unsigned cg = cube_level(g);
+    unsigned cb = cube_level(b);
+    unsigned cube_dist = rgb_distance(r, g, b, levels[cr], levels[cg], levels[cb]);
+
+    unsigned avg = (r + g + b) / 3;
+    unsigned gray = (avg < 8 ? 0 : MIN((avg - 3) / 10, 23u));
+    unsigned level = 8 + gray * 10;
+    unsigned gray_dist = rgb_distance(r, g, b, level, level, level);
+
+    return (gray_dist < cube_dist ? 232 + gray : 16 + cr * 36 + cg * 6 + cb);
+}
+
+static uint32_t palette_rgb(const struct vtr_canvas* vt, uint16_t id)
+{
+    assert(vt->palette && id >= VT_COLOR_RGB_BASE && (size_t)(id - VT_COLOR_RGB_BASE) < vt->palette->count);
+    return vt->palette->rgb[id - VT_COLOR_RGB_BASE];
+}
+
+// Color id of an RGB color in the palette of canvas vt.
+// Falls back to the nearest indexed color once the palette is full, or if there is none to use.
+static uint16_t intern_rgb(struct vtr_canvas* vt, uint32_t rgb)
+{
+    uint16_t id = VT_COLOR_INDEXED_BASE + quantize_rgb(rgb);
+
+    // Context outlived its canvas
+    if (!vt) {
+        return id;
+    }
+
+    pthread_mutex_lock(&vt->colorlock);
+
+    if (!vt->palette) {
+        vt->palette = calloc(1, sizeof(*vt->palette));
+    }
+
+    struct vtr_palette* pal = vt->palette;
+    if (pal) {
+        size_t slot = ((rgb * 0x9E3779B1u) >> 15) & (VT_PALETTE_SLOTS - 1);
+        while ((pal->keys[slot] & VT_PALETTE_USED) && pal->keys[slot] != (rgb | VT_PALETTE_USED)) {
+            slot = (slot + 1) & (VT_PALETTE_SLOTS - 1);
+        }
+
+        if (pal->keys[slot] & VT_PALETTE_USED) {
+            id = pal->ids[slot];
+        } else if (pal->count < VT_PALETTE_MAX_COLORS) {
+            id = VT_COLOR_RGB_BASE + pal->count;
+            pal->rgb[pal->count++] = rgb;
+            pal->keys[slot] = rgb | VT_PALETTE_USED;
+            pal->ids[slot] = id;
+        }
+    }
+
+    pthread_mutex_unlock(&vt->colorlock);
+
+    return id;
+}
+
+// Color id of an extended color, unknown colors are the default one
+static uint16_t color_id(struct vtr_canvas* vt, uint32_t color)
+{
+    switch (color >> 24) {
+    case 0:
+        return (color < VTR_COLOR_TOTAL ? color : VTR_COLOR_DEFAULT);
+    case VTR_XCOLOR_INDEXED(0) >> 24:
+        return VT_COLOR_INDEXED_BASE + (color & 0xFF);
+    case VTR_XCOLOR_RGB(0, 0, 0) >> 24:
+        return intern_rgb(vt->layer ? vt->layer->parent : vt, color & 0xFFFFFF);
+    default:
+        return VTR_COLOR_DEFAULT;
+    }
+}
+
+// Style id of a text style in canvas vt or the canvas of context vt.
+// Falls back to the default style once the canvas has no more style ids, or if there is none to use.
+static uint8_t text_style_id(struct vtr_canvas* vt, uint16_t fgc, uint16_t bgc, bool bold)
+{
+    if (fgc == VTR_COLOR_DEFAULT && bgc == VTR_COLOR_DEFAULT && !bold) {
+        return 0;
+    }
+
+    // Context outlived its canvas
+    vt = (vt->layer ? vt->layer->parent : vt);
+    if (!vt) {
+        return 0;
+    }
 
-    vtr_clear_screen(vt);
+    uint8_t id = 0;
+    pthread_mutex_lock(&vt->colorlock);
 
-    return 0;
+    if (!vt->styles) {
+        vt->styles = calloc(VT_MAX_TEXT_STYLES, sizeof(*vt->styles));
+    }
 
-error_out:
+    if (vt->styles) {
+        size_t i = 0;
+        while (i < vt->nstyles &&
+               (vt->styles[i].fgc != fgc || vt->styles[i].bgc != bgc || vt->styles[i].bold != bold)) {
+            i++;
+        }
 
-    free_stencil_buf(&sb1);
-    free_stencil_buf(&sb2);
-    free(seqlist);
+        if (i == vt->nstyles && i < VT_MAX_TEXT_STYLES) {
+            vt->styles[vt->nstyles++] = (struct vt_text_style){ fgc, bgc, bold };
+        }
 
-    return -1;
-}
+        id = (i < vt->nstyles ? i + 1 : 0);
+    }
 
-uint16_t vtr_xdots(struct vtr_canvas* vt)
-{
-    return vt->xdots;
+    pthread_mutex_unlock(&vt->colorlock);
+
+    return id;
 }
 
-uint16_t vtr_ydots(struct vtr_canvas* vt)
+// Style of a style id, styles never change once they are interned
+static struct vt_text_style text_style(const struct vtr_canvas* vt, uint8_t id)
 {
-    return vt->ydots;
+    if (id == 0) {
+        return (struct vt_text_style){ VTR_COLOR_DEFAULT, VTR_COLOR_DEFAULT, false };
+    }
+
+    assert(vt->styles && id <= vt->nstyles);
+    return vt->styles[id - 1];
 }
-    
-void vtr_close(struct vtr_canvas* vt)
+
+int vtr_set_color_mode(struct vtr_canvas* vt, enum vtr_color_mode mode)
 {
-    tcsetattr(vt->fd, TCSANOW, &vt->origattrs);
-    free_stencil_buf(&vt->sb[0]);
-    free_stencil_buf(&vt->sb[1]);
-    free(vt->seqlist);
+    assert(vt);
 
-    // switch back to main buffer and restore cursor
-    (void) sendseq(vt->fd, "\x1B[?1049l", 8);
-    (void) sendseq(vt->fd, "\x1B[?25h", 6);
+    if (vt->layer) {
+        return -EINVAL;
+    }
 
-    free(vt);
+    bool truecolor;
+    switch (mode) {
+    case VTR_COLORS_AUTO:
+        truecolor = colorterm_truecolor();
+        break;
+    case VTR_COLORS_256:
+        truecolor = false;
+        break;
+    case VTR_COLORS_TRUECOLOR:
+        truecolor = true;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    pipeline_idle(vt);
+    vt->truecolor = truecolor;
+
+    return 0;
 }
 
-int vtr_clear_screen(struct vtr_canvas* vt)
+int vtr_truecolor_active(struct vtr_canvas* vt)
 {
-    return sendseq(vt->fd, "\x1B[2J", 4);
+    assert(vt);
+    return vt->truecolor;
 }
 
-static char* extend_seq_buf(struct vtr_canvas* vt)
+//
+// Frame recording and replay.
+//
+// Recorder keeps a packed copy of the last recorded frame, cells and glyphs, and the spans it had, so a frame
+// is compared only where either one was drawn into. Changed cells are XORed with their previous value, which leaves little
+// more than the changed dot bits for the LEB128 encoding. Each frame is encoded into a buffer sized for the worst case
+// before it is written out, so the encoder never checks for space.
+//
+
+#define VT_REC_MAGIC        "VTRREC\2"
+#define VT_REC_MAGIC_LEN    ((size_t)8)
+
+// Longest LEB128 encoding of a 32-bit value
+#define VT_LEB128_MAX       ((size_t)5)
+
+struct vtr_recorder
 {
-    DBG_LOG("Ran out of sequence list capacity %zu\n", vt->seqcap);
+    int fd;
+    int error;
+
+    // Last recorded frame, ncols cells and glyphs per row, and the spans it was drawn and printed into
+    uint32_t* cells;
+    uint32_t* glyphs;
+    struct vtr_span* dirty;
+    struct vtr_span* text;
+    uint16_t nrows;
+    uint16_t ncols;
 
-    vt->seqcap <<= 1;
-    assert(vt->seqcap > 0);
+    // XORed words of the run being collected
+    uint32_t* run;
 
-    char* seqlist = realloc(vt->seqlist, vt->seqcap);
-    if (!seqlist) {
-        vt->seqcap >>= 1;
-        return NULL;
+    // Palette entries and text styles of the canvas written out so far
+    size_t ncolors;
+    size_t nstyles;
+
+    uint8_t* buf;
+    size_t bufcap;
+};
+
+static inline size_t put_leb128(uint8_t* buf, uint32_t v)
+{
+    size_t len = 0;
+    while (v >= 0x80) {
+        buf[len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
     }
+    buf[len++] = (uint8_t)v;
 
-    vt->seqlist = seqlist;
-    return seqlist;
+    return len;
 }
 
-static size_t set_pos_s(char* seq, size_t seqcap, uint16_t row, uint16_t col)
+static void free_recorder(struct vtr_recorder* rec)
 {
-    // Not having enough space for \0 is fine (which is the nwritten == seqcap case).
-    size_t nwritten = snprintf(seq, seqcap, "\x1B[%d;%dH", row, col);
-    assert(nwritten <= seqcap);
-    return nwritten;
+    if (rec) {
+        free(rec->cells);
+        free(rec->glyphs);
+        free(rec->dirty);
+        free(rec->text);
+        free(rec->run);
+        free(rec->buf);
+        free(rec);
+    }
 }
 
-static size_t draw_cell_s(char* seq, size_t seqcap, uint8_t mask)
+int vtr_record_start(struct vtr_canvas* vt, int fd)
 {
-    assert(seqcap >= 3);
+    assert(vt);
 
-    seq[0] = 0xE2;
-    seq[1] = 0xA0 | (mask >> 6);
-    seq[2] = 0x80 | (mask & 0x3f);
+    if (vt->layer || vt->recorder) {
+        return -EINVAL;
+    }
 
-    return 3;
-}
+    struct vtr_recorder* rec = calloc(1, sizeof(*rec));
+    if (!rec) {
+        return -ENOMEM;
+    }
 
-static size_t set_foreground_color_s(char* seq, size_t seqcap, uint8_t fgc)
-{
-    assert(fgc >= VTR_COLOR_DEFAULT && fgc < VTR_COLOR_TOTAL);
-    assert(seqcap >= 5);
+    rec->fd = fd;
+
+    ssize_t res;
+    do {
+        res = write(fd, VT_REC_MAGIC, VT_REC_MAGIC_LEN);
+    } while (res < 0 && errno == EINTR);
 
-    seq[0] = 0x1b;
-    seq[1] = '[';
-    seq[2] = '3';
-    seq[3] = (fgc == VTR_COLOR_DEFAULT ? '9' : '0' + fgc - 1);
-    seq[4] = 'm';
+    if (res != (ssize_t)VT_REC_MAGIC_LEN) {
+        free_recorder(rec);
+        return (res < 0 ? -errno : -EIO);
+    }
+
+    pipeline_idle(vt);
+    vt->recorder = rec;
 
-    return 5;
+    return 0;
 }
 
-static size_t put_char_s(char* seq, size_t seqcap, char chr)
+int vtr_record_stop(struct vtr_canvas* vt)
 {
-    assert(seqcap >= 1);
-    seq[0] = chr;
-    return 1;
+    assert(vt);
+
+    if (vt->layer) {
+        return -EINVAL;
+    }
+
+    pipeline_idle(vt);
+
+    struct vtr_recorder* rec = vt->recorder;
+    if (!rec) {
+        return 0;
+    }
+
+    int error = rec->error;
+    free_recorder(rec);
+    vt->recorder = NULL;
+
+    return error;
 }
 
-int vtr_swap_buffers(struct vtr_canvas* vt)
+// Make the last recorded frame a blank one of given dimensions,
+// with room for a frame of up to ncolors new colors and nstyles new text styles
+static int reset_recorder(struct vtr_recorder* rec, uint16_t rows, uint16_t cols, size_t ncolors, size_t nstyles)
 {
-    struct vtr_stencil_buf* cur_sb = vt->cur_sb;
-    struct vtr_stencil_buf* prev_sb = (vt->cur_sb == &vt->sb[0] ? &vt->sb[1] : &vt->sb[0]);
-    size_t seqlen = 0;
-    size_t cell_idx = 0;
-    bool cell_skipped = true;
+    size_t ncells = (size_t)rows * cols;
+    size_t runs = VT_LEB128_MAX * (2 * ncells + 2) + ncells * VT_LEB128_MAX;
+    size_t bufcap = VT_LEB128_MAX * (4 + ncolors + 3 * nstyles) + 2 * runs;
+
+    if (rows != rec->nrows || cols != rec->ncols) {
+        uint32_t* cells = calloc(MAX(ncells, 1), sizeof(*cells));
+        uint32_t* glyphs = calloc(MAX(ncells, 1), sizeof(*glyphs));
+        uint32_t* run = malloc(MAX(ncells, 1) * sizeof(*run));
+        struct vtr_span* dirty = malloc(MAX(rows, 1) * sizeof(*dirty));
+        struct vtr_span* text = malloc(MAX(rows, 1) * sizeof(*text));
+        if (!cells || !glyphs || !run || !dirty || !text) {
+            free(cells);
+            free(glyphs);
+            free(run);
+            free(dirty);
+            free(text);
+            return -ENOMEM;
+        }
+
+        for (uint16_t row = 0; row < rows; row++) {
+            dirty[row] = (struct vtr_span){ .lo = cols, .hi = 0 };
+            text[row] = dirty[row];
+        }
+
+        free(rec->cells);
+        free(rec->glyphs);
+        free(rec->run);
+        free(rec->dirty);
+        free(rec->text);
+        rec->cells = cells;
+        rec->glyphs = glyphs;
+        rec->run = run;
+        rec->dirty = dirty;
+        rec->text = text;
+        rec->nrows = rows;
+        rec->ncols = cols;
+    }
 
-    uint8_t cur_fgc = VTR_COLOR_DEFAULT;
-    seqlen += set_foreground_color_s(vt->seqlist, vt->seqcap, VTR_COLOR_DEFAULT);
+    if (bufcap > rec->bufcap) {
+        uint8_t* buf = realloc(rec->buf, bufcap);
+        if (!buf) {
+            return -ENOMEM;
+        }
+
+        rec->buf = buf;
+        rec->bufcap = bufcap;
+    }
 
-    for (uint16_t row = 1; row <= vt->nrows; row++) {
-        for (uint16_t col = 1; col <= vt->ncols; col++, cell_idx++) {
-            bool is_overlaid = cur_sb->textoverlay[cell_idx] != 0;
-            bool is_text_diff = cur_sb->textoverlay[cell_idx] != prev_sb->textoverlay[cell_idx];
-            bool is_cell_diff = (cur_sb->buffer[cell_idx] != prev_sb->buffer[cell_idx]) ||
-                                (cur_sb->fgcolors[cell_idx] != prev_sb->fgcolors[cell_idx]);
+    return 0;
+}
 
-            if (!is_text_diff && (is_overlaid || !is_cell_diff)) {
-                cell_skipped = true;
+// Append the words of a plane that changed since the last recorded frame as runs ended by an empty one,
+// and make the current plane the last recorded one. Words outside of both frames' spans are zero in both.
+static size_t put_runs(uint8_t* buf, uint32_t* run, uint16_t nrows, uint16_t ncols,
+                       const uint32_t* cur, size_t stride, const struct vtr_span* spans,
+                       uint32_t* prev, struct vtr_span* prev_spans)
+{
+    size_t len = 0;
+
+    // Runs are collected first as their length goes before their words, and they carry on across rows
+    size_t next = 0;
+    size_t start = 0;
+    size_t nrun = 0;
+    for (uint16_t row = 0; row < nrows; row++) {
+        const uint32_t* src = cur + (size_t)row * stride;
+        uint32_t* dst = prev + (size_t)row * ncols;
+        uint16_t lo = MIN(spans[row].lo, prev_spans[row].lo);
+        uint16_t hi = MAX(spans[row].hi, prev_spans[row].hi);
+
+        for (uint16_t col = lo; col < hi; col++) {
+            uint32_t delta = src[col] ^ dst[col];
+            if (!delta) {
                 continue;
             }
 
-            // We're going to draw something, check if we're nearing the end of our seqlist buffer and extend it.
-            // The most chars we can generate per iteration is ~12 (set_pos) + 6 (fgcolor) + 3 (draw).
-            // The check is made with a lot of slack just to be sure.
-            if (vt->seqcap - seqlen <= VT_MIN_SEQLIST_SLACK && !extend_seq_buf(vt)) {
-                return -ENOMEM;
+            size_t idx = (size_t)row * ncols + col;
+            if (nrun > 0 && idx != start + nrun) {
+                len += put_leb128(buf + len, (uint32_t)(start - next));
+                len += put_leb128(buf + len, (uint32_t)nrun);
+                for (size_t i = 0; i < nrun; i++) {
+                    len += put_leb128(buf + len, run[i]);
+                }
+
+                next = start + nrun;
+                nrun = 0;
             }
 
-            if (cell_skipped) {
-                seqlen += set_pos_s(vt->seqlist + seqlen, vt->seqcap - seqlen, row, col);
-                cell_skipped = false;
-            }
-
-            // Underlying buffer cell might just got un-overlaid so we need to draw it uncoditionally
-            if (!is_overlaid && (is_text_diff || is_cell_diff)) {
-                // Actual braille cell has a different mask layout, bit numbers displayed below.
-                // So we need to convert our stencil first.
-                //
-                // +---+---+
-                // | 1 | 4 |
-                // +---+---+
-                // | 2 | 5 |
-                // +---+---+
-                // | 3 | 6 |
-                // +---+---+
-                // | 7 | 8 |
-                // +---+---+
-
-                uint8_t stencil = cur_sb->buffer[cell_idx];
-                uint8_t bcell = (stencil & 0x7) | (stencil & 0x8) << 3 | (stencil & 0x70) >> 1 | (stencil & 0x80);
-                uint8_t fgc = cur_sb->fgcolors[cell_idx];
-
-                if (fgc != cur_fgc) {
-                    seqlen += set_foreground_color_s(vt->seqlist + seqlen, vt->seqcap - seqlen, fgc);
-                    cur_fgc = fgc;
-                }
+            start = (nrun == 0 ? idx : start);
+            run[nrun++] = delta;
+            dst[col] = src[col];
+        }
 
-                seqlen += draw_cell_s(vt->seqlist + seqlen, vt->seqcap - seqlen, bcell);
-            } else if (is_overlaid && is_text_diff) {
-                if (cur_fgc != VTR_COLOR_DEFAULT) {
-                    seqlen += set_foreground_color_s(vt->seqlist + seqlen, vt->seqcap - seqlen, VTR_COLOR_DEFAULT);
-                    cur_fgc = VTR_COLOR_DEFAULT;
-                }
+        prev_spans[row] = spans[row];
+    }
 
-                seqlen += put_char_s(vt->seqlist + seqlen, vt->seqcap - seqlen, cur_sb->textoverlay[cell_idx]);
-            }
+    if (nrun > 0) {
+        len += put_leb128(buf + len, (uint32_t)(start - next));
+        len += put_leb128(buf + len, (uint32_t)nrun);
+        for (size_t i = 0; i < nrun; i++) {
+            len += put_leb128(buf + len, run[i]);
         }
     }
 
-    memset(prev_sb->buffer, 0, vt->nrows * vt->ncols);
-    memset(prev_sb->fgcolors, 0, vt->nrows * vt->ncols);
-    memset(prev_sb->textoverlay, 0, vt->nrows * vt->ncols);
-    vt->cur_sb = prev_sb;
+    len += put_leb128(buf + len, 0);
+    len += put_leb128(buf + len, 0);
 
-    return sendseq(vt->fd, vt->seqlist, seqlen);
+    return len;
 }
 
-static void render_dot(struct vtr_stencil_buf* sb, uint16_t x, uint16_t y, enum vtr_color fgc)
+// Append the changed cells and glyphs of a fully drawn frame to the recording
+static void record_frame(struct vtr_canvas* vt, const struct vtr_stencil_buf* sb)
 {
-    assert(x < sb->xdots && y < sb->ydots);
+    struct vtr_recorder* rec = vt->recorder;
+    if (!rec || rec->error) {
+        return;
+    }
 
-    uint16_t row = y / VT_CELL_YDOTS;
-    uint16_t col = x / VT_CELL_XDOTS;
-    uint16_t ncols = sb->xdots / VT_CELL_XDOTS;
+    pthread_mutex_lock(&vt->colorlock);
+    size_t ncolors = (vt->palette ? vt->palette->count : 0);
+    size_t nstyles = vt->nstyles;
+    pthread_mutex_unlock(&vt->colorlock);
 
-    uint8_t stencil = (1u << (y & (VT_CELL_YDOTS - 1))) << ((x & (VT_CELL_XDOTS - 1)) * 4);
-    sb->buffer[row * ncols + col] |= stencil;
-    sb->fgcolors[row * ncols + col] = fgc;
-}
+    int error = reset_recorder(rec, vt->nrows, vt->ncols, ncolors - rec->ncolors, nstyles - rec->nstyles);
+    if (error) {
+        rec->error = error;
+        return;
+    }
 
-static void print_char(struct vtr_stencil_buf* sb, uint16_t row, uint16_t col, char c)
-{
-    uint16_t ncols = sb->xdots / VT_CELL_XDOTS;
-    sb->textoverlay[row * ncols + col] = c;
-}
+    uint8_t* buf = rec->buf;
+    size_t len = 0;
 
-static inline bool point_test(struct vtr_canvas* vt, int x, int y)
-{
-    return (x >= 0 && x < vt->xdots) && (y >= 0 && y < vt->ydots);
-}
+    len += put_leb128(buf + len, vt->nrows);
+    len += put_leb128(buf + len, vt->ncols);
+    len += put_leb128(buf + len, (uint32_t)(ncolors - rec->ncolors));
+    for (size_t i = rec->ncolors; i < ncolors; i++) {
+        len += put_leb128(buf + len, vt->palette->rgb[i]);
+    }
+    rec->ncolors = ncolors;
 
-void vtr_render_dot(struct vtr_canvas* vt, int x, int y)
-{
-    vtr_render_dotc(vt, x, y, VTR_COLOR_DEFAULT);
-}
+    len += put_leb128(buf + len, (uint32_t)(nstyles - rec->nstyles));
+    for (size_t i = rec->nstyles; i < nstyles; i++) {
+        len += put_leb128(buf + len, vt->styles[i].fgc);
+        len += put_leb128(buf + len, vt->styles[i].bgc);
+        len += put_leb128(buf + len, vt->styles[i].bold);
+    }
+    rec->nstyles = nstyles;
 
-void vtr_render_dotc(struct vtr_canvas* vt, int x, int y, enum vtr_color fgc)
-{
-    if (point_test(vt, x, y)) {
-        render_dot(vt->cur_sb, x, y, fgc);
+    len += put_runs(buf + len, rec->run, vt->nrows, vt->ncols, sb->cells, sb->stride, sb->dirty, rec->cells, rec->dirty);
+    len += put_runs(buf + len, rec->run, vt->nrows, vt->ncols, sb->glyphs, sb->stride, sb->text, rec->glyphs, rec->text);
+    assert(len <= rec->bufcap);
+
+    for (size_t off = 0; off < len;) {
+        ssize_t res = write(rec->fd, buf + off, len - off);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            rec->error = -errno;
+            return;
+        }
+
+        off += res;
     }
 }
 
-/**
- * Calculate a line slope.
- * Returns INFINITY if slope is undefined.
- */
-static float calc_slope(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+struct vtr_replay
 {
-    return (x1 == x0 ? INFINITY : ((float)y1 - y0) / ((float)x1 - x0));
-}
+    // Whole recording, mapped or read into memory
+    const uint8_t* data;
+    size_t size;
+    bool mapped;
+    size_t pos;
+
+    // Last decoded frame, ncols cells and glyphs per row
+    uint32_t* cells;
+    uint32_t* glyphs;
+    uint16_t nrows;
+    uint16_t ncols;
+    bool decoded;
+
+    // Recorded RGB colors by their recorded id, and the ids the first ncanvas of them got in the canvas
+    // with serial number canvas, 0 for none. Serials aren't reused the way addresses of closed canvases are.
+    uint32_t* colors;
+    uint16_t* ids;
+    size_t ncolors;
+    size_t colorcap;
+    uint64_t canvas;
+    size_t ncanvas;
+
+    // Recorded text styles by their recorded id minus 1, and the ids the first nstyles_canvas of them got there
+    struct vt_text_style styles[VT_MAX_TEXT_STYLES];
+    uint8_t style_ids[VT_MAX_TEXT_STYLES];
+    size_t nstyles;
+    size_t nstyles_canvas;
+};
 
-static void scan_line(struct vtr_stencil_buf* sb, uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1, enum vtr_color fgc)
+struct vtr_replay* vtr_replay_open(int fd)
 {
-    assert(x0 >= 0 && x0 < sb->xdots);
-    assert(x1 >= 0 && x1 < sb->xdots);
-    assert(y0 >= 0 && y0 < sb->ydots);
-    assert(y1 >= 0 && y1 < sb->ydots);
-
-    float m = calc_slope(x0, y0, x1, y1);
-    int hdir = (x0 < x1 ? 1 : -1);
-    int vdir = (y0 < y1 ? 1 : -1);
+    struct vtr_replay* rp = calloc(1, sizeof(*rp));
+    if (!rp) {
+        return NULL;
+    }
 
-    if (m == 0.0) {
-        for (int x = x0; x != x1 + hdir; x += hdir)
-        {
-            render_dot(sb, x, y0, fgc);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            rp->data = data;
+            rp->size = st.st_size;
+            rp->mapped = true;
         }
-    } else if (m == INFINITY) {
-        for (int y = y0; y != y1 + vdir; y += vdir)
-        {
-            render_dot(sb, x0, y, fgc);
-        }
-    } else if (m == -1.0 || m == 1.0) {
-        for (int x = x0, y = y0; x != x1 + hdir; x += hdir, y += vdir)
-        {
-            render_dot(sb, x, y, fgc);
-        }
-    } else {
+    }
 
-        // Generic slope case.
-        // A line is y - y0 = m(x - x0) in screen dot space.
-        // 
-        // We scan either the x or the y coord depending on which one increases faster
-        // and plug the scanned value into the line equation to get the other one.
-        //
-        // If the resulting value has a fractional part it means the line fragment sits in 2 adjacent dot boxes.
-        // The fraction distance between the 2 integers tells us which box has the most of the line.
-        // We will render the dot that has the largest fragment.
-        //
-        // If the distance is 0.5 then both boxes have equal fragment sizes, in which case we opt to render both.
-
-        float yf = 0, xf = 0;
-
-        if (m > -1.0 && m < 1.0) {
-            for (int x = x0, y = y0; x != x1 + hdir;)
-            {
-                render_dot(sb, x, y, fgc);
-                if (yf - y == -0.5) {
-                    render_dot(sb, x, y - 1, fgc);
+    // Pipes and such are read in full
+    if (!rp->mapped) {
+        uint8_t* data = NULL;
+        size_t cap = 0;
+
+        while (true) {
+            if (rp->size == cap) {
+                cap = MAX(cap * 2, (size_t)1 << 16);
+                uint8_t* grown = realloc(data, cap);
+                if (!grown) {
+                    goto error_out;
                 }
-
-                x += hdir;
-                yf = m * ((float)x - x1) + y1;
-                y = roundf(yf);
+                data = grown;
+                rp->data = data;
             }
-        } else {
-            for (int x = x0, y = y0; y != y1 + vdir;)
-            {
-                render_dot(sb, x, y, fgc);
-                if (xf - x == -0.5) {
-                    render_dot(sb, x - 1, y, fgc);
+
+            ssize_t res = read(fd, data + rp->size, cap - rp->size);
+            if (res < 0) {
+                if (errno == EINTR) {
+                    continue;
                 }
+                goto error_out;
+            }
 
-                y += vdir;
-                xf = ((float)y - y1) / m + x1;
-                x = roundf(xf);
+            if (res == 0) {
+                break;
             }
+
+            rp->size += res;
         }
     }
+
+    if (rp->size < VT_REC_MAGIC_LEN || memcmp(rp->data, VT_REC_MAGIC, VT_REC_MAGIC_LEN) != 0) {
+        goto error_out;
+    }
+
+    rp->pos = VT_REC_MAGIC_LEN;
+
+    return rp;
+
+error_out:
+    vtr_replay_close(rp);
+
+    return NULL;
+}
+
+void vtr_replay_close(struct vtr_replay* rp)
+{
+    if (!rp) {
+        return;
+    }
+
+    if (rp->mapped) {
+        munmap((void*)rp->data, rp->size);
+    } else {
+        free((void*)rp->data);
+    }
+
+    free(rp->cells);
+    free(rp->glyphs);
+    free(rp->colors);
+    free(rp->ids);
+    free(rp);
 }
 
-void vtr_scan_line(struct vtr_canvas* vt, int x0, int y0, int x1, int y1)
+void vtr_replay_rewind(struct vtr_replay* rp)
 {
-    vtr_scan_linec(vt, x0, y0, x1, y1, VTR_COLOR_DEFAULT);
+    assert(rp);
+
+    rp->pos = VT_REC_MAGIC_LEN;
+    rp->decoded = false;
+    rp->ncolors = 0;
+    rp->canvas = 0;
+    rp->ncanvas = 0;
+    rp->nstyles = 0;
+    rp->nstyles_canvas = 0;
+    if (rp->cells) {
+        memset(rp->cells, 0, (size_t)rp->nrows * rp->ncols * sizeof(*rp->cells));
+        memset(rp->glyphs, 0, (size_t)rp->nrows * rp->ncols * sizeof(*rp->glyphs));
+    }
 }
 
-void vtr_scan_linec(struct vtr_canvas* vt, int x0, int y0, int x1, int y1, enum vtr_color fgc)
+static bool get_leb128(struct vtr_replay* rp, uint32_t* v)
 {
-    int dx = x1 - x0, dy = y1 - y0;
-    int xmin = 0, ymin = 0;
-    int xmax = vt->xdots - 1, ymax = vt->ydots - 1;
-
-    // precomputed edge test parameters: left, right, bottom, top
-    int p[4] = { -dx, dx, -dy, dy };
-    int q[4] = { x0 - xmin, xmax - x0, y0 - ymin, ymax - y0 };
-
-    // find edge constraints on t in p * t <= q for each edge
-    // p == 0:
-    //  0 * t <= q, where q < 0 -> impossible, reject
-    //  0 * t <= q, where q >= 0 -> trivial, no restriction on t from this edge
-    //
-    // p != 0:
-    //  t <= q / p -> t is where we cross the edge boundary
-    //  if q < 0 we enter the rect at t >= q / p -> tenter = max(tenter, t)
-    //  if q > 0 we exit the rect at t <= q / p -> texit = min(texit, t)
-    //
-    // For line to be clipped to the rect we need tenter <= texit
-
-    float tentry = 0, texit = 1;
-    for (int i = 0; i < 4; i++) {
-        if (p[i] == 0) {
-            if (q[i] < 0) {
-                return;
-            }
-        } else {
-            float t = (float)(q[i]) / p[i];
-            if (p[i] < 0) {
-                tentry = MAX(tentry, t);
-            } else {
-                texit = MIN(texit, t);
-            }
+    uint32_t res = 0;
+    for (unsigned shift = 0; shift < 35 && rp->pos < rp->size; shift += 7) {
+        uint8_t b = rp->data[rp->pos++];
+        res |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *v = res;
+            return true;
         }
     }
 
-    if (tentry <= texit) {
-        scan_line(vt->cur_sb,
-                  roundf(x0 + tentry * dx), roundf(y0 + tentry * dy),
-                  roundf(x0 + texit * dx), roundf(y0 + texit * dy),
-                  fgc);
-    }
+    return false;
 }
 
-int vtr_trace_poly(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vlist)
+// Apply the runs of one plane of a frame to the last decoded one
+static bool get_runs(struct vtr_replay* rp, uint32_t* plane)
 {
-    return vtr_trace_polyc(vt, nvertices, vlist, VTR_COLOR_DEFAULT);
+    size_t ncells = (size_t)rp->nrows * rp->ncols;
+    size_t idx = 0;
+
+    while (true) {
+        uint32_t skip, count;
+        if (!get_leb128(rp, &skip) || !get_leb128(rp, &count) || skip > ncells - idx || count > ncells - idx - skip) {
+            return false;
+        }
+
+        if (count == 0) {
+            return true;
+        }
+
+        idx += skip;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t delta;
+            if (!get_leb128(rp, &delta)) {
+                return false;
+            }
+            plane[idx++] ^= delta;
+        }
+    }
 }
 
-int vtr_trace_polyc(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vlist, enum vtr_color fgc)
+int vtr_replay_next(struct vtr_replay* rp, uint16_t* rows, uint16_t* cols)
 {
-    assert(vt);
-    assert(vlist);
+    assert(rp);
 
-    if (nvertices == 0) {
-        return 0;
+    if (rp->pos >= rp->size) {
+        return -ENODATA;
     }
 
-    if (nvertices == 1) {
-        vtr_render_dotc(vt, vlist[0].x, vlist[0].y, fgc);
-        return 0;
+    rp->decoded = false;
+
+    uint32_t nrows, ncols, ncolors;
+    if (!get_leb128(rp, &nrows) || !get_leb128(rp, &ncols) || !get_leb128(rp, &ncolors) ||
+        nrows == 0 || ncols == 0 || nrows > UINT16_MAX || ncols > UINT16_MAX ||
+        ncolors > VT_PALETTE_MAX_COLORS - rp->ncolors) {
+        return -EINVAL;
     }
 
-    if (nvertices == 2) {
-        vtr_scan_linec(vt, vlist[0].x, vlist[0].y, vlist[1].x, vlist[1].y, fgc);
-        return 0;
+    if (nrows != rp->nrows || ncols != rp->ncols) {
+        uint32_t* cells = calloc((size_t)nrows * ncols, sizeof(*cells));
+        uint32_t* glyphs = calloc((size_t)nrows * ncols, sizeof(*glyphs));
+        if (!cells || !glyphs) {
+            free(cells);
+            free(glyphs);
+            return -ENOMEM;
+        }
+
+        free(rp->cells);
+        free(rp->glyphs);
+        rp->cells = cells;
+        rp->glyphs = glyphs;
+        rp->nrows = nrows;
+        rp->ncols = ncols;
+
+        // A new canvas is expected for new dimensions
+        rp->canvas = 0;
+        rp->ncanvas = 0;
+        rp->nstyles_canvas = 0;
     }
 
-    assert(nvertices >= 3);
+    if (rp->ncolors + ncolors > rp->colorcap) {
+        size_t cap = MAX(rp->ncolors + ncolors, rp->colorcap * 2);
+        uint32_t* colors = realloc(rp->colors, cap * sizeof(*colors));
+        if (colors) {
+            rp->colors = colors;
+        }
 
-    int cross = 0;
-    int ymax = INT_MIN, ymin = INT_MAX;
-    for (size_t i = 0; i < nvertices; i++) {
-        ymin = MIN(ymin, vlist[i].y);
-        ymax = MAX(ymax, vlist[i].y);
+        uint16_t* ids = realloc(rp->ids, cap * sizeof(*ids));
+        if (ids) {
+            rp->ids = ids;
+        }
 
-        struct vtr_vertex a, b, c;
-        a = vlist[i];
-        b = (i + 1 == nvertices ? vlist[0] : vlist[i + 1]);
-        c = (i + 2 == nvertices ? vlist[0] : (i + 1 == nvertices ? vlist[1] : vlist[i + 2]));
+        if (!colors || !ids) {
+            return -ENOMEM;
+        }
 
-        // Calculate 2d cross products and make sure they maintain the same sign
-        int cross2  = (b.x - a.x) * (c.y - b.y) - (b.y - a.y) * (c.x - b.x);
-        if (cross2 == 0) {
-            continue;
-        } else if ((cross > 0 && cross2 < 0) || (cross < 0 && cross2 > 0)) {
+        rp->colorcap = cap;
+    }
+
+    for (uint32_t i = 0; i < ncolors; i++) {
+        uint32_t rgb;
+        if (!get_leb128(rp, &rgb)) {
             return -EINVAL;
-        } else {
-            cross = cross2;
         }
+        rp->colors[rp->ncolors++] = rgb & 0xFFFFFF;
     }
 
-    // Clip bounding box
-    if ((ymin < 0 && ymax < 0) || (ymin >= vt->ydots && ymax >= vt->ydots)) {
-        return 0;
-    } else {
-        ymin = CLAMP(ymin, 0, vt->ydots - 1);
-        ymax = CLAMP(ymax, 0, vt->ydots - 1);
+    uint32_t nstyles;
+    if (!get_leb128(rp, &nstyles) || nstyles > VT_MAX_TEXT_STYLES - rp->nstyles) {
+        return -EINVAL;
     }
 
-    // Line-scan the convex polygon
-    for (int y = ymin; y != ymax + 1; y++) {
-        int xcepts[2];
-        size_t ncepts = 0;
-
-        for (size_t i = 0; i < nvertices; i++) {
-            struct vtr_vertex a = vlist[i];
-            struct vtr_vertex b = (i + 1 == nvertices ? vlist[0] : vlist[i + 1]);
-
-            if (y == a.y && y == b.y) {
-                // Special case: edge is horizontal and has no x intercepts.
-                vtr_scan_linec(vt, a.x, a.y, b.x, b.y, fgc);
-            } else if ((y == a.y || y == b.y) && (y == ymin || y == ymax)) {
-                // Special case: x intercept is a min/max vertex
-                int xcept = (y == a.y ? a.x : b.x);
-                vtr_render_dotc(vt, xcept, y, fgc);
-            } else if ((y >= a.y && y <= b.y) || (y >= b.y && y <= a.y)) {
-                int xcept = (int)((float)(a.x - b.x) * (y - b.y) / (a.y - b.y) + b.x);
-
-                // Intercepts can repeat if 2 edges meet at current y, ignore that
-                switch(ncepts) {
-                    case 2: if (xcepts[1] == xcept) continue;
-                    case 1: if (xcepts[0] == xcept) continue;
-                    case 0: break;
-                }
-
-                assert(ncepts < 2);
-                xcepts[ncepts++] = xcept;
-            }
+    for (uint32_t i = 0; i < nstyles; i++) {
+        uint32_t fgc, bgc, bold;
+        if (!get_leb128(rp, &fgc) || !get_leb128(rp, &bgc) || !get_leb128(rp, &bold) ||
+            fgc >= VT_COLOR_RGB_BASE + VT_PALETTE_MAX_COLORS || bgc >= VT_COLOR_RGB_BASE + VT_PALETTE_MAX_COLORS) {
+            return -EINVAL;
         }
+        rp->styles[rp->nstyles++] = (struct vt_text_style){ fgc, bgc, bold != 0 };
+    }
 
-        if (ncepts == 2) {
-            vtr_scan_linec(vt, xcepts[0], y, xcepts[1], y, fgc);
-        } else if (ncepts == 1) {
-            vtr_render_dotc(vt, xcepts[0], y, fgc);
-        }
+    if (!get_runs(rp, rp->cells) || !get_runs(rp, rp->glyphs)) {
+        return -EINVAL;
     }
 
+    rp->decoded = true;
+    *rows = rp->nrows;
+    *cols = rp->ncols;
+
     return 0;
 }
 
-int vtr_print_text(struct vtr_canvas* vt, uint16_t row, uint16_t col, const char* str)
+// Canvas color id of a recorded one, unknown RGB ids are drawn in the default color
+static uint16_t replay_color(const struct vtr_replay* rp, uint16_t id)
+{
+    if (id < VT_COLOR_RGB_BASE) {
+        return id;
+    }
+
+    size_t i = id - VT_COLOR_RGB_BASE;
+    return (i < rp->ncolors ? rp->ids[i] : VTR_COLOR_DEFAULT);
+}
+
+int vtr_replay_draw(struct vtr_replay* rp, struct vtr_canvas* vt)
 {
+    assert(rp);
     assert(vt);
-    assert(str);
 
-    if (row >= vt->nrows || col >= vt->ncols) {
+    if (vt->layer || !rp->decoded || vt->nrows != rp->nrows || vt->ncols != rp->ncols) {
         return -EINVAL;
     }
 
-    while (col < vt->ncols && *str != '\0') {
-        print_char(vt->cur_sb, row, col, *str);
-        str++;
-        col++;
+    if (vt->serial != rp->canvas) {
+        rp->canvas = vt->serial;
+        rp->ncanvas = 0;
+        rp->nstyles_canvas = 0;
+    }
+
+    for (; rp->ncanvas < rp->ncolors; rp->ncanvas++) {
+        rp->ids[rp->ncanvas] = color_id(vt, VTR_XCOLOR_RGB(0, 0, 0) | rp->colors[rp->ncanvas]);
+    }
+
+    for (; rp->nstyles_canvas < rp->nstyles; rp->nstyles_canvas++) {
+        const struct vt_text_style* style = &rp->styles[rp->nstyles_canvas];
+        rp->style_ids[rp->nstyles_canvas] = text_style_id(vt, replay_color(rp, style->fgc), replay_color(rp, style->bgc),
+                                                          style->bold);
+    }
+
+    struct vtr_stencil_buf* sb = vt->cur_sb;
+    for (uint16_t row = 0; row < rp->nrows; row++) {
+        const uint32_t* src = rp->cells + (size_t)row * rp->ncols;
+        const uint32_t* glyphs = rp->glyphs + (size_t)row * rp->ncols;
+        uint32_t* dst = sb->cells + (size_t)row * sb->stride;
+
+        for (uint16_t col = 0; col < rp->ncols; col++) {
+            uint32_t cell = src[col];
+            if (!cell) {
+                continue;
+            }
+
+            uint16_t fgc = replay_color(rp, cell_fgcolor(cell));
+            dst[col] = (cell & ~(VT_CELL_FGCOLOR_BITS | VT_CELL_TEXT_BITS)) | ((uint32_t)fgc << VT_CELL_FGCOLOR_SHIFT);
+            mark_dirty(sb, row, col);
+
+            // Unknown styles are printed in the default one, and wide glyph halves that can't be one are narrow
+            uint32_t glyph = glyphs[col];
+            if ((glyph & VT_GLYPH_TAIL && col == 0) || (glyph & VT_GLYPH_WIDE && col + 1 == rp->ncols)) {
+                glyph &= ~(VT_GLYPH_TAIL | VT_GLYPH_WIDE);
+            }
+
+            if ((cell & VT_CELL_TEXT_BITS) && glyph) {
+                size_t i = glyph_style(glyph);
+                uint8_t style = (i > 0 && i <= rp->nstyles ? rp->style_ids[i - 1] : 0);
+                print_glyph(sb, row, col, (glyph & ~((uint32_t)0xFF << VT_GLYPH_STYLE_SHIFT)) |
+                                          ((uint32_t)style << VT_GLYPH_STYLE_SHIFT));
+            }
+        }
     }
 
     return 0;
@@ -20,6 +20,15 @@ struct vtr_canvas;
  */
 struct vtr_canvas* vtr_canvas_create(int ttyfd);
 
+/*
+ * Create a canvas of fixed dimensions in char cells which isn't bound to a terminal, e.g. for benchmarks.
+ * Output is written to sinkfd, which can be any file descriptor like /dev/null or a pipe,
+ * or discarded right after encoding if sinkfd is negative. Terminal queries are never made,
+ * so automatic modes take the terminal for not supporting anything, and vtr_resize does nothing.
+ * Returns NULL on error.
+ */
+struct vtr_canvas* vtr_canvas_create_headless(uint16_t rows, uint16_t cols, int sinkfd);
+
 /*
  * Put the associated terminal into raw mode and switch to the alternate
  * screen buffer.  Must be called before any drawing takes place.
@@ -32,9 +41,13 @@ int vtr_reset(struct vtr_canvas* vt);
 void vtr_close(struct vtr_canvas* vt);
 
 /*
- * Check if VT dimensions have changed and reset it if needed.
+ * Check if VT dimensions have changed and reconfigure the canvas if needed.
  * Terminal resizes are handled asynchronously. The consumer could
  * watch for SIGWINCH and call the actual resize from the main loop.
+ * The on-screen overlap is kept and only the newly exposed area is
+ * erased. Shrinks apply at once; grows that fit the allocated buffers
+ * apply once the size has been stable for a short while, so keep
+ * calling this from the main loop.
  */
 int vtr_resize(struct vtr_canvas* vt);
 
@@ -48,11 +61,293 @@ int vtr_clear_screen(struct vtr_canvas* vt);
 /*
  * Swap buffers when a frame is complete.  All accumulated changes are
  * flushed to the terminal and the back buffer is cleared for the next
- * frame.
+ * frame.  Output space for the frame is reserved before it is encoded,
+ * so on -ENOMEM the back buffer is left untouched and can be swapped again.
  */
 
 int vtr_swap_buffers(struct vtr_canvas* vt);
 
+/*
+ * Output modes.
+ *
+ * In blocking mode (the default) vtr_swap_buffers returns once the whole frame was written to the TTY.
+ *
+ * In non-blocking mode the TTY fd is switched to O_NONBLOCK and whatever part of the output
+ * the TTY doesn't accept right away stays queued.  Consecutive frames are appended to the queue.
+ * The consumer is expected to poll vtr_output_fd for POLLOUT while vtr_pending_bytes is non-zero
+ * and call vtr_flush_pending when it becomes writable.
+ */
+enum vtr_output_mode
+{
+    VTR_OUTPUT_BLOCKING,
+    VTR_OUTPUT_NONBLOCKING,
+};
+
+/*
+ * Switch output mode.  Switching to blocking mode flushes anything that is still queued.
+ */
+int vtr_set_output_mode(struct vtr_canvas* vt, enum vtr_output_mode mode);
+
+/*
+ * Write out as much of the queued output as the TTY accepts.
+ * Returns 0 when the queue is drained and -EAGAIN if some of it is still pending.
+ */
+int vtr_flush_pending(struct vtr_canvas* vt);
+
+/* Number of bytes queued and not yet accepted by the TTY */
+size_t vtr_pending_bytes(struct vtr_canvas* vt);
+
+/* File descriptor to poll for POLLOUT while output is pending */
+int vtr_output_fd(struct vtr_canvas* vt);
+
+/*
+ * Synchronized updates.
+ *
+ * When enabled each frame is wrapped into a synchronized update (DEC private mode 2026),
+ * so a terminal that supports it renders the frame in one go instead of tearing half-way through it.
+ * VTR_SYNC_AUTO enables it only if the terminal reports support for the mode when queried with DECRQM.
+ * The query is made by vtr_reset, or right away if the terminal was reset already.
+ */
+enum vtr_sync_mode
+{
+    VTR_SYNC_OFF,
+    VTR_SYNC_ON,
+    VTR_SYNC_AUTO,
+};
+
+int vtr_set_sync_updates(struct vtr_canvas* vt, enum vtr_sync_mode mode);
+
+/* Check if frames are currently wrapped into synchronized updates */
+int vtr_sync_updates_active(struct vtr_canvas* vt);
+
+/*
+ * What to do with a frame that is still partly queued when the next one is swapped.
+ *
+ * VTR_FRAME_QUEUE (the default) appends the new frame after it, so the queue grows on slow links.
+ *
+ * VTR_FRAME_DROP discards the queued bytes the TTY hasn't seen yet, except for what's needed to finish
+ * the row being written, and diffs the new frame against the resulting terminal state.
+ * This keeps latency bounded at the cost of skipping frames.
+ */
+enum vtr_frame_policy
+{
+    VTR_FRAME_QUEUE,
+    VTR_FRAME_DROP,
+};
+
+int vtr_set_frame_policy(struct vtr_canvas* vt, enum vtr_frame_policy policy);
+
+/* Number of frames discarded entirely before any of their bytes were written out */
+uint64_t vtr_dropped_frames(struct vtr_canvas* vt);
+
+/* Number of frames that were cut short and merged into the next one */
+uint64_t vtr_merged_frames(struct vtr_canvas* vt);
+
+/**
+ * Encode rows grouped by color, off by default.
+ * Cells are normally sent left to right, switching colors as they come. With grouping enabled every row is
+ * also encoded one color at a time, moving the cursor back and forth, and the shorter of the two is sent.
+ * That pays off for interleaved colors at the cost of encoding some rows twice.
+ */
+int vtr_set_color_grouping(struct vtr_canvas* vt, int enable);
+
+/**
+ * Frame statistics.
+ * The last frame stats cover the last swapped frame, including writes made after the swap by vtr_flush_pending
+ * and other calls, the totals cover every frame so far.
+ * Times are in nanoseconds of the monotonic clock. Work done in parallel tiles is summed over all threads.
+ * In immediate mode draw calls rasterize right away on the caller's time, raster_ns only has context merges then.
+ * Primitives are counted per draw call made with the canvas handle, each batch element counts as one.
+ * Stats are compiled out if the library is built with VTR_NO_STATS, vtr_get_stats returns -ENOTSUP then.
+ */
+struct vtr_frame_stats
+{
+    uint64_t cells_scanned;     // cells diffed against the terminal state
+    uint64_t cells_changed;     // cells that had to be sent
+    uint64_t bytes;             // bytes queued, nothing if the frame didn't change anything
+    uint64_t inorder_bytes;     // bytes it would have taken without color grouping
+    uint64_t writes;            // write() calls
+    uint64_t short_writes;      // writes the TTY took only part of, or nothing at all
+    uint64_t seq_reallocs;      // output buffer reallocations
+    uint64_t raster_ns;
+    uint64_t diff_ns;
+    uint64_t encode_ns;
+    uint64_t write_ns;
+    uint64_t dots;
+    uint64_t lines;
+    uint64_t polys;
+    uint64_t texts;
+    uint64_t sprites;
+    uint64_t samples;           // density samples accumulated
+};
+
+struct vtr_stats
+{
+    uint64_t frames;            // frames encoded
+    struct vtr_frame_stats last;
+    struct vtr_frame_stats total;
+    double fps;                 // swaps per second over the last full second
+    unsigned pace_hz;           // rate the frame pacer runs at, 0 without pacing
+};
+
+int vtr_get_stats(struct vtr_canvas* vt, struct vtr_stats* stats);
+
+/**
+ * Frame pacing.
+ * With a rate set, vtr_frame_begin sleeps until the next frame is due, and vtr_frame_end swaps the buffers
+ * and schedules the frame after that one period later. Frames are due at absolute times on the monotonic clock,
+ * so the time a frame takes doesn't drift the schedule, but a frame late by more than a period starts it over.
+ * The rate adapts to the output between min_hz and hz: it goes down when the frames average more than
+ * byte_budget bytes per second, if that is set, or take more than half of a period to present, that is to merge,
+ * rasterize in deferred mode, encode and write out, and goes up again after about a second well below both.
+ * A hz of 0 or a NULL pacing turns pacing off, vtr_frame_begin returns right away and vtr_frame_end only swaps then.
+ * vtr_get_stats reports the current rate and the measured frame rate. Returns -EINVAL for contexts.
+ */
+struct vtr_pacing
+{
+    unsigned hz;
+    unsigned min_hz;            // hz if 0
+    uint64_t byte_budget;       // output bytes per second, 0 for no limit
+};
+
+int vtr_set_pacing(struct vtr_canvas* vt, const struct vtr_pacing* pacing);
+int vtr_frame_begin(struct vtr_canvas* vt);
+int vtr_frame_end(struct vtr_canvas* vt);
+
+/**
+ * Frame recording, to replay real workloads through the encoder offline.
+ * While recording, every frame the canvas presents is appended to fd once it is fully drawn,
+ * with context layers merged and deferred commands rasterized, as the cells that changed since the previous one.
+ * Scrolls are not recorded, a replayed frame is diffed in full. fd is left open.
+ * vtr_record_start returns -EINVAL for contexts or if the canvas is recording already.
+ * Recording stops at the first write error, which vtr_record_stop returns once it is called.
+ *
+ * The format is a "VTRREC\2\0" header followed by the frames, all numbers are unsigned LEB128:
+ * rows, cols, the number of RGB colors the canvas interned since the previous frame and those colors as 0xRRGGBB,
+ * the number of text styles it interned since then and those styles as their foreground color id,
+ * background color id and bold flag, then runs of changed cells as the count of unchanged cells before the run,
+ * in row-major order, the count of cells in the run and the cells XORed with the previous frame. A run of 0 cells
+ * ends the cells, and the text glyphs of the frame follow as runs in the same way.
+ * Frames of other dimensions than the previous one are stored against a blank frame.
+ * Cells and glyphs are those of the library version that recorded them.
+ */
+int vtr_record_start(struct vtr_canvas* vt, int fd);
+int vtr_record_stop(struct vtr_canvas* vt);
+
+/**
+ * Recording replay.
+ * vtr_replay_open reads a recording from fd, which it maps into memory if it can, and leaves fd open.
+ * vtr_replay_next decodes the next frame and gives its dimensions, it returns -ENODATA past the last frame
+ * and -EINVAL if the recording is corrupt. vtr_replay_draw then draws the decoded frame into the back buffer
+ * of a canvas of those dimensions, -EINVAL for others, over anything drawn there already, and the frame goes out
+ * with the next swap. Recorded RGB colors and text styles are interned into the palette of the canvas on first use,
+ * and again whenever the replay draws into another canvas than the last one.
+ */
+struct vtr_replay;
+struct vtr_replay* vtr_replay_open(int fd);
+int vtr_replay_next(struct vtr_replay* rp, uint16_t* rows, uint16_t* cols);
+int vtr_replay_draw(struct vtr_replay* rp, struct vtr_canvas* vt);
+void vtr_replay_rewind(struct vtr_replay* rp);
+void vtr_replay_close(struct vtr_replay* rp);
+
+/**
+ * Rasterize with a pool of nthreads threads, counting the one that calls vtr_swap_buffers.
+ * With more than one thread, draw calls only record commands into a list, which vtr_swap_buffers
+ * then rasterizes and encodes in parallel tiles of cell rows.
+ * 0 or 1 threads is the immediate mode, where draw calls rasterize right away. That is the default.
+ * Either way, draw calls and swaps have to come from one thread at a time.
+ * Returns -EINVAL for more than 256 threads.
+ */
+int vtr_set_raster_threads(struct vtr_canvas* vt, unsigned nthreads);
+
+/**
+ * Pipelined swaps, off by default.
+ * When enabled, a background thread merges, encodes and writes out every swapped frame,
+ * and vtr_swap_buffers returns a fresh back buffer right away, so the next frame is drawn
+ * while the previous one is still going out. In deferred mode it also rasterizes the frame.
+ * A swap waits for the previous frame if that is not out yet, and returns its error, if any.
+ * Other calls which queue output or change output settings wait for the frame in flight as well.
+ * Requires the blocking output mode, enabling it in non-blocking mode returns -EINVAL,
+ * and so does switching to non-blocking mode while it is enabled.
+ * Disabling it waits for the last frame and returns its error.
+ */
+int vtr_set_pipelined(struct vtr_canvas* vt, int enable);
+
+/**
+ * Per-thread draw contexts.
+ * A context is a canvas handle that its thread can pass to the draw calls below without any locking.
+ * Those draw into a private layer, and vtr_context_submit publishes that layer and starts a blank one.
+ * Every swap merges the last published layer of each context into the back buffer of its canvas:
+ * dot masks are ORed, while colors and text of higher priority contexts replace lower priority ones.
+ * Contexts of equal priority merge in creation order. Direct canvas drawing is below all of them.
+ * Context handles are only good for draw calls, vtr_xdots/vtr_ydots, vtr_context_submit and vtr_context_destroy.
+ * A context follows resizes of its canvas on the next submit.
+ */
+struct vtr_canvas* vtr_context_create(struct vtr_canvas* vt, int priority);
+int vtr_context_submit(struct vtr_canvas* ctx);
+void vtr_context_destroy(struct vtr_canvas* ctx);
+
+/**
+ * Retained layers.
+ * A retained layer is a draw context for static content, like axes, grids or labels, which is drawn once
+ * and then merged at every swap until the application invalidates it. Only the changing content
+ * has to be rasterized every frame then.
+ * Unlike other contexts it belongs to the thread that swaps the canvas and doesn't need submitting:
+ * once it needs a redraw, whatever is drawn into it gets published by the next swap.
+ * A layer needs a redraw after it is created, invalidated, or its canvas is resized.
+ * Until the redraw is published, the previous content stays on screen, except after a resize.
+ * vtr_layer_invalidate returns -EINVAL for handles that aren't retained layers, and so does vtr_context_submit
+ * for retained layers. They are destroyed with vtr_context_destroy.
+ */
+struct vtr_canvas* vtr_layer_create(struct vtr_canvas* vt, int priority);
+int vtr_layer_invalidate(struct vtr_canvas* layer);
+int vtr_layer_needs_redraw(struct vtr_canvas* layer);
+
+/**
+ * Viewports.
+ * A viewport is a canvas handle for a rectangle of rows by cols cells at row, col of its canvas, like a panel
+ * of a dashboard, which is redrawn and presented on its own. Its dots start at the top left corner of the rectangle,
+ * and draw calls are clipped to it. The canvas itself doesn't draw into viewports, and a wide glyph it prints
+ * across the edge of one shows as a space in the half outside. Viewports shouldn't overlap, where they do
+ * the last one presented shows.
+ * Like retained layers, viewports belong to the thread that swaps the canvas.
+ * vtr_viewport_begin returns 1 once a viewport is due for a redraw at its rate, which is every frame by default,
+ * or right away after it is created, resized or scrolled over. Otherwise it returns 0 and the viewport keeps
+ * showing what it does at no cost. A redraw starts from a blank viewport, can only be drawn after vtr_viewport_begin
+ * returned 1, and is presented by the next swap of the canvas, which only sends the cells that changed since
+ * the previous one. In pipelined mode beginning a redraw waits for the frame with the previous one to be written out.
+ * vtr_viewport_set_rate sets the rate in redraws per second, 0 redraws every frame.
+ * Both return -EINVAL for handles that aren't viewports. Viewports follow resizes of their canvas right away,
+ * clipped to the new dimensions, and are destroyed with vtr_context_destroy, which lets the canvas draw there again.
+ * Recordings of the canvas don't include them.
+ */
+struct vtr_canvas* vtr_viewport_create(struct vtr_canvas* vt, uint16_t row, uint16_t col,
+                                       uint16_t rows, uint16_t cols);
+int vtr_viewport_set_rate(struct vtr_canvas* vp, unsigned hz);
+int vtr_viewport_begin(struct vtr_canvas* vp);
+
+/* Rectangle in char cells */
+struct vtr_rect
+{
+    uint16_t row;
+    uint16_t col;
+    uint16_t nrows;
+    uint16_t ncols;
+};
+
+/**
+ * Tell the next swap that the contents of rect are the previous frame shifted by dx columns and dy rows,
+ * positive values move them right and down. The frame is still drawn in full as usual.
+ * The swap then scrolls the terminal contents before the frame, with DECSTBM and SU/SD vertically,
+ * and DECIC/DECDC horizontally, and only has to send what the shifted screen got wrong.
+ * Rectangles narrower than the screen and horizontal scrolls need left and right margins (DECSLRM).
+ * Those are only used if the terminal reports support for DECLRMM, otherwise this returns -ENOTSUP
+ * and the frame is simply diffed as is. Rectangle is clipped to the canvas, -EINVAL if it is outside.
+ * Scrolls made before one frame are applied in order. Frames starting with a scroll are never dropped
+ * or cut short with the VTR_FRAME_DROP policy.
+ */
+int vtr_scroll(struct vtr_canvas* vt, const struct vtr_rect* rect, int dx, int dy);
+
 /*
  * Rasterizer calls.
  */
@@ -64,6 +359,13 @@ struct vtr_vertex
     int y;
 };
 
+/* Line segment in dot coordinates */
+struct vtr_line
+{
+    struct vtr_vertex p0;
+    struct vtr_vertex p1;
+};
+
 /* Basic ANSI color palette */
 enum vtr_color
 {
@@ -80,31 +382,222 @@ enum vtr_color
     VTR_COLOR_TOTAL // always last
 };
 
+/**
+ * Extended colors for the vtr_*x draw calls.
+ * Basic colors are passed as is, VTR_XCOLOR_INDEXED picks one of the 256 palette colors of the terminal
+ * and VTR_XCOLOR_RGB is a 24-bit color.
+ * Each canvas keeps up to 65270 distinct RGB colors, further ones are drawn with the nearest palette color.
+ */
+#define VTR_XCOLOR_INDEXED(i)   (0x1000000u | (uint8_t)(i))
+#define VTR_XCOLOR_RGB(r, g, b) (0x2000000u | (uint32_t)(uint8_t)(r) << 16 | (uint32_t)(uint8_t)(g) << 8 | (uint8_t)(b))
+
+/**
+ * How RGB colors are sent to the terminal.
+ * VTR_COLORS_256 quantizes them to the nearest color of the standard 256 color palette,
+ * VTR_COLORS_TRUECOLOR sends them as is, and VTR_COLORS_AUTO (the default) does that only
+ * if the COLORTERM environment variable says "truecolor" or "24bit".
+ * Cells already on screen keep their colors until they change.
+ */
+enum vtr_color_mode
+{
+    VTR_COLORS_AUTO,
+    VTR_COLORS_256,
+    VTR_COLORS_TRUECOLOR,
+};
+
+int vtr_set_color_mode(struct vtr_canvas* vt, enum vtr_color_mode mode);
+
+/* Check if RGB colors are currently sent as is */
+int vtr_truecolor_active(struct vtr_canvas* vt);
+
 /**
  * Render a dot at given VT coordinates.
  */
 void vtr_render_dot(struct vtr_canvas* vt, int x, int y);
 void vtr_render_dotc(struct vtr_canvas* vt, int x, int y, enum vtr_color fgc);
+void vtr_render_dotx(struct vtr_canvas* vt, int x, int y, uint32_t color);
+
+/**
+ * Batched primitive calls.
+ * Colors are taken per element from the colors array, or if it is NULL, all elements use fgc.
+ * The x variants take vtr_*x colors, like vtr_render_dotx.
+ */
+void vtr_render_dots(struct vtr_canvas* vt, size_t ndots, const struct vtr_vertex* dots,
+                     const enum vtr_color* colors, enum vtr_color fgc);
+void vtr_render_dotsx(struct vtr_canvas* vt, size_t ndots, const struct vtr_vertex* dots,
+                      const uint32_t* colors, uint32_t color);
+void vtr_scan_lines(struct vtr_canvas* vt, size_t nlines, const struct vtr_line* lines,
+                    const enum vtr_color* colors, enum vtr_color fgc);
+void vtr_scan_linesx(struct vtr_canvas* vt, size_t nlines, const struct vtr_line* lines,
+                     const uint32_t* colors, uint32_t color);
+
+/* Range of touched cells within a single row, [lo, hi). A clean row has lo >= hi. */
+struct vtr_span
+{
+    uint16_t lo;
+    uint16_t hi;
+};
+
+/**
+ * Unchecked dots, for hot loops like particle trails and scatter plots.
+ * vtr_get_dot_target fills target with the back buffer of a canvas or context and the cell bits of color,
+ * one of the vtr_*x colors. vtr_plot_unchecked then sets a dot in that color without clipping, assertions
+ * or a library call: the caller guarantees 0 <= x < target->xdots and 0 <= y < target->ydots,
+ * anything else writes out of bounds.
+ * A target is good until the next swap, resize or submit, or a raster threads or pipelining change,
+ * and it can be mixed with other draw calls in between. Unchecked dots are not counted in the frame stats.
+ * Returns -ENOTSUP in deferred mode, where the draw calls have to be used instead.
+ */
+struct vtr_dot_target
+{
+    uint32_t* cells;            // stride cells per row
+    struct vtr_span* dirty;     // span of touched cells per row, has to cover every written cell
+    uint32_t color;
+    uint16_t stride;
+    uint16_t xdots;
+    uint16_t ydots;
+};
+
+int vtr_get_dot_target(struct vtr_canvas* vt, uint32_t color, struct vtr_dot_target* target);
+
+static inline void vtr_plot_unchecked(const struct vtr_dot_target* target, int x, int y)
+{
+    // Cells are 2x4 dots, the mask bits of the 8 dots are packed into one word, a byte per dot in row-major order
+    unsigned row = (unsigned)y >> 2;
+    unsigned col = (unsigned)x >> 1;
+    unsigned dot = ((unsigned)y & 3) << 1 | ((unsigned)x & 1);
+
+    // Low 16 bits are the dot mask and text overlay, the upper ones the color
+    uint32_t* cell = &target->cells[(size_t)row * target->stride + col];
+    *cell = (*cell & 0xFFFFu) | (uint8_t)(0x8008400420021001ull >> (dot * 8)) | target->color;
+
+    struct vtr_span* span = &target->dirty[row];
+    span->lo = (uint16_t)(col < span->lo ? col : span->lo);
+    span->hi = (uint16_t)(col >= span->hi ? col + 1 : span->hi);
+}
+
+/**
+ * Density mode, for point clouds dense enough to saturate into blobs when drawn dot by dot.
+ * vtr_accumulate_dots counts samples per dot instead of drawing them, and every swap maps the counts
+ * of the frame to dots and colors beneath everything else drawn into it, then starts over.
+ * A dot with a count of c has a coverage of c / full, or log(1 + c) / log(1 + full) with the log scale,
+ * and is lit once that exceeds its threshold of a 2x4 ordered dither matrix, 0 to 7/8 in steps of 1/8.
+ * Sparse areas thin out into dot patterns that way, while a full of 1 lights every dot hit, like vtr_render_dots.
+ * A full of 0 takes the densest dot of each frame instead, and counts saturate at 65535.
+ * Cells are colored from the ramp by the coverage of their mean count, with the first color
+ * below 1/ncolors and the last one from (ncolors - 1)/ncolors up, or drawn in the default color without a ramp.
+ * Cells that other calls draw dots into keep the color of those.
+ */
+enum vtr_density_scale
+{
+    VTR_DENSITY_LINEAR,
+    VTR_DENSITY_LOG,
+};
+
+struct vtr_density
+{
+    enum vtr_density_scale scale;
+    uint32_t full;
+    size_t ncolors;             // up to 256
+    const uint32_t* colors;     // vtr_*x colors, sparsest first
+};
+
+/*
+ * Enable density mode, or change its mapping which the next swap uses, keeping what was accumulated.
+ * NULL turns it off and drops the samples. Returns -EINVAL for contexts and invalid settings.
+ */
+int vtr_set_density(struct vtr_canvas* vt, const struct vtr_density* density);
+
+/*
+ * Accumulate a batch of samples, those outside of the canvas are skipped.
+ * Returns -EINVAL if density mode is off.
+ */
+int vtr_accumulate_dots(struct vtr_canvas* vt, size_t ndots, const struct vtr_vertex* dots);
 
 /**
  * Scan a line given two dot coordinates.
  */
 void vtr_scan_line(struct vtr_canvas* vt, int x0, int y0, int x1, int y1);
 void vtr_scan_linec(struct vtr_canvas* vt, int x0, int y0, int x1, int y1, enum vtr_color fgc);
+void vtr_scan_linex(struct vtr_canvas* vt, int x0, int y0, int x1, int y1, uint32_t color);
+
+/* Polygon fill rules */
+enum vtr_fill_rule
+{
+    VTR_FILL_NONZERO,   // dots with a non-zero winding number are inside
+    VTR_FILL_EVENODD,   // dots crossed by an odd number of edges on the way out are inside
+};
 
 /**
  * Trace a polygon path given a list of vertices.
  * The last vertex is traced back to the first one and the resulting polygon filled.
+ * Polygons can be non-convex and self-intersecting, vtr_trace_poly and vtr_trace_polyc use the non-zero fill rule.
  */
 int vtr_trace_poly(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vertexlist);
 int vtr_trace_polyc(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vertexlist, enum vtr_color fgc);
+int vtr_trace_poly_rule(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vertexlist,
+                        enum vtr_color fgc, enum vtr_fill_rule rule);
+int vtr_trace_polyx(struct vtr_canvas* vt, size_t nvertices, const struct vtr_vertex* vertexlist,
+                    uint32_t color, enum vtr_fill_rule rule);
+
+/**
+ * Trace a batch of polygons.
+ * Polygon i has nvertices[i] vertices, the vertex lists of all polygons follow each other in vlist.
+ */
+int vtr_trace_polys(struct vtr_canvas* vt, size_t npolys, const size_t* nvertices, const struct vtr_vertex* vlist,
+                    const enum vtr_color* colors, enum vtr_color fgc, enum vtr_fill_rule rule);
+int vtr_trace_polysx(struct vtr_canvas* vt, size_t npolys, const size_t* nvertices, const struct vtr_vertex* vlist,
+                     const uint32_t* colors, uint32_t color, enum vtr_fill_rule rule);
 
 /**
  * Print some text at the specified location.
  * The text will overlay any other rasterized output.
+ * Text is UTF-8, East Asian wide glyphs and emoji take two cells, while control chars, combining marks
+ * and other zero width code points are dropped. Text is cut at the end of the row and malformed UTF-8 is printed
+ * as U+FFFD. Printing over half of a wide glyph leaves the other half a space.
+ * Unchanged text costs nothing to present, and a changed string goes out as one run of chars.
  */
 int vtr_print_text(struct vtr_canvas* vt, uint16_t row, uint16_t col, const char* str);
 
+/**
+ * Text style for vtr_print_textx, colors are vtr_*x colors, with 0 for the default ones.
+ * Each canvas keeps up to 255 distinct styles besides the default one, further ones print in the default style.
+ */
+struct vtr_text_style
+{
+    uint32_t fg;
+    uint32_t bg;
+    int bold;
+};
+
+/**
+ * Print text in a style, see vtr_print_text. NULL style is the default one.
+ */
+int vtr_print_textx(struct vtr_canvas* vt, uint16_t row, uint16_t col, const char* str,
+                    const struct vtr_text_style* style);
+
+/**
+ * Sprites are polygons rasterized ahead of time, for shapes drawn many times over.
+ * vtr_sprite_create fills the polygon with the non-zero rule at nangles rotations evenly spread over a full turn,
+ * about the origin its vertices are relative to. Sprites don't belong to a canvas and can be used with any of them.
+ * Returns NULL for no vertices, no angles or more than 4096 of them, vertices farther than 1024 dots from the origin,
+ * or when out of memory.
+ */
+struct vtr_sprite;
+struct vtr_sprite* vtr_sprite_create(size_t nvertices, const struct vtr_vertex* vertexlist, unsigned nangles);
+void vtr_sprite_destroy(struct vtr_sprite* sprite);
+
+/**
+ * Blit a sprite with its origin at given dot coordinates, the color is one of the vtr_*x colors.
+ * That draws what tracing the rotated polygon there would, at the cost of a few cell mask ORs.
+ * vtr_blit_sprite_rotated picks the rotation nearest to angle, in radians from the x axis towards the y axis.
+ * Frames only reference the sprite, so it has to stay alive until the frames it is blitted into are rasterized,
+ * which for pipelined canvases is only guaranteed after vtr_flush_pending.
+ */
+void vtr_blit_sprite(struct vtr_canvas* vt, const struct vtr_sprite* sprite, int x, int y, uint32_t color);
+void vtr_blit_sprite_rotated(struct vtr_canvas* vt, const struct vtr_sprite* sprite, int x, int y, float angle,
+                             uint32_t color);
+
 #ifdef __cplusplus
 }
 #endif